@@ -2,6 +2,10 @@
 #define _SALTICIDAE_BUFFER_H
 
 #include <list>
+#include <functional>
+#include <sys/types.h>
+
+#include "salticidae/ref.h"
 
 namespace salticidae {
 
@@ -107,6 +111,27 @@ class SegBuffer {
         return res;
     }
     
+    /** Hand up to len bytes from the front to f(ptr, n), segment by
+     * segment, without copying them out. Returns the number of bytes
+     * consumed. */
+    template<typename Func>
+    size_t drain(size_t len, Func &&f) {
+        size_t res = 0;
+        while (len && !buffer.empty())
+        {
+            auto &e = buffer.front();
+            size_t n = std::min(e.length(), len);
+            f(&*e.offset, n);
+            e.offset += n;
+            len -= n;
+            res += n;
+            if (e.offset == e.data.end())
+                buffer.pop_front();
+        }
+        _size -= res;
+        return res;
+    }
+
     size_t size() const { return _size; }
     size_t len() const { return buffer.size(); }
     bool empty() const { return buffer.empty(); }
@@ -118,8 +143,120 @@ class SegBuffer {
 };
 
 struct MPSCWriteBuffer {
-    using buffer_entry_t = SegBuffer::buffer_entry_t;
-    using queue_t = MPSCQueueEventDriven<buffer_entry_t>;
+    /** an immutable buffer that can be queued by many connections */
+    using shared_t = ArcObj<const bytearray_t>;
+
+    /** a range of a file, handed to the kernel with sendfile(2) */
+    struct file_range_t {
+        int fd;
+        off_t offset;
+        size_t len;
+        /** invoked with true once the range is sent, otherwise with false
+         * when the range is discarded */
+        std::function<void(bool)> on_done;
+        bool done;
+
+        file_range_t(int fd, off_t offset, size_t len,
+                    std::function<void(bool)> on_done):
+            fd(fd), offset(offset), len(len),
+            on_done(std::move(on_done)), done(false) {}
+
+        ~file_range_t() { finish(false); }
+
+        void finish(bool ok) {
+            if (done) return;
+            done = true;
+            if (on_done) on_done(ok);
+        }
+    };
+    using file_t = ArcObj<file_range_t>;
+
+    struct buffer_entry_t {
+        /** bytes owned by the entry, sent before the shared part */
+        bytearray_t data;
+        shared_t shared;
+        /** sent after the owned bytes (instead of a shared buffer) */
+        file_t file;
+        /** bytes of the shared buffer (or the file range) that have been
+         * sent */
+        size_t offset;
+        /** traffic class used by the outbound shaper */
+        uint8_t tclass;
+        /** some of the bytes have been sent */
+        bool partial;
+        /** when the entry was queued (0 if not tracked) */
+        double enq_time;
+        /** a control frame, not subject to the flow control credit */
+        bool ctrl;
+        /** the entry is dropped if not sent by then (0 for never) */
+        double deadline;
+        /** a placeholder for the latest data written with the key (see
+         * ConnPool::Conn::write_conflated()) */
+        bool keyed;
+        uint64_t key;
+        buffer_entry_t(): offset(0), tclass(0), partial(false), enq_time(0),
+            ctrl(false), deadline(0), keyed(false), key(0) {}
+        buffer_entry_t(bytearray_t &&data, uint8_t tclass = 0):
+            data(std::move(data)), offset(0), tclass(tclass),
+            partial(false), enq_time(0), ctrl(false), deadline(0),
+            keyed(false), key(0) {}
+        buffer_entry_t(bytearray_t &&data, const shared_t &shared,
+                        size_t offset, uint8_t tclass = 0):
+            data(std::move(data)), shared(shared),
+            offset(offset), tclass(tclass), partial(false), enq_time(0),
+            ctrl(false), deadline(0), keyed(false), key(0) {}
+        buffer_entry_t(bytearray_t &&data, const file_t &file,
+                        uint8_t tclass = 0):
+            data(std::move(data)), file(file),
+            offset(0), tclass(tclass), partial(false), enq_time(0),
+            ctrl(false), deadline(0), keyed(false), key(0) {}
+
+        size_t size() const {
+            return buffered_size() + file_left();
+        }
+
+        /** the unsent bytes held in memory */
+        size_t buffered_size() const {
+            return data.size() + (shared ? shared->size() - offset : 0);
+        }
+
+        /** the unsent bytes of the file range */
+        size_t file_left() const { return file ? file->len - offset : 0; }
+
+        bool empty() const { return size() == 0; }
+
+        /** the next contiguous chunk to be sent (null for the file range) */
+        const uint8_t *chunk(size_t &len) const {
+            if (!data.empty() || (!shared && !file))
+            {
+                len = data.size();
+                return data.data();
+            }
+            if (file)
+            {
+                len = file_left();
+                return nullptr;
+            }
+            len = shared->size() - offset;
+            return shared->data() + offset;
+        }
+
+        /** drop the first n bytes that have been sent */
+        void consume(size_t n) {
+            if (n) partial = true;
+            if (n < data.size())
+            {
+                data = bytearray_t(data.begin() + n, data.end());
+                return;
+            }
+            offset += n - data.size();
+            data.clear();
+        }
+    };
+    /** smaller blocks than the default ones, as each connection has its
+     * own queue */
+    static const size_t block_size = 256;
+    using queue_t = MPSCQueueEventDriven<buffer_entry_t, block_size>;
     queue_t buffer;
 
     MPSCWriteBuffer() {}
@@ -129,18 +266,32 @@ struct MPSCWriteBuffer {
 
     void set_capacity(size_t capacity) { buffer.set_capacity(capacity); }
 
-    void rewind(bytearray_t &&data) {
-        buffer.rewind(buffer_entry_t(std::move(data)));
+    void rewind(bytearray_t &&data, uint8_t tclass = 0) {
+        buffer.rewind(buffer_entry_t(std::move(data), tclass));
+    }
+
+    void rewind(buffer_entry_t &&entry) {
+        buffer.rewind(std::move(entry));
     }
   
-    bool push(bytearray_t &&data, bool unbounded) {
-        return buffer.enqueue(buffer_entry_t(std::move(data)), unbounded);
+    bool push(bytearray_t &&data, bool unbounded, uint8_t tclass = 0) {
+        return buffer.enqueue(buffer_entry_t(std::move(data), tclass), unbounded);
+    }
+
+    bool push(buffer_entry_t &&entry, bool unbounded, bool notify = true) {
+        return buffer.enqueue(std::move(entry), unbounded, notify);
     }
 
     bytearray_t move_pop() {
         buffer_entry_t res;
         buffer.try_dequeue(res);
-        return res.data;
+        return std::move(res.data);
+    }
+
+    buffer_entry_t move_pop_entry() {
+        buffer_entry_t res;
+        buffer.try_dequeue(res);
+        return res;
     }
     
     queue_t &get_queue() { return buffer; }
@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SALTICIDAE_CAPTURE_H
+#define _SALTICIDAE_CAPTURE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <chrono>
+
+#include "salticidae/type.h"
+#include "salticidae/util.h"
+
+namespace salticidae {
+
+/** Records framed messages to a compact binary file.
+ *
+ * File layout: an 8-byte magic, then the little-endian fields version (u32),
+ * header_size (u32), flags (u32) and start time (u64, ns since epoch),
+ * followed by the records, in the order of their timestamps. Each record is
+ * ts (u64, ns since the start), conn (u32, the serial number of the
+ * connection, see ConnPool::Conn::get_serial()), dir (u8), the captured payload length (u32), the message
+ * header (header_size bytes) and the captured payload. */
+class WireCapture {
+    public:
+    enum Direction {
+        RECV = 0,
+        SEND = 1
+    };
+
+    static const char magic[8];
+    static const uint32_t version = 1;
+    static const uint32_t FLAG_PAYLOAD = 1;
+
+    private:
+    const std::string fname;
+    const size_t header_size;
+    const bool with_payload;
+    const size_t ring_size;
+    std::chrono::steady_clock::time_point t0;
+    std::mutex lock;
+    bytearray_t buffer;
+    /** the number of records in the buffer */
+    size_t nbuffered;
+    size_t written;
+    int fd;
+    bool failed;
+    std::atomic<size_t> nlost;
+
+    bool open_file();
+    /** Give up capturing after an I/O error (with errno set). */
+    void fail(const char *what);
+    void flush_buffer();
+    void rotate();
+
+    public:
+    /** Open `fname` for capturing. When `ring_size` is not zero, the file is
+     * rotated to `fname`.prev whenever it grows beyond `ring_size` bytes, so
+     * the most recent traffic is kept within twice that size. */
+    WireCapture(const std::string &fname, size_t header_size,
+                bool with_payload = false, size_t ring_size = 0);
+    ~WireCapture();
+
+    WireCapture(const WireCapture &) = delete;
+    WireCapture(WireCapture &&) = delete;
+
+    /** Append one record (thread-safe). An I/O error, e.g. a full disk, is
+     * logged once and disables the capture, as it would otherwise take down
+     * the worker that records. */
+    void record(uint32_t conn_id, Direction dir,
+                const uint8_t *header,
+                const uint8_t *payload, size_t payload_len);
+    /** Write out the buffered records. */
+    void flush();
+    /** The number of records not written because of an I/O error. */
+    size_t get_nlost() const { return nlost.load(std::memory_order_relaxed); }
+};
+
+/** Sequentially reads the records written by WireCapture. */
+class WireCaptureReader {
+    int fd;
+    uint32_t header_size;
+    uint32_t flags;
+    uint64_t start_time;
+    bytearray_t buffer;
+    size_t offset;
+
+    bool fill(size_t len);
+
+    public:
+    struct Record {
+        uint64_t ts;
+        uint32_t conn_id;
+        WireCapture::Direction dir;
+        bytearray_t header;
+        bytearray_t payload;
+    };
+
+    WireCaptureReader(const std::string &fname);
+    ~WireCaptureReader();
+
+    WireCaptureReader(const WireCaptureReader &) = delete;
+    WireCaptureReader(WireCaptureReader &&) = delete;
+
+    size_t get_header_size() const { return header_size; }
+    bool has_payload() const { return flags & WireCapture::FLAG_PAYLOAD; }
+    uint64_t get_start_time() const { return start_time; }
+    /** Read the next record, returns false at the end of the file. */
+    bool next(Record &rec);
+};
+
+}
+
+#endif
@@ -50,19 +50,144 @@
 
 namespace salticidae {
 
+/** A set of worker threads, each running an event loop of its own, that can
+ * be shared by several ConnPools (see ConnPool::Config::worker_group()), so
+ * that the connections of all of them are balanced across one set of
+ * per-core workers. The threads run from the construction of the group
+ * until the last reference to it is gone. */
+class WorkerGroup {
+    public:
+    struct Slot {
+        EventContext ec;
+        /** for running the management work of the pools on the loop */
+        BoxObj<ThreadCall> tcall;
+        std::thread handle;
+        /** the number of connections served by the loop, of all pools */
+        std::atomic<size_t> nconn;
+        Slot(): tcall(new ThreadCall(ec)), nconn(0) {}
+    };
+
+    private:
+    size_t nslot;
+    BoxObj<Slot[]> slots;
+
+    public:
+    WorkerGroup(size_t nworker):
+            nslot(std::max((size_t)1, nworker)),
+            slots(new Slot[nslot]) {
+        for (size_t i = 0; i < nslot; i++)
+        {
+            auto &slot = slots[i];
+            slot.handle = std::thread([&slot]() {
+                sigset_t mask;
+                sigfillset(&mask);
+                pthread_sigmask(SIG_BLOCK, &mask, NULL);
+                slot.ec.dispatch();
+            });
+        }
+    }
+
+    ~WorkerGroup() {
+        for (size_t i = 0; i < nslot; i++)
+        {
+            auto &slot = slots[i];
+            slot.tcall->async_call([&slot](ThreadCall::Handle &) { slot.ec.stop(); });
+        }
+        for (size_t i = 0; i < nslot; i++)
+            slots[i].handle.join();
+    }
+
+    WorkerGroup(const WorkerGroup &) = delete;
+    WorkerGroup(WorkerGroup &&) = delete;
+
+    size_t size() const { return nslot; }
+    Slot &get_slot(size_t idx) const { return slots[idx]; }
+
+    /** Run `func` on the loop of the idx-th slot and wait for it to
+     * finish (must not be called from the loops of the group). */
+    template<typename Func>
+    void call(size_t idx, Func &&func) {
+        slots[idx].tcall->call([&func](ThreadCall::Handle &) { func(); }).get();
+    }
+};
+
 /** Abstraction for connection management. */
 class ConnPool {
     protected:
     class Worker;
 
     public:
+    /** The byte budget shared by the send and receive buffers of all
+     * connections of a pool. */
+    struct MemBudget {
+        const size_t limit;
+        std::atomic<size_t> used;
+        std::atomic<size_t> nconn;
+        /** number of writes refused */
+        std::atomic<size_t> nrejected;
+        /** number of times reading from a connection was paused */
+        std::atomic<size_t> npaused;
+
+        MemBudget(size_t limit):
+            limit(limit), used(0), nconn(0), nrejected(0), npaused(0) {}
+
+        /** Whether a connection holding `held` bytes may take `size` more.
+         * Beyond 3/4 of the limit, only the connections under their fair
+         * share (limit / nconn) are admitted, so that the largest consumers
+         * are pushed back first. */
+        bool admit(size_t held, size_t size) const {
+            size_t u = used.load(std::memory_order_relaxed) + size;
+            if (u > limit) return false;
+            if (u <= limit / 4 * 3) return true;
+            size_t n = std::max(nconn.load(std::memory_order_relaxed), (size_t)1);
+            return held + size <= limit / n;
+        }
+        void acquire(size_t n) { used.fetch_add(n, std::memory_order_relaxed); }
+        void release(size_t n) { used.fetch_sub(n, std::memory_order_relaxed); }
+    };
+
+    /** What to do with a connection whose send queue falls behind (see
+     * Config::slow_consumer()). */
+    enum SlowConsumerPolicy {
+        SLOW_NOTIFY, /**< only invoke the slow consumer handler */
+        SLOW_CONFLATE, /**< drop all queued messages but the latest one */
+        SLOW_DROP_OLDEST, /**< drop the oldest messages until within limits */
+        SLOW_DISCONNECT /**< terminate the connection */
+    };
+
+    /** Stands in for the TCP stack of the kernel (see SimContext): hands
+     * out non-blocking stream sockets, which are then read and written as
+     * usual. */
+    class Transport {
+        public:
+        virtual ~Transport() = default;
+        /** Listen at `addr`, return an fd that turns readable while a
+         * connection is waiting to be accepted (-1 on failure). */
+        virtual int listen(const NetAddr &addr) = 0;
+        /** Take a waiting connection and its remote address, return -1
+         * (with errno set) if there is none. */
+        virtual int accept(int listen_fd, NetAddr &addr) = 0;
+        /** Start connecting to `addr`, the returned fd can be written to
+         * right away (-1 on failure). */
+        virtual int connect(const NetAddr &addr) = 0;
+        /** Close an fd handed out above. */
+        virtual void close(int fd) = 0;
+    };
+
     class Conn;
     /** The handle to a bi-directional connection. */
     using conn_t = ArcObj<Conn>;
     /** The type of callback invoked when connection status is changed. */
     using conn_callback_t = std::function<bool(const conn_t &, bool)>;
+    /** The type of callback that watches the connection status changes
+     * (see add_conn_watcher()). */
+    using conn_watcher_t = std::function<void(const conn_t &, bool)>;
     /** The type of callback invoked when an error occured (during async execution). */
     using error_callback_t = std::function<void(const std::exception_ptr, bool, int32_t)>;
+    /** The type of callback invoked when a connection becomes a slow
+     * consumer, with the age (in seconds) of its oldest unsent message and
+     * its number of unsent bytes. */
+    using slow_consumer_callback_t = std::function<void(const conn_t &, double, size_t)>;
     /** Abstraction for a bi-directional connection. */
     class Conn {
         friend ConnPool;
@@ -77,13 +202,41 @@ class ConnPool {
         size_t recv_chunk_size;
         size_t max_recv_buff_size;
         int fd;
-        Worker *worker;
+        /** numbers the connections of the pool (unlike the fd, it is not
+         * reused after the connection is closed) */
+        uint32_t serial;
+        /** the worker that serves the connection (changed only by that
+         * worker, see ConnPool::migrate_conn()) */
+        std::atomic<Worker *> worker;
+        /** the dispatcher shard that owns the connection (changed only by
+         * the owning shard, see ConnPool::move_conn()) */
+        std::atomic<Worker *> disp;
         ConnPool *cpool;
         ConnMode mode;
         NetAddr addr;
+        /** the time (EventContext::now()) of the last received data,
+         * written by the worker */
+        std::atomic<uint64_t> last_recv;
 
         MPSCWriteBuffer send_buffer;
+        /** number of bytes written but not yet sent */
+        std::atomic<size_t> send_backlog;
+        /** the latest unsent data of each conflated key (allocated on the
+         * first use) */
+        std::mutex conflate_lock;
+        BoxObj<std::unordered_map<uint64_t, MPSCWriteBuffer::buffer_entry_t>> conflated;
         SegBuffer recv_buffer;
+        /** number of bytes received but not yet handled (including the
+         * parsed messages waiting for the user thread) */
+        std::atomic<size_t> recv_backlog;
+        /** null if the pool has no memory budget */
+        ArcObj<MemBudget> mem;
+        /** reading is paused until the budget drains (owned by the worker) */
+        bool recv_mem_paused;
+        /** the size the receive buffer has to reach to complete the message
+         * being received, which is read even past the memory budget (set by
+         * the upper layer on the worker) */
+        size_t recv_reserve;
 
         /* initialized and destroyed by the dispatcher */
         TimedFdEvent ev_connect;
@@ -92,6 +245,37 @@ class ConnPool {
         /** does not need to wait if true */
         bool ready_send;
         bool ready_recv;
+        /* outbound shaping, owned by the worker */
+        TokenBucket send_bucket;
+        TimerEvent ev_throttle;
+        /** the time the head segment was first throttled (0 if not) */
+        double throttle_since;
+        /** the bytes charged to the buckets ahead of sending: those of the
+         * head segment, and those of the dropped (expired) heads, which go
+         * to the next segments */
+        size_t send_paid;
+        /* slow consumer detection, owned by the worker */
+        /** when the head segment was queued */
+        double send_head_time;
+        /** the send queue is not drained, watched by the worker */
+        bool send_stalled;
+        /** the connection is currently considered a slow consumer */
+        bool slow;
+        /* credit-based flow control, owned by the worker */
+        /** the window granted by the remote (0 until its first grant, and
+         * for good if it does not use flow control) */
+        size_t flow_window;
+        /** the number of bytes the remote is still willing to take (sent
+         * bytes are charged before the first grant as well) */
+        int64_t send_credit;
+        /** writing is paused until more credit is granted */
+        bool credit_blocked;
+        /** control frames that go ahead of the queued data (see
+         * ConnPool::write_ctrl()) */
+        BoxObj<bytearray_t> ctrl_out;
+        /* hibernation of the idle send queue, owned by the worker */
+        bool io_active; /**< there was I/O since the last check */
+        bool hibernated;
 
         typedef void (socket_io_func)(const conn_t &, int, int);
         socket_io_func *send_data_func;
@@ -107,16 +291,113 @@ class ConnPool {
         static socket_io_func _recv_data_tls_handshake;
         static socket_io_func _send_data_tls_handshake;
         static socket_io_func _recv_data_dummy;
+        /** Called by the worker when reading the next chunk would exceed
+         * the memory budget: returns true with `want` cut down to what is
+         * left of the message being received, or pauses reading. */
+        static bool _recv_over_budget(const conn_t &conn, size_t &want);
+
+        /** Pop the head segment, which carries the latest data of its key if
+         * it is conflated. */
+        MPSCWriteBuffer::buffer_entry_t pop_send() {
+            auto seg = send_buffer.move_pop_entry();
+            if (seg.keyed)
+            {
+                std::lock_guard<std::mutex> _(conflate_lock);
+                auto it = conflated->find(seg.key);
+                assert(it != conflated->end());
+                /* keep the time the key was first queued */
+                double enq_time = seg.enq_time;
+                seg = std::move(it->second);
+                seg.enq_time = enq_time;
+                conflated->erase(it);
+            }
+            return seg;
+        }
+
+        /** Discard the unsent data, so the file ranges among it are
+         * reported at once rather than when the connection is freed (called
+         * by the worker). */
+        void discard_send() {
+            for (auto seg = pop_send(); !seg.empty(); seg = pop_send())
+                release_send(seg.buffered_size());
+        }
+
+        /** Pop the next segment to send: the pending control frames go
+         * first, unless the head segment is half-sent (called by the
+         * worker). */
+        MPSCWriteBuffer::buffer_entry_t next_send() {
+            auto seg = pop_send();
+            if (!ctrl_out || ctrl_out->empty() || seg.partial) return seg;
+            if (!seg.empty()) rewind_send(std::move(seg));
+            MPSCWriteBuffer::buffer_entry_t ctrl(std::move(*ctrl_out));
+            ctrl_out->clear();
+            ctrl.ctrl = true;
+            return ctrl;
+        }
+
+        /** Whether a write has to wake up the worker: in the single-threaded
+         * mode, the writer sends to an idle connection right away instead
+         * (see ConnPool::flush_send()), and a busy one is waiting for the
+         * socket anyway. */
+        bool notify_send() const {
+            return !cpool->single_thread || !ready_send;
+        }
+
+        /** Put back the unsent head segment (called by the worker). */
+        void rewind_send(MPSCWriteBuffer::buffer_entry_t &&seg) {
+            if (seg.ctrl)
+            {
+                /* control frames stay out of the queue, so they are never
+                 * dropped or held back behind the data */
+                size_t size;
+                auto p = seg.chunk(size);
+                ctrl_out->insert(ctrl_out->begin(), p, p + size);
+                return;
+            }
+            send_head_time = seg.enq_time;
+            send_buffer.rewind(std::move(seg));
+        }
+
+        /** Note down that the send queue cannot be drained for now (called
+         * by the worker). */
+        static void mark_stalled(const conn_t &conn) {
+            if (conn->send_stalled || !conn->cpool->slow_policy_enabled()) return;
+            conn->send_stalled = true;
+            conn->worker.load(std::memory_order_relaxed)->watch_stalled(conn);
+        }
+
+        /** Note down the I/O activity (called by the worker). */
+        static void mark_active(const conn_t &conn) {
+            conn->io_active = true;
+            if (conn->hibernated)
+            {
+                conn->hibernated = false;
+                conn->worker.load(std::memory_order_relaxed)->awake.push_back(conn);
+            }
+        }
 
         public:
         Conn(): terminated(false),
             // recv_chunk_size initialized later
             // max_recv_buff_size initialized later
             fd(-1),
+            serial(0),
             worker(nullptr),
+            disp(nullptr),
             cpool(nullptr),
             mode(ConnMode::PASSIVE),
+            last_recv(0),
+            send_backlog(0),
+            conflated(nullptr),
+            recv_backlog(0),
+            mem(nullptr),
+            recv_mem_paused(false),
+            recv_reserve(0),
             ready_send(false), ready_recv(false),
+            throttle_since(0), send_paid(0),
+            send_head_time(0), send_stalled(false), slow(false),
+            flow_window(0), send_credit(0), credit_blocked(false),
+            io_active(false), hibernated(false),
             send_data_func(nullptr), recv_data_func(nullptr),
             tls(nullptr), peer_cert(nullptr) {}
         Conn(const Conn &) = delete;
@@ -124,6 +405,12 @@ class ConnPool {
 
         virtual ~Conn() {
             SALTICIDAE_LOG_DEBUG("destroyed %s", std::string(*this).c_str());
+            if (mem)
+            {
+                /* whatever is left in the buffers goes with the connection */
+                mem->release(get_send_backlog() + get_recv_backlog());
+                mem->nconn.fetch_sub(1, std::memory_order_relaxed);
+            }
         }
 
         bool is_terminated() const {
@@ -136,14 +423,127 @@ class ConnPool {
 
         operator std::string() const;
         const NetAddr &get_addr() const { return addr; }
+        uint32_t get_serial() const { return serial; }
         const X509 *get_peer_cert() const { return peer_cert.get(); }
         ConnMode get_mode() const { return mode; }
         ConnPool *get_pool() const { return cpool; }
+        uint64_t get_last_recv() const {
+            return last_recv.load(std::memory_order_relaxed);
+        }
 
         /** Write data to the connection (non-blocking). The data will be sent
-         * whenever I/O is available. */
-        bool write(bytearray_t &&data) {
-            return send_buffer.push(std::move(data), !cpool->max_send_buff_size);
+         * whenever I/O is available (and the traffic class `tclass` is within
+         * its send rate). */
+        bool write(bytearray_t &&data, uint8_t tclass = 0) {
+            size_t size = data.size();
+            if (!admit_send(size)) return false;
+            MPSCWriteBuffer::buffer_entry_t entry(std::move(data), tclass);
+            if (cpool->slow_max_age > 0) entry.enq_time = TokenBucket::now();
+            if (!send_buffer.push(std::move(entry), !cpool->max_send_buff_size,
+                                    notify_send()))
+            {
+                release_send(size);
+                return false;
+            }
+            return true;
+        }
+
+        /** Write a buffer entry, which may refer to a buffer shared with
+         * other connections (see MPSCWriteBuffer::shared_t). */
+        bool write(MPSCWriteBuffer::buffer_entry_t &&entry) {
+            /* a file range does not take memory */
+            size_t size = entry.buffered_size();
+            if (!admit_send(size)) return false;
+            if (cpool->slow_max_age > 0) entry.enq_time = TokenBucket::now();
+            if (!send_buffer.push(std::move(entry), !cpool->max_send_buff_size,
+                                    notify_send()))
+            {
+                release_send(size);
+                return false;
+            }
+            return true;
+        }
+
+        /** Write an entry that supersedes the unsent one written with the
+         * same key: the latter is replaced in place (keeping its position
+         * in the queue, relative to the other data), so at most one entry
+         * per key is waiting. */
+        bool write_conflated(MPSCWriteBuffer::buffer_entry_t &&entry, uint64_t key) {
+            size_t size = entry.buffered_size();
+            if (entry.empty()) return true;
+            if (!admit_send(size)) return false;
+            std::lock_guard<std::mutex> _(conflate_lock);
+            if (!conflated)
+                conflated = new std::unordered_map<
+                    uint64_t, MPSCWriteBuffer::buffer_entry_t>();
+            auto it = conflated->find(key);
+            if (it != conflated->end())
+            {
+                release_send(it->second.buffered_size());
+                it->second = std::move(entry);
+                cpool->nconflated.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            MPSCWriteBuffer::buffer_entry_t slot;
+            slot.keyed = true;
+            slot.key = key;
+            if (cpool->slow_max_age > 0) slot.enq_time = TokenBucket::now();
+            if (!send_buffer.push(std::move(slot), !cpool->max_send_buff_size,
+                                    notify_send()))
+            {
+                release_send(size);
+                return false;
+            }
+            conflated->emplace(key, std::move(entry));
+            return true;
+        }
+
+        /** Get the number of bytes written to the connection but not yet
+         * handed to the kernel (file ranges are not counted). */
+        size_t get_send_backlog() const {
+            return send_backlog.load(std::memory_order_relaxed);
+        }
+
+        /** Get the number of bytes received from the connection but not yet
+         * handled. */
+        size_t get_recv_backlog() const {
+            return recv_backlog.load(std::memory_order_relaxed);
+        }
+
+        /* the accounting of the buffered bytes */
+        size_t get_mem_held() const {
+            return get_send_backlog() + get_recv_backlog();
+        }
+
+        bool admit_send(size_t size) {
+            if (mem)
+            {
+                if (!mem->admit(get_mem_held(), size))
+                {
+                    mem->nrejected.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                mem->acquire(size);
+            }
+            send_backlog.fetch_add(size, std::memory_order_relaxed);
+            return true;
+        }
+
+        void release_send(size_t size) {
+            send_backlog.fetch_sub(size, std::memory_order_relaxed);
+            if (mem) mem->release(size);
+        }
+
+        void acquire_recv(size_t size) {
+            recv_backlog.fetch_add(size, std::memory_order_relaxed);
+            if (mem) mem->acquire(size);
+        }
+
+        /** Account for the bytes leaving the receive side (parsed headers,
+         * handled or dropped messages). */
+        void release_recv(size_t size) {
+            recv_backlog.fetch_sub(size, std::memory_order_relaxed);
+            if (mem) mem->release(size);
         }
     };
 
@@ -161,7 +561,9 @@ class ConnPool {
     std::atomic<uint16_t> async_id;
 
     int32_t gen_async_id() { return async_id.fetch_add(1, std::memory_order_relaxed); }
-    conn_t _connect(const NetAddr &addr);
+    /** Connect from the given dispatcher shard, which owns the new
+     * connection (called by that shard). */
+    conn_t _connect(const NetAddr &addr, Worker &disp);
     void _listen(NetAddr listen_addr);
     void recoverable_error(const std::exception_ptr err, int32_t id) const {
         user_tcall->async_call([this, err, id](ThreadCall::Handle &) {
@@ -171,8 +573,88 @@ class ConnPool {
 
     /** Terminate the connection (from the worker thread). */
     void worker_terminate(const conn_t &conn);
-    /** Terminate the connection (from the dispatcher thread). */
+    /** Terminate the connections of the calling worker at once, with a
+     * single call to the dispatcher. */
+    void worker_terminate(std::vector<conn_t> &&conns);
+    /** Terminate the connection (from a dispatcher thread). */
     void disp_terminate(const conn_t &conn);
+    /** Run `func` on the dispatcher shard that owns the connection. */
+    template<typename Func>
+    void disp_call(const conn_t &conn, Func &&func) {
+        Worker *disp = conn->disp.load(std::memory_order_acquire);
+        disp->get_tcall()->async_call(
+                [this, conn, disp, func=std::forward<Func>(func)](ThreadCall::Handle &h) {
+            /* moved to another shard in the meantime */
+            if (conn->disp.load(std::memory_order_acquire) != disp)
+                disp_call(conn, std::move(func));
+            else
+                func(h);
+        });
+    }
+    /** Run `func` on the worker of the connection, following the
+     * connection if it moves to another worker in the meantime. */
+    template<typename Func>
+    void worker_call(const conn_t &conn, Func &&func) {
+        Worker *worker = conn->worker.load(std::memory_order_acquire);
+        worker->get_tcall()->async_call(
+                [this, conn, worker, func=std::forward<Func>(func)](ThreadCall::Handle &h) {
+            /* moved to another worker in the meantime */
+            if (conn->worker.load(std::memory_order_acquire) != worker)
+                worker_call(conn, std::move(func));
+            else
+                func(h);
+        });
+    }
+    /** Move the connection to another worker (called by the worker that
+     * has it). Returns false if it cannot be moved. */
+    bool migrate_conn(const conn_t &conn, Worker &to);
+    /** Hand the connection over to another dispatcher shard and run `func`
+     * there once it is in (called by the owning shard). Nothing happens if
+     * the connection is already gone. */
+    template<typename Func>
+    void move_conn(const conn_t &conn, Worker &disp, Func &&func) {
+        auto &pool = conn->disp.load(std::memory_order_relaxed)->pool;
+        auto it = pool.find(conn->fd);
+        if (it == pool.end() || it->second != conn) return;
+        pool.erase(it);
+        /* the connect event belongs to the loop of the old shard */
+        conn->ev_connect.clear();
+        disp.get_tcall()->async_call(
+                [this, conn, &disp, func=std::forward<Func>(func)](ThreadCall::Handle &h) {
+            disp.pool.insert(std::make_pair(conn->fd, conn));
+            func(h);
+        });
+        /* the calls posted to the old shard from now on are forwarded,
+         * and land after the insertion above */
+        conn->disp.store(&disp, std::memory_order_release);
+    }
+    /** Add to the credit granted by the remote and resume writing if it was
+     * waiting for it (called by the worker). The first grant is the window
+     * of the remote, and turns the credit check on. */
+    void grant_credit(const conn_t &conn, size_t n);
+    /** Send what has just been written to an idle connection right away
+     * in the single-threaded mode, rather than upon the next wake-up of the
+     * loop. Returns `written` for convenience. */
+    bool flush_send(const conn_t &conn, bool written) {
+        if (!single_thread || !written ||
+            !conn->ready_send || conn->is_terminated())
+            return written;
+        conn->ev_socket.del();
+        conn->ev_socket.add((conn->ready_recv ? 0 : FdEvent::READ) |
+                            FdEvent::WRITE);
+        conn->send_data_func(conn, conn->fd, FdEvent::WRITE);
+        return written;
+    }
+    /** Send a small control frame (e.g. a grant) ahead of the queued data,
+     * which may be held back by the flow control itself. */
+    void write_ctrl(const conn_t &conn, bytearray_t &&frame);
+
+    /* messages dropped because of their deadline */
+    std::atomic<size_t> nsend_expired;
+    std::atomic<size_t> send_expired_bytes;
+    std::atomic<size_t> nrecv_expired;
+    /** Drop the unsent segment past its deadline (called by the worker). */
+    void drop_expired(const conn_t &conn, MPSCWriteBuffer::buffer_entry_t &seg);
 
     /** Should be implemented by derived class to return a new Conn object. */
     virtual Conn *create_conn() = 0;
@@ -184,13 +666,27 @@ class ConnPool {
     virtual void on_dispatcher_setup(const conn_t &) {}
     /** Called when the underlying connection breaks. */
     virtual void on_worker_teardown(const conn_t &conn) {
-        if (conn->worker) conn->worker->unfeed();
+        auto worker = conn->worker.load(std::memory_order_relaxed);
+        if (worker) worker->unfeed(conn);
         if (conn->tls) conn->tls->shutdown();
         conn->ev_socket.clear();
+        conn->ev_throttle.clear();
         conn->send_buffer.get_queue().unreg_handler();
+        conn->discard_send();
     }
     /** Called when the underlying connection breaks. */
     virtual void on_dispatcher_teardown(const conn_t &) {}
+    /** Whether the connection can be moved to another worker (called by
+     * its worker). */
+    virtual bool can_migrate(const conn_t &) { return true; }
+    /** Called by the worker that gives the connection away, to release
+     * what is bound to its loop. */
+    virtual void on_worker_detach(const conn_t &) {}
+    /** Called by the worker that takes over the connection. */
+    virtual void on_worker_attach(const conn_t &) {}
+    /** Called on the loop of the worker when the pool stops, after its
+     * connections are torn down, to release what is bound to that loop. */
+    virtual void on_worker_stop(Worker &) {}
 
     private:
     const int max_listen_backlog;
@@ -198,24 +694,81 @@ class ConnPool {
     const size_t recv_chunk_size;
     const size_t max_recv_buff_size;
     const size_t max_send_buff_size;
+    const double hibernate_after;
+    const int tcp_keepalive_idle;
+    const int tcp_keepalive_interval;
+    const int tcp_keepalive_count;
+    ArcObj<MemBudget> mem;
+
+    /* slow consumer policy */
+    const double slow_max_age;
+    const size_t slow_max_backlog;
+    const SlowConsumerPolicy slow_policy;
+    std::atomic<size_t> nslow;
+    std::atomic<size_t> nslow_dropped;
+    std::atomic<size_t> nslow_dropped_bytes;
+    std::atomic<size_t> nslow_disconnected;
+
+    bool slow_policy_enabled() const {
+        return slow_max_age > 0 || slow_max_backlog > 0;
+    }
+    /** Check the stalled connections of a worker against the slow consumer
+     * policy and drop those drained (called by the worker). */
+    void check_slow(std::vector<conn_t> &stalled);
+    /** Drop the queued messages (called by the worker). If `all` is true,
+     * keep only the latest one, otherwise drop the oldest ones until the
+     * queue is within the limits. */
+    void drop_queued(const conn_t &conn, bool all);
     tls_context_t tls_ctx;
 
+    /* outbound shaping shared by all workers (null if unlimited) */
+    struct SendShaper {
+        std::mutex lock;
+        TokenBucket global;
+        std::vector<TokenBucket> classes;
+    };
+    BoxObj<SendShaper> shaper;
+    const double conn_send_rate;
+    const double conn_send_burst;
+    std::atomic<size_t> nthrottled;
+    std::atomic<size_t> throttled_bytes;
+    std::atomic<uint64_t> throttle_delay_ns;
+
+    bool is_shaped(const conn_t &conn) const {
+        return shaper || conn->send_bucket.is_enabled();
+    }
+    /** Charge the segment to the buckets if it can be sent now, otherwise
+     * rewind it and wait for the buckets to refill (called by the worker). */
+    bool admit_send(const conn_t &conn, MPSCWriteBuffer::buffer_entry_t &seg);
+    std::atomic<size_t> nflow_blocked;
+    std::atomic<size_t> nconflated;
+    /** the serial number of the next connection */
+    std::atomic<uint32_t> conn_serial;
+    /** Check that the remote has granted enough credit for the segment,
+     * otherwise rewind it and wait for the next grant (called by the
+     * worker). */
+    bool admit_credit(const conn_t &conn, MPSCWriteBuffer::buffer_entry_t &seg);
+
     conn_callback_t conn_cb;
+    /** only used by the user thread */
+    std::unordered_map<size_t, conn_watcher_t> conn_watchers;
+    size_t conn_watcher_id;
     error_callback_t error_cb;
+    slow_consumer_callback_t slow_consumer_cb;
 
-    /* owned by the dispatcher */
+    /* owned by the first dispatcher shard */
     FdEvent ev_listen;
-    std::unordered_map<int, conn_t> pool;
     int listen_fd;  /**< for accepting new network connections */
 
     void update_conn(const conn_t &conn, bool connected) {
         user_tcall->async_call([this, conn, connected](ThreadCall::Handle &) {
+            for (auto &w: conn_watchers) w.second(conn, connected);
             bool ret = !conn_cb || conn_cb(conn, connected);
             if (connected)
             {
                 if (enable_tls)
                 {
-                    conn->worker->get_tcall()->async_call([this, conn, ret](ThreadCall::Handle &) {
+                    worker_call(conn, [this, conn, ret](ThreadCall::Handle &) {
                         if (conn->is_terminated()) return;
                         if (ret)
                         {
@@ -227,7 +780,7 @@ class ConnPool {
                     });
                 }
                 else
-                    conn->worker->get_tcall()->async_call([conn](ThreadCall::Handle &) {
+                    worker_call(conn, [conn](ThreadCall::Handle &) {
                         if (conn->is_terminated()) return;
                         conn->ev_socket.add(FdEvent::READ | FdEvent::WRITE);
                     });
@@ -237,17 +790,101 @@ class ConnPool {
 
     protected:
     class Worker {
+        friend Conn;
+        friend ConnPool;
         EventContext ec;
-        ThreadCall tcall;
+        BoxObj<ThreadCall> tcall;
         BoxObj<ThreadCall> exit_tcall; /** only used by the dispatcher thread */
+        /** the connections owned by the shard (only used by the dispatcher
+         * threads) */
+        std::unordered_map<int, conn_t> pool;
         std::thread handle;
         bool disp_flag;
+        /** runs on a loop it does not own (of the user or a WorkerGroup)
+         * instead of a thread of its own */
+        bool shared_loop;
         std::atomic<size_t> nconn;
+        /** the connection count of the loop in a WorkerGroup */
+        std::atomic<size_t> *group_nconn;
+        /** the connections fed to the worker, tracked on the loop of a
+         * WorkerGroup or in the elastic mode, so that the pool can tear
+         * them down while the loop keeps running, or move them elsewhere */
+        std::unordered_map<int, conn_t> fed;
+        bool track_fed;
         ConnPool::worker_error_callback_t on_fatal_error;
+        /** the connections whose send queue is not hibernated */
+        std::vector<conn_t> awake;
+        TimerEvent ev_hibernate;
+        /** the connections whose send queue is not drained */
+        std::vector<conn_t> stalled;
+        TimerEvent ev_slow_check;
+        double ev_slow_check_interval;
+
+        /** the connections paused by the memory budget */
+        static constexpr double recv_resume_interval = 0.01;
+        std::vector<conn_t> recv_paused;
+        TimerEvent ev_recv_resume;
+
+        /** Resume reading from the paused connections that fit in the
+         * budget again. */
+        void resume_recv() {
+            std::vector<conn_t> resumed;
+            for (size_t i = 0; i < recv_paused.size();)
+            {
+                auto &conn = recv_paused[i];
+                if (!conn->is_terminated() &&
+                    !conn->mem->admit(conn->get_mem_held(), conn->recv_chunk_size))
+                {
+                    i++;
+                    continue;
+                }
+                conn->recv_mem_paused = false;
+                if (!conn->is_terminated())
+                    resumed.push_back(conn);
+                std::swap(conn, recv_paused.back());
+                recv_paused.pop_back();
+            }
+            for (auto &conn: resumed)
+            {
+                if (!conn->ready_recv) continue;
+                try {
+                    conn->ev_socket.del();
+                    conn->ev_socket.add(FdEvent::READ |
+                                        (conn->ready_send ? 0 : FdEvent::WRITE));
+                    conn->recv_data_func(conn, conn->fd, FdEvent::READ);
+                } catch (...) {
+                    conn->cpool->recoverable_error(std::current_exception(), -1);
+                    conn->cpool->worker_terminate(conn);
+                }
+            }
+            if (!recv_paused.empty()) ev_recv_resume.add(recv_resume_interval);
+        }
+
+        /** Hibernate the send queues of the connections that had no I/O
+         * since the last call. */
+        void hibernate_idle() {
+            for (size_t i = 0; i < awake.size();)
+            {
+                auto &conn = awake[i];
+                if (!conn->is_terminated() &&
+                    (conn->io_active || !conn->send_buffer.get_queue().hibernate()))
+                {
+                    conn->io_active = false;
+                    i++;
+                    continue;
+                }
+                conn->hibernated = true;
+                std::swap(conn, awake.back());
+                awake.pop_back();
+            }
+        }
 
         public:
 
-        Worker(): tcall(ec), disp_flag(false), nconn(0) {}
+        Worker(): tcall(new ThreadCall(ec)), disp_flag(false),
+            shared_loop(false), nconn(0), group_nconn(nullptr),
+            track_fed(false),
+            ev_slow_check_interval(0) {}
 
         void set_error_callback(ConnPool::worker_error_callback_t _on_error) {
             on_fatal_error = std::move(_on_error);
@@ -259,6 +896,13 @@ class ConnPool {
 
         /* the following functions are called by the dispatcher */
         void start() {
+            if (shared_loop) return;
+            if (handle.joinable())
+            {
+                /* parked before, the thread has long been told to exit */
+                handle.join();
+                tcall->forward_to(nullptr);
+            }
             handle = std::thread([this]() {
                 sigset_t mask;
                 sigfillset(&mask);
@@ -282,22 +926,47 @@ class ConnPool {
             });
         }
 
+        void watch_socket(const conn_t &conn) {
+            conn->ev_socket = FdEvent(ec, conn->fd, [conn](int fd, int what) {
+                try {
+                    if (what & FdEvent::READ)
+                        conn->recv_data_func(conn, fd, what);
+                    else
+                        conn->send_data_func(conn, fd, what);
+                } catch (...) {
+                    conn->cpool->recoverable_error(std::current_exception(), -1);
+                    conn->cpool->worker_terminate(conn);
+                }
+            });
+        }
+
+        void watch_hibernate(double t) {
+            if (ev_hibernate) return;
+            ev_hibernate = TimerEvent(ec, [this, t](TimerEvent &) {
+                hibernate_idle();
+                ev_hibernate.add(t);
+            });
+            ev_hibernate.add(t);
+        }
+
+        void count_in(const conn_t &conn) {
+            nconn++;
+            if (group_nconn) (*group_nconn)++;
+            if (track_fed) fed[conn->fd] = conn;
+        }
+
         void feed(const conn_t &conn, int client_fd) {
             /* the caller should finalize all the preparation */
-            tcall.async_call([this, conn, client_fd](ThreadCall::Handle &) {
+            tcall->async_call([this, conn, client_fd](ThreadCall::Handle &) {
                 try {
-                    conn->ev_socket = FdEvent(ec, client_fd, [this, conn](int fd, int what) {
-                        try {
-                            if (what & FdEvent::READ)
-                                conn->recv_data_func(conn, fd, what);
-                            else
-                                conn->send_data_func(conn, fd, what);
-                        } catch (...) {
-                            conn->cpool->recoverable_error(std::current_exception(), -1);
-                            conn->cpool->worker_terminate(conn);
-                        }
-                    });
+                    watch_socket(conn);
                     auto cpool = conn->cpool;
+                    if (cpool->hibernate_after > 0)
+                    {
+                        /* the send queue starts in hibernation */
+                        conn->hibernated = true;
+                        watch_hibernate(cpool->hibernate_after);
+                    }
                     if (cpool->enable_tls)
                     {
                         conn->tls = new TLS(
@@ -313,7 +982,7 @@ class ConnPool {
                         conn->recv_data_func = Conn::_recv_data;
                         enable_send_buffer(conn, client_fd);
                         cpool->on_worker_setup(conn);
-                        cpool->disp_tcall->async_call([cpool, conn](ThreadCall::Handle &) {
+                        cpool->disp_call(conn, [cpool, conn](ThreadCall::Handle &) {
                             try {
                                 cpool->on_dispatcher_setup(conn);
                                 cpool->update_conn(conn, true);
@@ -328,15 +997,74 @@ class ConnPool {
                     SALTICIDAE_LOG_DEBUG("worker %x got %s",
                             std::this_thread::get_id(),
                             std::string(*conn).c_str());
-                    nconn++;
+                    count_in(conn);
                 } catch (...) { on_fatal_error(std::current_exception()); }
             });
         }
 
-        void unfeed() { nconn--; }
+        void unfeed(const conn_t &conn) {
+            if (track_fed)
+            {
+                /* count each connection out only once */
+                auto it = fed.find(conn->fd);
+                if (it == fed.end() || it->second.get() != conn.get()) return;
+                fed.erase(it);
+            }
+            if (group_nconn) (*group_nconn)--;
+            nconn--;
+        }
+
+        /** Release what binds the connection to this worker, so that it can
+         * be adopted by another one. Returns the socket events to watch
+         * there. */
+        int disown(const conn_t &conn) {
+            /* a throttled connection waits for its timer to write again */
+            int events = conn->ev_socket.get_events() |
+                        (conn->throttle_since ? FdEvent::WRITE : 0);
+            unfeed(conn);
+            conn->ev_socket.clear();
+            conn->ev_throttle.clear();
+            conn->send_buffer.get_queue().unreg_handler();
+            if (!conn->hibernated) drop(awake, conn);
+            if (conn->send_stalled) drop(stalled, conn);
+            if (conn->recv_mem_paused) drop(recv_paused, conn);
+            return events;
+        }
+
+        /** Take over the connection disowned by another worker. */
+        void adopt(const conn_t &conn, int events) {
+            watch_socket(conn);
+            if (events) conn->ev_socket.add(events);
+            enable_send_buffer(conn, conn->fd);
+            auto cpool = conn->cpool;
+            if (cpool->hibernate_after > 0)
+            {
+                watch_hibernate(cpool->hibernate_after);
+                if (!conn->hibernated) awake.push_back(conn);
+            }
+            if (conn->send_stalled) watch_stalled(conn);
+            if (conn->recv_mem_paused) watch_paused(conn);
+            count_in(conn);
+        }
 
         void stop() {
-            tcall.async_call([this](ThreadCall::Handle &) { ec.stop(); });
+            /* the loop is not ours to stop */
+            if (shared_loop)
+            {
+                tcall->stop();
+                return;
+            }
+            tcall->async_call([this](ThreadCall::Handle &) { ec.stop(); });
+        }
+
+        /** Stop the loop without waiting for the thread (which is joined
+         * when the worker starts again, or the pool stops), and pass the
+         * calls that still reach the worker on to `to`. */
+        void park(ThreadCall *to) {
+            tcall->async_call([this, to](ThreadCall::Handle &) {
+                tcall->forward_to(to);
+                ec.stop();
+            });
         }
 
         void disp_stop() {
@@ -346,33 +1074,179 @@ class ConnPool {
 
         std::thread &get_handle() { return handle; }
         const EventContext &get_ec() { return ec; }
-        ThreadCall *get_tcall() { return &tcall; }
+        ThreadCall *get_tcall() { return tcall.get(); }
+        /** Run on the given loop (of the user) instead of a thread of its
+         * own, must be called before anything is set up on the worker. */
+        void use_user_loop(const EventContext &_ec) {
+            ec = _ec;
+            tcall = new ThreadCall(ec);
+            tcall->set_inline_call(true);
+            shared_loop = true;
+        }
+        /** Run on the loop of a WorkerGroup, must be called on that loop
+         * before anything is set up on the worker. */
+        void use_group_loop(WorkerGroup::Slot &slot) {
+            ec = slot.ec;
+            tcall = new ThreadCall(ec);
+            shared_loop = true;
+            group_nconn = &slot.nconn;
+            track_fed = true;
+        }
+        /** Keep track of the fed connections (for moving them elsewhere),
+         * must be called before the worker starts. */
+        void track_conns() {
+            track_fed = true;
+            ec.enable_idle_time();
+        }
         void set_dispatcher() {
             disp_flag = true;
-            exit_tcall = new ThreadCall(ec);
+            /* a shared loop is never stopped by the pool */
+            if (!shared_loop) exit_tcall = new ThreadCall(ec);
         }
         bool is_dispatcher() const { return disp_flag; }
         size_t get_nconn() { return nconn; }
-        void stop_tcall() { tcall.stop(); }
+        /** The number of connections on the loop (of all pools sharing
+         * it). */
+        size_t get_load() {
+            return group_nconn ? group_nconn->load(std::memory_order_relaxed) : nconn.load();
+        }
+        void stop_tcall() { tcall->stop(); }
+        /** Watch the stalled connection for the slow consumer policy
+         * (called by the worker). */
+        void watch_stalled(const conn_t &conn) {
+            if (!ev_slow_check)
+            {
+                auto cpool = conn->cpool;
+                double t = cpool->slow_max_age > 0 ? cpool->slow_max_age / 4 : 0.1;
+                t = std::min(t, 1.0);
+                ev_slow_check = TimerEvent(ec, [this, cpool, t](TimerEvent &) {
+                    cpool->check_slow(stalled);
+                    if (!stalled.empty()) ev_slow_check.add(t);
+                });
+                ev_slow_check_interval = t;
+            }
+            if (stalled.empty()) ev_slow_check.add(ev_slow_check_interval);
+            stalled.push_back(conn);
+        }
+
+        /** Stop reading from the connection because it does not fit in the
+         * memory budget (called by the worker). */
+        void pause_recv(const conn_t &conn) {
+            conn->ev_socket.del();
+            conn->ev_socket.add(conn->ready_send ? 0 : FdEvent::WRITE);
+            conn->ready_recv = true;
+            if (conn->recv_mem_paused) return;
+            conn->recv_mem_paused = true;
+            conn->mem->npaused.fetch_add(1, std::memory_order_relaxed);
+            watch_paused(conn);
+        }
+
+        void watch_paused(const conn_t &conn) {
+            if (recv_paused.empty())
+            {
+                if (!ev_recv_resume)
+                    ev_recv_resume = TimerEvent(ec, [this](TimerEvent &) {
+                        resume_recv();
+                    });
+                ev_recv_resume.add(recv_resume_interval);
+            }
+            recv_paused.push_back(conn);
+        }
+
+        static void drop(std::vector<conn_t> &conns, const conn_t &conn) {
+            for (auto &c: conns)
+                if (c == conn)
+                {
+                    std::swap(c, conns.back());
+                    conns.pop_back();
+                    return;
+                }
+        }
+
+        /** Drop the references to the connections (after the worker
+         * thread exits). */
+        void release_conns() {
+            ev_hibernate.clear();
+            awake.clear();
+            ev_recv_resume.clear();
+            recv_paused.clear();
+            ev_slow_check.clear();
+            stalled.clear();
+            fed.clear();
+        }
     };
 
     private:
     /* related to workers */
+    /** the shared loops the workers run on (if any), outlives them */
+    ArcObj<WorkerGroup> group;
     size_t nworker;
     salticidae::BoxObj<Worker[]> workers;
+    /* the first ndisp workers are also the dispatcher shards */
+    size_t ndisp;
+    std::atomic<size_t> disp_rr;
+    /* the elastic mode (enabled if max_worker > 0), run by the first
+     * dispatcher shard: only workers[0, nactive) take connections, and
+     * those beyond have no thread unless being retired */
+    size_t min_worker;
+    size_t max_worker;
+    const double grow_util;
+    const double shrink_util;
+    const double elastic_period;
+    std::atomic<size_t> nactive;
+    /** the index + 1 of the worker being retired (0 if none) */
+    size_t retiring;
+    size_t retire_nquiet;
+    size_t retire_nticks;
+    size_t ngrow_vote;
+    size_t nshrink_vote;
+    uint64_t util_since;
+    std::vector<uint64_t> idle_since;
+    std::atomic<double> worker_util;
+    std::atomic<size_t> nmigrated;
+    /** the connections on their way to another worker */
+    std::atomic<size_t> nmigrating;
+    TimerEvent ev_elastic;
+    /** the number of samples in a row needed to resize */
+    static const size_t elastic_patience = 3;
+    /** the number of samples to wait for a retired worker to drain */
+    static const size_t retire_max_ticks = 10;
+
+    void elastic_tick();
+    void grow_workers();
+    void retire_worker(size_t idx);
+    void shed_conns(Worker &worker, size_t n, Worker *to);
 
     void accept_client(int, int);
+    bool set_keepalive(int fd) const;
     void conn_server(const conn_t &conn, int, int);
     conn_t add_conn(const conn_t &conn);
     void del_conn(const conn_t &conn);
     void release_conn(const conn_t &conn);
+    void stop_group_workers();
+
+    protected:
+    size_t get_nworker() const { return nworker; }
+    Worker &get_worker(size_t idx) const { return workers[idx]; }
+    size_t get_ndisp() const { return ndisp; }
+    /** The dispatcher shard of an accepted connection. */
+    Worker &get_fd_disp(int fd) { return workers[fd % ndisp]; }
+    /** The dispatcher shard of a connection made by the user. */
+    Worker &next_disp() {
+        return workers[disp_rr.fetch_add(1, std::memory_order_relaxed) % ndisp];
+    }
+    size_t get_worker_idx(const Worker *worker) const {
+        return worker - workers.get();
+    }
 
+    private:
     Worker &select_worker() {
         size_t idx = 0;
-        size_t best = workers[idx].get_nconn();
-        for (size_t i = 0; i < nworker; i++)
+        size_t best = workers[idx].get_load();
+        size_t n = nactive.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < n; i++)
         {
-            size_t t = workers[i].get_nconn();
+            size_t t = workers[i].get_load();
             if (t < best)
             {
                 best = t;
@@ -384,6 +1258,8 @@ class ConnPool {
 
     public:
     const bool enable_tls;
+    const bool single_thread;
+    Transport *const transport;
 
     class Config {
         friend class ConnPool;
@@ -392,7 +1268,24 @@ class ConnPool {
         size_t _recv_chunk_size;
         size_t _max_recv_buff_size;
         size_t _max_send_buff_size;
+        double _hibernate_after;
+        size_t _mem_budget;
+        double _slow_max_age;
+        size_t _slow_max_backlog;
+        SlowConsumerPolicy _slow_policy;
+        int _tcp_keepalive_idle;
+        int _tcp_keepalive_interval;
+        int _tcp_keepalive_count;
         size_t _nworker;
+        size_t _ndispatcher;
+        size_t _min_worker;
+        size_t _max_worker;
+        double _grow_util;
+        double _shrink_util;
+        double _elastic_period;
+        ArcObj<WorkerGroup> _worker_group;
+        bool _single_thread;
+        Transport *_transport;
         bool _enable_tls;
         std::string _tls_cert_file;
         std::string _tls_key_file;
@@ -400,22 +1293,48 @@ class ConnPool {
         RcObj<PKey> _tls_key;
         bool _tls_skip_ca_check;
         SSL_verify_cb _tls_verify_callback;
+        double _send_rate;
+        double _send_burst;
+        double _conn_send_rate;
+        double _conn_send_burst;
+        std::vector<std::pair<double, double>> _class_send_rate;
 
         public:
         Config():
             _max_listen_backlog(10),
             _conn_server_timeout(2),
             _recv_chunk_size(4096),
-            _max_recv_buff_size(4096),
+            _max_recv_buff_size(1 << 20),
             _max_send_buff_size(0),
+            _hibernate_after(0),
+            _mem_budget(0),
+            _slow_max_age(0),
+            _slow_max_backlog(0),
+            _slow_policy(SLOW_NOTIFY),
+            _tcp_keepalive_idle(0),
+            _tcp_keepalive_interval(0),
+            _tcp_keepalive_count(0),
             _nworker(1),
+            _ndispatcher(1),
+            _min_worker(1),
+            _max_worker(0),
+            _grow_util(0.75),
+            _shrink_util(0.3),
+            _elastic_period(1),
+            _worker_group(nullptr),
+            _single_thread(false),
+            _transport(nullptr),
             _enable_tls(false),
             _tls_cert_file(""),
             _tls_key_file(""),
             _tls_cert(nullptr),
             _tls_key(nullptr),
             _tls_skip_ca_check(true),
-            _tls_verify_callback(nullptr) {}
+            _tls_verify_callback(nullptr),
+            _send_rate(0),
+            _send_burst(65536),
+            _conn_send_rate(0),
+            _conn_send_burst(65536) {}
 
         Config &max_listen_backlog(int x) {
             _max_listen_backlog = x;
@@ -437,6 +1356,76 @@ class ConnPool {
             return *this;
         }
 
+        /** Split the dispatcher role (connection setup and teardown,
+         * handshakes of PeerNetwork) into `x` shards, each run by one of the
+         * first `x` workers with its own connections (no more than
+         * nworker). An accepted connection goes to the shard picked by its
+         * fd, one made by connect() to the next shard in turn, and a
+         * connection of PeerNetwork to the shard of its peer. */
+        Config &ndispatcher(size_t x) {
+            _ndispatcher = std::max((size_t)1, x);
+            return *this;
+        }
+
+        /** Let the number of workers float between `min_worker` and
+         * `max_worker`, starting from nworker. A worker is added once the
+         * average utilization of the workers (the share of time their loops
+         * are not waiting for events) stays above `grow_util`, and the
+         * connections are rebalanced onto it. One is retired, with its
+         * connections moved to the others, once the utilization would stay
+         * below `shrink_util` without it. Either has to hold for a few
+         * samples in a row. Not available with a worker group or the
+         * single-threaded mode. Needs libuv 1.39 or later, the pool throws
+         * SALTI_ERROR_NOT_AVAIL otherwise. */
+        Config &elastic_workers(size_t min_worker, size_t max_worker,
+                                double grow_util = 0.75, double shrink_util = 0.3) {
+            _min_worker = std::max((size_t)1, min_worker);
+            _max_worker = std::max(_min_worker, max_worker);
+            _grow_util = grow_util;
+            _shrink_util = shrink_util;
+            return *this;
+        }
+
+        /** How often (in seconds) the utilization of the workers is
+         * sampled in the elastic mode. */
+        Config &elastic_period(double x) {
+            _elastic_period = x;
+            return *this;
+        }
+
+        /** Run the workers (and the dispatcher shards) on the loops of `x`
+         * instead of threads of their own, so that the connections of all
+         * pools sharing the group are balanced across the same workers;
+         * nworker is then the size of the group. The pool must be created
+         * and stopped outside the loops of the group. */
+        Config &worker_group(const ArcObj<WorkerGroup> &x) {
+            _worker_group = x;
+            return *this;
+        }
+
+        /** Run the dispatcher and the (only) worker on the EventContext
+         * given to the network instead of threads of their own, for small,
+         * latency-critical deployments: a received message goes straight
+         * to its handler, and a message sent to an idle connection
+         * straight to the socket. The network must then be used only from
+         * the thread that runs the EventContext. */
+        Config &single_thread(bool x) {
+            _single_thread = x;
+            return *this;
+        }
+
+        /** Open the connections through `x` instead of TCP sockets, `x`
+         * must outlive the network. */
+        Config &transport(Transport *x) {
+            _transport = x;
+            return *this;
+        }
+
+        /** The number of received bytes buffered by a connection before it
+         * stops reading from the socket (it used to count the buffered
+         * segments, of whatever size each read returned). MsgNetwork raises
+         * it to at least one whole message (see
+         * MsgNetwork::Config::max_msg_size()). */
         Config &max_recv_buff_size(size_t x) {
             _max_recv_buff_size = x;
             return *this;
@@ -447,6 +1436,48 @@ class ConnPool {
             return *this;
         }
 
+        /** Release the send queue of a connection after it has had no I/O
+         * for `x` seconds, the queue is reallocated upon the next write (0
+         * to keep the queues). */
+        Config &hibernate_after(double x) {
+            _hibernate_after = x;
+            return *this;
+        }
+
+        /** The number of bytes that can be held by the send buffers,
+         * receive buffers and received messages of all connections
+         * altogether (0 for unlimited). Writes are refused and reading is
+         * paused as the budget runs out, except for what is left of the
+         * message each connection is receiving, so the budget may be
+         * exceeded by up to one message per connection. */
+        Config &mem_budget(size_t x) {
+            _mem_budget = x;
+            return *this;
+        }
+
+        /** Treat a connection as a slow consumer once its oldest unsent
+         * message has been queued for more than `max_age` seconds, or it has
+         * more than `max_backlog` unsent bytes (0 to disable either check),
+         * and apply `policy` to it. */
+        Config &slow_consumer(double max_age, size_t max_backlog,
+                            SlowConsumerPolicy policy = SLOW_NOTIFY) {
+            _slow_max_age = max_age;
+            _slow_max_backlog = max_backlog;
+            _slow_policy = policy;
+            return *this;
+        }
+
+        /** Let the kernel probe a connection after it has been idle for
+         * `idle` seconds, every `interval` seconds, and drop it after `count`
+         * unanswered probes (0 for the system defaults; `idle` = 0 disables
+         * the keepalive). */
+        Config &tcp_keepalive(int idle, int interval = 0, int count = 0) {
+            _tcp_keepalive_idle = idle;
+            _tcp_keepalive_interval = interval;
+            _tcp_keepalive_count = count;
+            return *this;
+        }
+
         Config &enable_tls(bool x) {
             _enable_tls = x;
             return *this;
@@ -481,20 +1512,99 @@ class ConnPool {
             _tls_verify_callback = x;
             return *this;
         }
+
+        /** The egress budget (bytes/sec) shared by all connections (0 for
+         * unlimited). */
+        Config &send_rate(double x) {
+            _send_rate = x;
+            return *this;
+        }
+
+        Config &send_burst(double x) {
+            _send_burst = x;
+            return *this;
+        }
+
+        /** The default send rate (bytes/sec) of each connection (0 for
+         * unlimited). */
+        Config &conn_send_rate(double x) {
+            _conn_send_rate = x;
+            return *this;
+        }
+
+        Config &conn_send_burst(double x) {
+            _conn_send_burst = x;
+            return *this;
+        }
+
+        /** The send rate (bytes/sec) shared by all data of traffic class
+         * `tclass`, drawn from the egress budget. */
+        Config &class_send_rate(uint8_t tclass, double rate, double burst = 65536) {
+            if (_class_send_rate.size() <= tclass)
+                _class_send_rate.resize(tclass + 1, std::make_pair(0, 0));
+            _class_send_rate[tclass] = std::make_pair(rate, burst);
+            return *this;
+        }
     };
 
     ConnPool(const EventContext &ec, const Config &config):
             system_state(0), ec(ec),
             async_id(0),
+            nsend_expired(0),
+            send_expired_bytes(0),
+            nrecv_expired(0),
             max_listen_backlog(config._max_listen_backlog),
             conn_server_timeout(config._conn_server_timeout),
             recv_chunk_size(config._recv_chunk_size),
             max_recv_buff_size(config._max_recv_buff_size),
             max_send_buff_size(config._max_send_buff_size),
+            hibernate_after(config._hibernate_after),
+            tcp_keepalive_idle(config._tcp_keepalive_idle),
+            tcp_keepalive_interval(config._tcp_keepalive_interval),
+            tcp_keepalive_count(config._tcp_keepalive_count),
+            mem(config._mem_budget ? new MemBudget(config._mem_budget) : nullptr),
+            slow_max_age(config._slow_max_age),
+            slow_max_backlog(config._slow_max_backlog),
+            slow_policy(config._slow_policy),
+            nslow(0),
+            nslow_dropped(0),
+            nslow_dropped_bytes(0),
+            nslow_disconnected(0),
             tls_ctx(nullptr),
+            shaper(nullptr),
+            conn_send_rate(config._conn_send_rate),
+            conn_send_burst(config._conn_send_burst),
+            nthrottled(0),
+            throttled_bytes(0),
+            throttle_delay_ns(0),
+            nflow_blocked(0),
+            nconflated(0),
+            conn_serial(0),
+            conn_watcher_id(0),
             listen_fd(-1),
-            nworker(config._nworker),
-            enable_tls(config._enable_tls) {
+            group(config._single_thread ? nullptr : config._worker_group),
+            nworker(config._single_thread ? 1 :
+                    group ? group->size() : config._nworker),
+            ndisp(std::min(nworker, config._ndispatcher)),
+            disp_rr(0),
+            min_worker(0),
+            max_worker(0),
+            grow_util(config._grow_util),
+            shrink_util(config._shrink_util),
+            elastic_period(config._elastic_period),
+            nactive(0),
+            retiring(0),
+            retire_nquiet(0),
+            retire_nticks(0),
+            ngrow_vote(0),
+            nshrink_vote(0),
+            util_since(0),
+            worker_util(0),
+            nmigrated(0),
+            nmigrating(0),
+            enable_tls(config._enable_tls),
+            single_thread(config._single_thread),
+            transport(config._transport) {
         if (enable_tls)
         {
             tls_ctx = new TLSContext();
@@ -511,15 +1621,61 @@ class ConnPool {
             if (!tls_ctx->check_privkey())
                 throw SalticidaeError(SALTI_ERROR_TLS_KEY_NOT_MATCH);
         }
+        bool shaped = config._send_rate > 0;
+        for (auto &r: config._class_send_rate)
+            if (r.first > 0) shaped = true;
+        if (shaped)
+        {
+            shaper = new SendShaper();
+            shaper->global = TokenBucket(config._send_rate, config._send_burst);
+            shaper->classes.resize(256);
+            for (size_t i = 0; i < config._class_send_rate.size(); i++)
+                shaper->classes[i] = TokenBucket(
+                    config._class_send_rate[i].first,
+                    config._class_send_rate[i].second);
+        }
+        if (config._max_worker && !single_thread && !group)
+        {
+#if UV_VERSION_HEX < 0x012700
+            /* the utilization is sampled with uv_metrics_idle_time() */
+            throw SalticidaeError(SALTI_ERROR_NOT_AVAIL);
+#endif
+            min_worker = config._min_worker;
+            max_worker = config._max_worker;
+            nworker = max_worker;
+            ndisp = std::min(min_worker, config._ndispatcher);
+            nactive = std::min(std::max(config._nworker, min_worker), max_worker);
+        }
+        else nactive = nworker;
         workers = new Worker[nworker];
+        if (max_worker)
+        {
+            for (size_t i = 0; i < nworker; i++)
+                workers[i].track_conns();
+            idle_since.resize(nworker);
+        }
         user_tcall = new ThreadCall(ec);
+        if (single_thread)
+        {
+            workers[0].use_user_loop(ec);
+            user_tcall->set_inline_call(true);
+        }
+        else if (group)
+        {
+            for (size_t i = 0; i < nworker; i++)
+                group->call(i, [this, i]() {
+                    workers[i].use_group_loop(group->get_slot(i));
+                });
+        }
         disp_ec = workers[0].get_ec();
         disp_tcall = workers[0].get_tcall();
-        workers[0].set_dispatcher();
+        for (size_t i = 0; i < ndisp; i++)
+            workers[i].set_dispatcher();
         disp_error_cb = [this](const std::exception_ptr err) {
-            workers[0].stop_tcall();
+            for (size_t i = 0; i < ndisp; i++)
+                workers[i].stop_tcall();
             user_tcall->async_call([this, err](ThreadCall::Handle &) {
-                for (size_t i = 1; i < nworker; i++)
+                for (size_t i = ndisp; i < nworker; i++)
                     workers[i].stop();
                 if (error_cb) error_cb(err, true, -1);
             });
@@ -541,7 +1697,14 @@ class ConnPool {
         }
     }
 
-    ~ConnPool() { stop(); }
+    ~ConnPool() {
+        stop();
+        /* the ThreadCalls of the workers are bound to the loops of the
+         * group, which are still running */
+        if (group)
+            for (size_t i = 0; i < nworker; i++)
+                group->call(i, [this, i]() { workers[i].tcall = nullptr; });
+    }
 
     ConnPool(const ConnPool &) = delete;
     ConnPool(ConnPool &&) = delete;
@@ -550,49 +1713,84 @@ class ConnPool {
         std::atomic_thread_fence(std::memory_order_acq_rel);
         if (system_state) return;
         SALTICIDAE_LOG_INFO("starting all threads...");
-        for (size_t i = 0; i < nworker; i++)
+        if (max_worker)
+        {
+            ev_elastic = TimerEvent(disp_ec, [this](TimerEvent &) {
+                elastic_tick();
+                ev_elastic.add(elastic_period);
+            });
+            ev_elastic.add(elastic_period);
+            util_since = uv_hrtime();
+        }
+        /* the rest of the workers are started on demand */
+        for (size_t i = 0; i < nactive; i++)
             workers[i].start();
         system_state = 1;
     }
 
     void stop_workers() {
+        if (group)
+        {
+            /* the loops are left running, so a pool that has never started
+             * is also torn down on them */
+            if (system_state == 2) return;
+            system_state = 2;
+            SALTICIDAE_LOG_INFO("detaching from the worker group...");
+            stop_group_workers();
+            return;
+        }
         if (system_state != 1) return;
         system_state = 2;
         SALTICIDAE_LOG_INFO("stopping all threads...");
-        /* stop the dispatcher */
-        workers[0].disp_stop();
-        workers[0].get_handle().join();
+        /* stop the dispatcher shards (the loop of the user is left
+         * running) */
+        if (!single_thread)
+        {
+            for (size_t i = 0; i < ndisp; i++)
+                workers[i].disp_stop();
+            for (size_t i = 0; i < ndisp; i++)
+                workers[i].get_handle().join();
+        }
         /* stop all workers */
-        for (size_t i = 1; i < nworker; i++)
+        for (size_t i = ndisp; i < nworker; i++)
             workers[i].stop();
         /* join all worker threads */
-        for (size_t i = 1; i < nworker; i++)
-            workers[i].get_handle().join();
-        for (auto it: pool)
-        {
-            auto &conn = it.second;
-            on_worker_teardown(conn);
-            //conn->stop();
-            conn->set_terminated();
-            release_conn(conn);
-        }
+        for (size_t i = ndisp; i < nworker; i++)
+            if (workers[i].get_handle().joinable())
+                workers[i].get_handle().join();
+        ev_elastic.clear();
+        for (size_t i = 0; i < nworker; i++)
+            workers[i].release_conns();
+        for (size_t i = 0; i < ndisp; i++)
+            for (auto it: workers[i].pool)
+            {
+                auto &conn = it.second;
+                on_worker_teardown(conn);
+                //conn->stop();
+                conn->set_terminated();
+                release_conn(conn);
+            }
+        for (size_t i = 0; i < nworker; i++)
+            on_worker_stop(workers[i]);
     }
 
     void stop() {
         stop_workers();
         if (listen_fd != -1)
         {
-            close(listen_fd);
+            if (transport) transport->close(listen_fd);
+            else close(listen_fd);
             listen_fd = -1;
         }
     }
 
     /** Actively connect to remote addr. */
     conn_t connect_sync(const NetAddr &addr) {
+        auto &disp = next_disp();
         auto ret = *(static_cast<conn_t *>(
-                    disp_tcall->call([this, addr](ThreadCall::Handle &h) {
+                    disp.get_tcall()->call([this, addr, &disp](ThreadCall::Handle &h) {
             conn_t conn;
-            conn = _connect(addr);
+            conn = _connect(addr, disp);
             h.set_result(conn);
         }).get()));
         return ret;
@@ -601,9 +1799,10 @@ class ConnPool {
     /** Actively connect to remote addr (async). */
     int32_t connect(const NetAddr &addr) {
         auto id = gen_async_id();
-        disp_tcall->async_call([this, addr, id](ThreadCall::Handle &) {
+        auto &disp = next_disp();
+        disp.get_tcall()->async_call([this, addr, id, &disp](ThreadCall::Handle &) {
             try {
-                _connect(addr);
+                _connect(addr, disp);
             } catch (...) {
                 this->recoverable_error(std::current_exception(), id);
             }
@@ -624,11 +1823,26 @@ class ConnPool {
     template<typename Func>
     void reg_conn_handler(Func &&cb) { conn_cb = std::forward<Func>(cb); }
 
+    /** Register a callback invoked (by the user thread) on every connection
+     * status change before the conn handler, for the layers built on top of
+     * the network (e.g. RPCEndpoint). It cannot reject a connection. Return
+     * the id for del_conn_watcher() (both are called by the user thread). */
+    size_t add_conn_watcher(conn_watcher_t cb) {
+        conn_watchers.insert(std::make_pair(++conn_watcher_id, std::move(cb)));
+        return conn_watcher_id;
+    }
+    void del_conn_watcher(size_t id) { conn_watchers.erase(id); }
+
     template<typename Func>
     void reg_error_handler(Func &&cb) { error_cb = std::forward<Func>(cb); }
 
+    /** Register the callback invoked (by the user thread) when a connection
+     * becomes a slow consumer (see Config::slow_consumer()). */
+    template<typename Func>
+    void reg_slow_consumer_handler(Func &&cb) { slow_consumer_cb = std::forward<Func>(cb); }
+
     void terminate(const conn_t &conn) {
-        disp_tcall->async_call([this, conn](ThreadCall::Handle &) {
+        disp_call(conn, [this, conn](ThreadCall::Handle &) {
             try {
                 disp_terminate(conn);
             } catch (...) {
@@ -638,6 +1852,137 @@ class ConnPool {
     }
 
     const X509 *get_cert() const { return tls_cert.get(); }
+
+    /** Change the send rate (bytes/sec, 0 for unlimited) of a connection. */
+    void set_send_rate(const conn_t &conn, double rate, double burst = 65536) {
+        worker_call(conn, [conn, rate, burst](ThreadCall::Handle &) {
+            conn->send_bucket = TokenBucket(rate, burst);
+        });
+    }
+
+    struct SendShapingStats {
+        /** number of times a segment was held back by the shaper */
+        size_t nthrottled;
+        /** total size of the segments held back */
+        size_t throttled_bytes;
+        /** total time (in seconds) segments were held back */
+        double throttle_delay;
+    };
+
+    SendShapingStats get_send_shaping_stats() const {
+        return SendShapingStats{
+            nthrottled.load(std::memory_order_relaxed),
+            throttled_bytes.load(std::memory_order_relaxed),
+            throttle_delay_ns.load(std::memory_order_relaxed) / 1e9
+        };
+    }
+
+    /** Get the number of workers taking connections (see
+     * Config::elastic_workers()). */
+    size_t get_nactive_worker() const {
+        return nactive.load(std::memory_order_relaxed);
+    }
+
+    /** Get the average utilization of the workers (0 to 1) at the last
+     * sample of the elastic mode. */
+    double get_worker_util() const {
+        return worker_util.load(std::memory_order_relaxed);
+    }
+
+    /** Get the number of connections moved to another worker. */
+    size_t get_nmigrated() const {
+        return nmigrated.load(std::memory_order_relaxed);
+    }
+
+    /** Get the number of times a connection had to wait for the remote to
+     * grant more credit (see MsgNetwork::Config::flow_control()). */
+    size_t get_nflow_blocked() const {
+        return nflow_blocked.load(std::memory_order_relaxed);
+    }
+
+    /** Get the number of unsent entries replaced by a newer one with the
+     * same key (see Conn::write_conflated()). */
+    size_t get_nconflated() const {
+        return nconflated.load(std::memory_order_relaxed);
+    }
+
+    struct SlowConsumerStats {
+        /** number of times a connection became a slow consumer */
+        size_t nslow;
+        /** number of messages dropped by SLOW_CONFLATE or SLOW_DROP_OLDEST */
+        size_t ndropped;
+        /** total size of the dropped messages */
+        size_t ndropped_bytes;
+        /** number of connections terminated by SLOW_DISCONNECT */
+        size_t ndisconnected;
+    };
+
+    SlowConsumerStats get_slow_consumer_stats() const {
+        return SlowConsumerStats{
+            nslow.load(std::memory_order_relaxed),
+            nslow_dropped.load(std::memory_order_relaxed),
+            nslow_dropped_bytes.load(std::memory_order_relaxed),
+            nslow_disconnected.load(std::memory_order_relaxed)
+        };
+    }
+
+    struct MemStats {
+        /** the budget (0 if unlimited) */
+        size_t limit;
+        /** bytes held by all connections */
+        size_t used;
+        /** number of writes refused */
+        size_t nrejected;
+        /** number of times reading from a connection was paused */
+        size_t npaused;
+    };
+
+    MemStats get_mem_stats() const {
+        if (!mem) return MemStats{0, 0, 0, 0};
+        return MemStats{
+            mem->limit,
+            mem->used.load(std::memory_order_relaxed),
+            mem->nrejected.load(std::memory_order_relaxed),
+            mem->npaused.load(std::memory_order_relaxed)
+        };
+    }
+
+    struct ConnMemUsage {
+        conn_t conn;
+        /** bytes written but not yet sent */
+        size_t send;
+        /** bytes received but not yet handled */
+        size_t recv;
+    };
+
+    /** Get the `n` connections holding the most bytes (blocking, should not
+     * be invoked by the dispatcher). */
+    std::vector<ConnMemUsage> get_top_mem_conns(size_t n) {
+        std::vector<ConnMemUsage> usage;
+        for (size_t i = 0; i < ndisp; i++)
+        {
+            auto &disp = workers[i];
+            auto ret = *(static_cast<std::vector<ConnMemUsage> *>(
+                        disp.get_tcall()->call([&disp](ThreadCall::Handle &h) {
+                std::vector<ConnMemUsage> usage;
+                for (auto &p: disp.pool)
+                {
+                    auto &conn = p.second;
+                    usage.push_back(ConnMemUsage{conn,
+                        conn->get_send_backlog(), conn->get_recv_backlog()});
+                }
+                h.set_result(std::move(usage));
+            }).get()));
+            usage.insert(usage.end(), ret.begin(), ret.end());
+        }
+        size_t m = std::min(n, usage.size());
+        std::partial_sort(usage.begin(), usage.begin() + m, usage.end(),
+            [](const ConnMemUsage &a, const ConnMemUsage &b) {
+                return a.send + a.recv > b.send + b.recv;
+            });
+        usage.resize(m, ConnMemUsage{nullptr, 0, 0});
+        return usage;
+    }
 };
 
 }
@@ -79,6 +79,38 @@ class EventContext: public _event_context_ot {
         uv_run(get(), UV_RUN_DEFAULT);
     }
     void stop() const { uv_stop(get()); }
+    /** Drive the timers of the loop by `clock` instead of libuv (nullptr
+     * to go back), before any timer is added. */
+    void set_clock(VirtualClock *clock) const { get()->data = clock; }
+    VirtualClock *get_clock() const {
+        return static_cast<VirtualClock *>(get()->data);
+    }
+    /** The cached time (in milliseconds) at the start of the current loop
+     * iteration, which is cheap to get and shares the same monotonic clock
+     * across all contexts. */
+    uint64_t now() const {
+        auto clock = get_clock();
+        return clock ? (uint64_t)(clock->now() * 1e3) : uv_now(get());
+    }
+    /** The current time (in nanoseconds), read afresh. */
+    uint64_t hrtime() const {
+        auto clock = get_clock();
+        return clock ? (uint64_t)(clock->now() * 1e9) : uv_hrtime();
+    }
+#if UV_VERSION_HEX >= 0x012700
+    /** Account the time the loop spends waiting for events (see
+     * get_idle_time()), must be called before the loop runs (needs libuv
+     * 1.39 or later). */
+    void enable_idle_time() const {
+        uv_loop_configure(get(), UV_METRICS_IDLE_TIME);
+    }
+    /** The total time (in nanoseconds) the loop has spent waiting for
+     * events, including the ongoing wait, can be read by any thread. */
+    uint64_t get_idle_time() const { return uv_metrics_idle_time(get()); }
+#else
+    void enable_idle_time() const { throw SalticidaeError(SALTI_ERROR_NOT_AVAIL); }
+    uint64_t get_idle_time() const { return 0; }
+#endif
 };
 
 class FdEvent {
@@ -93,6 +125,8 @@ class FdEvent {
     int fd;
     uv_poll_t *ev_fd;
     callback_t callback;
+    /** the events being watched */
+    int events;
 
     static inline void fd_then(uv_poll_t *h, int status, int events) {
         if (status != 0)
@@ -102,10 +136,10 @@ class FdEvent {
     }
 
     public:
-    FdEvent(): ec(nullptr), ev_fd(nullptr) {}
+    FdEvent(): ec(nullptr), ev_fd(nullptr), events(0) {}
     FdEvent(const EventContext &ec, int fd, callback_t callback):
             ec(ec), fd(fd), ev_fd(new uv_poll_t()),
-            callback(std::move(callback)) {
+            callback(std::move(callback)), events(0) {
         if (uv_poll_init(ec.get(), ev_fd, fd) < 0)
             throw SalticidaeError(SALTI_ERROR_LIBUV_INIT);
         ev_fd->data = this;
@@ -114,8 +148,9 @@ class FdEvent {
     FdEvent(const FdEvent &) = delete;
     FdEvent(FdEvent &&other):
             ec(std::move(other.ec)), fd(other.fd), ev_fd(other.ev_fd),
-            callback(std::move(other.callback)) {
+            callback(std::move(other.callback)), events(other.events) {
         other.ev_fd = nullptr;
+        other.events = 0;
         if (ev_fd != nullptr)
             ev_fd->data = this;
     }
@@ -125,6 +160,7 @@ class FdEvent {
         std::swap(fd, other.fd);
         std::swap(ev_fd, other.ev_fd);
         std::swap(callback, other.callback);
+        std::swap(events, other.events);
         if (ev_fd != nullptr)
             ev_fd->data = this;
         if (other.ev_fd != nullptr)
@@ -150,22 +186,28 @@ class FdEvent {
             ev_fd = nullptr;
         }
         callback = nullptr;
+        events = 0;
     }
 
     void set_callback(callback_t _callback) {
         callback = _callback;
     }
 
-    void add(int events) {
+    void add(int _events) {
         assert(ev_fd != nullptr);
-        if (uv_poll_start(ev_fd, events, FdEvent::fd_then) < 0)
+        if (uv_poll_start(ev_fd, _events, FdEvent::fd_then) < 0)
             throw SalticidaeError(SALTI_ERROR_LIBUV_START);
+        events = _events;
+        if (auto clock = ec.get_clock()) clock->on_fd_watch();
     }
 
     void del() {
         if (ev_fd != nullptr) uv_poll_stop(ev_fd);
+        events = 0;
     }
 
+    int get_events() const { return events; }
+
     operator bool() const { return ev_fd != nullptr; }
 };
 
@@ -177,6 +219,8 @@ class TimerEvent {
     protected:
     EventContext ec;
     uv_timer_t *ev_timer;
+    /** the pending timer on the virtual clock of the loop, if any */
+    VirtualClock::timer_id_t vtimer;
     callback_t callback;
 
     static inline void timer_then(uv_timer_t *h) {
@@ -184,10 +228,32 @@ class TimerEvent {
         event->callback(*event);
     }
 
+    void start_timer(double t_sec, uv_timer_cb cb) {
+        auto clock = ec.get_clock();
+        if (clock)
+        {
+            clock->del_timer(vtimer);
+            vtimer = clock->add_timer(t_sec, [h=ev_timer, cb]() { cb(h); });
+        }
+        else if (uv_timer_start(ev_timer, cb, uint64_t(t_sec * 1000), 0) < 0)
+            throw SalticidaeError(SALTI_ERROR_LIBUV_START);
+    }
+
+    void stop_timer() {
+        if (ev_timer == nullptr) return;
+        uv_timer_stop(ev_timer);
+        if (vtimer)
+        {
+            auto clock = ec.get_clock();
+            if (clock) clock->del_timer(vtimer);
+            vtimer = 0;
+        }
+    }
+
     public:
-    TimerEvent(): ec(nullptr), ev_timer(nullptr) {}
+    TimerEvent(): ec(nullptr), ev_timer(nullptr), vtimer(0) {}
     TimerEvent(const EventContext &ec, callback_t callback):
-            ec(ec), ev_timer(new uv_timer_t()),
+            ec(ec), ev_timer(new uv_timer_t()), vtimer(0),
             callback(std::move(callback)) {
         if (uv_timer_init(ec.get(), ev_timer) < 0)
             throw SalticidaeError(SALTI_ERROR_LIBUV_INIT);
@@ -197,8 +263,9 @@ class TimerEvent {
     TimerEvent(const TimerEvent &) = delete;
     TimerEvent(TimerEvent &&other):
             ec(std::move(other.ec)), ev_timer(other.ev_timer),
-            callback(std::move(other.callback)) {
+            vtimer(other.vtimer), callback(std::move(other.callback)) {
         other.ev_timer = nullptr;
+        other.vtimer = 0;
         if (ev_timer != nullptr)
             ev_timer->data = this;
     }
@@ -206,6 +273,7 @@ class TimerEvent {
     void swap(TimerEvent &other) {
         std::swap(ec, other.ec);
         std::swap(ev_timer, other.ev_timer);
+        std::swap(vtimer, other.vtimer);
         std::swap(callback, other.callback);
         if (ev_timer != nullptr)
             ev_timer->data = this;
@@ -227,7 +295,7 @@ class TimerEvent {
     void clear() {
         if (ev_timer != nullptr)
         {
-            uv_timer_stop(ev_timer);
+            stop_timer();
             uv_close((uv_handle_t *)ev_timer, _on_uv_handle_close);
             ev_timer = nullptr;
         }
@@ -240,13 +308,10 @@ class TimerEvent {
 
     void add(double t_sec) {
         assert(ev_timer != nullptr);
-        if (uv_timer_start(ev_timer, TimerEvent::timer_then, uint64_t(t_sec * 1000), 0) < 0)
-            throw SalticidaeError(SALTI_ERROR_LIBUV_START);
+        start_timer(t_sec, TimerEvent::timer_then);
     }
 
-    void del() {
-        if (ev_timer != nullptr) uv_timer_stop(ev_timer);
-    }
+    void del() { stop_timer(); }
 
     operator bool() const { return ev_timer != nullptr; }
 
@@ -272,9 +337,7 @@ class TimedFdEvent: public FdEvent, public TimerEvent {
             events |= ERROR;
         auto event = static_cast<TimedFdEvent *>(h->data);
         event->TimerEvent::del();
-        if (uv_timer_start(event->ev_timer, TimedFdEvent::timer_then,
-                            event->timeout, 0) < 0)
-            throw SalticidaeError(SALTI_ERROR_LIBUV_START);
+        event->start_timer(event->timeout / 1e3, TimedFdEvent::timer_then);
         event->callback(event->fd, events);
     }
 
@@ -339,11 +402,11 @@ class TimedFdEvent: public FdEvent, public TimerEvent {
 
     void add(int events, double t_sec) {
         assert(ev_fd != nullptr && ev_timer != nullptr);
-        auto ret1 = uv_timer_start(ev_timer, TimedFdEvent::timer_then,
-                                    timeout = uint64_t(t_sec * 1000), 0);
-        auto ret2 = uv_poll_start(ev_fd, events, TimedFdEvent::fd_then);
-        if (ret1 < 0 || ret2 < 0)
+        start_timer(t_sec, TimedFdEvent::timer_then);
+        timeout = uint64_t(t_sec * 1000);
+        if (uv_poll_start(ev_fd, events, TimedFdEvent::fd_then) < 0)
             throw SalticidaeError(SALTI_ERROR_LIBUV_START);
+        if (auto clock = FdEvent::ec.get_clock()) clock->on_fd_watch();
     }
 
     void del() {
@@ -354,6 +417,108 @@ class TimedFdEvent: public FdEvent, public TimerEvent {
     operator bool() const { return ev_fd != nullptr; }
 };
 
+/** Hashed timing wheel that drives a large number of coarse-grained timeouts
+ * with a single TimerEvent (which only ticks while there are pending
+ * entries). An entry can be cancelled through the handle returned by add(),
+ * in time proportional to the size of its slot. */
+template<typename T>
+class TimerWheel {
+    public:
+    using callback_t = std::function<void(T &)>;
+    /** identifies an entry for cancel() */
+    struct handle_t {
+        size_t slot;
+        uint64_t seq;
+    };
+
+    private:
+    struct entry_t {
+        size_t rounds;
+        uint64_t seq;
+        T data;
+    };
+    EventContext ec;
+    std::vector<std::vector<entry_t>> slots;
+    uint64_t tick_ms;
+    size_t cur;
+    uint64_t last; /**< the time of the last processed tick */
+    size_t nentry;
+    uint64_t next_seq;
+    callback_t callback;
+    TimerEvent ev_tick;
+
+    void on_tick() {
+        uint64_t now = ec.now();
+        std::vector<entry_t> expired;
+        for (; last + tick_ms <= now && nentry; last += tick_ms)
+        {
+            cur = (cur + 1) % slots.size();
+            auto &slot = slots[cur];
+            for (size_t i = 0; i < slot.size();)
+            {
+                if (slot[i].rounds)
+                {
+                    slot[i++].rounds--;
+                    continue;
+                }
+                expired.push_back(std::move(slot[i]));
+                slot[i] = std::move(slot.back());
+                slot.pop_back();
+                nentry--;
+            }
+        }
+        if (nentry) ev_tick.add(tick_ms / 1e3);
+        for (auto &e: expired) callback(e.data);
+    }
+
+    public:
+    TimerWheel(const EventContext &ec, callback_t callback,
+                double tick = 0.01, size_t nslot = 512):
+        ec(ec), slots(nslot),
+        tick_ms(std::max((uint64_t)1, (uint64_t)(tick * 1000))),
+        cur(0), last(0), nentry(0), next_seq(0),
+        callback(std::move(callback)),
+        ev_tick(ec, [this](TimerEvent &) { on_tick(); }) {}
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel(TimerWheel &&) = delete;
+
+    /** Invoke the callback on data after (at least) t_sec seconds, rounded
+     * up to the tick. */
+    handle_t add(double t_sec, T data) {
+        uint64_t now = ec.now();
+        if (!nentry)
+        {
+            last = now;
+            ev_tick.add(tick_ms / 1e3);
+        }
+        uint64_t t = (uint64_t)(t_sec * 1000) + (now - last);
+        size_t nticks = std::max((uint64_t)1, (t + tick_ms - 1) / tick_ms);
+        size_t slot = (cur + nticks) % slots.size();
+        slots[slot].push_back(
+            entry_t{(nticks - 1) / slots.size(), next_seq, std::move(data)});
+        nentry++;
+        return handle_t{slot, next_seq++};
+    }
+
+    /** Remove the entry without invoking the callback, return false if it
+     * has already expired (or been cancelled). */
+    bool cancel(const handle_t &h) {
+        auto &slot = slots[h.slot];
+        for (size_t i = 0; i < slot.size(); i++)
+            if (slot[i].seq == h.seq)
+            {
+                slot[i] = std::move(slot.back());
+                slot.pop_back();
+                if (!--nentry) ev_tick.del();
+                return true;
+            }
+        return false;
+    }
+
+    size_t size() const { return nentry; }
+};
+
 class SigEvent {
     public:
     using callback_t = std::function<void(int signum)>;
@@ -596,8 +761,8 @@ class NotifyFd {
 #warning "platform not supported!"
 #endif
 
-template<typename T>
-class MPSCQueueEventDriven: public MPSCQueue<T> {
+template<typename T, size_t BlockSize = MPMCQ_SIZE>
+class MPSCQueueEventDriven: public MPSCQueue<T, BlockSize> {
     private:
     std::atomic<bool> wait_sig;
     NotifyFd nfd;
@@ -627,11 +792,15 @@ class MPSCQueueEventDriven: public MPSCQueue<T> {
     }
 
     void unreg_handler() { ev.clear(); }
+    bool is_registered() const { return ev; }
 
+    /** Enqueue an item and wake up the consumer, unless `notify` is false
+     * (the consumer is the caller itself and takes care of it). */
     template<typename U>
-    bool enqueue(U &&e, bool unbounded = true) {
-        if (!MPSCQueue<T>::enqueue(std::forward<U>(e), unbounded))
+    bool enqueue(U &&e, bool unbounded = true, bool notify = true) {
+        if (!MPSCQueue<T, BlockSize>::enqueue(std::forward<U>(e), unbounded))
             return false;
+        if (!notify) return true;
         // memory barrier here, so any load/store in enqueue must be finialized
         if (wait_sig.exchange(false, std::memory_order_acq_rel))
         {
@@ -696,6 +865,29 @@ class ThreadCall {
     using queue_t = MPSCQueueEventDriven<Handle *>;
     queue_t q;
     bool stopped;
+    bool inline_call;
+    /** where the calls go once the loop is parked (see forward_to()) */
+    std::atomic<ThreadCall *> fwd;
+    std::mutex fwd_lock;
+
+    /** Move the queued calls to the forwarding target, which is the only
+     * way they are taken off the queue once it is set. */
+    void forward_queued() {
+        std::lock_guard<std::mutex> _(fwd_lock);
+        auto to = fwd.load();
+        Handle *h;
+        if (to)
+            while (q.try_dequeue(h)) to->enqueue(h);
+    }
+
+    void enqueue(Handle *h) {
+        q.enqueue(h);
+        /* pairs with the store in forward_to(), so that either the queue
+         * is drained there after this call is in, or it is forwarded
+         * here */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (fwd.load(std::memory_order_relaxed)) forward_queued();
+    }
 
     public:
     struct Result {
@@ -758,11 +950,14 @@ class ThreadCall {
 
     ThreadCall(const ThreadCall &) = delete;
     ThreadCall(ThreadCall &&) = delete;
-    ThreadCall(EventContext ec, size_t burst_size = 128): ec(ec), stopped(false) {
+    ThreadCall(EventContext ec, size_t burst_size = 128):
+            ec(ec), stopped(false), inline_call(false), fwd(nullptr) {
         q.reg_handler(ec, [this, burst_size=burst_size](queue_t &q) {
             size_t cnt = 0;
             Handle *h;
-            while (q.try_dequeue(h))
+            /* a call may set the forwarding target, which takes over the
+             * queue */
+            while (!fwd.load(std::memory_order_relaxed) && q.try_dequeue(h))
             {
                 try {
                     if (!stopped) h->exec();
@@ -787,23 +982,48 @@ class ThreadCall {
     bool async_call(Func &&callback) {
         auto h = new Handle();
         h->callback = std::forward<Func>(callback);
-        q.enqueue(h);
+        enqueue(h);
         return true;
     }
 
     template<typename Func>
     Result call(Func &&callback) {
+        if (inline_call)
+        {
+            Handle h;
+            h.callback = std::forward<Func>(callback);
+            try {
+                if (stopped) throw SalticidaeError(SALTI_ERROR_NOT_AVAIL);
+                h.callback(h);
+            } catch (...) {
+                h.set_result(0).error = std::current_exception();
+            }
+            return std::move(h.result);
+        }
         auto h = new Handle();
         h->callback = std::forward<Func>(callback);
         ThreadNotifier<Result> notifier;
         h->notifier = &notifier;
-        q.enqueue(h);
+        enqueue(h);
         return notifier.wait();
     }
 
     const EventContext &get_ec() const { return ec; }
+    /** Run call() in place instead of waiting for the loop, as the caller
+     * is on the loop thread itself (async_call() is still deferred, so the
+     * callbacks never re-enter their caller). */
+    void set_inline_call(bool x) { inline_call = x; }
     void stop() { stopped = true; }
     bool is_stopped() { return stopped; }
+    /** Pass the pending and future calls on to `to`, for a loop that is
+     * about to stop (called on the loop), or run them here again (nullptr,
+     * called while the loop is not running). */
+    void forward_to(ThreadCall *to) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        fwd.store(to, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        forward_queued();
+    }
 };
 
 }
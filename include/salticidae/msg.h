@@ -28,6 +28,7 @@
 #include "salticidae/type.h"
 #include "salticidae/stream.h"
 #include "salticidae/netaddr.h"
+#include "salticidae/util.h"
 
 #ifdef __cplusplus
 
@@ -35,6 +36,8 @@
 #include <cstring>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <unistd.h>
 
 namespace salticidae {
 
@@ -224,8 +227,38 @@ class MsgBase {
     bool verify_checksum() const {
         return checksum == get_checksum();
     }
+
+    void set_checksum(uint32_t _checksum) { checksum = _checksum; }
+
+    /** The checksum carried by the header. */
+    uint32_t peek_checksum() const { return checksum; }
+
+    /** Compute the checksum of a payload stored in a file (read here and
+     * now, in full). */
+    static uint32_t get_checksum(int fd, off_t offset, size_t len) {
+        static thread_local class SHA1 sha1;
+        uint32_t res;
+        bytearray_t tmp(std::min(len, (size_t)65536));
+        sha1.reset();
+        while (len)
+        {
+            ssize_t ret = pread(fd, &tmp[0], std::min(len, tmp.size()), offset);
+            if (ret <= 0)
+                throw MsgNetworkError("failed to read the file");
+            sha1.update(&tmp[0], ret);
+            offset += ret;
+            len -= ret;
+        }
+        sha1.digest(tmp);
+        memmove(&res, &*tmp.begin(), 4);
+        return res;
+    }
 #endif
 
+    /** Set the length of a payload that is not held by the message (e.g.
+     * streamed from a file), so only the header is serialized. */
+    void set_payload_size(uint32_t _length) { length = _length; }
+
     bytearray_t serialize() const {
         DataStream s;
         s << htole(magic)
@@ -238,6 +271,21 @@ class MsgBase {
         return bytearray_t(std::move(s));
     }
 
+    bytearray_t serialize_header() const {
+        DataStream s;
+        s << htole(magic)
+          << opcode
+          << htole(length)
+#ifndef SALTICIDAE_NOCHECKSUM
+          << htole(checksum)
+#endif
+          ;
+        return bytearray_t(std::move(s));
+    }
+
+    /** Access the payload without consuming it. */
+    const bytearray_t &peek_payload() const { return payload; }
+
     void gen_hash_list(DataStream &s,
                         const std::vector<uint256_t> &hashes) {
         uint32_t size = htole((uint32_t)hashes.size());
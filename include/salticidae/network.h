@@ -32,7 +32,11 @@
 #include "salticidae/conn.h"
 
 #ifdef __cplusplus
+#include "salticidae/capture.h"
 #include <unordered_set>
+#include <tuple>
+#include <chrono>
+#include <cmath>
 #include <shared_mutex>
 #include <openssl/rand.h>
 namespace salticidae {
@@ -69,11 +73,41 @@ class MsgNetwork: public ConnPool {
     struct callback_traits<ReturnType(ClassType::*)(Args...)>:
         public callback_traits<ReturnType(Args...)> {};
 
+    /** Where a receive sink writes a payload to: a file (at the offset of
+     * fd) if addr is null, otherwise a memory region (e.g. mmap'd) that
+     * holds at least the length of the payload. */
+    struct RecvSink {
+        int fd;
+        off_t offset;
+        uint8_t *addr;
+        RecvSink(): fd(-1), offset(0), addr(nullptr) {}
+    };
+
+    /** The completed range handed to a sink handler. */
+    struct SinkedPayload {
+        RecvSink sink;
+        size_t len;
+        /** false if a write failed or the checksum does not match */
+        bool ok;
+    };
+
+    private:
+    struct SinkState {
+        SinkedPayload done;
+        /** bytes yet to arrive */
+        size_t left;
+#ifndef SALTICIDAE_NOCHECKSUM
+        class SHA1 sha1;
+#endif
+    };
+
+    public:
     class Conn: public ConnPool::Conn {
         friend MsgNetwork;
         enum MsgState {
             HEADER,
-            PAYLOAD
+            PAYLOAD,
+            SINK
         };
 
         Msg msg;
@@ -81,6 +115,14 @@ class MsgNetwork: public ConnPool {
         bool msg_sleep;
         /* initialized and destroyed by the worker */
         TimerEvent ev_enqueue_poll;
+        /** bytes handled since the last credit grant to the remote */
+        std::atomic<size_t> credit_consumed;
+        /** the deadline carried by the last tag, for the next message
+         * (owned by the worker) */
+        double recv_deadline;
+        /** the payload being written to a receive sink (owned by the
+         * worker) */
+        BoxObj<SinkState> sink;
 
         protected:
 #ifdef SALTICIDAE_MSG_STAT
@@ -91,7 +133,8 @@ class MsgNetwork: public ConnPool {
 #endif
 
         public:
-        Conn(): msg_state(HEADER), msg_sleep(false)
+        Conn(): msg_state(HEADER), msg_sleep(false), credit_consumed(0),
+            recv_deadline(0)
 #ifdef SALTICIDAE_MSG_STAT
             , nsent(0), nrecv(0), nsentb(0), nrecvb(0)
 #endif
@@ -126,27 +169,344 @@ class MsgNetwork: public ConnPool {
     std::unordered_map<
         typename Msg::opcode_t,
         std::function<void(const Msg &msg, const conn_t &)>> handler_map;
-    using queue_t = MPSCQueueEventDriven<std::pair<Msg, conn_t>>;
+    struct inbound_t {
+        Msg msg;
+        conn_t conn;
+        /** dropped if not handled by then (0 for never) */
+        double deadline;
+        /** set if the payload went to a receive sink instead */
+        BoxObj<SinkState> sunk;
+    };
+    using queue_t = MPSCQueueEventDriven<inbound_t>;
     queue_t incoming_msgs;
+    BoxObj<WireCapture> capture;
+    /** traffic class of each opcode (used by the outbound shaper) */
+    std::unordered_map<typename Msg::opcode_t, uint8_t> opcode_class;
+    /* credit-based flow control (disabled if the window is 0) */
+    const size_t flow_window;
+    const OpcodeType credit_opcode;
+    /* deadline tags sent along with the messages of send_msg_ttl() */
+    const bool deadline_tags;
+    const OpcodeType deadline_opcode;
+
+    inline bool write_msg(const Msg &msg, const conn_t &conn, double deadline,
+                        bool keyed = false, uint64_t key = 0);
+
+    public:
+    /** The type of function that extracts the ID of a message from its
+     * payload, for the deduplication (see Config::dedup()). */
+    using dedup_id_func_t = std::function<uint64_t(const bytearray_t &)>;
+
+    private:
+    /** Remember the IDs seen in the last `window` to `2 * window` seconds:
+     * two generations are kept, and the older one is discarded every
+     * `window` seconds, or as soon as the newer one is full. The IDs are
+     * spread over stripes with their own locks, so that the workers rarely
+     * wait for each other. */
+    struct DedupFilter {
+        static const size_t nstripe = 16;
+        struct Stripe {
+            std::mutex lock;
+            std::unordered_set<uint64_t> cur, prev;
+            double rotated;
+        };
+        const double window;
+        /** the maximum size of a generation of a stripe */
+        const size_t gen_cap;
+        const dedup_id_func_t get_id;
+        Stripe stripes[nstripe];
+        std::atomic<size_t> ndup;
+
+        DedupFilter(double window, size_t capacity, dedup_id_func_t get_id):
+                window(window),
+                gen_cap(std::max(capacity / (2 * nstripe), (size_t)1)),
+                get_id(std::move(get_id)), ndup(0) {
+            auto now = TokenBucket::now();
+            for (auto &s: stripes) s.rotated = now;
+        }
+
+        bool check(uint64_t id) {
+            double now = TokenBucket::now();
+            /* the top bits of a multiplicative hash, as the IDs returned by
+             * get_id may be sequential */
+            auto &s = stripes[(id * 0x9e3779b97f4a7c15ULL) >> 60];
+            std::lock_guard<std::mutex> _(s.lock);
+            if (now - s.rotated >= window || s.cur.size() >= gen_cap)
+            {
+                /* everything is stale after two windows */
+                if (now - s.rotated >= 2 * window) s.prev.clear();
+                else std::swap(s.prev, s.cur);
+                s.cur.clear();
+                s.rotated = now;
+            }
+            if (s.prev.count(id) || !s.cur.insert(id).second)
+            {
+                ndup.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            return false;
+        }
+    };
+    std::unordered_map<OpcodeType, BoxObj<DedupFilter>> dedup_filters;
+    /** the random key of payload_digest() */
+    uint8_t dedup_key[16];
+
+    public:
+    /** The type of function that chooses the destination of a payload of
+     * the given length (called by a worker). It returns false to receive
+     * the message in memory as usual. */
+    using sink_func_t = std::function<bool(const conn_t &, size_t, RecvSink &)>;
+    using sink_handler_t = std::function<void(const SinkedPayload &, const conn_t &)>;
+
+    private:
+    std::unordered_map<OpcodeType,
+        std::pair<sink_func_t, sink_handler_t>> sink_map;
+
+    /** Ask the sink of the opcode (if any) for the destination of the
+     * payload whose header was just parsed. */
+    bool open_sink(const conn_t &conn) {
+        auto it = sink_map.find(conn->msg.get_opcode());
+        if (it == sink_map.end()) return false;
+        size_t len = conn->msg.get_length();
+        RecvSink dest;
+        if (!it->second.first(conn, len, dest)) return false;
+        auto s = new SinkState();
+        s->done.sink = dest;
+        s->done.len = len;
+        s->done.ok = true;
+        s->left = len;
+        conn->sink = s;
+        return true;
+    }
+
+    /** Let the worker read what is left of the message being received, even
+     * past the memory budget (see ConnPool::Config::mem_budget()). */
+    static void set_recv_reserve(const conn_t &conn) {
+        if (conn->msg_state == Conn::PAYLOAD)
+            conn->recv_reserve = conn->msg.get_length();
+        else if (conn->msg_state == Conn::SINK)
+            conn->recv_reserve = conn->sink->left;
+        else
+            /* a header that has started arriving */
+            conn->recv_reserve = conn->recv_buffer.size() ? Msg::header_size : 0;
+    }
+
+    /** Write what has arrived of the payload to its sink, and release the
+     * buffer (and the credit) right away. Returns true once the payload is
+     * complete. */
+    bool feed_sink(const conn_t &conn) {
+        auto &s = *conn->sink;
+        auto &dest = s.done.sink;
+        size_t pos = s.done.len - s.left;
+        size_t n = conn->recv_buffer.drain(s.left,
+            [&s, &dest, &pos](const uint8_t *p, size_t n) {
+#ifndef SALTICIDAE_NOCHECKSUM
+            s.sha1.update(p, n);
+#endif
+            if (s.done.ok && dest.addr)
+                memmove(dest.addr + pos, p, n);
+            else if (s.done.ok)
+            {
+                for (size_t i = 0; i < n;)
+                {
+                    ssize_t ret = pwrite(dest.fd, p + i, n - i, dest.offset + pos + i);
+                    if (ret < 0 && errno == EINTR) continue;
+                    if (ret <= 0)
+                    {
+                        /* keep consuming the payload, but report the failure */
+                        SALTICIDAE_LOG_WARN("failed to write to the sink: %s",
+                                            strerror(errno));
+                        s.done.ok = false;
+                        break;
+                    }
+                    i += ret;
+                }
+            }
+            pos += n;
+        });
+        s.left -= n;
+        conn->release_recv(n);
+        return_credit(conn, n);
+        if (s.left) return false;
+        return_credit(conn, Msg::header_size);
+#ifndef SALTICIDAE_NOCHECKSUM
+        bytearray_t md;
+        uint32_t checksum;
+        s.sha1.digest(md);
+        memmove(&checksum, &*md.begin(), 4);
+        if (checksum != conn->msg.peek_checksum())
+        {
+            SALTICIDAE_LOG_WARN("checksums do not match for the sunk payload");
+            s.done.ok = false;
+        }
+#endif
+        return true;
+    }
+
+    /** Digest of the payload, keyed so that a remote cannot make up a
+     * payload that collides with someone else's. */
+    uint64_t payload_digest(const bytearray_t &payload) const {
+        return siphash24(dedup_key, payload.data(), payload.size());
+    }
+
+    /** Check the message against the filter of its opcode (called by the
+     * workers). */
+    bool is_dup(const Msg &msg) {
+        auto it = dedup_filters.find(msg.get_opcode());
+        if (it == dedup_filters.end()) return false;
+        auto &f = it->second;
+        uint64_t id;
+        try {
+            auto &payload = msg.peek_payload();
+            id = f->get_id ? f->get_id(payload) : payload_digest(payload);
+        } catch (...) {
+            /* let the handler deal with a malformed message */
+            return false;
+        }
+        return f->check(id);
+    }
+
+    /** Grant the remote n more bytes (a control frame, which is sent
+     * regardless of the credit). */
+    void send_credit(const conn_t &conn, size_t n) {
+        Msg msg(msg_magic);
+        DataStream s;
+        s << htole((uint64_t)n);
+        msg.set_opcode(credit_opcode);
+        msg.set_payload(std::move(s));
+        msg.set_checksum();
+        this->write_ctrl(conn, msg.serialize());
+    }
+
+    /** Count the bytes of a message the user loop is done with, and grant
+     * them back once half of the window is consumed. */
+    void return_credit(const conn_t &conn, size_t n) {
+        if (!flow_window) return;
+        if (conn->credit_consumed.fetch_add(n, std::memory_order_relaxed) + n <
+                flow_window / 2)
+            return;
+        n = conn->credit_consumed.exchange(0, std::memory_order_relaxed);
+        if (n) send_credit(conn, n);
+    }
 
     protected:
     const uint32_t msg_magic;
     ConnPool::Conn *create_conn() override { return new Conn(); }
     void on_read(const ConnPool::conn_t &) override;
+    /** Called by the worker on each message before it is handed over. */
+    virtual void on_worker_recv(const Msg &, const conn_t &) {}
+
+    /** Move the received message to incoming_msgs, so the connection does
+     * not hold on to its payload (it is kept if the queue is full). */
+    bool enqueue_msg(const conn_t &conn) {
+        inbound_t item{std::move(conn->msg), conn, conn->recv_deadline,
+                        std::move(conn->sink)};
+        if (incoming_msgs.enqueue(std::move(item), false))
+        {
+            conn->recv_deadline = 0;
+            return true;
+        }
+        conn->msg = std::move(item.msg);
+        conn->sink = std::move(item.sunk);
+        return false;
+    }
+
+    /** Call the handler of a received message (in the user loop). */
+    void handle_inbound(inbound_t &item) {
+        auto &msg = item.msg;
+        auto &conn = item.conn;
+        size_t len = msg.get_length();
+        if (item.sunk)
+        {
+            /* the worker has released the buffer and the credit */
+            SALTICIDAE_LOG_DEBUG("got sunk payload %s from %s",
+                    std::string(msg).c_str(),
+                    std::string(*conn).c_str());
+            /* the map is read by the workers as well, so it must not be
+             * modified here */
+            auto it = sink_map.find(msg.get_opcode());
+            if (it != sink_map.end() && it->second.second)
+                it->second.second(item.sunk->done, conn);
+            return;
+        }
+        conn->release_recv(len);
+        auto it = handler_map.find(msg.get_opcode());
+        if (item.deadline > 0 && TokenBucket::now() > item.deadline)
+        {
+            /* stale, e.g. it was held behind a backlog */
+            this->nrecv_expired.fetch_add(1, std::memory_order_relaxed);
+            SALTICIDAE_LOG_DEBUG("dropped expired message %s from %s",
+                    std::string(msg).c_str(),
+                    std::string(*conn).c_str());
+        }
+        else if (it == handler_map.end())
+            SALTICIDAE_LOG_WARN("unknown opcode: %s",
+                                get_hex(msg.get_opcode()).c_str());
+        else /* call the handler */
+        {
+            SALTICIDAE_LOG_DEBUG("got message %s from %s",
+                    std::string(msg).c_str(),
+                    std::string(*conn).c_str());
+#ifdef SALTICIDAE_MSG_STAT
+            conn->nrecv++;
+            conn->nrecvb += msg.get_length();
+#endif
+            it->second(msg, conn);
+        }
+        return_credit(conn, Msg::header_size + len);
+    }
+
+    /** Hand the received message over to the user loop, or to its handler
+     * right away in the single-threaded mode. Returns false if reading has
+     * to wait for the queue. */
+    bool deliver_msg(const conn_t &conn) {
+        if (this->single_thread)
+        {
+            inbound_t item{std::move(conn->msg), conn, conn->recv_deadline,
+                            std::move(conn->sink)};
+            conn->recv_deadline = 0;
+            if (this->system_state == 1) handle_inbound(item);
+            return true;
+        }
+        if (enqueue_msg(conn)) return true;
+        poll_enqueue(conn);
+        return false;
+    }
+
+    /** Stop reading until the message can be enqueued (the timer is created
+     * on demand, as most connections never need it). */
+    void poll_enqueue(const conn_t &conn) {
+        conn->msg_sleep = true;
+        if (!conn->ev_enqueue_poll)
+            conn->ev_enqueue_poll = TimerEvent(
+                conn->worker.load(std::memory_order_relaxed)->get_ec(),
+                [this, conn](TimerEvent &) {
+                    if (!enqueue_msg(conn))
+                    {
+                        conn->ev_enqueue_poll.add(0);
+                        return;
+                    }
+                    conn->msg_sleep = false;
+                    on_read(conn);
+                });
+        conn->ev_enqueue_poll.add(0);
+    }
+
+    void capture_msg(const Msg &msg, const conn_t &conn,
+                    WireCapture::Direction dir) {
+        auto header = msg.serialize_header();
+        auto &payload = msg.peek_payload();
+        capture->record(conn->get_serial(), dir, &header[0], payload.data(), payload.size());
+    }
 
     void on_worker_setup(const ConnPool::conn_t &_conn) override {
         auto conn = static_pointer_cast<Conn>(_conn);
-        conn->ev_enqueue_poll = TimerEvent(conn->worker->get_ec(),
-            [this, conn](TimerEvent &) {
-                if (!incoming_msgs.enqueue(std::make_pair(conn->msg, conn), false))
-                {
-                    conn->msg_sleep = true;
-                    conn->ev_enqueue_poll.add(0);
-                    return;
-                }
-                conn->msg_sleep = false;
-                on_read(conn);
-            });
+        /* a whole message has to fit in the receive buffer */
+        conn->max_recv_buff_size = std::max(conn->max_recv_buff_size,
+                                            max_msg_size + Msg::header_size);
+        /* the remote holds back once it has the window */
+        if (flow_window) send_credit(conn, flow_window);
+        ConnPool::on_worker_setup(_conn);
     }
 
     void on_worker_teardown(const ConnPool::conn_t &_conn) override {
@@ -155,6 +515,19 @@ class MsgNetwork: public ConnPool {
         ConnPool::on_worker_teardown(_conn);
     }
 
+    void on_worker_detach(const ConnPool::conn_t &_conn) override {
+        auto conn = static_pointer_cast<Conn>(_conn);
+        conn->ev_enqueue_poll.clear();
+        ConnPool::on_worker_detach(_conn);
+    }
+
+    void on_worker_attach(const ConnPool::conn_t &_conn) override {
+        ConnPool::on_worker_attach(_conn);
+        auto conn = static_pointer_cast<Conn>(_conn);
+        /* keep waiting for the inbound queue on the new loop */
+        if (conn->msg_sleep) poll_enqueue(conn);
+    }
+
     public:
 
     class Config: public ConnPool::Config {
@@ -163,6 +536,16 @@ class MsgNetwork: public ConnPool {
         size_t _max_msg_queue_size;
         size_t _burst_size;
         uint32_t _msg_magic;
+        std::string _capture_file;
+        bool _capture_payload;
+        size_t _capture_ring_size;
+        std::unordered_map<OpcodeType, uint8_t> _opcode_class;
+        size_t _flow_window;
+        OpcodeType _credit_opcode;
+        bool _deadline_tags;
+        OpcodeType _deadline_opcode;
+        std::unordered_map<OpcodeType,
+            std::tuple<double, size_t, dedup_id_func_t>> _dedup;
 
         public:
         Config(): Config(ConnPool::Config()) {}
@@ -171,7 +554,13 @@ class MsgNetwork: public ConnPool {
             _max_msg_size(1024),
             _max_msg_queue_size(65536),
             _burst_size(1000),
-            _msg_magic(0x0) {}
+            _msg_magic(0x0),
+            _capture_payload(false),
+            _capture_ring_size(0),
+            _flow_window(0),
+            _credit_opcode(),
+            _deadline_tags(false),
+            _deadline_opcode() {}
 
         Config &max_msg_size(size_t x) {
             _max_msg_size = x;
@@ -190,6 +579,79 @@ class MsgNetwork: public ConnPool {
 
         Config &msg_magic(uint32_t x) {
             _msg_magic = x;
+            return *this;
+        }
+
+        /** Record all sent and received messages to the given file (empty
+         * string disables the capture). */
+        Config &capture_file(const std::string &x) {
+            _capture_file = x;
+            return *this;
+        }
+
+        /** Also record the payloads, otherwise only headers are kept. */
+        Config &capture_payload(bool x) {
+            _capture_payload = x;
+            return *this;
+        }
+
+        /** Rotate the capture file once it exceeds the given size (0 for no
+         * limit). */
+        Config &capture_ring_size(size_t x) {
+            _capture_ring_size = x;
+            return *this;
+        }
+
+        /** Assign the messages of the given opcode to a traffic class (see
+         * ConnPool::Config::class_send_rate()). Unassigned opcodes use class
+         * 0. */
+        Config &opcode_class(OpcodeType opcode, uint8_t tclass) {
+            _opcode_class[opcode] = tclass;
+            return *this;
+        }
+
+        /** Enable credit-based flow control (0 disables it): each side
+         * grants the other `window` bytes, and grants them again as its
+         * user loop handles the messages, so a sender stops writing once the
+         * remote falls behind instead of filling the kernel buffers. The
+         * first grant tells the remote to hold back, so an end only waits
+         * for credit if the other one has enabled it with the same
+         * `credit_opcode` (which is reserved for the grants), and is not
+         * limited otherwise. */
+        Config &flow_control(size_t window, OpcodeType credit_opcode = 0xf2) {
+            _flow_window = window;
+            _credit_opcode = credit_opcode;
+            return *this;
+        }
+
+        /** Precede each message of send_msg_ttl() with a tag carrying its
+         * time to live, so the remote drops it if its user loop does not get
+         * to it in time. Both ends must enable it with the same
+         * `tag_opcode`, which is reserved for the tags. The time spent in
+         * the queue of the sender is not deducted, as the clocks of the two
+         * hosts cannot be compared (the sender drops the message on its own
+         * once expired). */
+        Config &deadline_tags(OpcodeType tag_opcode = 0xf3) {
+            _deadline_tags = true;
+            _deadline_opcode = tag_opcode;
+            return *this;
+        }
+
+        /** Drop the messages of the opcode whose copy has been received
+         * (from any connection) in the last `window` seconds, before they
+         * are queued for the user loop. The messages are identified by
+         * `get_id`, or by a digest of their payload (keyed with a random key
+         * of this network) if it is null. Whoever can send a message with
+         * the ID of another one suppresses the latter, so the ID returned by
+         * `get_id` has to be authenticated (e.g. covered by the signature of
+         * the originator), not just picked by the sender. At most
+         * `capacity` IDs are kept: at a higher rate, IDs are forgotten
+         * before `window` has passed. */
+        Config &dedup(OpcodeType opcode, double window,
+                    dedup_id_func_t get_id = nullptr,
+                    size_t capacity = 1 << 20) {
+            _dedup[opcode] = std::make_tuple(window, capacity, std::move(get_id));
+            return *this;
         }
     };
 
@@ -199,30 +661,29 @@ class MsgNetwork: public ConnPool {
             ConnPool(ec, config),
             max_msg_size(config._max_msg_size),
             max_msg_queue_size(config._max_msg_queue_size),
+            opcode_class(config._opcode_class),
+            flow_window(config._flow_window),
+            credit_opcode(config._credit_opcode),
+            deadline_tags(config._deadline_tags),
+            deadline_opcode(config._deadline_opcode),
             msg_magic(config._msg_magic) {
+        if (!config._capture_file.empty())
+            capture = new WireCapture(config._capture_file, Msg::header_size,
+                                    config._capture_payload,
+                                    config._capture_ring_size);
+        for (auto &d: config._dedup)
+            dedup_filters[d.first] = new DedupFilter(std::get<0>(d.second),
+                                                    std::get<1>(d.second),
+                                                    std::get<2>(d.second));
+        if (!dedup_filters.empty() && !RAND_bytes(dedup_key, sizeof(dedup_key)))
+            throw SalticidaeError(SALTI_ERROR_RAND_SOURCE);
         incoming_msgs.set_capacity(max_msg_queue_size);
         incoming_msgs.reg_handler(ec, [this, burst_size=config._burst_size](queue_t &q) {
-            std::pair<Msg, conn_t> item;
+            inbound_t item;
             size_t cnt = 0;
             while (q.try_dequeue(item) && this->system_state == 1)
             {
-                auto &msg = item.first;
-                auto &conn = item.second;
-                auto it = handler_map.find(msg.get_opcode());
-                if (it == handler_map.end())
-                    SALTICIDAE_LOG_WARN("unknown opcode: %s",
-                                        get_hex(msg.get_opcode()).c_str());
-                else /* call the handler */
-                {
-                    SALTICIDAE_LOG_DEBUG("got message %s from %s",
-                            std::string(msg).c_str(),
-                            std::string(*conn).c_str());
-#ifdef SALTICIDAE_MSG_STAT
-                    conn->nrecv++;
-                    conn->nrecvb += msg.get_length();
-#endif
-                    it->second(msg, conn);
-                }
+                handle_inbound(item);
                 if (++cnt == burst_size) return true;
             }
             return false;
@@ -255,14 +716,107 @@ class MsgNetwork: public ConnPool {
         handler_map[opcode] = std::forward<Func>(handler);
     }
 
+    /** Stream the payloads of an opcode into a file or a memory region as
+     * they arrive, instead of buffering whole messages (e.g. for blocks or
+     * snapshots). get_sink chooses the destination once the header is
+     * parsed, so it is also where the length should be checked (the
+     * payload is not limited by max_msg_size). The handler is called in
+     * the user loop with the completed range. Register before start(). */
+    void reg_recv_sink(OpcodeType opcode, sink_func_t get_sink,
+                        sink_handler_t handler) {
+        sink_map[opcode] = std::make_pair(std::move(get_sink), std::move(handler));
+    }
+
     template<typename MsgType>
     inline bool send_msg(const MsgType &msg, const conn_t &conn);
     inline bool _send_msg(const Msg &msg, const conn_t &conn);
+    /** Send a message that is worthless after `ttl` seconds (e.g. a vote
+     * for a round that may end soon): it is dropped from the send queue
+     * once expired, and by the remote if it is not handled in time (see
+     * Config::deadline_tags()). */
+    template<typename MsgType>
+    inline bool send_msg_ttl(const MsgType &msg, const conn_t &conn, double ttl);
+    inline bool _send_msg_ttl(const Msg &msg, const conn_t &conn, double ttl);
+    /** Send a message that supersedes the unsent one with the same key
+     * (e.g. the latest height announcement): the queued message is
+     * replaced in place, so the backlog of a slow link is bounded by the
+     * number of keys instead of the update rate. */
+    template<typename MsgType>
+    inline bool send_msg_conflated(const MsgType &msg, const conn_t &conn, uint64_t key);
+    inline bool _send_msg_conflated(const Msg &msg, const conn_t &conn, uint64_t key);
     template<typename MsgType>
     inline int32_t send_msg_deferred(MsgType &&msg, const conn_t &conn);
     inline int32_t _send_msg_deferred(Msg &&msg, const conn_t &conn);
 
-    void stop() { stop_workers(); }
+    /** The type of callback invoked (by the user loop) once a file range is
+     * sent, with false if it is discarded instead. */
+    using file_callback_t = std::function<void(bool)>;
+    /** Send `len` bytes of the file from `offset` as the payload of a
+     * message with the given opcode: the header is queued as usual, and the
+     * worker streams the body with sendfile(2), without copying it to the
+     * user space. Unless SALTICIDAE_NOCHECKSUM is defined, the range is
+     * still read once to compute the checksum, by the calling thread and
+     * before returning, so a large or uncached file blocks the caller for
+     * that long. The file must stay open and unchanged until `cb` is
+     * invoked. With TLS, the range is read into memory (also by the
+     * caller) instead. Throws MsgNetworkError if the file cannot be
+     * read. */
+    inline bool send_file(const conn_t &conn, int fd, off_t offset, size_t len,
+                        const OpcodeType &opcode, file_callback_t cb = nullptr);
+
+    /** A message as it is on the wire (header with the checksum, followed by
+     * the payload), shared by all the connections it is forwarded to. */
+    using frame_t = MPSCWriteBuffer::shared_t;
+    /** Frame a (received) message for forwarding: the message is copied once
+     * and its checksum is reused. The payload must not have been consumed by
+     * get_payload(). */
+    static inline frame_t make_frame(const Msg &msg);
+    /** Enqueue the frame without serializing it again. */
+    inline bool forward_msg(const frame_t &frame, const conn_t &conn);
+    /** Enqueue the frame with its magic and opcode rewritten (only the header
+     * is copied). */
+    inline bool forward_msg(const frame_t &frame, const conn_t &conn,
+                            uint32_t magic, const OpcodeType &opcode);
+    /** Forward the message to each of the connections, return the number of
+     * the connections that accepted it. */
+    inline size_t forward_msg(const Msg &msg, const std::vector<conn_t> &conns);
+
+    struct ExpiryStats {
+        /** number of messages dropped from the send queues */
+        size_t nsend_expired;
+        /** total size of the messages dropped from the send queues */
+        size_t send_expired_bytes;
+        /** number of received messages dropped before being handled */
+        size_t nrecv_expired;
+    };
+
+    /** Get the number of duplicates dropped (see Config::dedup()). */
+    size_t get_ndup() const {
+        size_t n = 0;
+        for (auto &f: dedup_filters)
+            n += f.second->ndup.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    /** Get the number of records the capture lost to an I/O error (see
+     * WireCapture::record()). */
+    size_t get_capture_nlost() const {
+        return capture ? capture->get_nlost() : 0;
+    }
+
+    ExpiryStats get_expiry_stats() const {
+        return ExpiryStats{
+            this->nsend_expired.load(std::memory_order_relaxed),
+            this->send_expired_bytes.load(std::memory_order_relaxed),
+            this->nrecv_expired.load(std::memory_order_relaxed)
+        };
+    }
+
+    void stop() {
+        stop_workers();
+        if (capture) capture->flush();
+    }
+    uint32_t get_msg_magic() const { return msg_magic; }
     using ConnPool::listen;
     conn_t connect_sync(const NetAddr &addr) {
         return static_pointer_cast<Conn>(ConnPool::connect_sync(addr));
@@ -275,15 +829,44 @@ class ClientNetwork: public MsgNetwork<OpcodeType> {
     public:
     using MsgNet = MsgNetwork<OpcodeType>;
     using Msg = typename MsgNet::Msg;
+    using topic_t = std::string;
+
+    /** What to do with a published message when a subscriber already has
+     * more than `max_sub_backlog` bytes unsent. */
+    enum SlowSubPolicy {
+        SUB_BUFFER, /**< queue it anyway */
+        SUB_DROP, /**< drop it */
+        SUB_CONFLATE /**< keep only the latest message of the topic, and send
+                        it once the backlog drops below the limit */
+    };
 
     private:
-    std::unordered_map<NetAddr, typename MsgNet::conn_t> addr2conn;
+    /** A shard of the address index, written by the dispatcher and read by
+     * any thread that sends by address. */
+    struct AddrShard {
+        mutable std::shared_timed_mutex lock;
+        std::unordered_map<NetAddr, typename MsgNet::conn_t> addr2conn;
+    };
+    using addr_slock_t = std::shared_lock<std::shared_timed_mutex>;
+    using addr_ulock_t = std::unique_lock<std::shared_timed_mutex>;
+    static const size_t naddr_shard = 16;
+    AddrShard addr_shards[naddr_shard];
+
+    AddrShard &get_addr_shard(const NetAddr &addr) {
+        return addr_shards[std::hash<NetAddr>()(addr) % naddr_shard];
+    }
 
     public:
     class Conn: public MsgNet::Conn {
         friend ClientNetwork;
+        /** subscribed topics, owned by the worker */
+        std::vector<topic_t> topics;
+        /** the slot of the idle wheel holding the connection (-1 if none),
+         * owned by the worker */
+        size_t idle_slot;
+
         public:
-        Conn() = default;
+        Conn(): idle_slot(-1) {}
         ClientNetwork *get_net() {
             return static_cast<ClientNetwork *>(ConnPool::Conn::get_pool());
         }
@@ -291,23 +874,191 @@ class ClientNetwork: public MsgNetwork<OpcodeType> {
 
     using conn_t = ArcObj<Conn>;
 
+    private:
+    using frame_t = typename MsgNet::frame_t;
+    struct Subscriber {
+        conn_t conn;
+        /** the conflated message waiting for the backlog to drain */
+        frame_t pending;
+        Subscriber(const conn_t &conn): conn(conn) {}
+    };
+
+    /** The subscriptions of the connections handled by one worker, only
+     * accessed by that worker. */
+    struct TopicShard {
+        std::unordered_map<topic_t, std::vector<Subscriber>> topics;
+        size_t npending;
+        TimerEvent ev_flush;
+        TopicShard(): npending(0) {}
+    };
+
+    const size_t max_sub_backlog;
+    const SlowSubPolicy slow_sub_policy;
+    const double conflate_interval;
+    /** per-topic overrides of slow_sub_policy, owned by the user thread */
+    std::unordered_map<topic_t, SlowSubPolicy> topic_policy;
+    std::vector<BoxObj<TopicShard>> shards;
+    std::atomic<size_t> nsub_dropped;
+    std::atomic<size_t> nsub_conflated;
+
+    /** The subscriptions of the worker of the connection (called by
+     * that worker). */
+    TopicShard &get_shard(const conn_t &conn) {
+        return *shards[this->get_worker_idx(
+            conn->worker.load(std::memory_order_relaxed))];
+    }
+    inline void flush_conflated(TopicShard &shard);
+
+    /** A coarse timing wheel of the connections handled by one worker, so
+     * idle clients are found without a timer per connection. Each slot is
+     * visited once per tick, only accessed by that worker. */
+    struct IdleWheel {
+        static const size_t nslot = 16;
+        std::vector<conn_t> slots[nslot];
+        /** the slot to be visited by the next tick */
+        size_t cur;
+        TimerEvent ev_tick;
+        IdleWheel(): cur(0) {}
+    };
+
+    const double idle_timeout;
+    std::vector<BoxObj<IdleWheel>> wheels;
+    std::atomic<size_t> nidle_reaped;
+
+    inline void idle_schedule(IdleWheel &wheel, const conn_t &conn, uint64_t now);
+    inline void idle_tick(IdleWheel &wheel, ConnPool::Worker *worker);
+    /** Put the connection into the wheel of its worker. */
+    void idle_watch(const conn_t &conn);
+    /** Take the connection out of the wheel of its worker. */
+    inline void idle_unwatch(const conn_t &conn);
+
     protected:
     ConnPool::Conn *create_conn() override { return new Conn(); }
+    void on_worker_setup(const ConnPool::conn_t &) override;
     void on_dispatcher_setup(const ConnPool::conn_t &) override;
+    void on_worker_teardown(const ConnPool::conn_t &) override;
     void on_dispatcher_teardown(const ConnPool::conn_t &) override;
+    void on_worker_stop(ConnPool::Worker &) override;
+    /* the subscriptions live with the worker, so subscribers stay put */
+    bool can_migrate(const ConnPool::conn_t &_conn) override {
+        auto conn = static_pointer_cast<Conn>(_conn);
+        return conn->topics.empty() && MsgNet::can_migrate(_conn);
+    }
+    void on_worker_detach(const ConnPool::conn_t &_conn) override {
+        if (idle_timeout > 0) idle_unwatch(static_pointer_cast<Conn>(_conn));
+        MsgNet::on_worker_detach(_conn);
+    }
+    void on_worker_attach(const ConnPool::conn_t &_conn) override {
+        MsgNet::on_worker_attach(_conn);
+        if (idle_timeout > 0) idle_watch(static_pointer_cast<Conn>(_conn));
+    }
 
     public:
-    using Config = typename MsgNet::Config;
+    class Config: public MsgNet::Config {
+        friend ClientNetwork;
+        size_t _max_sub_backlog;
+        SlowSubPolicy _slow_sub_policy;
+        double _conflate_interval;
+        double _idle_timeout;
+
+        public:
+        Config(): Config(typename MsgNet::Config()) {}
+        Config(const typename MsgNet::Config &config):
+            MsgNet::Config(config),
+            _max_sub_backlog(0),
+            _slow_sub_policy(SUB_BUFFER),
+            _conflate_interval(0.01),
+            _idle_timeout(0) {}
+
+        /** The number of unsent bytes beyond which a subscriber is
+         * considered slow (0 for no limit). */
+        Config &max_sub_backlog(size_t x) {
+            _max_sub_backlog = x;
+            return *this;
+        }
+
+        Config &slow_sub_policy(SlowSubPolicy x) {
+            _slow_sub_policy = x;
+            return *this;
+        }
+
+        /** How often the conflated messages are retried. */
+        Config &conflate_interval(double x) {
+            _conflate_interval = x;
+            return *this;
+        }
+
+        /** Close a client connection if nothing has been received from it
+         * for `x` seconds (0 to keep idle clients). The timeout is checked
+         * with a granularity of 1/16 of it. */
+        Config &idle_timeout(double x) {
+            _idle_timeout = x;
+            return *this;
+        }
+    };
+
     ClientNetwork(const EventContext &ec, const Config &config):
-        MsgNet(ec, config) {}
+            MsgNet(ec, config),
+            max_sub_backlog(config._max_sub_backlog),
+            slow_sub_policy(config._slow_sub_policy),
+            conflate_interval(config._conflate_interval),
+            nsub_dropped(0),
+            nsub_conflated(0),
+            idle_timeout(config._idle_timeout),
+            nidle_reaped(0) {
+        for (size_t i = 0; i < this->get_nworker(); i++)
+        {
+            shards.push_back(new TopicShard());
+            if (idle_timeout > 0)
+                wheels.push_back(new IdleWheel());
+        }
+    }
+
+    virtual ~ClientNetwork() { this->stop(); }
 
     using MsgNet::send_msg;
+    /** Send to the client by its address, can be invoked by any thread. */
     template<typename MsgType>
     inline bool send_msg(const MsgType &msg, const NetAddr &addr);
     inline bool _send_msg(const Msg &msg, const NetAddr &addr);
     template<typename MsgType>
     inline int32_t send_msg_deferred(MsgType &&msg, const NetAddr &addr);
     inline int32_t _send_msg_deferred(Msg &&msg, const NetAddr &addr);
+
+    /* the following functions should be invoked by the user thread (e.g.
+     * from message handlers) */
+
+    /** Subscribe the client to the topic. */
+    inline void subscribe(const typename MsgNet::conn_t &conn, const topic_t &topic);
+    inline void unsubscribe(const typename MsgNet::conn_t &conn, const topic_t &topic);
+    /** Override the slow subscriber policy for the topic. */
+    void set_topic_policy(const topic_t &topic, SlowSubPolicy policy) {
+        topic_policy[topic] = policy;
+    }
+    /** Send the message to all subscribers of the topic. The message is
+     * serialized once, and each worker writes to its own clients. */
+    template<typename MsgType>
+    inline void publish(const MsgType &msg, const topic_t &topic);
+    inline void _publish(const Msg &msg, const topic_t &topic);
+
+    struct PubSubStats {
+        /** number of messages dropped for slow subscribers */
+        size_t ndropped;
+        /** number of messages replaced by a newer one before being sent */
+        size_t nconflated;
+    };
+
+    PubSubStats get_pubsub_stats() const {
+        return PubSubStats{
+            nsub_dropped.load(std::memory_order_relaxed),
+            nsub_conflated.load(std::memory_order_relaxed)
+        };
+    }
+
+    /** Get the number of client connections closed for being idle. */
+    size_t get_nidle_reaped() const {
+        return nidle_reaped.load(std::memory_order_relaxed);
+    }
 };
 
 struct PeerId: public uint256_t {
@@ -361,6 +1112,10 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
     static const uint32_t passive_nonce = 0xffff;
 
     public:
+    /** The key of send_msg() that spreads the messages over the stripes in
+     * a round-robin way, without any ordering. */
+    static const size_t any_stripe = SIZE_MAX;
+
     class Conn: public MsgNet::Conn {
         friend PeerNetwork;
         Peer *peer;
@@ -368,24 +1123,50 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
         TimerEvent ev_timeout;
         bool manual; /* whether it is a temporary connection manually initiated
                         by the user, only meanful in ACTIVE mode. */
+        uint16_t stripe; /* the index in the peer's bundle (0 if not a stripe) */
+        bool stripe_ready; /* protected by Peer::stripe_lock */
+        /* when the worker got the last pong (in nanoseconds) */
+        std::atomic<uint64_t> pong_recv;
+        /* the unsent data of a broken stripe, kept by its worker for the
+         * dispatcher to hand over to the rest of the bundle */
+        std::vector<MPSCWriteBuffer::buffer_entry_t> unsent;
 
         void reset_timeout(double timeout);
 
+        /** Run `func` on the dispatcher shard owning the connection and
+         * wait for it. */
+        template<typename Func>
+        void disp_call_sync(Func &&func) {
+            for (;;)
+            {
+                auto disp = this->disp.load(std::memory_order_acquire);
+                bool done = *(static_cast<bool *>(
+                    disp->get_tcall()->call([this, disp, &func](ThreadCall::Handle &h) {
+                        /* moved to another shard in the meantime */
+                        bool owned = this->disp.load(std::memory_order_acquire) == disp;
+                        if (owned) func();
+                        h.set_result(owned);
+                    }).get()));
+                if (done) return;
+            }
+        }
+
         public:
-        Conn(): MsgNet::Conn(), peer(nullptr), manual(true) {}
+        Conn(): MsgNet::Conn(), peer(nullptr), manual(true),
+            stripe(0), stripe_ready(false), pong_recv(0) {}
         NetAddr get_peer_addr() {
-            auto ret = *(static_cast<NetAddr *>(
-                get_net()->disp_tcall->call([this](ThreadCall::Handle &h) {
-                    h.set_result(peer ? NetAddr(peer->addr) : NetAddr());
-                }).get()));
+            NetAddr ret;
+            disp_call_sync([this, &ret]() {
+                if (peer) ret = peer->addr;
+            });
             return ret;
         }
 
         PeerId get_peer_id() {
-            auto ret = *(static_cast<PeerId *>(
-                get_net()->disp_tcall->call([this](ThreadCall::Handle &h) {
-                    h.set_result(peer ? PeerId(peer->id) : PeerId());
-                }).get()));
+            PeerId ret;
+            disp_call_sync([this, &ret]() {
+                if (peer) ret = peer->id;
+            });
             return ret;
         }
 
@@ -396,6 +1177,14 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
 
     using conn_t = ArcObj<Conn>;
     using peer_callback_t = std::function<void(const conn_t &peer_conn, bool connected)>;
+    /** Smoothed round-trip time and its variation (RFC 6298) in seconds,
+     * measured by the heartbeat ping-pong (and by the occasional probe on a
+     * busy link, see Config::rtt_probe_period()). srtt is negative if no
+     * sample is available yet. */
+    struct PeerRTT {
+        double srtt;
+        double rttvar;
+    };
     using unknown_peer_callback_t = std::function<void(const NetAddr &claimed_addr, const X509 *cert)>;
 
     private:
@@ -405,29 +1194,40 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
         DataStream serialized;
         NetAddr claimed_addr;
         uint32_t nonce;
-        MsgPing() { serialized << (uint8_t)false; }
-        MsgPing(const NetAddr &_claimed_addr, uint32_t _nonce) {
-            serialized << (uint8_t)true << _claimed_addr << htole(_nonce);
+        uint16_t stripe;
+        MsgPing(): stripe(0) { serialized << (uint8_t)false; }
+        MsgPing(const NetAddr &_claimed_addr, uint32_t _nonce, uint16_t _stripe = 0): stripe(0) {
+            if (_stripe) /* joins a striped connection */
+                serialized << (uint8_t)2 << _claimed_addr << htole(_nonce) << htole(_stripe);
+            else
+                serialized << (uint8_t)true << _claimed_addr << htole(_nonce);
         }
-        MsgPing(DataStream &&s) {
+        MsgPing(DataStream &&s): stripe(0) {
             uint8_t flag;
             s >> flag;
             if (flag)
                 s >> claimed_addr >> nonce;
             nonce = letoh(nonce);
+            if (flag == 2)
+            {
+                s >> stripe;
+                stripe = letoh(stripe);
+            }
         }
     };
 
     struct MsgPong: public MsgPing {
         static const OpcodeType opcode;
         MsgPong(): MsgPing() {}
-        MsgPong(const NetAddr &_claimed_addr, uint32_t _nonce):
-            MsgPing(_claimed_addr, _nonce) {}
+        MsgPong(const NetAddr &_claimed_addr, uint32_t _nonce, uint16_t _stripe = 0):
+            MsgPing(_claimed_addr, _nonce, _stripe) {}
         MsgPong(DataStream &&s): MsgPing(std::move(s)) {}
     };
 
     struct Peer {
         PeerId id;
+        /** the dispatcher shard handling the peer and its connections */
+        ConnPool::Worker *disp;
         NetAddr addr; /** remote address (if set) */
         uint32_t nonce;
         conn_t conn;
@@ -447,31 +1247,120 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
         bool ping_timer_ok;
         bool pong_msg_ok;
         double ping_period;
+        double rtt_probe_period;
+        /** when the last heartbeat ping was sent (in nanoseconds) */
+        uint64_t ping_sent;
+        PeerRTT rtt;
+        /** when rtt was last updated */
+        std::chrono::steady_clock::time_point rtt_time;
         BoxObj<MsgPing> inbound_preempt_ping;
+        /** send rate applied to the peer's connections (< 0 if unset) */
+        double send_rate;
+        double send_burst;
+        /** extra connections bundled with `conn`, the i-th one is stripe i + 1
+         * (modified by the dispatcher under stripe_lock) */
+        std::vector<conn_t> stripes;
+        std::atomic<bool> striped;
+        size_t stripe_rr;
+        std::mutex stripe_lock;
 
         enum State {
             DISCONNECTED,
             CONNECTED,
             RESET
         } state;
+        /** srtt as read by the threads other than the peer's shard:
+         * negative if not connected, HUGE_VAL if there is no sample yet */
+        std::atomic<double> srtt_snap;
 
-        Peer(const PeerId &pid, const PeerNetwork *pn):
+        Peer(const PeerId &pid, const PeerNetwork *pn, ConnPool::Worker *disp):
             id(pid),
+            disp(disp),
             nonce(passive_nonce),
             id_hex(get_hex10(id)),
             retry_delay(0), ntry(0), cur_ntry(0),
             ev_ping_timer(
-                TimerEvent(pn->disp_ec, std::bind(&Peer::ping_timer, this, _1))),
+                TimerEvent(disp->get_ec(), std::bind(&Peer::ping_timer, this, _1))),
             ping_period(pn->ping_period),
+            rtt_probe_period(pn->rtt_probe_period),
+            ping_sent(0),
+            rtt{-1, 0},
             inbound_preempt_ping(nullptr),
-            state(DISCONNECTED) {}
+            send_rate(-1), send_burst(0),
+            striped(false), stripe_rr(0),
+            state(DISCONNECTED), srtt_snap(-1) {}
 
         Peer &operator=(const Peer &) = delete;
         Peer(const Peer &) = delete;
 
         void reset_ping_timer();
         void send_ping();
+        void set_state(State s) {
+            state = s;
+            update_srtt_snap();
+        }
+        void update_srtt_snap() {
+            srtt_snap.store(state != CONNECTED ? -1 :
+                rtt.srtt < 0 ? HUGE_VAL : rtt.srtt, std::memory_order_relaxed);
+        }
+        void update_rtt(double r) {
+            rtt_time = std::chrono::steady_clock::now();
+            if (rtt.srtt < 0)
+            {
+                rtt.srtt = r;
+                rtt.rttvar = r / 2;
+            }
+            else
+            {
+                rtt.rttvar = 0.75 * rtt.rttvar + 0.25 * std::fabs(rtt.srtt - r);
+                rtt.srtt = 0.875 * rtt.srtt + 0.125 * r;
+            }
+            update_srtt_snap();
+        }
         void ping_timer(TimerEvent &);
+        void ping_stripes();
+        /** Get the connection for the stripe chosen by `key` (round-robin
+         * if key is any_stripe), or the chosen connection if that stripe is
+         * not ready. */
+        conn_t get_conn(size_t key) {
+            if (!striped.load(std::memory_order_acquire)) return conn;
+            std::lock_guard<std::mutex> _(stripe_lock);
+            if (key == any_stripe) key = stripe_rr++;
+            size_t i = key % (stripes.size() + 1);
+            if (i == 0 || !stripes[i - 1] || !stripes[i - 1]->stripe_ready)
+                return conn;
+            return stripes[i - 1];
+        }
+        /** Put the connection in its slot and return the one it replaces. */
+        conn_t set_stripe(const conn_t &c) {
+            std::lock_guard<std::mutex> _(stripe_lock);
+            if (stripes.size() < c->stripe) stripes.resize(c->stripe);
+            conn_t old = std::move(stripes[c->stripe - 1]);
+            stripes[c->stripe - 1] = c;
+            striped.store(true, std::memory_order_release);
+            return old;
+        }
+        void set_stripe_ready(const conn_t &c) {
+            std::lock_guard<std::mutex> _(stripe_lock);
+            c->stripe_ready = true;
+        }
+        /** Remove the connection from its slot, return true if it was
+         * ready. */
+        bool clear_stripe(const conn_t &c) {
+            std::lock_guard<std::mutex> _(stripe_lock);
+            if (stripes.size() < c->stripe) return false;
+            auto &s = stripes[c->stripe - 1];
+            if (s != c) return false;
+            s = nullptr;
+            return c->stripe_ready;
+        }
+        std::vector<conn_t> clear_stripes() {
+            std::lock_guard<std::mutex> _(stripe_lock);
+            std::vector<conn_t> ret;
+            std::swap(ret, stripes);
+            striped.store(false, std::memory_order_release);
+            return ret;
+        }
         void clear_all_events() {
             if (ev_ping_timer)
                 ev_ping_timer.del();
@@ -491,11 +1380,14 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
         ~Peer() {
             if (inbound_conn) inbound_conn->peer = nullptr;
             if (outbound_conn) outbound_conn->peer = nullptr;
+            for (auto &s: stripes)
+                if (s) s->peer = nullptr;
         }
     };
 
     /* connections whose PeerId is unknown */
     std::unordered_map<NetAddr, conn_t> pending_peers;
+    mutable std::mutex pending_peers_lock;
     /* registered peers */
     std::unordered_map<PeerId, BoxObj<Peer>> known_peers;
 
@@ -510,6 +1402,10 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
     const IdentityMode id_mode;
     double ping_period;
     double conn_timeout;
+    bool piggyback_heartbeat;
+    double rtt_probe_period;
+    size_t nstripe;
+    std::atomic<size_t> nstripe_lost_bytes;
     NetAddr listen_addr;
     bool allow_unknown_peer;
     PeerId id;
@@ -521,21 +1417,80 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
 
     void ping_handler(MsgPing &&msg, const conn_t &conn);
     void pong_handler(MsgPong &&msg, const conn_t &conn);
+    void disp_ping(const MsgPing &msg, const conn_t &conn);
+    void disp_pong(const MsgPong &msg, const conn_t &conn);
     void _ping_msg_cb(const conn_t &conn, uint16_t port);
     void _pong_msg_cb(const conn_t &conn, uint16_t port);
     void finish_handshake(Peer *peer);
     void replace_pending_conn(const conn_t &conn);
     void start_active_conn(Peer *peer);
-    static void tcall_reset_timeout(ConnPool::Worker *worker,
-                                    const conn_t &conn, double timeout);
-    inline conn_t _get_peer_conn(const PeerId &peer) const;
+    void start_stripe_conn(Peer *peer, uint16_t stripe);
+    void accept_stripe_conn(const MsgPing &msg, const conn_t &conn);
+    void tcall_reset_timeout(const conn_t &conn, double timeout);
+    void watch_timeout(const conn_t &conn);
+    inline conn_t _get_peer_conn(const PeerId &peer, size_t key = 0) const;
+
+    size_t get_peer_disp_idx(const PeerId &pid) const {
+        return std::hash<PeerId>()(pid) % this->get_ndisp();
+    }
+    ConnPool::Worker &get_peer_disp(const PeerId &pid) const {
+        return this->get_worker(get_peer_disp_idx(pid));
+    }
+
+    /** a multicast split among the dispatcher shards of the peers */
+    struct MulticastState {
+        const Msg msg;
+        std::atomic<size_t> nleft;
+        std::mutex err_lock;
+        std::exception_ptr err;
+        /** reported if no send fails */
+        const std::exception_ptr fallback;
+        MulticastState(Msg &&msg, size_t nleft, std::exception_ptr fallback):
+            msg(std::move(msg)), nleft(nleft), fallback(fallback) {}
+        void fail(std::exception_ptr e) {
+            std::lock_guard<std::mutex> _(err_lock);
+            if (!err) err = e;
+        }
+    };
+    /** Send to each peer from its shard, and report the first failure (or
+     * else `err`) once all are done. */
+    void multicast_by_disp(Msg &&msg, const std::vector<PeerId> &pids,
+                            int32_t id, std::exception_ptr err = nullptr);
+
+    /** Run `func` on the dispatcher shard of the peer, moving the
+     * connection over first if another shard owns it (called by the owning
+     * shard), so that a connection is always handled together with its
+     * peer. */
+    template<typename Func>
+    void on_peer_disp(const conn_t &conn, const PeerId &pid, Func &&func) {
+        auto &disp = get_peer_disp(pid);
+        if (conn->disp.load(std::memory_order_relaxed) == &disp)
+            func();
+        else
+            this->move_conn(conn, disp, [this, conn, func](ThreadCall::Handle &) {
+                try {
+                    if (conn->is_terminated()) return;
+                    func();
+                } catch (...) { this->disp_error_cb(std::current_exception()); }
+            });
+    }
 
     protected:
     ConnPool::Conn *create_conn() override { return new Conn(); }
     void on_worker_setup(const ConnPool::conn_t &) override;
     void on_worker_teardown(const ConnPool::conn_t &) override;
+    void on_worker_detach(const ConnPool::conn_t &) override;
+    void on_worker_attach(const ConnPool::conn_t &) override;
     void on_dispatcher_setup(const ConnPool::conn_t &) override;
     void on_dispatcher_teardown(const ConnPool::conn_t &) override;
+    void on_worker_stop(ConnPool::Worker &) override;
+    void on_worker_recv(const Msg &msg, const typename MsgNet::conn_t &_conn) override {
+        if (msg.get_opcode() != MsgPong::opcode) return;
+        auto conn = static_pointer_cast<Conn>(_conn);
+        conn->pong_recv.store(
+            conn->worker.load(std::memory_order_relaxed)->get_ec().hrtime(),
+            std::memory_order_relaxed);
+    }
 
     PeerId _get_peer_id(const X509 *cert, const NetAddr &addr) {
         if (!this->enable_tls || id_mode == ADDR_BASED)
@@ -553,6 +1508,9 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
         friend PeerNetwork;
         double _ping_period;
         double _conn_timeout;
+        bool _piggyback_heartbeat;
+        double _rtt_probe_period;
+        size_t _nstripe;
         bool _allow_unknown_peer;
         IdentityMode _id_mode;
 
@@ -563,6 +1521,9 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
             MsgNet::Config(config),
             _ping_period(30),
             _conn_timeout(180),
+            _piggyback_heartbeat(true),
+            _rtt_probe_period(60),
+            _nstripe(1),
             _allow_unknown_peer(false),
             _id_mode(CERT_BASED) {}
 
@@ -577,6 +1538,33 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
             return *this;
         }
 
+        /** Treat any received data as a proof of liveness: pings are only
+         * sent on links idle for longer than the ping period, and a
+         * connection times out after `conn_timeout` without incoming data.
+         * Otherwise, pings are always sent and the timeout is reset upon each
+         * ping. */
+        Config &piggyback_heartbeat(bool x) {
+            _piggyback_heartbeat = x;
+            return *this;
+        }
+
+        /** With piggybacked heartbeats, a busy link still sends a ping at
+         * most once per `x` seconds, only to keep its RTT estimate fresh (0
+         * disables the probe). */
+        Config &rtt_probe_period(double x) {
+            _rtt_probe_period = x;
+            return *this;
+        }
+
+        /** Bundle up to `x` connections (spread across the workers) for each
+         * peer: the side that actively established the connection opens the
+         * extra ones. Messages go through the chosen connection, in order,
+         * unless a stripe key is given to send_msg(). */
+        Config &nstripe(size_t x) {
+            _nstripe = std::max((size_t)1, std::min(x, (size_t)UINT16_MAX));
+            return *this;
+        }
+
         Config &id_mode(IdentityMode x) {
             _id_mode = x;
             return *this;
@@ -593,6 +1581,10 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
             id_mode(config._id_mode),
             ping_period(config._ping_period),
             conn_timeout(config._conn_timeout),
+            piggyback_heartbeat(config._piggyback_heartbeat),
+            rtt_probe_period(config._rtt_probe_period),
+            nstripe(config._nstripe),
+            nstripe_lost_bytes(0),
             allow_unknown_peer(config._allow_unknown_peer),
             tty_primary_color(""),
             tty_secondary_color(""),
@@ -621,20 +1613,62 @@ class PeerNetwork: public MsgNetwork<OpcodeType> {
     int32_t conn_peer(const PeerId &peer, int32_t ntry = -1, double retry_delay = 2);
     /* check if a peer is registered */
     bool has_peer(const PeerId &peer) const;
+    /* limit the send rate (bytes/sec, 0 for unlimited) to the peer */
+    int32_t set_peer_send_rate(const PeerId &peer, double rate, double burst = 65536);
 
     const PeerId &get_peer_id() const { return id; }
     size_t get_npending() const;
     conn_t get_peer_conn(const PeerId &addr) const;
+    /* get the chosen connection to the peer without waiting for the
+     * dispatcher (it may have been terminated) */
+    conn_t get_peer_conn_nowait(const PeerId &peer) const {
+        pinfo_slock_t _g(known_peers_lock);
+        return _get_peer_conn(peer, 0);
+    }
+    PeerRTT get_peer_rtt(const PeerId &peer) const;
+    /** Get the number of unsent bytes lost with broken stripes: those of
+     * the stripes that went down with the chosen connection or were
+     * replaced, and half-sent messages (the rest of a broken stripe is sent
+     * again through the chosen connection). */
+    size_t get_stripe_lost_bytes() const {
+        return nstripe_lost_bytes.load(std::memory_order_relaxed);
+    }
     using MsgNet::send_msg;
     template<typename MsgType>
     inline bool send_msg(const MsgType &msg, const PeerId &peer);
     inline bool _send_msg(const Msg &msg, const PeerId &peer);
+    /** Send through the stripe chosen by `key` (any_stripe for
+     * round-robin): messages with the same key are delivered in order, as
+     * long as the set of ready stripes does not change in between. */
+    template<typename MsgType>
+    inline bool send_msg(const MsgType &msg, const PeerId &peer, size_t key);
+    inline bool _send_msg(const Msg &msg, const PeerId &peer, size_t key);
+    using MsgNet::send_msg_ttl;
+    template<typename MsgType>
+    inline bool send_msg_ttl(const MsgType &msg, const PeerId &peer, double ttl);
+    inline bool _send_msg_ttl(const Msg &msg, const PeerId &peer, double ttl);
+    using MsgNet::send_msg_conflated;
+    template<typename MsgType>
+    inline bool send_msg_conflated(const MsgType &msg, const PeerId &peer, uint64_t key);
+    inline bool _send_msg_conflated(const Msg &msg, const PeerId &peer, uint64_t key);
     template<typename MsgType>
     inline int32_t send_msg_deferred(MsgType &&msg, const PeerId &peer);
     inline int32_t _send_msg_deferred(Msg &&msg, const PeerId &peer);
     template<typename MsgType>
     inline int32_t multicast_msg(MsgType &&msg, const std::vector<PeerId> &peers);
     inline int32_t _multicast_msg(Msg &&msg, const std::vector<PeerId> &peers);
+    using MsgNet::forward_msg;
+    /** Forward the frame (see MsgNetwork::make_frame()) to the peer. */
+    inline bool forward_msg(const typename MsgNet::frame_t &frame, const PeerId &peer);
+    /** Send to the (up to) k connected peers with the lowest smoothed RTT
+     * among `peers` (duplicates count once); peers without an RTT sample
+     * are ranked last, in the given order. If fewer than k of them are
+     * connected, the message still goes to all that are, and the call
+     * fails with SALTI_ERROR_MULTICAST_PARTIAL (SALTI_ERROR_CONN_NOT_READY
+     * if none is). */
+    template<typename MsgType>
+    inline int32_t multicast_msg_nearest(MsgType &&msg, const std::vector<PeerId> &peers, size_t k);
+    inline int32_t _multicast_msg_nearest(Msg &&msg, const std::vector<PeerId> &peers, size_t k);
 
     void listen(NetAddr listen_addr);
     //conn_t connect(const NetAddr &addr) = delete;
@@ -660,14 +1694,33 @@ void MsgNetwork<OpcodeType>::on_read(const ConnPool::conn_t &_conn) {
             if (recv_buffer.size() < Msg::header_size) break;
             /* new header available */
             msg = Msg(recv_buffer.pop(Msg::header_size));
-            if (msg.get_length() > max_msg_size)
+            conn->release_recv(Msg::header_size);
+            if (!sink_map.empty() && open_sink(conn))
+                msg_state = Conn::SINK;
+            else
             {
-                SALTICIDAE_LOG_WARN(
-                        "oversized message from %s, terminating the connection",
-                        std::string(*conn).c_str());
-                throw MsgNetworkError(SALTI_ERROR_CONN_OVERSIZED_MSG);
+                if (msg.get_length() > max_msg_size)
+                {
+                    SALTICIDAE_LOG_WARN(
+                            "oversized message from %s, terminating the connection",
+                            std::string(*conn).c_str());
+                    throw MsgNetworkError(SALTI_ERROR_CONN_OVERSIZED_MSG);
+                }
+                msg_state = Conn::PAYLOAD;
             }
-            msg_state = Conn::PAYLOAD;
+        }
+        if (msg_state == Conn::SINK)
+        {
+            if (!feed_sink(conn)) break;
+            msg_state = Conn::HEADER;
+            /* already written, so a deadline no longer applies */
+            conn->recv_deadline = 0;
+            if (!deliver_msg(conn))
+            {
+                set_recv_reserve(conn);
+                return;
+            }
+            continue;
         }
         if (msg_state == Conn::PAYLOAD)
         {
@@ -680,18 +1733,55 @@ void MsgNetwork<OpcodeType>::on_read(const ConnPool::conn_t &_conn) {
             if (!msg.verify_checksum())
             {
                 SALTICIDAE_LOG_WARN("checksums do not match, dropping the message");
+                conn->release_recv(len);
+                return_credit(conn, Msg::header_size + len);
                 break;
             }
 #endif
-            if (!incoming_msgs.enqueue(std::make_pair(msg, conn), false))
+            if (flow_window && msg.get_opcode() == credit_opcode)
             {
-                conn->msg_sleep = true;
-                conn->ev_enqueue_poll.add(0);
+                /* grants are handled right away by the worker */
+                uint64_t n = 0;
+                try {
+                    msg.get_payload() >> n;
+                } catch (...) {}
+                conn->release_recv(len);
+                this->grant_credit(conn, letoh(n));
+                continue;
+            }
+            if (deadline_tags && msg.get_opcode() == deadline_opcode)
+            {
+                /* the deadline applies to the message that follows */
+                uint32_t ttl_us = 0;
+                try {
+                    msg.get_payload() >> ttl_us;
+                } catch (...) {}
+                conn->release_recv(len);
+                return_credit(conn, Msg::header_size + len);
+                conn->recv_deadline = TokenBucket::now() + letoh(ttl_us) / 1e6;
+                continue;
+            }
+            if (capture) capture_msg(msg, conn, WireCapture::RECV);
+            if (!dedup_filters.empty() && is_dup(msg))
+            {
+                /* a copy has been seen recently (relayed, or resent after a
+                 * reconnect) */
+                conn->release_recv(len);
+                return_credit(conn, Msg::header_size + len);
+                conn->recv_deadline = 0;
+                continue;
+            }
+            on_worker_recv(msg, conn);
+            if (!deliver_msg(conn))
+            {
+                set_recv_reserve(conn);
                 return;
             }
         }
     }
-    if (conn->ready_recv && recv_buffer.len() < conn->max_recv_buff_size)
+    set_recv_reserve(conn);
+    if (conn->ready_recv && !conn->recv_mem_paused &&
+        recv_buffer.size() < conn->max_recv_buff_size)
     {
         /* resume reading from socket */
         conn->ev_socket.del();
@@ -710,7 +1800,7 @@ inline int32_t MsgNetwork<OpcodeType>::send_msg_deferred(MsgType &&msg, const co
 template<typename OpcodeType>
 inline int32_t MsgNetwork<OpcodeType>::_send_msg_deferred(Msg &&msg, const conn_t &conn) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call(
+    this->disp_call(conn,
             [this, msg=std::move(msg), conn, id](ThreadCall::Handle &) {
         try {
             if (!_send_msg(msg, conn))
@@ -728,6 +1818,34 @@ inline bool MsgNetwork<OpcodeType>::send_msg(const MsgType &msg, const conn_t &c
 
 template<typename OpcodeType>
 inline bool MsgNetwork<OpcodeType>::_send_msg(const Msg &msg, const conn_t &conn) {
+    return write_msg(msg, conn, 0);
+}
+
+template<typename OpcodeType>
+template<typename MsgType>
+inline bool MsgNetwork<OpcodeType>::send_msg_ttl(const MsgType &msg, const conn_t &conn, double ttl) {
+    return _send_msg_ttl(Msg(msg, msg_magic), conn, ttl);
+}
+
+template<typename OpcodeType>
+inline bool MsgNetwork<OpcodeType>::_send_msg_ttl(const Msg &msg, const conn_t &conn, double ttl) {
+    return write_msg(msg, conn, TokenBucket::now() + ttl);
+}
+
+template<typename OpcodeType>
+template<typename MsgType>
+inline bool MsgNetwork<OpcodeType>::send_msg_conflated(const MsgType &msg, const conn_t &conn, uint64_t key) {
+    return _send_msg_conflated(Msg(msg, msg_magic), conn, key);
+}
+
+template<typename OpcodeType>
+inline bool MsgNetwork<OpcodeType>::_send_msg_conflated(const Msg &msg, const conn_t &conn, uint64_t key) {
+    return write_msg(msg, conn, 0, true, key);
+}
+
+template<typename OpcodeType>
+inline bool MsgNetwork<OpcodeType>::write_msg(const Msg &msg, const conn_t &conn, double deadline,
+                                            bool keyed, uint64_t key) {
     bytearray_t msg_data = msg.serialize();
     SALTICIDAE_LOG_DEBUG("wrote message %s to %s",
                 std::string(msg).c_str(),
@@ -736,13 +1854,171 @@ inline bool MsgNetwork<OpcodeType>::_send_msg(const Msg &msg, const conn_t &conn
     conn->nsent++;
     conn->nsentb += msg.get_length();
 #endif
-    return conn->write(std::move(msg_data));
+    if (capture)
+        capture->record(conn->get_serial(), WireCapture::SEND,
+                        &msg_data[0], &msg_data[Msg::header_size],
+                        msg_data.size() - Msg::header_size);
+    uint8_t tclass = 0;
+    if (!opcode_class.empty())
+    {
+        auto it = opcode_class.find(msg.get_opcode());
+        if (it != opcode_class.end()) tclass = it->second;
+    }
+    if (deadline == 0 && !keyed)
+        return this->flush_send(conn, conn->write(std::move(msg_data), tclass));
+    bytearray_t data;
+    if (deadline > 0 && deadline_tags)
+    {
+        /* the tag goes in the same segment, so both are sent or dropped */
+        double ttl = std::max(deadline - TokenBucket::now(), 0.0);
+        Msg tag(msg_magic);
+        DataStream s;
+        s << htole((uint32_t)std::min(ttl * 1e6, (double)UINT32_MAX));
+        tag.set_opcode(deadline_opcode);
+        tag.set_payload(std::move(s));
+        tag.set_checksum();
+        data = tag.serialize();
+        data.insert(data.end(), msg_data.begin(), msg_data.end());
+    }
+    else data = std::move(msg_data);
+    MPSCWriteBuffer::buffer_entry_t entry(std::move(data), tclass);
+    entry.deadline = deadline;
+    if (keyed)
+        return this->flush_send(conn, conn->write_conflated(std::move(entry), key));
+    return this->flush_send(conn, conn->write(std::move(entry)));
+}
+
+template<typename OpcodeType>
+inline bool MsgNetwork<OpcodeType>::send_file(const conn_t &conn, int fd, off_t offset, size_t len,
+                                            const OpcodeType &opcode, file_callback_t cb) {
+    using file_range_t = MPSCWriteBuffer::file_range_t;
+    if (len > UINT32_MAX)
+        throw MsgNetworkError("the file range is too large for a message");
+    std::function<void(bool)> on_done;
+    if (cb)
+        on_done = [this, cb=std::move(cb)](bool ok) {
+            this->user_tcall->async_call([cb, ok](ThreadCall::Handle &) {
+                cb(ok);
+            });
+        };
+    uint8_t tclass = 0;
+    if (!opcode_class.empty())
+    {
+        auto it = opcode_class.find(opcode);
+        if (it != opcode_class.end()) tclass = it->second;
+    }
+    Msg msg(msg_magic);
+    msg.set_opcode(opcode);
+    MPSCWriteBuffer::buffer_entry_t entry;
+    if (this->enable_tls)
+    {
+        /* the body has to go through the TLS session */
+        bytearray_t payload(len);
+        for (size_t n = 0; n < len;)
+        {
+            ssize_t ret = pread(fd, &payload[n], len - n, offset + n);
+            if (ret <= 0) throw MsgNetworkError("failed to read the file");
+            n += ret;
+        }
+        msg.set_payload(std::move(payload));
+        msg.set_checksum();
+        /* an empty range, for the notification */
+        entry = MPSCWriteBuffer::buffer_entry_t(msg.serialize(),
+            MPSCWriteBuffer::file_t(new file_range_t(fd, offset, 0, std::move(on_done))),
+            tclass);
+    }
+    else
+    {
+        msg.set_payload_size(len);
+#ifndef SALTICIDAE_NOCHECKSUM
+        msg.set_checksum(Msg::get_checksum(fd, offset, len));
+#endif
+        entry = MPSCWriteBuffer::buffer_entry_t(msg.serialize_header(),
+            MPSCWriteBuffer::file_t(new file_range_t(fd, offset, len, std::move(on_done))),
+            tclass);
+    }
+    SALTICIDAE_LOG_DEBUG("wrote file(%d) of %zu bytes to %s",
+                fd, len, std::string(*conn).c_str());
+#ifdef SALTICIDAE_MSG_STAT
+    conn->nsent++;
+    conn->nsentb += len;
+#endif
+    return this->flush_send(conn, conn->write(std::move(entry)));
+}
+
+template<typename OpcodeType>
+inline typename MsgNetwork<OpcodeType>::frame_t
+MsgNetwork<OpcodeType>::make_frame(const Msg &msg) {
+    if (msg.peek_payload().size() != msg.get_length())
+        throw MsgNetworkError("payload not available");
+    return frame_t(new bytearray_t(msg.serialize()));
+}
+
+template<typename OpcodeType>
+inline bool MsgNetwork<OpcodeType>::forward_msg(const frame_t &frame, const conn_t &conn) {
+    OpcodeType opcode;
+    memmove(&opcode, &(*frame)[sizeof(uint32_t)], sizeof(OpcodeType));
+    SALTICIDAE_LOG_DEBUG("forwarded %zu bytes to %s",
+                frame->size(), std::string(*conn).c_str());
+#ifdef SALTICIDAE_MSG_STAT
+    conn->nsent++;
+    conn->nsentb += frame->size() - Msg::header_size;
+#endif
+    if (capture)
+        capture->record(conn->get_serial(), WireCapture::SEND,
+                        &(*frame)[0], &(*frame)[Msg::header_size],
+                        frame->size() - Msg::header_size);
+    uint8_t tclass = 0;
+    if (!opcode_class.empty())
+    {
+        auto it = opcode_class.find(opcode);
+        if (it != opcode_class.end()) tclass = it->second;
+    }
+    return this->flush_send(conn, conn->write(MPSCWriteBuffer::buffer_entry_t(
+        bytearray_t(), frame, 0, tclass)));
+}
+
+template<typename OpcodeType>
+inline bool MsgNetwork<OpcodeType>::forward_msg(const frame_t &frame, const conn_t &conn,
+                                                uint32_t magic, const OpcodeType &opcode) {
+    DataStream s;
+    s << htole(magic) << opcode;
+    s.put_data(&(*frame)[s.size()], &(*frame)[Msg::header_size]);
+    bytearray_t header(std::move(s));
+    SALTICIDAE_LOG_DEBUG("forwarded %zu bytes to %s",
+                frame->size(), std::string(*conn).c_str());
+#ifdef SALTICIDAE_MSG_STAT
+    conn->nsent++;
+    conn->nsentb += frame->size() - Msg::header_size;
+#endif
+    if (capture)
+        capture->record(conn->get_serial(), WireCapture::SEND,
+                        &header[0], &(*frame)[Msg::header_size],
+                        frame->size() - Msg::header_size);
+    uint8_t tclass = 0;
+    if (!opcode_class.empty())
+    {
+        auto it = opcode_class.find(opcode);
+        if (it != opcode_class.end()) tclass = it->second;
+    }
+    return this->flush_send(conn, conn->write(MPSCWriteBuffer::buffer_entry_t(
+        std::move(header), frame, Msg::header_size, tclass)));
+}
+
+template<typename OpcodeType>
+inline size_t MsgNetwork<OpcodeType>::forward_msg(const Msg &msg,
+                                                const std::vector<conn_t> &conns) {
+    auto frame = make_frame(msg);
+    size_t n = 0;
+    for (auto &conn: conns)
+        n += forward_msg(frame, conn);
+    return n;
 }
 
 template<typename O, O _, O __>
-void PeerNetwork<O, _, __>::tcall_reset_timeout(ConnPool::Worker *worker,
-                                    const conn_t &conn, double timeout) {
-    worker->get_tcall()->async_call([worker, conn, t=timeout](ThreadCall::Handle &) {
+void PeerNetwork<O, _, __>::tcall_reset_timeout(const conn_t &conn, double timeout) {
+    this->worker_call(conn, [conn, t=timeout](ThreadCall::Handle &) {
+        auto worker = conn->worker.load(std::memory_order_relaxed);
         try {
             if (!conn->ev_timeout) return;
             conn->ev_timeout.del();
@@ -756,11 +2032,29 @@ template<typename O, O _, O __>
 void PeerNetwork<O, _, __>::on_worker_setup(const ConnPool::conn_t &_conn) {
     MsgNet::on_worker_setup(_conn);
     auto conn = static_pointer_cast<Conn>(_conn);
-    auto worker = conn->worker;
-    auto &ev_timeout = conn->ev_timeout;
-    assert(!ev_timeout);
-    ev_timeout = TimerEvent(worker->get_ec(), [=](TimerEvent &) {
+    assert(!conn->ev_timeout);
+    conn->last_recv.store(conn->worker.load()->get_ec().now(),
+                        std::memory_order_relaxed);
+    watch_timeout(conn);
+}
+
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::watch_timeout(const conn_t &conn) {
+    auto worker = conn->worker.load(std::memory_order_relaxed);
+    conn->ev_timeout = TimerEvent(worker->get_ec(), [=](TimerEvent &) {
         try {
+            if (piggyback_heartbeat)
+            {
+                /* re-arm for the remaining time if anything has been
+                 * received since the timer was set */
+                double idle = (int64_t)(worker->get_ec().now() - conn->get_last_recv()) / 1e3;
+                if (idle < conn_timeout)
+                {
+                    /* at least 1ms, see Peer::ping_timer() */
+                    conn->ev_timeout.add(std::max(conn_timeout - idle, 1e-3));
+                    return;
+                }
+            }
             SALTICIDAE_LOG_INFO("%s%s%s: peer ping-pong timeout",
                 tty_secondary_color,
                 id_hex.c_str(),
@@ -774,9 +2068,51 @@ template<typename O, O _, O __>
 void PeerNetwork<O, _, __>::on_worker_teardown(const ConnPool::conn_t &_conn) {
     auto conn = static_pointer_cast<Conn>(_conn);
     conn->ev_timeout.clear();
+    if (conn->stripe)
+    {
+        /* a half-sent head cannot go through another stream */
+        for (auto seg = conn->pop_send(); !seg.empty(); seg = conn->pop_send())
+        {
+            conn->release_send(seg.buffered_size());
+            if (seg.partial)
+                nstripe_lost_bytes.fetch_add(seg.size(), std::memory_order_relaxed);
+            else
+                conn->unsent.push_back(std::move(seg));
+        }
+    }
     MsgNet::on_worker_teardown(_conn);
 }
 
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::on_worker_detach(const ConnPool::conn_t &_conn) {
+    auto conn = static_pointer_cast<Conn>(_conn);
+    conn->ev_timeout.clear();
+    MsgNet::on_worker_detach(_conn);
+}
+
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::on_worker_attach(const ConnPool::conn_t &_conn) {
+    MsgNet::on_worker_attach(_conn);
+    auto conn = static_pointer_cast<Conn>(_conn);
+    /* the timeout starts over on the new loop */
+    watch_timeout(conn);
+    conn->ev_timeout.add(conn_timeout);
+}
+
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::on_worker_stop(ConnPool::Worker &worker) {
+    /* the timers of the peers run on their dispatcher shards */
+    pinfo_slock_t _g(known_peers_lock);
+    for (auto &it: known_peers)
+    {
+        auto &p = it.second;
+        if (p->disp != &worker) continue;
+        p->ev_ping_timer.clear();
+        p->ev_retry_timer.clear();
+    }
+    MsgNet::on_worker_stop(worker);
+}
+
 /* begin: functions invoked by the dispatcher */
 
 /* the initial ping-pong to set up the connection */
@@ -789,12 +2125,18 @@ void PeerNetwork<O, _, __>::on_dispatcher_setup(const ConnPool::conn_t &_conn) {
             id_hex.c_str(),
             tty_reset_color,
             std::string(*conn).c_str());
-    tcall_reset_timeout(conn->worker, conn, conn_timeout);
-    if (conn->get_mode() == Conn::ConnMode::ACTIVE)
+    tcall_reset_timeout(conn, conn_timeout);
+    if (conn->get_mode() == Conn::ConnMode::ACTIVE && conn->stripe)
+        send_msg(MsgPing(listen_addr, 0, conn->stripe), conn);
+    else if (conn->get_mode() == Conn::ConnMode::ACTIVE)
     {
         auto pid = get_peer_id(conn, conn->get_addr());
-        auto it = known_peers.find(pid);
-        if (it == known_peers.end())
+        bool known;
+        {
+            pinfo_slock_t _g(known_peers_lock);
+            known = known_peers.count(pid);
+        }
+        if (!known)
         {
             if (conn->manual)
                 send_msg(MsgPing(listen_addr, 0), conn);
@@ -802,12 +2144,14 @@ void PeerNetwork<O, _, __>::on_dispatcher_setup(const ConnPool::conn_t &_conn) {
                 throw PeerNetworkError(SALTI_ERROR_PEER_NOT_MATCH);
         }
         else
-        {
-            pinfo_slock_t _g(known_peers_lock);
-            send_msg(MsgPing(
-                listen_addr,
-                it->second->get_nonce()), conn);
-        }
+            on_peer_disp(conn, pid, [this, conn, pid]() {
+                pinfo_slock_t _g(known_peers_lock);
+                auto it = known_peers.find(pid);
+                if (it == known_peers.end()) return;
+                send_msg(MsgPing(
+                    listen_addr,
+                    it->second->get_nonce()), conn);
+            });
     }
     else
         replace_pending_conn(conn);
@@ -818,13 +2162,43 @@ void PeerNetwork<O, _, __>::on_dispatcher_teardown(const ConnPool::conn_t &_conn
     MsgNet::on_dispatcher_teardown(_conn);
     auto conn = static_pointer_cast<Conn>(_conn);
     auto addr = conn->get_addr();
-    pending_peers.erase(addr);
+    {
+        std::lock_guard<std::mutex> _g(pending_peers_lock);
+        pending_peers.erase(addr);
+    }
     SALTICIDAE_LOG_INFO("%s%s%s: lost connection %s",
             tty_secondary_color,
             id_hex.c_str(),
             tty_reset_color,
             std::string(*conn).c_str());
     auto p = conn->peer;
+    if (!p && conn->stripe)
+    {
+        /* the bundle went away with the peer or its chosen connection, or
+         * the stripe was replaced */
+        for (auto &seg: conn->unsent)
+            nstripe_lost_bytes.fetch_add(seg.size(), std::memory_order_relaxed);
+        conn->unsent.clear();
+        return;
+    }
+    if (p && conn->stripe)
+    {
+        bool ready = p->clear_stripe(conn);
+        /* hand over the unsent data to the chosen connection */
+        for (auto &seg: conn->unsent)
+        {
+            auto size = seg.size();
+            if (!p->conn->write(std::move(seg)))
+                nstripe_lost_bytes.fetch_add(size, std::memory_order_relaxed);
+        }
+        conn->unsent.clear();
+        this->flush_send(p->conn, true);
+        conn->peer = nullptr;
+        if (ready && p->state == Peer::State::CONNECTED &&
+            conn->get_mode() == Conn::ConnMode::ACTIVE)
+            start_stripe_conn(p, conn->stripe);
+        return;
+    }
     if (!p || (conn->get_mode() == Conn::ConnMode::ACTIVE && conn->manual))
         return;
     /* there are only two possible cases where p != nullptr:
@@ -834,9 +2208,15 @@ void PeerNetwork<O, _, __>::on_dispatcher_teardown(const ConnPool::conn_t &_conn
     if (p->state != Peer::State::DISCONNECTED)
     {
         assert(p->conn == conn);
-        p->state = Peer::State::DISCONNECTED;
+        p->set_state(Peer::State::DISCONNECTED);
         p->outbound_conn = nullptr;
         p->ev_ping_timer.del();
+        for (auto &s: p->clear_stripes())
+            if (s)
+            {
+                s->peer = nullptr;
+                this->disp_terminate(s);
+            }
         SALTICIDAE_LOG_INFO("%sended %s%s%s <-/-> %s%s%s (via %s)%s",
             tty_tertiary_color,
             tty_secondary_color,
@@ -890,12 +2270,51 @@ void PeerNetwork<O, _, __>::Peer::send_ping() {
     auto pn = chosen_conn->get_net();
     ping_timer_ok = false;
     pong_msg_ok = false;
-    tcall_reset_timeout(chosen_conn->worker, chosen_conn, pn->conn_timeout);
+    ping_sent = disp->get_ec().hrtime();
+    if (!pn->piggyback_heartbeat)
+        pn->tcall_reset_timeout(chosen_conn, pn->conn_timeout);
     pn->send_msg(MsgPing(), chosen_conn);
 }
 
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::Peer::ping_stripes() {
+    auto pn = chosen_conn->get_net();
+    for (auto &s: stripes)
+    {
+        if (!s || !s->stripe_ready) continue;
+        if (pn->piggyback_heartbeat)
+        {
+            double idle = (int64_t)(disp->get_ec().now() - s->get_last_recv()) / 1e3;
+            if (idle < ping_period) continue;
+        }
+        else
+            pn->tcall_reset_timeout(s, pn->conn_timeout);
+        pn->send_msg(MsgPing(), s);
+    }
+}
+
 template<typename O, O _, O __>
 void PeerNetwork<O, _, __>::Peer::ping_timer(TimerEvent &) {
+    auto pn = chosen_conn->get_net();
+    ping_stripes();
+    if (pn->piggyback_heartbeat)
+    {
+        /* the link is not idle, no need to ping */
+        double idle = (int64_t)(disp->get_ec().now() - chosen_conn->get_last_recv()) / 1e3;
+        if (idle < ping_period)
+        {
+            /* unless the RTT is due for a sample */
+            if (pong_msg_ok && rtt_probe_period > 0 &&
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - rtt_time).count() >=
+                        rtt_probe_period)
+                send_ping();
+            /* at least 1ms: a timer re-armed with 0ms runs again right away
+             * with the same cached loop time, and would spin forever */
+            ev_ping_timer.add(std::max(ping_period - idle, 1e-3));
+            return;
+        }
+    }
     ping_timer_ok = true;
     if (pong_msg_ok)
     {
@@ -915,7 +2334,7 @@ void PeerNetwork<O, _, __>::finish_handshake(Peer *p) {
         p->outbound_conn->peer = nullptr;
         p->outbound_conn = nullptr;
     }
-    p->state = Peer::State::CONNECTED;
+    p->set_state(Peer::State::CONNECTED);
     p->reset_ping_timer();
     p->send_ping();
     p->ev_retry_timer.del();
@@ -928,18 +2347,27 @@ void PeerNetwork<O, _, __>::finish_handshake(Peer *p) {
         assert(p->conn->is_terminated());
         for (;;)
         {
-            bytearray_t buff_seg = old_conn->send_buffer.move_pop();
-            if (!buff_seg.size()) break;
-            new_conn->write(std::move(buff_seg));
+            auto seg = old_conn->pop_send();
+            if (seg.empty()) break;
+            new_conn->write(std::move(seg));
         }
+        this->flush_send(new_conn, true);
         old_conn->peer = nullptr;
     }
     old_conn = new_conn;
     new_conn->peer = p;
+    if (p->send_rate >= 0)
+        this->set_send_rate(new_conn, p->send_rate, p->send_burst);
+    if (new_conn->get_mode() == Conn::ConnMode::ACTIVE)
+        for (uint16_t i = 1; i < nstripe; i++)
+            start_stripe_conn(p, i);
     this->user_tcall->async_call([this, conn=p->conn](ThreadCall::Handle &) {
         if (peer_cb) peer_cb(conn, true);
     });
-    pending_peers.erase(p->conn->get_addr());
+    {
+        std::lock_guard<std::mutex> _g(pending_peers_lock);
+        pending_peers.erase(p->conn->get_addr());
+    }
     SALTICIDAE_LOG_INFO("%sestablished %s%s%s <---> %s%s%s (via %s)%s",
         tty_primary_color,
         tty_secondary_color,
@@ -955,6 +2383,7 @@ void PeerNetwork<O, _, __>::finish_handshake(Peer *p) {
 template<typename O, O _, O __>
 void PeerNetwork<O, _, __>::replace_pending_conn(const conn_t &conn) {
     const auto &addr = conn->get_addr();
+    std::lock_guard<std::mutex> _g(pending_peers_lock);
     auto it = pending_peers.find(addr);
     if (it != pending_peers.end())
     {
@@ -971,185 +2400,291 @@ void PeerNetwork<O, _, __>::replace_pending_conn(const conn_t &conn) {
 template<typename O, O _, O __>
 void PeerNetwork<O, _, __>::start_active_conn(Peer *p) {
     assert(!p->addr.is_null());
-    auto conn = static_pointer_cast<Conn>(MsgNet::_connect(p->addr));
+    auto conn = static_pointer_cast<Conn>(MsgNet::_connect(p->addr, *p->disp));
     conn->peer = p;
     conn->manual = false;
     if (p->outbound_conn)
         this->disp_terminate(p->outbound_conn);
     p->outbound_conn = conn;
+    std::lock_guard<std::mutex> _g(pending_peers_lock);
     assert(pending_peers.count(conn->get_addr()) == 0);
 }
 
 template<typename O, O _, O __>
-inline typename PeerNetwork<O, _, __>::conn_t PeerNetwork<O, _, __>::_get_peer_conn(const PeerId &pid) const {
+void PeerNetwork<O, _, __>::start_stripe_conn(Peer *p, uint16_t stripe) {
+    assert(!p->addr.is_null());
+    auto conn = static_pointer_cast<Conn>(MsgNet::_connect(p->addr, *p->disp));
+    conn->peer = p;
+    conn->manual = false;
+    conn->stripe = stripe;
+    auto old_conn = p->set_stripe(conn);
+    if (old_conn)
+    {
+        old_conn->peer = nullptr;
+        this->disp_terminate(old_conn);
+    }
+}
+
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::accept_stripe_conn(const MsgPing &msg, const conn_t &conn) {
+    if (conn->get_mode() != Conn::ConnMode::PASSIVE)
+    {
+        SALTICIDAE_LOG_WARN("%s%s%s: unexpected stripe from %s",
+            tty_secondary_color, id_hex.c_str(), tty_reset_color,
+            std::string(*conn).c_str());
+        return;
+    }
+    auto pid = get_peer_id(conn, msg.claimed_addr);
+    pinfo_slock_t _g(known_peers_lock);
+    auto pit = known_peers.find(pid);
+    /* only join the bundle of an established peer */
+    if (pit == known_peers.end() ||
+        pit->second->state != Peer::State::CONNECTED)
+    {
+        this->disp_terminate(conn);
+        return;
+    }
+    auto p = pit->second.get();
+    {
+        std::lock_guard<std::mutex> _g(pending_peers_lock);
+        pending_peers.erase(conn->get_addr());
+    }
+    conn->peer = p;
+    conn->stripe = msg.stripe;
+    conn->stripe_ready = true;
+    auto old_conn = p->set_stripe(conn);
+    if (old_conn)
+    {
+        old_conn->peer = nullptr;
+        this->disp_terminate(old_conn);
+    }
+    send_msg(MsgPong(listen_addr, 0, msg.stripe), conn);
+    SALTICIDAE_LOG_INFO("%s%s%s: stripe %u to %s%s%s (via %s)",
+        tty_secondary_color, id_hex.c_str(), tty_reset_color,
+        msg.stripe,
+        tty_secondary_color, p->id_hex.c_str(), tty_reset_color,
+        std::string(*conn).c_str());
+}
+
+template<typename O, O _, O __>
+inline typename PeerNetwork<O, _, __>::conn_t PeerNetwork<O, _, __>::_get_peer_conn(const PeerId &pid, size_t key) const {
     auto it = known_peers.find(pid);
     if (it == known_peers.end())
         throw PeerNetworkError(SALTI_ERROR_PEER_NOT_EXIST);
-    return it->second->conn;
+    return it->second->get_conn(key);
 }
 /* end: functions invoked by the dispatcher */
 
 /* begin: functions invoked by the user loop */
 template<typename O, O _, O __>
 void PeerNetwork<O, _, __>::ping_handler(MsgPing &&msg, const conn_t &conn) {
-    this->disp_tcall->async_call([this, conn, msg=std::move(msg)](ThreadCall::Handle &) {
+    this->disp_call(conn, [this, conn, msg=std::move(msg)](ThreadCall::Handle &) {
         try {
             if (conn->is_terminated()) return;
-            if (!msg.claimed_addr.is_null()) /* handshake ping */
+            /* the stripes and handshakes are handled by the shard of the
+             * peer */
+            if (msg.stripe || !msg.claimed_addr.is_null())
+                on_peer_disp(conn, get_peer_id(conn, msg.claimed_addr),
+                    [this, conn, msg]() { disp_ping(msg, conn); });
+            else
+                disp_ping(msg, conn);
+        } catch (...) { this->disp_error_cb(std::current_exception()); }
+    });
+}
+
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::disp_ping(const MsgPing &msg, const conn_t &conn) {
+    if (msg.stripe)
+        accept_stripe_conn(msg, conn);
+    else if (!msg.claimed_addr.is_null()) /* handshake ping */
+    {
+        if (conn->get_mode() == Conn::ConnMode::PASSIVE)
+        {
+            auto pid = get_peer_id(conn, msg.claimed_addr);
+            pinfo_slock_t _g(known_peers_lock);
+            auto pit = known_peers.find(pid);
+            if (pit == known_peers.end())
             {
-                if (conn->get_mode() == Conn::ConnMode::PASSIVE)
-                {
-                    auto pid = get_peer_id(conn, msg.claimed_addr);
-                    pinfo_slock_t _g(known_peers_lock);
-                    auto pit = known_peers.find(pid);
-                    if (pit == known_peers.end())
-                    {
-                        this->user_tcall->async_call([this, addr=msg.claimed_addr, conn](ThreadCall::Handle &) {
-                            if (unknown_peer_cb) unknown_peer_cb(addr, conn->get_peer_cert());
-                        });
-                        SALTICIDAE_LOG_WARN(
-                            "%s%s%s: %s%s%s does not match the record",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            tty_secondary_color, get_hex10(pid).c_str(), tty_reset_color);
-                        this->disp_terminate(conn);
-                        return;
-                    }
-                    if (!msg.nonce) return; // ignore manual connection
-                    auto &p = pit->second;
-                    if (p->state == Peer::State::CONNECTED)
-                    {
-                        // defer the handling of the inbound connection
-                        p->inbound_preempt_ping = new MsgPing(std::move(msg));
-                        p->inbound_conn = conn;
-                        p->nonce = passive_nonce;
-                        this->disp_terminate(p->conn);
-                        return;
-                    }
-                    if (p->state != Peer::State::DISCONNECTED) return;
-                    SALTICIDAE_LOG_DEBUG("%s%s%s: inbound handshake from %s%s%s",
-                        tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                        tty_secondary_color, p->id_hex.c_str(), tty_reset_color);
-                    send_msg(MsgPong(listen_addr, p->get_nonce()), conn);
-                    auto &old_conn = p->inbound_conn;
-                    if (old_conn && old_conn != conn)
-                    {
-                        SALTICIDAE_LOG_DEBUG("%s%s%s: terminating stale handshake connection %s",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            std::string(*old_conn).c_str());
-                        assert(old_conn->peer == nullptr);
-                        this->disp_terminate(old_conn);
-                    }
-                    old_conn = conn;
-                    if (msg.nonce < p->get_nonce() || p->addr.is_null())
-                    {
-                        SALTICIDAE_LOG_DEBUG("%s%s%s: choses connection %s",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            std::string(*conn).c_str());
-                        p->chosen_conn = conn;
-                        finish_handshake(p.get());
-                    }
-                    else
-                    {
-                        SALTICIDAE_LOG_DEBUG("%s%s%s: terminates one side (%04x >= %04x)",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            msg.nonce, p->get_nonce());
-                        this->disp_terminate(conn);
-                    }
-                }
-                else
-                    SALTICIDAE_LOG_WARN("%s%s%s: unexpected inbound handshake from %s",
-                        tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                        std::string(*conn).c_str());
+                this->user_tcall->async_call([this, addr=msg.claimed_addr, conn](ThreadCall::Handle &) {
+                    if (unknown_peer_cb) unknown_peer_cb(addr, conn->get_peer_cert());
+                });
+                SALTICIDAE_LOG_WARN(
+                    "%s%s%s: %s%s%s does not match the record",
+                    tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                    tty_secondary_color, get_hex10(pid).c_str(), tty_reset_color);
+                this->disp_terminate(conn);
+                return;
             }
-            else /* heartbeat ping */
+            if (!msg.nonce) return; // ignore manual connection
+            auto &p = pit->second;
+            if (p->state == Peer::State::CONNECTED)
             {
-                SALTICIDAE_LOG_INFO("%s%s%s: ping from %s",
+                // defer the handling of the inbound connection
+                p->inbound_preempt_ping = new MsgPing(msg);
+                p->inbound_conn = conn;
+                p->nonce = passive_nonce;
+                this->disp_terminate(p->conn);
+                return;
+            }
+            if (p->state != Peer::State::DISCONNECTED) return;
+            SALTICIDAE_LOG_DEBUG("%s%s%s: inbound handshake from %s%s%s",
+                tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                tty_secondary_color, p->id_hex.c_str(), tty_reset_color);
+            send_msg(MsgPong(listen_addr, p->get_nonce()), conn);
+            auto &old_conn = p->inbound_conn;
+            if (old_conn && old_conn != conn)
+            {
+                SALTICIDAE_LOG_DEBUG("%s%s%s: terminating stale handshake connection %s",
+                    tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                    std::string(*old_conn).c_str());
+                assert(old_conn->peer == nullptr);
+                this->disp_terminate(old_conn);
+            }
+            old_conn = conn;
+            if (msg.nonce < p->get_nonce() || p->addr.is_null())
+            {
+                SALTICIDAE_LOG_DEBUG("%s%s%s: choses connection %s",
                     tty_secondary_color, id_hex.c_str(), tty_reset_color,
                     std::string(*conn).c_str());
-                send_msg(MsgPong(), conn);
+                p->chosen_conn = conn;
+                finish_handshake(p.get());
             }
-        } catch (...) { this->disp_error_cb(std::current_exception()); }
-    });
+            else
+            {
+                SALTICIDAE_LOG_DEBUG("%s%s%s: terminates one side (%04x >= %04x)",
+                    tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                    msg.nonce, p->get_nonce());
+                this->disp_terminate(conn);
+            }
+        }
+        else
+            SALTICIDAE_LOG_WARN("%s%s%s: unexpected inbound handshake from %s",
+                tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                std::string(*conn).c_str());
+    }
+    else /* heartbeat ping */
+    {
+        SALTICIDAE_LOG_INFO("%s%s%s: ping from %s",
+            tty_secondary_color, id_hex.c_str(), tty_reset_color,
+            std::string(*conn).c_str());
+        send_msg(MsgPong(), conn);
+    }
 }
 
 template<typename O, O _, O __>
 void PeerNetwork<O, _, __>::pong_handler(MsgPong &&msg, const conn_t &conn) {
-    this->disp_tcall->async_call([this, conn, msg=std::move(msg)](ThreadCall::Handle &) {
+    this->disp_call(conn, [this, conn, msg=std::move(msg)](ThreadCall::Handle &) {
         try {
             if (conn->is_terminated()) return;
-            if (!msg.claimed_addr.is_null()) /* handshake pong */
+            /* the handshakes are handled by the shard of the peer (a
+             * stripe is already there) */
+            if (!msg.stripe && !msg.claimed_addr.is_null() &&
+                conn->get_mode() == Conn::ConnMode::ACTIVE)
+                on_peer_disp(conn, get_peer_id(conn, conn->get_addr()),
+                    [this, conn, msg]() { disp_pong(msg, conn); });
+            else
+                disp_pong(msg, conn);
+        } catch (...) { this->disp_error_cb(std::current_exception()); }
+    });
+}
+
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::disp_pong(const MsgPong &msg, const conn_t &conn) {
+    if (msg.stripe)
+    {
+        auto p = conn->peer;
+        if (!p || conn->stripe != msg.stripe ||
+            p->state != Peer::State::CONNECTED)
+        {
+            this->disp_terminate(conn);
+            return;
+        }
+        p->set_stripe_ready(conn);
+        SALTICIDAE_LOG_INFO("%s%s%s: stripe %u to %s%s%s (via %s)",
+            tty_secondary_color, id_hex.c_str(), tty_reset_color,
+            msg.stripe,
+            tty_secondary_color, p->id_hex.c_str(), tty_reset_color,
+            std::string(*conn).c_str());
+    }
+    else if (!msg.claimed_addr.is_null()) /* handshake pong */
+    {
+        if (conn->get_mode() == Conn::ConnMode::ACTIVE)
+        {
+            auto pid = get_peer_id(conn, conn->get_addr());
+            pinfo_slock_t _g(known_peers_lock);
+            auto pit = known_peers.find(pid);
+            if (pit == known_peers.end())
             {
-                if (conn->get_mode() == Conn::ConnMode::ACTIVE)
-                {
-                    auto pid = get_peer_id(conn, conn->get_addr());
-                    pinfo_slock_t _g(known_peers_lock);
-                    auto pit = known_peers.find(pid);
-                    if (pit == known_peers.end())
-                    {
-                        SALTICIDAE_LOG_WARN(
-                            "%s%s%s: %s%s%s does not match the record",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            tty_secondary_color, get_hex10(pid).c_str(), tty_reset_color);
-                        this->disp_terminate(conn);
-                        return;
-                    }
-                    auto &p = pit->second;
-                    assert(!p->addr.is_null() && p->addr == conn->get_addr());
-                    if (p->state != Peer::State::DISCONNECTED ||
-                        p->addr != msg.claimed_addr) return;
-                    SALTICIDAE_LOG_DEBUG("%s%s%s: outbound handshake to %s%s%s",
-                        tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                        tty_secondary_color, p->id_hex.c_str(), tty_reset_color);
-                    auto &old_conn = p->outbound_conn;
-                    if (old_conn && old_conn != conn)
-                    {
-                        SALTICIDAE_LOG_DEBUG("%s%s%s: terminating stale handshake connection %s",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            std::string(*old_conn).c_str());
-                        assert(old_conn->peer == nullptr);
-                        this->disp_terminate(old_conn);
-                    }
-                    old_conn = conn;
-                    if (p->get_nonce() < msg.nonce)
-                    {
-                        SALTICIDAE_LOG_DEBUG("%s%s%s: choses connection %s",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            std::string(*conn).c_str());
-                        p->chosen_conn = conn;
-                        p->reset_ping_timer();
-                        finish_handshake(p.get());
-                    }
-                    else
-                    {
-                        SALTICIDAE_LOG_DEBUG("%s%s%s: terminates one side (%04x >= %04x)",
-                            tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                            p->get_nonce(), msg.nonce);
-                        this->disp_terminate(conn);
-                    }
-                }
-                else
-                    SALTICIDAE_LOG_WARN("%s%s%s: unexpected outbound handshake from %s",
-                        tty_secondary_color, id_hex.c_str(), tty_reset_color,
-                        std::string(*conn).c_str());
+                SALTICIDAE_LOG_WARN(
+                    "%s%s%s: %s%s%s does not match the record",
+                    tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                    tty_secondary_color, get_hex10(pid).c_str(), tty_reset_color);
+                this->disp_terminate(conn);
+                return;
             }
-            else /* heartbeat pong */
+            auto &p = pit->second;
+            assert(!p->addr.is_null() && p->addr == conn->get_addr());
+            if (p->state != Peer::State::DISCONNECTED ||
+                p->addr != msg.claimed_addr) return;
+            SALTICIDAE_LOG_DEBUG("%s%s%s: outbound handshake to %s%s%s",
+                tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                tty_secondary_color, p->id_hex.c_str(), tty_reset_color);
+            auto &old_conn = p->outbound_conn;
+            if (old_conn && old_conn != conn)
             {
-                auto p = conn->peer;
-                if (!p)
-                {
-                    SALTICIDAE_LOG_WARN("%s%s%s: unexpected pong mesage",
-                        tty_secondary_color, id_hex.c_str(), tty_reset_color);
-                    return;
-                }
-                p->pong_msg_ok = true;
-                if (p->ping_timer_ok)
-                {
-                    p->reset_ping_timer();
-                    p->send_ping();
-                }
+                SALTICIDAE_LOG_DEBUG("%s%s%s: terminating stale handshake connection %s",
+                    tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                    std::string(*old_conn).c_str());
+                assert(old_conn->peer == nullptr);
+                this->disp_terminate(old_conn);
             }
-        } catch (...) { this->disp_error_cb(std::current_exception()); }
-    });
+            old_conn = conn;
+            if (p->get_nonce() < msg.nonce)
+            {
+                SALTICIDAE_LOG_DEBUG("%s%s%s: choses connection %s",
+                    tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                    std::string(*conn).c_str());
+                p->chosen_conn = conn;
+                p->reset_ping_timer();
+                finish_handshake(p.get());
+            }
+            else
+            {
+                SALTICIDAE_LOG_DEBUG("%s%s%s: terminates one side (%04x >= %04x)",
+                    tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                    p->get_nonce(), msg.nonce);
+                this->disp_terminate(conn);
+            }
+        }
+        else
+            SALTICIDAE_LOG_WARN("%s%s%s: unexpected outbound handshake from %s",
+                tty_secondary_color, id_hex.c_str(), tty_reset_color,
+                std::string(*conn).c_str());
+    }
+    else /* heartbeat pong */
+    {
+        auto p = conn->peer;
+        if (!p)
+        {
+            SALTICIDAE_LOG_WARN("%s%s%s: unexpected pong mesage",
+                tty_secondary_color, id_hex.c_str(), tty_reset_color);
+            return;
+        }
+        if (conn->stripe) return;
+        if (!p->pong_msg_ok)
+        {
+            /* up to the arrival of the pong, leaving out the time it spent
+             * queued for the user loop and the dispatcher */
+            auto t = conn->pong_recv.load(std::memory_order_relaxed);
+            p->update_rtt(t > p->ping_sent ? (t - p->ping_sent) / 1e9 : 0);
+        }
+        p->pong_msg_ok = true;
+        if (p->ping_timer_ok)
+        {
+            p->reset_ping_timer();
+            p->send_ping();
+        }
+    }
 }
 
 template<typename O, O _, O __>
@@ -1166,18 +2701,19 @@ void PeerNetwork<O, _, __>::listen(NetAddr _listen_addr) {
 template<typename O, O _, O __>
 int32_t PeerNetwork<O, _, __>::add_peer(const PeerId &pid) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call([this, pid, id](ThreadCall::Handle &) {
+    get_peer_disp(pid).get_tcall()->async_call([this, pid, id](ThreadCall::Handle &) {
         try {
             pinfo_ulock_t _g(known_peers_lock);
             if (known_peers.count(pid))
                 throw PeerNetworkError(SALTI_ERROR_PEER_ALREADY_EXISTS);
-            auto p = new Peer(pid, this);
+            auto p = new Peer(pid, this, &get_peer_disp(pid));
             conn_t conn{new Conn()};
             conn->cpool = this;
+            conn->disp = p->disp;
             conn->set_terminated();
             conn->peer = p;
             p->conn = conn;
-            p->state = Peer::State::DISCONNECTED;
+            p->set_state(Peer::State::DISCONNECTED);
             known_peers.insert(std::make_pair(pid, p));
         } catch (const PeerNetworkError &) {
             this->recoverable_error(std::current_exception(), id);
@@ -1189,7 +2725,7 @@ int32_t PeerNetwork<O, _, __>::add_peer(const PeerId &pid) {
 template<typename O, O _, O __>
 int32_t PeerNetwork<O, _, __>::conn_peer(const PeerId &pid, int32_t ntry, double retry_delay) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call([this, pid, ntry, retry_delay, id](ThreadCall::Handle &) {
+    get_peer_disp(pid).get_tcall()->async_call([this, pid, ntry, retry_delay, id](ThreadCall::Handle &) {
         try {
             pinfo_slock_t _g(known_peers_lock);
             auto it = known_peers.find(pid);
@@ -1205,7 +2741,7 @@ int32_t PeerNetwork<O, _, __>::conn_peer(const PeerId &pid, int32_t ntry, double
             p->outbound_conn = nullptr;
             p->ev_ping_timer.del();
             p->nonce = 0;
-            p->ev_retry_timer = TimerEvent(this->disp_ec,
+            p->ev_retry_timer = TimerEvent(p->disp->get_ec(),
                     [this, addr=p->addr, p=p.get()](TimerEvent &) {
                 try {
                     start_active_conn(p);
@@ -1219,7 +2755,7 @@ int32_t PeerNetwork<O, _, __>::conn_peer(const PeerId &pid, int32_t ntry, double
                 p->ev_retry_timer.add(0);
             else if (p->state == Peer::State::CONNECTED)
             {
-                p->state = Peer::State::RESET;
+                p->set_state(Peer::State::RESET);
                 this->disp_terminate(p->conn);
             }
             // else ntry == 0 but state is not connected
@@ -1235,7 +2771,7 @@ int32_t PeerNetwork<O, _, __>::conn_peer(const PeerId &pid, int32_t ntry, double
 template<typename O, O _, O __>
 int32_t PeerNetwork<O, _, __>::set_peer_addr(const PeerId &pid, const NetAddr &addr) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call([this, pid, addr, id](ThreadCall::Handle &) {
+    get_peer_disp(pid).get_tcall()->async_call([this, pid, addr, id](ThreadCall::Handle &) {
         try {
             pinfo_slock_t _g(known_peers_lock);
             auto it = known_peers.find(pid);
@@ -1251,11 +2787,31 @@ int32_t PeerNetwork<O, _, __>::set_peer_addr(const PeerId &pid, const NetAddr &a
     return id;
 }
 
+template<typename O, O _, O __>
+int32_t PeerNetwork<O, _, __>::set_peer_send_rate(const PeerId &pid, double rate, double burst) {
+    auto id = this->gen_async_id();
+    get_peer_disp(pid).get_tcall()->async_call([this, pid, rate, burst, id](ThreadCall::Handle &) {
+        try {
+            pinfo_slock_t _g(known_peers_lock);
+            auto it = known_peers.find(pid);
+            if (it == known_peers.end())
+                throw PeerNetworkError(SALTI_ERROR_PEER_NOT_EXIST);
+            auto &p = it->second;
+            p->send_rate = rate;
+            p->send_burst = burst;
+            if (p->state == Peer::State::CONNECTED)
+                this->set_send_rate(p->conn, rate, burst);
+        } catch (const PeerNetworkError &) {
+            this->recoverable_error(std::current_exception(), id);
+        } catch (...) { this->disp_error_cb(std::current_exception()); }
+    });
+    return id;
+}
 
 template<typename O, O _, O __>
 int32_t PeerNetwork<O, _, __>::del_peer(const PeerId &pid) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call([this, pid, id](ThreadCall::Handle &) {
+    get_peer_disp(pid).get_tcall()->async_call([this, pid, id](ThreadCall::Handle &) {
         try {
             pinfo_ulock_t _g(known_peers_lock);
             auto it = known_peers.find(pid);
@@ -1264,6 +2820,12 @@ int32_t PeerNetwork<O, _, __>::del_peer(const PeerId &pid) {
             auto &p = it->second;
             p->conn->peer = nullptr;
             this->disp_terminate(p->conn);
+            for (auto &s: p->clear_stripes())
+                if (s)
+                {
+                    s->peer = nullptr;
+                    this->disp_terminate(s);
+                }
             if (p->inbound_conn)
                 this->disp_terminate(p->inbound_conn);
             if (p->outbound_conn)
@@ -1280,7 +2842,7 @@ template<typename O, O _, O __>
 typename PeerNetwork<O, _, __>::conn_t
 PeerNetwork<O, _, __>::get_peer_conn(const PeerId &pid) const {
     auto ret = *(static_cast<conn_t *>(
-            this->disp_tcall->call([this, pid](ThreadCall::Handle &h) {
+            get_peer_disp(pid).get_tcall()->call([this, pid](ThreadCall::Handle &h) {
         conn_t conn;
         pinfo_slock_t _g(known_peers_lock);
         auto it = known_peers.find(pid);
@@ -1291,21 +2853,35 @@ PeerNetwork<O, _, __>::get_peer_conn(const PeerId &pid) const {
     return ret;
 }
 
+template<typename O, O _, O __>
+typename PeerNetwork<O, _, __>::PeerRTT
+PeerNetwork<O, _, __>::get_peer_rtt(const PeerId &pid) const {
+    auto ret = *(static_cast<PeerRTT *>(
+            get_peer_disp(pid).get_tcall()->call([this, pid](ThreadCall::Handle &h) {
+        pinfo_slock_t _g(known_peers_lock);
+        auto it = known_peers.find(pid);
+        if (it == known_peers.end())
+            throw PeerNetworkError(SALTI_ERROR_PEER_NOT_EXIST);
+        h.set_result(PeerRTT(it->second->rtt));
+    }).get()));
+    return ret;
+}
+
 template<typename O, O _, O __>
 bool PeerNetwork<O, _, __>::has_peer(const PeerId &pid) const {
-    return *(static_cast<bool *>(this->disp_tcall->call(
+    /* after the add_peer() or del_peer() calls made before */
+    return *(static_cast<bool *>(get_peer_disp(pid).get_tcall()->call(
                 [this, pid](ThreadCall::Handle &h) {
         pinfo_slock_t _g(known_peers_lock);
-        h.set_result(known_peers.count(pid));
+        h.set_result((bool)known_peers.count(pid));
     }).get()));
 }
 
 template<typename O, O _, O __>
 size_t PeerNetwork<O, _, __>::get_npending() const {
-    return *(static_cast<bool *>(this->disp_tcall->call(
-                [this](ThreadCall::Handle &h) {
-        h.set_result(pending_peers.size());
-    }).get()));
+    /* the pending connections belong to all shards */
+    std::lock_guard<std::mutex> _g(pending_peers_lock);
+    return pending_peers.size();
 }
 
 template<typename O, O _, O __>
@@ -1317,7 +2893,7 @@ inline int32_t PeerNetwork<O, _, __>::send_msg_deferred(MsgType &&msg, const Pee
 template<typename O, O _, O __>
 inline int32_t PeerNetwork<O, _, __>::_send_msg_deferred(Msg &&msg, const PeerId &pid) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call(
+    get_peer_disp(pid).get_tcall()->async_call(
             [this, msg=std::move(msg), pid, id](ThreadCall::Handle &) {
         try {
             if (!_send_msg(msg, pid))
@@ -1339,6 +2915,49 @@ inline bool PeerNetwork<O, _, __>::_send_msg(const Msg &msg, const PeerId &pid)
     return MsgNet::_send_msg(msg, _get_peer_conn(pid));
 }
 
+template<typename O, O _, O __>
+template<typename MsgType>
+inline bool PeerNetwork<O, _, __>::send_msg_ttl(const MsgType &msg, const PeerId &pid, double ttl) {
+    return _send_msg_ttl(Msg(msg, this->msg_magic), pid, ttl);
+}
+
+template<typename O, O _, O __>
+inline bool PeerNetwork<O, _, __>::_send_msg_ttl(const Msg &msg, const PeerId &pid, double ttl) {
+    pinfo_slock_t _g(known_peers_lock);
+    return MsgNet::_send_msg_ttl(msg, _get_peer_conn(pid), ttl);
+}
+
+template<typename O, O _, O __>
+template<typename MsgType>
+inline bool PeerNetwork<O, _, __>::send_msg_conflated(const MsgType &msg, const PeerId &pid, uint64_t key) {
+    return _send_msg_conflated(Msg(msg, this->msg_magic), pid, key);
+}
+
+template<typename O, O _, O __>
+inline bool PeerNetwork<O, _, __>::_send_msg_conflated(const Msg &msg, const PeerId &pid, uint64_t key) {
+    pinfo_slock_t _g(known_peers_lock);
+    return MsgNet::_send_msg_conflated(msg, _get_peer_conn(pid), key);
+}
+
+template<typename O, O _, O __>
+inline bool PeerNetwork<O, _, __>::forward_msg(
+        const typename MsgNet::frame_t &frame, const PeerId &pid) {
+    pinfo_slock_t _g(known_peers_lock);
+    return MsgNet::forward_msg(frame, _get_peer_conn(pid));
+}
+
+template<typename O, O _, O __>
+template<typename MsgType>
+inline bool PeerNetwork<O, _, __>::send_msg(const MsgType &msg, const PeerId &pid, size_t key) {
+    return _send_msg(Msg(msg, this->msg_magic), pid, key);
+}
+
+template<typename O, O _, O __>
+inline bool PeerNetwork<O, _, __>::_send_msg(const Msg &msg, const PeerId &pid, size_t key) {
+    pinfo_slock_t _g(known_peers_lock);
+    return MsgNet::_send_msg(msg, _get_peer_conn(pid, key));
+}
+
 template<typename O, O _, O __>
 template<typename MsgType>
 inline int32_t PeerNetwork<O, _, __>::multicast_msg(MsgType &&msg, const std::vector<PeerId> &pids) {
@@ -1348,21 +2967,181 @@ inline int32_t PeerNetwork<O, _, __>::multicast_msg(MsgType &&msg, const std::ve
 template<typename O, O _, O __>
 inline int32_t PeerNetwork<O, _, __>::_multicast_msg(Msg &&msg, const std::vector<PeerId> &pids) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call(
-                [this, msg=std::move(msg), pids, id](ThreadCall::Handle &) {
-        try {
-            pinfo_slock_t _g(known_peers_lock);
-            bool succ = true;
+    multicast_by_disp(std::move(msg), pids, id);
+    return id;
+}
+
+template<typename O, O _, O __>
+void PeerNetwork<O, _, __>::multicast_by_disp(
+        Msg &&msg, const std::vector<PeerId> &pids, int32_t id, std::exception_ptr err) {
+    auto ndisp = this->get_ndisp();
+    std::vector<std::vector<PeerId>> by_disp(ndisp);
+    for (auto &pid: pids)
+        by_disp[get_peer_disp_idx(pid)].push_back(pid);
+    size_t nleft = 0;
+    for (auto &d: by_disp) nleft += !d.empty();
+    if (!nleft)
+    {
+        if (err) this->recoverable_error(err, id);
+        return;
+    }
+    auto state = std::make_shared<MulticastState>(std::move(msg), nleft, err);
+    for (size_t i = 0; i < ndisp; i++)
+    {
+        if (by_disp[i].empty()) continue;
+        this->get_worker(i).get_tcall()->async_call(
+                [this, state, pids=std::move(by_disp[i]), id](ThreadCall::Handle &) {
             for (auto &pid: pids)
-                succ &= MsgNet::_send_msg(msg, _get_peer_conn(pid));
-            if (!succ) throw PeerNetworkError(SALTI_ERROR_CONN_NOT_READY);
-        } catch (...) { this->recoverable_error(std::current_exception(), id); }
-    });
+            {
+                try {
+                    pinfo_slock_t _g(known_peers_lock);
+                    if (!MsgNet::_send_msg(state->msg, _get_peer_conn(pid)))
+                        throw PeerNetworkError(SALTI_ERROR_CONN_NOT_READY);
+                } catch (...) { state->fail(std::current_exception()); }
+            }
+            /* the last shard reports the (first) failure */
+            if (state->nleft.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                auto err = state->err ? state->err : state->fallback;
+                if (err) this->recoverable_error(err, id);
+            }
+        });
+    }
+}
+
+template<typename O, O _, O __>
+template<typename MsgType>
+inline int32_t PeerNetwork<O, _, __>::multicast_msg_nearest(
+        MsgType &&msg, const std::vector<PeerId> &pids, size_t k) {
+    return _multicast_msg_nearest(Msg(std::move(msg), this->msg_magic), pids, k);
+}
+
+template<typename O, O _, O __>
+inline int32_t PeerNetwork<O, _, __>::_multicast_msg_nearest(
+        Msg &&msg, const std::vector<PeerId> &pids, size_t k) {
+    auto id = this->gen_async_id();
+    std::vector<std::pair<double, PeerId>> cands;
+    std::unordered_set<PeerId> seen;
+    try {
+        /* the peers belong to different shards, so their state is read
+         * from the snapshots */
+        pinfo_slock_t _g(known_peers_lock);
+        for (auto &pid: pids)
+        {
+            if (!seen.insert(pid).second) continue;
+            auto it = known_peers.find(pid);
+            if (it == known_peers.end())
+                throw PeerNetworkError(SALTI_ERROR_PEER_NOT_EXIST);
+            auto srtt = it->second->srtt_snap.load(std::memory_order_relaxed);
+            if (srtt < 0) continue;
+            cands.push_back(std::make_pair(srtt, pid));
+        }
+    } catch (...) {
+        this->recoverable_error(std::current_exception(), id);
+        return id;
+    }
+    std::stable_sort(cands.begin(), cands.end(),
+        [](const std::pair<double, PeerId> &a,
+            const std::pair<double, PeerId> &b) {
+            return a.first < b.first;
+        });
+    size_t n = std::min(k, seen.size());
+    std::exception_ptr err;
+    if (cands.empty() && n)
+        err = std::make_exception_ptr(PeerNetworkError(SALTI_ERROR_CONN_NOT_READY));
+    else if (cands.size() < n)
+        err = std::make_exception_ptr(PeerNetworkError(SALTI_ERROR_MULTICAST_PARTIAL));
+    if (cands.size() > n) cands.resize(n);
+    std::vector<PeerId> nearest;
+    for (auto &c: cands) nearest.push_back(c.second);
+    multicast_by_disp(std::move(msg), nearest, id, err);
     return id;
 }
 
 /* end: functions invoked by the user loop */
 
+template<typename OpcodeType>
+void ClientNetwork<OpcodeType>::on_worker_setup(const ConnPool::conn_t &_conn) {
+    MsgNet::on_worker_setup(_conn);
+    if (!(idle_timeout > 0)) return;
+    auto conn = static_pointer_cast<Conn>(_conn);
+    conn->last_recv.store(conn->worker.load()->get_ec().now(),
+                        std::memory_order_relaxed);
+    idle_watch(conn);
+}
+
+template<typename OpcodeType>
+void ClientNetwork<OpcodeType>::idle_watch(const conn_t &conn) {
+    auto worker = conn->worker.load(std::memory_order_relaxed);
+    auto &wheel = *wheels[this->get_worker_idx(worker)];
+    auto now = worker->get_ec().now();
+    if (!wheel.ev_tick)
+    {
+        wheel.ev_tick = TimerEvent(worker->get_ec(), [this, &wheel, worker](TimerEvent &) {
+            idle_tick(wheel, worker);
+            wheel.ev_tick.add(idle_timeout / IdleWheel::nslot);
+        });
+        wheel.ev_tick.add(idle_timeout / IdleWheel::nslot);
+    }
+    idle_schedule(wheel, conn, now);
+}
+
+template<typename OpcodeType>
+inline void ClientNetwork<OpcodeType>::idle_schedule(
+        IdleWheel &wheel, const conn_t &conn, uint64_t now) {
+    /* all in milliseconds */
+    uint64_t timeout = idle_timeout * 1e3;
+    uint64_t tick = std::max(timeout / IdleWheel::nslot, (uint64_t)1);
+    uint64_t deadline = conn->get_last_recv() + timeout;
+    /* the number of ticks to wait (1 for the slot at cur) */
+    size_t nticks = deadline > now ? (deadline - now + tick - 1) / tick : 1;
+    nticks = std::min(std::max(nticks, (size_t)1), (size_t)IdleWheel::nslot);
+    conn->idle_slot = (wheel.cur + nticks - 1) % IdleWheel::nslot;
+    wheel.slots[conn->idle_slot].push_back(conn);
+}
+
+template<typename OpcodeType>
+inline void ClientNetwork<OpcodeType>::idle_unwatch(const conn_t &conn) {
+    if (conn->idle_slot == (size_t)-1) return;
+    auto worker = conn->worker.load(std::memory_order_relaxed);
+    auto &slot = wheels[this->get_worker_idx(worker)]->slots[conn->idle_slot];
+    conn->idle_slot = -1;
+    for (size_t i = 0; i < slot.size(); i++)
+        if (slot[i] == conn)
+        {
+            if (i + 1 < slot.size()) slot[i] = std::move(slot.back());
+            slot.pop_back();
+            break;
+        }
+}
+
+template<typename OpcodeType>
+inline void ClientNetwork<OpcodeType>::idle_tick(IdleWheel &wheel, ConnPool::Worker *worker) {
+    auto due = std::move(wheel.slots[wheel.cur]);
+    wheel.slots[wheel.cur].clear();
+    wheel.cur = (wheel.cur + 1) % IdleWheel::nslot;
+    auto now = worker->get_ec().now();
+    uint64_t timeout = idle_timeout * 1e3;
+    std::vector<ConnPool::conn_t> idle;
+    for (auto &conn: due)
+    {
+        /* closed or moved to another worker meanwhile, just forget it */
+        if (conn->is_terminated() ||
+            conn->worker.load(std::memory_order_relaxed) != worker) continue;
+        conn->idle_slot = -1;
+        if (now - conn->get_last_recv() >= timeout)
+        {
+            SALTICIDAE_LOG_INFO("closing idle client %s",
+                                std::string(*conn).c_str());
+            idle.push_back(conn);
+        }
+        else idle_schedule(wheel, conn, now);
+    }
+    if (idle.empty()) return;
+    nidle_reaped.fetch_add(idle.size(), std::memory_order_relaxed);
+    this->worker_terminate(std::move(idle));
+}
+
 template<typename OpcodeType>
 void ClientNetwork<OpcodeType>::on_dispatcher_setup(const ConnPool::conn_t &_conn) {
     MsgNet::on_dispatcher_setup(_conn);
@@ -1370,15 +3149,183 @@ void ClientNetwork<OpcodeType>::on_dispatcher_setup(const ConnPool::conn_t &_con
     assert(conn->get_mode() == Conn::PASSIVE);
     const auto &addr = conn->get_addr();
     auto cn = conn->get_net();
-    cn->addr2conn.erase(addr);
-    cn->addr2conn.insert(std::make_pair(addr, conn));
+    auto &shard = cn->get_addr_shard(addr);
+    addr_ulock_t _g(shard.lock);
+    shard.addr2conn[addr] = conn;
 }
 
 template<typename OpcodeType>
 void ClientNetwork<OpcodeType>::on_dispatcher_teardown(const ConnPool::conn_t &_conn) {
     MsgNet::on_dispatcher_teardown(_conn);
     auto conn = static_pointer_cast<Conn>(_conn);
-    conn->get_net()->addr2conn.erase(conn->get_addr());
+    auto &shard = conn->get_net()->get_addr_shard(conn->get_addr());
+    addr_ulock_t _g(shard.lock);
+    auto it = shard.addr2conn.find(conn->get_addr());
+    /* the address may have been taken by a newer connection */
+    if (it != shard.addr2conn.end() && it->second == conn)
+        shard.addr2conn.erase(it);
+}
+
+template<typename OpcodeType>
+void ClientNetwork<OpcodeType>::on_worker_stop(ConnPool::Worker &worker) {
+    auto idx = this->get_worker_idx(&worker);
+    shards[idx]->ev_flush.clear();
+    if (idle_timeout > 0)
+    {
+        auto &wheel = *wheels[idx];
+        wheel.ev_tick.clear();
+        for (auto &slot: wheel.slots) slot.clear();
+    }
+    MsgNet::on_worker_stop(worker);
+}
+
+template<typename OpcodeType>
+void ClientNetwork<OpcodeType>::on_worker_teardown(const ConnPool::conn_t &_conn) {
+    auto conn = static_pointer_cast<Conn>(_conn);
+    if (conn->worker.load(std::memory_order_relaxed))
+    {
+        /* drop the subscriptions */
+        auto &shard = get_shard(conn);
+        for (auto &topic: conn->topics)
+        {
+            auto it = shard.topics.find(topic);
+            if (it == shard.topics.end()) continue;
+            auto &subs = it->second;
+            for (size_t i = 0; i < subs.size(); i++)
+                if (subs[i].conn == conn)
+                {
+                    if (subs[i].pending) shard.npending--;
+                    subs[i] = std::move(subs.back());
+                    subs.pop_back();
+                    break;
+                }
+            if (subs.empty()) shard.topics.erase(it);
+        }
+        conn->topics.clear();
+        /* do not keep the connection alive until its slot comes up */
+        if (idle_timeout > 0) idle_unwatch(conn);
+    }
+    MsgNet::on_worker_teardown(_conn);
+}
+
+template<typename OpcodeType>
+inline void ClientNetwork<OpcodeType>::subscribe(
+        const typename MsgNet::conn_t &_conn, const topic_t &topic) {
+    auto conn = static_pointer_cast<Conn>(_conn);
+    this->worker_call(conn, [this, conn, topic](ThreadCall::Handle &) {
+        if (conn->is_terminated()) return;
+        auto &shard = get_shard(conn);
+        auto &ts = conn->topics;
+        if (std::find(ts.begin(), ts.end(), topic) != ts.end()) return;
+        ts.push_back(topic);
+        shard.topics[topic].push_back(Subscriber(conn));
+    });
+}
+
+template<typename OpcodeType>
+inline void ClientNetwork<OpcodeType>::unsubscribe(
+        const typename MsgNet::conn_t &_conn, const topic_t &topic) {
+    auto conn = static_pointer_cast<Conn>(_conn);
+    this->worker_call(conn, [this, conn, topic](ThreadCall::Handle &) {
+        auto &shard = get_shard(conn);
+        auto &ts = conn->topics;
+        auto tit = std::find(ts.begin(), ts.end(), topic);
+        if (tit == ts.end()) return;
+        ts.erase(tit);
+        auto it = shard.topics.find(topic);
+        if (it == shard.topics.end()) return;
+        auto &subs = it->second;
+        for (size_t i = 0; i < subs.size(); i++)
+            if (subs[i].conn == conn)
+            {
+                if (subs[i].pending) shard.npending--;
+                subs[i] = std::move(subs.back());
+                subs.pop_back();
+                break;
+            }
+        if (subs.empty()) shard.topics.erase(it);
+    });
+}
+
+template<typename OpcodeType>
+template<typename MsgType>
+inline void ClientNetwork<OpcodeType>::publish(const MsgType &msg, const topic_t &topic) {
+    _publish(Msg(msg, this->msg_magic), topic);
+}
+
+template<typename OpcodeType>
+inline void ClientNetwork<OpcodeType>::_publish(const Msg &msg, const topic_t &topic) {
+    auto frame = MsgNet::make_frame(msg);
+    auto policy = slow_sub_policy;
+    if (!topic_policy.empty())
+    {
+        auto it = topic_policy.find(topic);
+        if (it != topic_policy.end()) policy = it->second;
+    }
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        auto &shard = *shards[i];
+        this->get_worker(i).get_tcall()->async_call(
+                [this, &shard, topic, frame, policy](ThreadCall::Handle &) {
+            auto it = shard.topics.find(topic);
+            if (it == shard.topics.end()) return;
+            for (auto &sub: it->second)
+            {
+                auto &conn = sub.conn;
+                /* will be dropped by the teardown in the worker */
+                if (conn->is_terminated()) continue;
+                if (max_sub_backlog && policy != SUB_BUFFER &&
+                    conn->get_send_backlog() >= max_sub_backlog)
+                {
+                    if (policy == SUB_DROP)
+                        nsub_dropped.fetch_add(1, std::memory_order_relaxed);
+                    else
+                    {
+                        if (sub.pending)
+                            nsub_conflated.fetch_add(1, std::memory_order_relaxed);
+                        else if (!shard.npending++)
+                        {
+                            if (!shard.ev_flush)
+                                shard.ev_flush = TimerEvent(
+                                    conn->worker.load(std::memory_order_relaxed)->get_ec(),
+                                    [this, &shard](TimerEvent &) {
+                                        flush_conflated(shard);
+                                    });
+                            shard.ev_flush.add(conflate_interval);
+                        }
+                        sub.pending = frame;
+                    }
+                    continue;
+                }
+                if (sub.pending)
+                {
+                    /* superseded by the new message */
+                    sub.pending = nullptr;
+                    shard.npending--;
+                    nsub_conflated.fetch_add(1, std::memory_order_relaxed);
+                }
+                MsgNet::forward_msg(frame, conn);
+            }
+        });
+    }
+}
+
+template<typename OpcodeType>
+inline void ClientNetwork<OpcodeType>::flush_conflated(TopicShard &shard) {
+    for (auto &t: shard.topics)
+    {
+        if (!shard.npending) break;
+        for (auto &sub: t.second)
+        {
+            if (!sub.pending || sub.conn->is_terminated() ||
+                sub.conn->get_send_backlog() >= max_sub_backlog)
+                continue;
+            MsgNet::forward_msg(sub.pending, sub.conn);
+            sub.pending = nullptr;
+            shard.npending--;
+        }
+    }
+    if (shard.npending) shard.ev_flush.add(conflate_interval);
 }
 
 template<typename OpcodeType>
@@ -1390,7 +3337,8 @@ inline int32_t ClientNetwork<OpcodeType>::send_msg_deferred(MsgType &&msg, const
 template<typename OpcodeType>
 inline int32_t ClientNetwork<OpcodeType>::_send_msg_deferred(Msg &&msg, const NetAddr &addr) {
     auto id = this->gen_async_id();
-    this->disp_tcall->async_call(
+    /* spread over the shards like the connections */
+    this->get_worker(std::hash<NetAddr>()(addr) % this->get_ndisp()).get_tcall()->async_call(
             [this, msg=std::move(msg), addr, id](ThreadCall::Handle &) {
         try {
             _send_msg(msg, addr);
@@ -1407,10 +3355,16 @@ inline bool ClientNetwork<OpcodeType>::send_msg(const MsgType &msg, const NetAdd
 
 template<typename OpcodeType>
 inline bool ClientNetwork<OpcodeType>::_send_msg(const Msg &msg, const NetAddr &addr) {
-    auto it = addr2conn.find(addr);
-    if (it == addr2conn.end())
-        throw ClientNetworkError(SALTI_ERROR_CLIENT_NOT_EXIST);
-    return MsgNet::_send_msg(msg, it->second);
+    typename MsgNet::conn_t conn;
+    {
+        auto &shard = get_addr_shard(addr);
+        addr_slock_t _g(shard.lock);
+        auto it = shard.addr2conn.find(addr);
+        if (it == shard.addr2conn.end())
+            throw ClientNetworkError(SALTI_ERROR_CLIENT_NOT_EXIST);
+        conn = it->second;
+    }
+    return MsgNet::_send_msg(msg, conn);
 }
 
 template<typename O, O OPCODE_PING, O _>
@@ -1560,6 +3514,8 @@ void peernetwork_conn_free(const peernetwork_conn_t *self);
 bool peernetwork_send_msg(peernetwork_t *self, const msg_t * msg, const peerid_t *peer);
 int32_t peernetwork_send_msg_deferred_by_move(peernetwork_t *self, msg_t * _moved_msg, const peerid_t *peer);
 int32_t peernetwork_multicast_msg_by_move(peernetwork_t *self, msg_t *_moved_msg, const peerid_array_t *peers);
+int32_t peernetwork_multicast_msg_nearest_by_move(peernetwork_t *self, msg_t *_moved_msg, const peerid_array_t *peers, size_t k);
+double peernetwork_get_peer_rtt(const peernetwork_t *self, const peerid_t *peer, double *rttvar, SalticidaeCError *cerror);
 void peernetwork_listen(peernetwork_t *self, const netaddr_t *listen_addr, SalticidaeCError *err);
 
 typedef void (*peernetwork_peer_callback_t)(const peernetwork_conn_t *, bool connected, void *userdata);
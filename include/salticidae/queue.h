@@ -89,29 +89,70 @@ class FreeList {
 
 const size_t MPMCQ_SIZE = 4096;
 
-template<typename T>
+/** A lock-free queue made of a linked list of blocks, each holding
+ * BlockSize elements. */
+template<typename T, size_t BlockSize = MPMCQ_SIZE>
 class MPMCQueue {
     protected:
     struct Block: public FreeList::Node {
         std::atomic<uint32_t> head;
         cacheline_pad _pad0;
         std::atomic<uint32_t> tail;
-        T elem[MPMCQ_SIZE];
-        std::atomic<bool> avail[MPMCQ_SIZE] = {};
+        T elem[BlockSize];
+        std::atomic<bool> avail[BlockSize] = {};
         std::atomic<Block *> next;
     };
 
     FreeList blks;
+    /** the number of allocated blocks */
+    std::atomic<size_t> nblk;
+    /** the limit of nblk for bounded enqueues */
+    size_t max_nblk;
 
     std::atomic<Block *> head;
     cacheline_pad _pad0;
     std::atomic<Block *> tail;
 
+    /** the tail while the queue is being put into hibernation */
+    static Block *hibernating() { return reinterpret_cast<Block *>(1); }
+
+    Block *new_block(bool unbounded) {
+        FreeList::Node *_nblk;
+        if (blks.pop(_nblk)) return static_cast<Block *>(_nblk);
+        if (nblk.fetch_add(1, std::memory_order_relaxed) >= max_nblk && !unbounded)
+        {
+            nblk.fetch_sub(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return new Block();
+    }
+
     template<typename U>
     bool _enqueue(U &&e, bool unbounded = true) {
         for (;;)
         {
-            auto t = tail.load(std::memory_order_acquire);
+            /* seq_cst: pairs with MPSCQueue::hibernate() */
+            auto t = tail.load(std::memory_order_seq_cst);
+            if (t == nullptr)
+            {
+                /* wake up the hibernated queue with a new block */
+                auto nblk = new_block(true);
+                nblk->head.store(0, std::memory_order_relaxed);
+                nblk->tail.store(0, std::memory_order_relaxed);
+                nblk->next.store(nullptr, std::memory_order_relaxed);
+                nblk->freed.store(false, std::memory_order_relaxed);
+                Block *t2 = nullptr;
+                if (tail.compare_exchange_strong(t2, nblk, std::memory_order_acq_rel))
+                    head.store(nblk, std::memory_order_release);
+                else
+                    blks.push(nblk);
+                continue;
+            }
+            if (t == hibernating())
+            {
+                std::this_thread::yield();
+                continue;
+            }
             auto tcnt = t->refcnt.load(std::memory_order_relaxed);
             if (!tcnt) continue;
             if (!t->refcnt.compare_exchange_weak(tcnt, tcnt + 1, std::memory_order_relaxed))
@@ -122,20 +163,16 @@ class MPMCQueue {
                 continue;
             }
             auto tt = t->tail.load(std::memory_order_relaxed);
-            if (tt >= MPMCQ_SIZE)
+            if (tt >= BlockSize)
             {
                 if (t->next.load(std::memory_order_relaxed) == nullptr)
                 {
-                    FreeList::Node * _nblk;
-                    if (!blks.pop(_nblk))
+                    auto nblk = new_block(unbounded);
+                    if (!nblk)
                     {
-                        if (unbounded) _nblk = new Block();
-                        else {
-                            blks.release_ref(t);
-                            return false;
-                        }
+                        blks.release_ref(t);
+                        return false;
                     }
-                    auto nblk = static_cast<Block *>(_nblk);
                     nblk->head.store(0, std::memory_order_relaxed);
                     nblk->tail.store(0, std::memory_order_relaxed);
                     nblk->next.store(nullptr, std::memory_order_relaxed);
@@ -168,7 +205,7 @@ class MPMCQueue {
     MPMCQueue(const MPMCQueue &) = delete;
     MPMCQueue(MPMCQueue &&) = delete;
 
-    MPMCQueue(): head(new Block()), tail(head.load()) {
+    MPMCQueue(): nblk(1), max_nblk(1), head(new Block()), tail(head.load()) {
         auto h = head.load();
         h->head = h->tail = 0;
         h->next = nullptr;
@@ -183,9 +220,10 @@ class MPMCQueue {
         }
     }
 
+    /** Limit the number of elements for bounded enqueues (the blocks are
+     * allocated on demand). */
     void set_capacity(size_t capacity = 0) {
-        capacity = std::max(capacity / MPMCQ_SIZE, (size_t)1);
-        while (capacity--) blks.push(new Block());
+        max_nblk = std::max(capacity / BlockSize, (size_t)1) + 1;
     }
 
     template<typename U>
@@ -211,7 +249,7 @@ class MPMCQueue {
             auto tt = h->tail.load(std::memory_order_relaxed);
             if (hh >= tt)
             {
-                if (tt < MPMCQ_SIZE) { blks.release_ref(h); return false; }
+                if (tt < BlockSize) { blks.release_ref(h); return false; }
                 auto hnext = h->next.load(std::memory_order_acquire);
                 if (hnext == nullptr) { blks.release_ref(h); return false; }
                 auto h2 = h;
@@ -236,20 +274,92 @@ class MPMCQueue {
     }
 };
 
-template<typename T>
-struct MPSCQueue: public MPMCQueue<T> {
-    using MPMCQueue<T>::MPMCQueue;
+template<typename T, size_t BlockSize = MPMCQ_SIZE>
+struct MPSCQueue: public MPMCQueue<T, BlockSize> {
+    using base_t = MPMCQueue<T, BlockSize>;
+    using Block = typename base_t::Block;
+
+    private:
+    bool hibernatable;
+    /** the number of ongoing enqueues (only counted if hibernatable) */
+    std::atomic<size_t> nenq;
+
+    public:
+    MPSCQueue(): hibernatable(false), nenq(0) {}
+
+    template<typename U>
+    bool enqueue(U &&e, bool unbounded = true) {
+        if (!hibernatable) return this->_enqueue(std::forward<U>(e), unbounded);
+        nenq.fetch_add(1, std::memory_order_seq_cst);
+        bool ret = this->_enqueue(std::forward<U>(e), unbounded);
+        nenq.fetch_sub(1, std::memory_order_release);
+        return ret;
+    }
+
+    template<typename U>
+    bool try_enqueue(U &&e) { return enqueue(std::forward<U>(e), false); }
+
     /* the same thread is calling the following functions */
 
+    /** Allow hibernate() to be used, must be called before the queue is
+     * shared with the producers. The queue starts in hibernation. */
+    void enable_hibernation() {
+        hibernatable = true;
+        hibernate();
+    }
+
+    /** Release all blocks if the queue is empty and no enqueue is ongoing,
+     * so an idle queue takes no memory. The next enqueue allocates a new
+     * block. Return true if the queue is hibernated. */
+    bool hibernate() {
+        if (!hibernatable) return false;
+        auto h = this->head.load(std::memory_order_relaxed);
+        if (h == nullptr) return true;
+        auto empty = [h]() {
+            return h->head.load(std::memory_order_relaxed) ==
+                    h->tail.load(std::memory_order_acquire) &&
+                    h->next.load(std::memory_order_acquire) == nullptr;
+        };
+        if (!empty()) return false;
+        /* stop the producers from entering the last block, then check if
+         * any of them has already entered */
+        Block *t = h;
+        auto hib = base_t::hibernating();
+        if (!this->tail.compare_exchange_strong(t, hib, std::memory_order_seq_cst))
+            return false;
+        if (nenq.load(std::memory_order_seq_cst) || !empty())
+        {
+            /* a producer may have appended a new block meanwhile */
+            this->tail.compare_exchange_strong(hib, h, std::memory_order_seq_cst);
+            return false;
+        }
+        /* no producer is left, clear the head first because the next
+         * enqueue sets it once the tail is cleared */
+        this->head.store(nullptr, std::memory_order_relaxed);
+        this->tail.store(nullptr, std::memory_order_seq_cst);
+        delete h;
+        size_t n = 1;
+        for (FreeList::Node *ptr; this->blks.pop(ptr); n++) delete ptr;
+        this->nblk.fetch_sub(n, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool is_hibernated() const {
+        return this->head.load(std::memory_order_relaxed) == nullptr;
+    }
+
     bool try_dequeue(T &e) {
         for (;;)
         {
-            auto h = this->head.load(std::memory_order_relaxed);
+            auto h = this->head.load(std::memory_order_acquire);
+            /* hibernated, or the block of the waking enqueue is not yet
+             * published */
+            if (h == nullptr) return false;
             auto hh = h->head.load(std::memory_order_relaxed);
             auto tt = h->tail.load(std::memory_order_relaxed);
             if (hh >= tt)
             {
-                if (tt < MPMCQ_SIZE) return false;
+                if (tt < BlockSize) return false;
                 auto hnext = h->next.load(std::memory_order_relaxed);
                 if (hnext == nullptr) return false;
                 this->head.store(hnext, std::memory_order_relaxed);
@@ -269,14 +379,14 @@ struct MPSCQueue: public MPMCQueue<T> {
     template<typename U>
     bool rewind(U &&e) {
         auto h = this->head.load(std::memory_order_relaxed);
+        /* rewind only puts back what has been dequeued */
+        assert(h != nullptr);
         auto hh = h->head.load(std::memory_order_relaxed);
         if (!hh)
         {
-            FreeList::Node * _nblk;
-            if (!this->blks.pop(_nblk)) _nblk = new typename MPMCQueue<T>::Block();
-            auto nblk = static_cast<typename MPMCQueue<T>::Block *>(_nblk);
-            nblk->head.store(MPMCQ_SIZE, std::memory_order_relaxed);
-            nblk->tail.store(MPMCQ_SIZE, std::memory_order_relaxed);
+            auto nblk = this->new_block(true);
+            nblk->head.store(BlockSize, std::memory_order_relaxed);
+            nblk->tail.store(BlockSize, std::memory_order_relaxed);
             nblk->next.store(h, std::memory_order_relaxed);
             this->head.store(nblk, std::memory_order_relaxed);
         }
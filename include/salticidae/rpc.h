@@ -0,0 +1,516 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SALTICIDAE_RPC_H
+#define _SALTICIDAE_RPC_H
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+namespace salticidae {
+
+/** Request/response layer on top of a MsgNetwork (or ClientNetwork,
+ * PeerNetwork).
+ *
+ * A request is an ordinary message whose payload is prefixed by a 64-bit
+ * correlation id (little endian), and the response carries the same id, so
+ * any number of requests can be in flight on one connection. Responses are
+ * dispatched to the callback given to call(), and the timeouts of all
+ * pending requests share one TimerWheel. With a PeerNetwork, quorum_call()
+ * sends one request to a group of peers and completes once k of them have
+ * responded. Except for call_future(), all
+ * methods should be invoked by the thread running the network's user event
+ * loop. */
+template<typename NetType>
+class RPCEndpoint {
+    public:
+    using Msg = typename NetType::Msg;
+    using opcode_t = typename Msg::opcode_t;
+    using conn_t = typename NetType::conn_t;
+    using rpc_id_t = uint64_t;
+
+    enum Status {
+        RPC_OK,
+        RPC_TIMEOUT,
+        RPC_CANCELLED,
+        /** too many peers of a quorum call are gone to reach the quorum */
+        RPC_UNREACHABLE,
+        /** the response cannot be parsed (the connection is terminated) */
+        RPC_MALFORMED,
+        /** the connection of the request is gone before the response */
+        RPC_DISCONNECTED
+    };
+
+    /** The request (or response) message prefixed with the correlation id. */
+    template<typename MsgType>
+    struct Envelope {
+        static const opcode_t opcode;
+        DataStream serialized;
+        Envelope(const MsgType &msg, rpc_id_t id) {
+            auto &s = msg.serialized;
+            serialized << htole(id);
+            serialized.put_data(s.data(), s.data() + s.size());
+        }
+    };
+
+    /** Sends the response back to where the request came from, it can be
+     * kept and invoked later. */
+    template<typename RespType>
+    class Reply {
+        NetType *net;
+        conn_t conn;
+        rpc_id_t id;
+
+        public:
+        Reply(NetType *net, const conn_t &conn, rpc_id_t id):
+            net(net), conn(conn), id(id) {}
+
+        bool operator()(const RespType &resp) const {
+            return net->send_msg(Envelope<RespType>(resp, id), conn);
+        }
+
+        const conn_t &get_conn() const { return conn; }
+    };
+
+    private:
+    using MsgNet = MsgNetwork<opcode_t>;
+    /** the response payload is nullptr unless the status is RPC_OK, return
+     * false if it cannot be parsed */
+    using resp_callback_t = std::function<bool(Status, DataStream *)>;
+    using timer_t = typename TimerWheel<rpc_id_t>::handle_t;
+
+    /** A pending quorum call. The slots of targets/conns/state are
+     * allocated once by quorum_call(), so that collecting a response only
+     * appends to the vector reserved for k responses. */
+    struct QuorumBase {
+        enum TargetState: uint8_t {
+            WAITING,
+            RESPONDED,
+            LOST
+        };
+        std::vector<PeerId> targets;
+        std::vector<conn_t> conns;
+        std::vector<uint8_t> state;
+        size_t k;
+        size_t nresp;
+        size_t nlost;
+        bool timed;
+        timer_t timer;
+        QuorumBase(std::vector<PeerId> &&targets, size_t k):
+            targets(std::move(targets)),
+            state(this->targets.size(), WAITING),
+            k(k), nresp(0), nlost(0), timed(false) {
+            conns.reserve(this->targets.size());
+        }
+        virtual ~QuorumBase() = default;
+        bool reachable() const { return targets.size() - nlost >= k; }
+        /** throw if the response cannot be parsed */
+        virtual void add_resp(size_t idx, DataStream &s) = 0;
+        virtual void complete(Status status) = 0;
+    };
+
+    template<typename RespType, typename Func>
+    struct Quorum: public QuorumBase {
+        std::vector<RespType> resps;
+        std::vector<size_t> from;
+        Func callback;
+        template<typename F>
+        Quorum(std::vector<PeerId> &&targets, size_t k, F &&callback):
+                QuorumBase(std::move(targets), k),
+                callback(std::forward<F>(callback)) {
+            resps.reserve(k);
+            from.reserve(k);
+        }
+        void add_resp(size_t idx, DataStream &s) override {
+            resps.emplace_back(std::move(s));
+            from.push_back(idx);
+        }
+        void complete(Status status) override {
+            callback(status, resps, from);
+        }
+    };
+
+    struct Pending {
+        resp_callback_t callback;
+        /** the connection the request is sent through (null if unknown) */
+        conn_t conn;
+        bool timed;
+        timer_t timer;
+    };
+
+    NetType &net;
+    const double default_timeout;
+    rpc_id_t next_id;
+    std::unordered_map<rpc_id_t, Pending> pending;
+    /** the ids in pending by the connection they are sent through */
+    std::unordered_map<const ConnPool::Conn *, std::unordered_set<rpc_id_t>> conn_pending;
+    size_t conn_watcher;
+    std::unordered_map<rpc_id_t, BoxObj<QuorumBase>> quorums;
+    std::unordered_set<opcode_t> resp_opcodes;
+    TimerWheel<rpc_id_t> timeouts;
+    ThreadCall tcall;
+
+    static bool parse_id(DataStream &s, rpc_id_t &id) {
+        if (s.size() < sizeof(rpc_id_t)) return false;
+        s >> id;
+        id = letoh(id);
+        return true;
+    }
+
+    static conn_t get_dest_conn(const conn_t &conn) { return conn; }
+    conn_t get_dest_conn(const PeerId &pid) {
+        try {
+            return net.get_peer_conn_nowait(pid);
+        } catch (SalticidaeError &) { return nullptr; }
+    }
+    /* the other destinations are not tracked */
+    template<typename Dest>
+    static conn_t get_dest_conn(const Dest &) { return nullptr; }
+
+    /** Return false if the response cannot be parsed. */
+    bool finish(rpc_id_t id, Status status, DataStream *s,
+                const typename MsgNet::Conn *conn = nullptr) {
+        auto it = pending.find(id);
+        if (it == pending.end())
+        {
+            if (!quorums.empty())
+                return finish_quorum(id, status, s, conn);
+            return true; /* completed or cancelled */
+        }
+        auto p = std::move(it->second);
+        pending.erase(it);
+        if (p.timed && status != RPC_TIMEOUT) timeouts.cancel(p.timer);
+        if (p.conn)
+        {
+            auto cit = conn_pending.find(p.conn.get());
+            if (cit != conn_pending.end())
+            {
+                cit->second.erase(id);
+                if (cit->second.empty()) conn_pending.erase(cit);
+            }
+        }
+        return p.callback(status, s);
+    }
+
+    /** Fail the requests sent through the connection that is gone, and
+     * count it as lost by the quorum calls. */
+    void on_conn_down(const ConnPool::conn_t &conn) {
+        auto it = conn_pending.find(conn.get());
+        if (it != conn_pending.end())
+        {
+            auto ids = std::move(it->second);
+            conn_pending.erase(it);
+            for (auto id: ids)
+                finish(id, RPC_DISCONNECTED, nullptr);
+        }
+        if (quorums.empty()) return;
+        const ConnPool::Conn *c = conn.get();
+        lose_targets([c](const QuorumBase &q, size_t i) {
+            return q.conns[i].get() == c;
+        });
+    }
+
+    bool finish_quorum(rpc_id_t id, Status status, DataStream *s,
+                        const typename MsgNet::Conn *conn) {
+        auto it = quorums.find(id);
+        if (it == quorums.end()) return true;
+        auto &q = *it->second;
+        bool parsed = true;
+        if (status == RPC_OK)
+        {
+            /* only count the first response from each target, on the
+             * connection the request was sent through */
+            size_t i = 0;
+            for (; i < q.conns.size(); i++)
+                if (q.state[i] == QuorumBase::WAITING &&
+                    q.conns[i].get() == conn) break;
+            if (i == q.conns.size()) return true;
+            try {
+                q.add_resp(i, *s);
+                q.state[i] = QuorumBase::RESPONDED;
+                if (++q.nresp < q.k) return true;
+            } catch (std::exception &e) {
+                SALTICIDAE_LOG_WARN("malformed rpc response: %s", e.what());
+                /* the target is as good as gone */
+                q.state[i] = QuorumBase::LOST;
+                q.nlost++;
+                if (q.reachable()) return false;
+                status = RPC_UNREACHABLE;
+                parsed = false;
+            }
+        }
+        /* the stragglers are dropped together with the entry, their
+         * responses will be ignored */
+        auto qb = std::move(it->second);
+        quorums.erase(it);
+        if (qb->timed && status != RPC_TIMEOUT) timeouts.cancel(qb->timer);
+        qb->complete(status);
+        return parsed;
+    }
+
+    /** Count the targets still waiting for which lost(q, i) holds as lost,
+     * and complete the quorum calls that can no longer be satisfied. */
+    template<typename Pred>
+    void lose_targets(Pred &&lost) {
+        std::vector<rpc_id_t> failed;
+        for (auto &p: quorums)
+        {
+            auto &q = *p.second;
+            for (size_t i = 0; i < q.targets.size(); i++)
+                if (q.state[i] == QuorumBase::WAITING && lost(q, i))
+                {
+                    q.state[i] = QuorumBase::LOST;
+                    q.nlost++;
+                }
+            if (!q.reachable()) failed.push_back(p.first);
+        }
+        for (auto id: failed)
+            finish_quorum(id, RPC_UNREACHABLE, nullptr, nullptr);
+    }
+
+    public:
+    RPCEndpoint(NetType &net, const EventContext &ec,
+                double default_timeout = 10, double tick = 0.01):
+        net(net), default_timeout(default_timeout), next_id(0),
+        timeouts(ec, [this](rpc_id_t &id) {
+            finish(id, RPC_TIMEOUT, nullptr);
+        }, tick),
+        tcall(ec) {
+        conn_watcher = net.add_conn_watcher(
+            [this](const ConnPool::conn_t &conn, bool connected) {
+                if (!connected) on_conn_down(conn);
+            });
+    }
+
+    ~RPCEndpoint() { net.del_conn_watcher(conn_watcher); }
+
+    RPCEndpoint(const RPCEndpoint &) = delete;
+    RPCEndpoint(RPCEndpoint &&) = delete;
+
+    /** Serve the requests of type ReqType. The handler is invoked as
+     * handler(ReqType &&req, const conn_t &conn, Reply<RespType> &&reply). */
+    template<typename ReqType, typename RespType, typename Func>
+    void reg_method(Func &&handler) {
+        net.set_handler(ReqType::opcode,
+            [this, handler=std::forward<Func>(handler)](
+                    const Msg &msg, const typename MsgNet::conn_t &_conn) {
+            auto conn = static_pointer_cast<typename NetType::Conn>(_conn);
+            try {
+                rpc_id_t id;
+                DataStream s = msg.get_payload();
+                if (!parse_id(s, id))
+                    throw SalticidaeError("missing rpc id");
+                handler(ReqType(std::move(s)), conn,
+                        Reply<RespType>(&net, conn, id));
+            } catch (std::exception &e) {
+                SALTICIDAE_LOG_WARN(
+                    "error while handling rpc: %s, terminating the connection",
+                    e.what());
+                net.terminate(conn);
+            }
+        });
+    }
+
+    /** Accept the responses of type RespType (also done implicitly by
+     * call()). */
+    template<typename RespType>
+    void reg_response() {
+        if (!resp_opcodes.insert(RespType::opcode).second) return;
+        net.set_handler(RespType::opcode,
+            [this](const Msg &msg, const typename MsgNet::conn_t &conn) {
+            rpc_id_t id;
+            DataStream s = msg.get_payload();
+            if (!parse_id(s, id))
+            {
+                SALTICIDAE_LOG_WARN("rpc response without id");
+                return;
+            }
+            if (!finish(id, RPC_OK, &s, conn.get()))
+                net.terminate(conn);
+        });
+    }
+
+    /** Send the request to dest (a conn_t, or a PeerId for PeerNetwork) and
+     * invoke callback(Status status, RespType *resp) once the response
+     * arrives (resp is nullptr if status is not RPC_OK, and status is
+     * RPC_MALFORMED if the response cannot be parsed). A negative timeout
+     * means the default one, and 0 means no timeout. The request fails with
+     * RPC_DISCONNECTED once its connection is gone (the destinations other
+     * than a conn_t or PeerId are not tracked). Return the id of the
+     * request, or 0 if it cannot be sent. */
+    template<typename RespType, typename ReqType, typename Dest, typename Func>
+    rpc_id_t call(const ReqType &req, const Dest &dest, Func &&callback,
+                    double timeout = -1) {
+        reg_response<RespType>();
+        rpc_id_t id = ++next_id;
+        auto conn = get_dest_conn(dest);
+        if (!(conn ? net.send_msg(Envelope<ReqType>(req, id), conn) :
+                    net.send_msg(Envelope<ReqType>(req, id), dest)))
+            return 0;
+        Pending p;
+        p.callback =
+            [callback=std::forward<Func>(callback)](Status status, DataStream *s) {
+                if (!s)
+                {
+                    callback(status, nullptr);
+                    return true;
+                }
+                bool parsed = false;
+                try {
+                    RespType resp(std::move(*s));
+                    parsed = true;
+                    callback(status, &resp);
+                } catch (std::exception &e) {
+                    /* only the errors of the parsing are handled here */
+                    if (parsed) throw;
+                    SALTICIDAE_LOG_WARN("malformed rpc response: %s", e.what());
+                    callback(RPC_MALFORMED, nullptr);
+                    return false;
+                }
+                return true;
+            };
+        p.conn = conn;
+        if (timeout < 0) timeout = default_timeout;
+        p.timed = timeout > 0;
+        if (p.timed) p.timer = timeouts.add(timeout, id);
+        if (conn) conn_pending[conn.get()].insert(id);
+        pending.insert(std::make_pair(id, std::move(p)));
+        return id;
+    }
+
+    /** Same as call(), but can be invoked by any other thread. The future
+     * throws SalticidaeError if the request times out, is cancelled, loses
+     * its connection or gets a malformed response. */
+    template<typename RespType, typename ReqType, typename Dest>
+    std::future<RespType> call_future(const ReqType &req, const Dest &dest,
+                                        double timeout = -1) {
+        auto promise = std::make_shared<std::promise<RespType>>();
+        auto ret = promise->get_future();
+        tcall.async_call([this, req, dest, timeout, promise](ThreadCall::Handle &) {
+            try {
+                auto id = call<RespType>(req, dest,
+                    [promise](Status status, RespType *resp) {
+                        if (resp)
+                            promise->set_value(std::move(*resp));
+                        else
+                            promise->set_exception(std::make_exception_ptr(
+                                SalticidaeError(status == RPC_TIMEOUT ?
+                                    SALTI_ERROR_RPC_TIMEOUT :
+                                    status == RPC_MALFORMED ?
+                                    SALTI_ERROR_RPC_MALFORMED :
+                                    status == RPC_DISCONNECTED ?
+                                    SALTI_ERROR_RPC_DISCONNECTED :
+                                    SALTI_ERROR_RPC_CANCELLED)));
+                    }, timeout);
+                if (!id) throw SalticidaeError(SALTI_ERROR_CONN_NOT_READY);
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return ret;
+    }
+
+    /** Send the same request to each of the peers (PeerNetwork only) and
+     * invoke callback(Status status, std::vector<RespType> &resps,
+     * std::vector<size_t> &from) once k of them have responded, where from[i]
+     * is the index in peers of the sender of resps[i]. The request is
+     * framed once and the frame is shared by all the connections, and each
+     * response is parsed from the payload moved out of its message. If the
+     * call times out, is cancelled or can no longer reach k (a peer is lost
+     * once the connection the request went through is gone, or its
+     * response cannot be parsed, in which case the connection is
+     * terminated), the callback gets the responses collected so far.
+     * Return the id of the call. */
+    template<typename RespType, typename ReqType, typename Func>
+    rpc_id_t quorum_call(const ReqType &req, std::vector<PeerId> peers,
+                        size_t k, Func &&callback, double timeout = -1) {
+        reg_response<RespType>();
+        rpc_id_t id = ++next_id;
+        BoxObj<QuorumBase> qb = new Quorum<RespType, typename std::decay<Func>::type>(
+                std::move(peers), k, std::forward<Func>(callback));
+        auto &q = *qb;
+        auto frame = MsgNet::make_frame(
+                Msg(Envelope<ReqType>(req, id), net.get_msg_magic()));
+        for (size_t i = 0; i < q.targets.size(); i++)
+        {
+            conn_t conn;
+            try {
+                conn = net.get_peer_conn_nowait(q.targets[i]);
+            } catch (SalticidaeError &) {}
+            if (!conn || !static_cast<MsgNet &>(net).forward_msg(frame, conn))
+            {
+                q.state[i] = QuorumBase::LOST;
+                q.nlost++;
+            }
+            q.conns.push_back(std::move(conn));
+        }
+        if (!q.reachable())
+        {
+            qb->complete(RPC_UNREACHABLE);
+            return id;
+        }
+        if (k == 0)
+        {
+            qb->complete(RPC_OK);
+            return id;
+        }
+        if (timeout < 0) timeout = default_timeout;
+        q.timed = timeout > 0;
+        if (q.timed) q.timer = timeouts.add(timeout, id);
+        quorums.insert(std::make_pair(id, std::move(qb)));
+        return id;
+    }
+
+    /** Count the peer as lost by the quorum calls regardless of its
+     * connection (the connections that go down are noticed without it), so
+     * those that can no longer be satisfied complete with RPC_UNREACHABLE
+     * without waiting for their timeouts. */
+    void on_peer_lost(const PeerId &pid) {
+        lose_targets([&pid](const QuorumBase &q, size_t i) {
+            return q.targets[i] == pid;
+        });
+    }
+
+    /** Stop waiting for the response, the callback is invoked with
+     * RPC_CANCELLED. */
+    void cancel(rpc_id_t id) { finish(id, RPC_CANCELLED, nullptr); }
+
+    size_t get_npending() const { return pending.size() + quorums.size(); }
+};
+
+template<typename NetType>
+template<typename MsgType>
+const typename RPCEndpoint<NetType>::opcode_t
+RPCEndpoint<NetType>::Envelope<MsgType>::opcode = MsgType::opcode;
+
+}
+
+#endif
@@ -0,0 +1,536 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SALTICIDAE_SIM_H
+#define _SALTICIDAE_SIM_H
+
+#include <cstdint>
+#include <csignal>
+#include <functional>
+#include <queue>
+#include <random>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "salticidae/type.h"
+#include "salticidae/util.h"
+#include "salticidae/event.h"
+#include "salticidae/conn.h"
+
+namespace salticidae {
+
+/** Discrete-event simulator for running many networks (ConnPool and the
+ * classes built on it, e.g. PeerNetwork) in the calling thread. The
+ * networks run unchanged, in the single-threaded mode, on the EventContext
+ * of the simulator, whose timers follow a virtual clock (and so does
+ * TokenBucket::now()). Their connections are socket pairs handed out in
+ * place of TCP sockets, and the bytes written to them are carried to the
+ * other end through simulated links with the configured latency,
+ * bandwidth and loss.
+ *
+ * Everything but the handshake nonces of PeerNetwork (drawn from OpenSSL)
+ * follows the seed, so which side wins a connection race may differ from
+ * run to run. The process ignores SIGPIPE while a simulator exists.
+ *
+ * Each simulated connection takes four fds. When they run out, run_until()
+ * throws SalticidaeError (SALTI_ERROR_FD). */
+class SimContext: public VirtualClock {
+    public:
+    using callback_t = std::function<void()>;
+
+    struct LinkModel {
+        double latency;     /** one-way propagation delay (sec) */
+        double jitter;      /** extra delay drawn uniformly from [0, jitter) */
+        double bandwidth;   /** bytes per second (0 for unlimited) */
+        double loss;        /** chance that a chunk has to be retransmitted */
+        double rto;         /** delay added by each retransmission */
+
+        LinkModel(double latency = 0.01, double jitter = 0,
+                double bandwidth = 0, double loss = 0, double rto = 0.2):
+            latency(latency), jitter(jitter),
+            bandwidth(bandwidth), loss(loss), rto(rto) {}
+    };
+
+    private:
+    using conn_id_t = uint64_t;
+
+    struct Event {
+        double t;
+        uint64_t seq;
+        timer_id_t id;
+        bool operator>(const Event &other) const {
+            return t > other.t || (t == other.t && seq > other.seq);
+        }
+    };
+
+    struct Link {
+        LinkModel model;
+        double busy_until;      /** when the last chunk leaves the sender */
+        double last_arrival;    /** chunks on a link are delivered in order */
+        bool down;
+        /** the transmissions held back while the link is down */
+        std::vector<callback_t> held;
+        Link(const LinkModel &model):
+            model(model), busy_until(0), last_arrival(0), down(false) {}
+    };
+
+    /** A simulated TCP connection: each network holds one end of a socket
+     * pair, the simulator holds the other end and relays the bytes. */
+    struct Conn {
+        NetAddr addr[2];    /** 0: active side, 1: passive side */
+        int fd[2];          /** the ends of the simulator (-1 if closed) */
+        FdEvent ev[2];
+        bytearray_t out[2]; /** bytes yet to be written to fd[i] */
+        size_t out_off[2];
+        bool fin[2];        /** close fd[i] once out[i] is written */
+        bool syn;           /** the connection request is in flight */
+
+        Conn(const NetAddr &src, const NetAddr &dst):
+                addr{src, dst}, fd{-1, -1}, out_off{0, 0},
+                fin{false, false}, syn(true) {}
+        ~Conn() {
+            for (int i = 0; i < 2; i++)
+            {
+                ev[i].clear();
+                if (fd[i] != -1) ::close(fd[i]);
+            }
+        }
+    };
+
+    class Endpoint: public ConnPool::Transport {
+        friend SimContext;
+        SimContext &sim;
+        const NetAddr addr;
+        int listen_fd;
+        /** accepted by the simulator, yet to be taken by the network */
+        std::deque<std::pair<int, NetAddr>> backlog;
+
+        void push(int fd, const NetAddr &remote) {
+            uint64_t one = 1;
+            backlog.push_back(std::make_pair(fd, remote));
+            if (write(listen_fd, &one, 8) != 8)
+                throw SalticidaeError(SALTI_ERROR_FD);
+        }
+
+        public:
+        Endpoint(SimContext &sim, const NetAddr &addr):
+            sim(sim), addr(addr), listen_fd(-1) {}
+        ~Endpoint() {
+            for (auto &e: backlog) ::close(e.first);
+            if (listen_fd != -1) ::close(listen_fd);
+        }
+
+        int listen(const NetAddr &) override {
+            if (listen_fd != -1)
+            {
+                errno = EADDRINUSE;
+                return -1;
+            }
+            /* readable while the backlog is not empty */
+            return listen_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+        }
+
+        int accept(int, NetAddr &remote) override {
+            uint64_t x;
+            if (read(listen_fd, &x, 8) != 8) return -1;
+            auto fd = backlog.front().first;
+            remote = backlog.front().second;
+            backlog.pop_front();
+            return fd;
+        }
+
+        int connect(const NetAddr &dst) override { return sim.connect(addr, dst); }
+
+        void close(int fd) override {
+            if (fd == listen_fd)
+            {
+                /* the connections not taken are reset */
+                for (auto &e: backlog) ::close(e.first);
+                backlog.clear();
+                listen_fd = -1;
+            }
+            ::close(fd);
+        }
+    };
+
+    EventContext ec;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    std::unordered_map<timer_id_t, callback_t> callbacks;
+    std::unordered_map<NetAddr, BoxObj<Endpoint>> endpoints;
+    std::unordered_map<NetAddr, std::unordered_map<NetAddr, Link>> links;
+    std::unordered_map<conn_id_t, BoxObj<Conn>> conns;
+    LinkModel default_model;
+    double connect_timeout;
+    double _now;
+    uint64_t seq;
+    timer_id_t timer_cnt;
+    conn_id_t conn_cnt;
+    size_t nwatch;
+    size_t nevents;
+    size_t nframes;
+    size_t nbytes;
+    /** set when the simulator ran out of fds */
+    int fd_errno;
+    std::mt19937_64 rng;
+
+    inline Link &get_link(const NetAddr &src, const NetAddr &dst);
+    double delay(Link &link) {
+        auto &m = link.model;
+        double d = m.latency;
+        if (m.jitter > 0) d += rand_uniform() * m.jitter;
+        return d;
+    }
+
+    inline int connect(const NetAddr &src, const NetAddr &dst);
+    inline void arrive(conn_id_t id);
+    inline void transmit(conn_id_t id, int side, bytearray_t &&data);
+    inline void deliver(conn_id_t id, int side, bytearray_t &&data);
+    inline void on_event(conn_id_t id, int side, int events);
+    inline void flush(conn_id_t id, int side);
+    inline void watch(Conn &c, int side);
+    inline void close_end(conn_id_t id, int side);
+
+    void check_fds() {
+        if (fd_errno)
+            throw SalticidaeError(SALTI_ERROR_FD, fd_errno);
+    }
+
+    /** Run the networks until none of their sockets has anything to do. */
+    void settle() {
+        auto loop = ec.get();
+        struct pollfd pfd;
+        pfd.fd = uv_backend_fd(loop);
+        pfd.events = POLLIN;
+        size_t nwatch0;
+        do {
+            /* the fds watched in a pass are only polled in the next */
+            nwatch0 = nwatch;
+            uv_run(loop, UV_RUN_NOWAIT);
+            check_fds();
+        } while (nwatch != nwatch0 || poll(&pfd, 1, 0) > 0);
+    }
+
+    public:
+    SimContext(uint64_t seed = 0):
+            connect_timeout(3), _now(0), seq(0), timer_cnt(0), conn_cnt(0),
+            nwatch(0), nevents(0), nframes(0), nbytes(0), fd_errno(0), rng(seed) {
+        ec.set_clock(this);
+        TokenBucket::set_clock(this);
+        /* for the retry timeouts (see gen_rand_timeout()) */
+        srand(seed);
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    ~SimContext() {
+        conns.clear();
+        endpoints.clear();
+        fd_errno = 0;
+        settle();
+        TokenBucket::set_clock(nullptr);
+        ec.set_clock(nullptr);
+    }
+
+    SimContext(const SimContext &) = delete;
+    SimContext(SimContext &&) = delete;
+
+    /** The context to create the networks with. */
+    const EventContext &get_ec() const { return ec; }
+
+    /** Set up `config` for a network at `addr`: it runs in the
+     * single-threaded mode and connects through the simulator. The network
+     * must be destroyed before the simulator. */
+    void add_node(ConnPool::Config &config, const NetAddr &addr) {
+        auto it = endpoints.find(addr);
+        if (it == endpoints.end())
+            it = endpoints.insert(std::make_pair(addr,
+                    BoxObj<Endpoint>(new Endpoint(*this, addr)))).first;
+        config.single_thread(true);
+        config.transport(it->second.get());
+    }
+
+    double now() const override { return _now; }
+    size_t get_nevents() const { return nevents; }
+    size_t get_nframes() const { return nframes; }
+    size_t get_nbytes() const { return nbytes; }
+
+    double rand_uniform() {
+        return std::uniform_real_distribution<double>(0, 1)(rng);
+    }
+    uint32_t rand_u32() { return (uint32_t)rng(); }
+
+    /** Model used by links without an explicit setting. */
+    void set_default_link_model(const LinkModel &model) { default_model = model; }
+    /** Set the model of the directed link from `src` to `dst`. */
+    void set_link_model(const NetAddr &src, const NetAddr &dst,
+                        const LinkModel &model) {
+        get_link(src, dst).model = model;
+    }
+    /** Partition (or heal) both directions between two nodes: the bytes
+     * sent through a down link are held back until it heals (as TCP keeps
+     * retransmitting them) and new connections are reset after the connect
+     * timeout. */
+    void set_link_down(const NetAddr &a, const NetAddr &b, bool down) {
+        for (auto *link: {&get_link(a, b), &get_link(b, a)})
+        {
+            link->down = down;
+            if (down) continue;
+            auto held = std::move(link->held);
+            link->held.clear();
+            for (auto &cb: held) cb();
+        }
+    }
+    void set_connect_timeout(double t) { connect_timeout = t; }
+
+    timer_id_t add_timer(double delay, callback_t cb) override {
+        auto id = ++timer_cnt;
+        callbacks.insert(std::make_pair(id, std::move(cb)));
+        events.push(Event{_now + std::max(delay, 0.0), seq++, id});
+        return id;
+    }
+
+    void del_timer(timer_id_t id) override { callbacks.erase(id); }
+
+    void on_fd_watch() override { nwatch++; }
+
+    /** Run the events scheduled no later than `t` and advance the clock to
+     * `t`. */
+    void run_until(double t) {
+        settle();
+        while (!events.empty() && events.top().t <= t)
+        {
+            auto ev = events.top();
+            events.pop();
+            auto it = callbacks.find(ev.id);
+            if (it == callbacks.end()) continue;
+            auto cb = std::move(it->second);
+            callbacks.erase(it);
+            _now = ev.t;
+            nevents++;
+            cb();
+            settle();
+        }
+        _now = std::max(_now, t);
+    }
+
+    /** Run until no event is left. */
+    void run() {
+        while (!events.empty()) run_until(events.top().t);
+    }
+};
+
+SimContext::Link &SimContext::get_link(const NetAddr &src, const NetAddr &dst) {
+    auto &m = links[src];
+    auto it = m.find(dst);
+    if (it == m.end())
+        it = m.insert(std::make_pair(dst, Link(default_model))).first;
+    return it->second;
+}
+
+int SimContext::connect(const NetAddr &src, const NetAddr &dst) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+        fd_errno = errno;
+        return -1;
+    }
+    auto id = ++conn_cnt;
+    auto c = new Conn(src, dst);
+    conns.insert(std::make_pair(id, BoxObj<Conn>(c)));
+    c->fd[0] = fds[1];
+    c->ev[0] = FdEvent(ec, fds[1], [this, id](int, int events) {
+        on_event(id, 0, events);
+    });
+    watch(*c, 0);
+    auto &link = get_link(src, dst);
+    if (link.down)
+        add_timer(connect_timeout, [this, id]() { close_end(id, 0); });
+    else
+    {
+        /* the data that follows is delivered after the request */
+        double t = std::max(_now + delay(link), link.last_arrival);
+        link.last_arrival = t;
+        add_timer(t - _now, [this, id]() { arrive(id); });
+    }
+    return fds[0];
+}
+
+void SimContext::arrive(conn_id_t id) {
+    auto it = conns.find(id);
+    if (it == conns.end()) return;
+    auto &c = *it->second;
+    c.syn = false;
+    auto eit = endpoints.find(c.addr[1]);
+    int fds[2];
+    if (eit != endpoints.end() && eit->second->listen_fd != -1 &&
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+        fd_errno = errno;
+    if (eit == endpoints.end() || eit->second->listen_fd == -1 || fd_errno)
+    {
+        /* connection refused */
+        add_timer(delay(get_link(c.addr[1], c.addr[0])),
+                [this, id]() { close_end(id, 0); });
+        return;
+    }
+    c.fd[1] = fds[1];
+    c.ev[1] = FdEvent(ec, fds[1], [this, id](int, int events) {
+        on_event(id, 1, events);
+    });
+    watch(c, 1);
+    /* seen from an ephemeral port, as with TCP */
+    eit->second->push(fds[0], NetAddr(c.addr[0].ip, htons(32768 + id % 28232)));
+}
+
+void SimContext::transmit(conn_id_t id, int side, bytearray_t &&data) {
+    auto it = conns.find(id);
+    if (it == conns.end()) return;
+    auto &c = *it->second;
+    auto &link = get_link(c.addr[side], c.addr[side ^ 1]);
+    if (link.down)
+    {
+        link.held.push_back([this, id, side, data]() mutable {
+            transmit(id, side, std::move(data));
+        });
+        return;
+    }
+    auto &m = link.model;
+    double t = std::max(_now, link.busy_until);
+    if (m.bandwidth > 0) t += data.size() / m.bandwidth;
+    link.busy_until = t;
+    t += delay(link);
+    while (m.loss > 0 && rand_uniform() < m.loss) t += m.rto;
+    t = std::max(t, link.last_arrival);
+    link.last_arrival = t;
+    if (!data.empty())
+    {
+        nframes++;
+        nbytes += data.size();
+    }
+    add_timer(t - _now, [this, id, side, data]() mutable {
+        deliver(id, side ^ 1, std::move(data));
+    });
+}
+
+/* empty data stands for the end of the stream */
+void SimContext::deliver(conn_id_t id, int side, bytearray_t &&data) {
+    auto it = conns.find(id);
+    if (it == conns.end()) return;
+    auto &c = *it->second;
+    if (c.fd[side] == -1) return;
+    if (data.empty())
+        c.fin[side] = true;
+    else
+        c.out[side].insert(c.out[side].end(), data.begin(), data.end());
+    flush(id, side);
+}
+
+void SimContext::flush(conn_id_t id, int side) {
+    auto &c = *conns[id];
+    auto &out = c.out[side];
+    auto &off = c.out_off[side];
+    while (off < out.size())
+    {
+        auto ret = send(c.fd[side], out.data() + off, out.size() - off, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            /* the network has closed its end */
+            off = out.size();
+            break;
+        }
+        off += ret;
+    }
+    if (off == out.size())
+    {
+        out.clear();
+        off = 0;
+        if (c.fin[side])
+        {
+            close_end(id, side);
+            return;
+        }
+    }
+    watch(c, side);
+}
+
+void SimContext::watch(Conn &c, int side) {
+    c.ev[side].add(FdEvent::READ |
+        (c.out_off[side] < c.out[side].size() ? FdEvent::WRITE : 0));
+}
+
+void SimContext::on_event(conn_id_t id, int side, int events) {
+    auto it = conns.find(id);
+    if (it == conns.end() || it->second->fd[side] == -1) return;
+    auto fd = it->second->fd[side];
+    if (events & FdEvent::WRITE)
+    {
+        flush(id, side);
+        if (it->second->fd[side] == -1) return;
+    }
+    if (!(events & (FdEvent::READ | FdEvent::ERROR))) return;
+    for (;;)
+    {
+        bytearray_t buff(65536);
+        auto ret = recv(fd, buff.data(), buff.size(), 0);
+        if (ret > 0)
+        {
+            buff.resize(ret);
+            transmit(id, side, std::move(buff));
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        /* the network has closed its end, which is passed on after the
+         * bytes in flight */
+        close_end(id, side);
+        transmit(id, side, bytearray_t());
+        break;
+    }
+}
+
+void SimContext::close_end(conn_id_t id, int side) {
+    auto it = conns.find(id);
+    if (it == conns.end()) return;
+    auto &c = *it->second;
+    if (c.fd[side] == -1) return;
+    c.ev[side].clear();
+    ::close(c.fd[side]);
+    c.fd[side] = -1;
+    c.out[side].clear();
+    c.out_off[side] = 0;
+    if (c.fd[side ^ 1] == -1 && !c.syn)
+        /* not from within the callbacks of the connection */
+        add_timer(0, [this, id]() {
+            auto it = conns.find(id);
+            if (it != conns.end() && it->second->fd[0] == -1 &&
+                it->second->fd[1] == -1 && !it->second->syn)
+                conns.erase(it);
+        });
+}
+
+}
+
+#endif
@@ -80,6 +80,7 @@ class DataStream {
     }
 
     uint8_t *data() { return &buffer[offset]; }
+    const uint8_t *data() const { return buffer.data() + offset; }
 
     void clear() {
         buffer.clear();
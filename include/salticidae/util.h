@@ -64,12 +64,16 @@ const char *salticidae_strerror(int code);
 #include <vector>
 #include <unordered_map>
 #include <functional>
+#include <chrono>
+#include <algorithm>
 #include "salticidae/ref.h"
 
 namespace salticidae {
 
 void sec2tv(double t, struct timeval &tv);
 double gen_rand_timeout(double base_timeout, double alpha = 0.5);
+/** SipHash-2-4 of the data with the 128-bit key. */
+uint64_t siphash24(const uint8_t key[16], const uint8_t *data, size_t len);
 
 std::string trim(const std::string &s,
                 const std::string &space = "\t\r\n ");
@@ -114,7 +118,14 @@ enum SalticidaeErrorCode {
     SALTI_ERROR_CONN_NOT_READY,
     SALTI_ERROR_NOT_AVAIL,
     SALTI_ERROR_UNKNOWN,
-    SALTI_ERROR_CONN_OVERSIZED_MSG
+    SALTI_ERROR_CONN_OVERSIZED_MSG,
+    SALTI_ERROR_CAPTURE_IO,
+    SALTI_ERROR_CAPTURE_FORMAT,
+    SALTI_ERROR_RPC_TIMEOUT,
+    SALTI_ERROR_RPC_CANCELLED,
+    SALTI_ERROR_RPC_MALFORMED,
+    SALTI_ERROR_RPC_DISCONNECTED,
+    SALTI_ERROR_MULTICAST_PARTIAL
 };
 
 extern const char *SALTICIDAE_ERROR_STRINGS[];
@@ -250,6 +261,59 @@ class ElapsedTime {
     void stop(bool show_info = false);
 };
 
+/** A clock (in seconds) with timers, which can take over the timing of the
+ * library from the system (see SimContext). */
+class VirtualClock {
+    public:
+    using timer_id_t = uint64_t;
+    virtual ~VirtualClock() = default;
+    virtual double now() const = 0;
+    /** Run `cb` after `delay` seconds, returns a non-zero id. */
+    virtual timer_id_t add_timer(double delay, std::function<void()> cb) = 0;
+    virtual void del_timer(timer_id_t id) = 0;
+    /** Called when a loop driven by the clock starts watching an fd. */
+    virtual void on_fd_watch() {}
+};
+
+/** Token bucket used for traffic shaping. A request is admitted as long as
+ * the bucket is not in debt and is charged afterwards, so variable-sized
+ * requests never have to be split. A zero rate disables the bucket. */
+class TokenBucket {
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+    static const VirtualClock *vclock;
+
+    public:
+    TokenBucket(double rate = 0, double burst = 0):
+        rate(rate), burst(burst), tokens(burst), last(now()) {}
+
+    /** The monotonic time (in seconds) of the shaping and the deadlines. */
+    static double now() {
+        if (vclock) return vclock->now();
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /** Make now() follow `clock` in the whole process (nullptr for the
+     * system clock again). */
+    static void set_clock(const VirtualClock *clock) { vclock = clock; }
+
+    bool is_enabled() const { return rate > 0; }
+
+    /** Refill the bucket and return the time (in seconds) to wait before
+     * the next request can be admitted (0 if it can be admitted now). */
+    double get_wait(double t) {
+        if (!is_enabled()) return 0;
+        tokens = std::min(burst, tokens + (t - last) * rate);
+        last = t;
+        return tokens >= 0 ? 0 : -tokens / rate;
+    }
+
+    void consume(double n) { if (is_enabled()) tokens -= n; }
+};
+
 class Config {
     public:
     enum Action {
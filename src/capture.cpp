@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "salticidae/capture.h"
+
+namespace salticidae {
+
+const char WireCapture::magic[8] = {'S', 'A', 'L', 'T', 'C', 'A', 'P', '\0'};
+
+/* flush the buffer once it holds this many bytes */
+static const size_t capture_flush_size = 65536;
+
+template<typename T>
+static inline void put_le(bytearray_t &buff, T x) {
+    x = htole(x);
+    auto p = reinterpret_cast<const uint8_t *>(&x);
+    buff.insert(buff.end(), p, p + sizeof(T));
+}
+
+template<typename T>
+static inline T get_le(const uint8_t *p) {
+    T x;
+    memmove(&x, p, sizeof(T));
+    return letoh(x);
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size)
+    {
+        ssize_t ret = ::write(fd, data, size);
+        if (ret < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+WireCapture::WireCapture(const std::string &fname, size_t header_size,
+                        bool with_payload, size_t ring_size):
+        fname(fname), header_size(header_size),
+        with_payload(with_payload), ring_size(ring_size),
+        t0(std::chrono::steady_clock::now()),
+        nbuffered(0), written(0), fd(-1), failed(false), nlost(0) {
+    buffer.reserve(capture_flush_size);
+    if (!open_file())
+    {
+        int err = errno;
+        if (fd != -1) ::close(fd);
+        throw SalticidaeError(SALTI_ERROR_CAPTURE_IO, err);
+    }
+}
+
+WireCapture::~WireCapture() {
+    flush();
+    if (fd != -1) ::close(fd);
+}
+
+bool WireCapture::open_file() {
+    if ((fd = ::open(fname.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644)) == -1)
+        return false;
+    bytearray_t hdr(magic, magic + sizeof(magic));
+    put_le(hdr, version);
+    put_le(hdr, (uint32_t)header_size);
+    put_le(hdr, with_payload ? FLAG_PAYLOAD : (uint32_t)0);
+    put_le(hdr, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    written = hdr.size();
+    return write_all(fd, hdr.data(), hdr.size());
+}
+
+void WireCapture::fail(const char *what) {
+    SALTICIDAE_LOG_WARN("capture to %s disabled, cannot %s: %s",
+                        fname.c_str(), what, strerror(errno));
+    failed = true;
+    nlost.fetch_add(nbuffered, std::memory_order_relaxed);
+    nbuffered = 0;
+    buffer.clear();
+    buffer.shrink_to_fit();
+    if (fd != -1) ::close(fd);
+    fd = -1;
+}
+
+void WireCapture::flush_buffer() {
+    if (buffer.empty() || failed) return;
+    if (!write_all(fd, buffer.data(), buffer.size()))
+    {
+        fail("write");
+        return;
+    }
+    written += buffer.size();
+    buffer.clear();
+    nbuffered = 0;
+    if (ring_size && written >= ring_size) rotate();
+}
+
+void WireCapture::rotate() {
+    /* renamed while still open, so a failure leaves the file as it is */
+    if (::rename(fname.c_str(), (fname + ".prev").c_str()) == -1)
+    {
+        fail("rotate");
+        return;
+    }
+    ::close(fd);
+    if (!open_file()) fail("reopen");
+}
+
+void WireCapture::record(uint32_t conn_id, Direction dir,
+                        const uint8_t *header,
+                        const uint8_t *payload, size_t payload_len) {
+    if (!with_payload) payload_len = 0;
+    mutex_lg_t _(lock);
+    if (failed)
+    {
+        nlost.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    /* taken under the lock, so the records of all workers are written in
+     * the order of their timestamps */
+    uint64_t ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - t0).count();
+    put_le(buffer, ts);
+    put_le(buffer, conn_id);
+    buffer.push_back((uint8_t)dir);
+    put_le(buffer, (uint32_t)payload_len);
+    buffer.insert(buffer.end(), header, header + header_size);
+    if (payload_len)
+        buffer.insert(buffer.end(), payload, payload + payload_len);
+    nbuffered++;
+    if (buffer.size() >= capture_flush_size) flush_buffer();
+}
+
+void WireCapture::flush() {
+    mutex_lg_t _(lock);
+    flush_buffer();
+}
+
+WireCaptureReader::WireCaptureReader(const std::string &fname): offset(0) {
+    if ((fd = ::open(fname.c_str(), O_RDONLY)) == -1)
+        throw SalticidaeError(SALTI_ERROR_CAPTURE_IO, errno);
+    const size_t size = sizeof(WireCapture::magic) + 3 * sizeof(uint32_t) + sizeof(uint64_t);
+    if (!fill(size) ||
+        memcmp(buffer.data(), WireCapture::magic, sizeof(WireCapture::magic)) ||
+        get_le<uint32_t>(&buffer[8]) != WireCapture::version)
+    {
+        ::close(fd);
+        throw SalticidaeError(SALTI_ERROR_CAPTURE_FORMAT);
+    }
+    header_size = get_le<uint32_t>(&buffer[12]);
+    flags = get_le<uint32_t>(&buffer[16]);
+    start_time = get_le<uint64_t>(&buffer[20]);
+    offset = size;
+}
+
+WireCaptureReader::~WireCaptureReader() { ::close(fd); }
+
+bool WireCaptureReader::fill(size_t len) {
+    if (offset)
+    {
+        buffer.erase(buffer.begin(), buffer.begin() + offset);
+        offset = 0;
+    }
+    while (buffer.size() < len)
+    {
+        size_t size = buffer.size();
+        buffer.resize(std::max(len, capture_flush_size));
+        ssize_t ret = ::read(fd, &buffer[size], buffer.size() - size);
+        if (ret < 0 && errno == EINTR) ret = 0;
+        else if (ret <= 0)
+        {
+            buffer.resize(size);
+            return false;
+        }
+        buffer.resize(size + ret);
+    }
+    return true;
+}
+
+bool WireCaptureReader::next(Record &rec) {
+    const size_t fixed = sizeof(uint64_t) + 2 * sizeof(uint32_t) + 1;
+    if (buffer.size() - offset < fixed + header_size && !fill(fixed + header_size))
+        return false;
+    const uint8_t *p = &buffer[offset];
+    uint32_t payload_len = get_le<uint32_t>(p + 13);
+    size_t len = fixed + header_size + payload_len;
+    if (buffer.size() - offset < len)
+    {
+        if (!fill(len)) return false;
+        p = &buffer[offset];
+    }
+    rec.ts = get_le<uint64_t>(p);
+    rec.conn_id = get_le<uint32_t>(p + 8);
+    rec.dir = (WireCapture::Direction)p[12];
+    p += fixed;
+    rec.header.assign(p, p + header_size);
+    p += header_size;
+    rec.payload.assign(p, p + payload_len);
+    offset += len;
+    return true;
+}
+
+}
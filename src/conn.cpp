@@ -29,6 +29,9 @@
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "salticidae/util.h"
 #include "salticidae/conn.h"
@@ -60,6 +63,135 @@ ConnPool::Conn::operator std::string() const {
 
 /* the following functions are executed by exactly one worker per Conn object */
 
+/** the maximum number of bytes a shaped connection sends in one turn when the
+ * buckets are shared with other connections */
+static const size_t send_quantum = 65536;
+
+bool ConnPool::admit_send(const conn_t &conn, MPSCWriteBuffer::buffer_entry_t &seg) {
+    double now = TokenBucket::now();
+    double wait = 0;
+    size_t size = seg.size();
+    if (conn->send_paid >= size)
+        /* the head segment has already been charged (or is covered by what
+         * was paid for the dropped ones) */
+        conn->send_paid -= size;
+    else
+    {
+        /* only charge what has not been paid yet */
+        size_t due = size - conn->send_paid;
+        wait = conn->send_bucket.get_wait(now);
+        if (shaper)
+        {
+            std::lock_guard<std::mutex> _(shaper->lock);
+            auto &cb = shaper->classes[seg.tclass];
+            wait = std::max(wait, cb.get_wait(now));
+            if (wait <= 0)
+            {
+                /* the connection and its class are within their rates, so
+                 * reserve from the shared budget: reservations are served in
+                 * order, so the connections take turns */
+                wait = shaper->global.get_wait(now);
+                shaper->global.consume(due);
+                cb.consume(due);
+                conn->send_bucket.consume(due);
+                conn->send_paid = wait > 0 ? size : 0;
+            }
+        }
+        else if (wait <= 0)
+        {
+            conn->send_bucket.consume(due);
+            conn->send_paid = 0;
+        }
+    }
+    if (wait <= 0)
+    {
+        if (conn->throttle_since > 0)
+        {
+            throttle_delay_ns.fetch_add(
+                (uint64_t)((now - conn->throttle_since) * 1e9),
+                std::memory_order_relaxed);
+            conn->throttle_since = 0;
+        }
+        return true;
+    }
+    if (conn->throttle_since == 0)
+    {
+        conn->throttle_since = now;
+        nthrottled.fetch_add(1, std::memory_order_relaxed);
+        throttled_bytes.fetch_add(seg.size(), std::memory_order_relaxed);
+    }
+    /* put the segment back (the order is preserved) and stop writing until
+     * the buckets are refilled */
+    conn->rewind_send(std::move(seg));
+    Conn::mark_stalled(conn);
+    conn->ready_send = false;
+    conn->ev_socket.del();
+    conn->ev_socket.add(conn->ready_recv ? 0 : FdEvent::READ);
+    if (!conn->ev_throttle)
+        conn->ev_throttle = TimerEvent(conn->worker.load(std::memory_order_relaxed)->get_ec(), [conn](TimerEvent &) {
+            conn->ev_socket.del();
+            conn->ev_socket.add((conn->ready_recv ? 0 : FdEvent::READ) |
+                                FdEvent::WRITE);
+        });
+    conn->ev_throttle.add(std::max(wait, 1e-3));
+    return false;
+}
+
+bool ConnPool::admit_credit(const conn_t &conn, MPSCWriteBuffer::buffer_entry_t &seg) {
+    /* credit is charged as the bytes are sent, so an entry is only checked
+     * before it starts */
+    if (seg.ctrl || seg.partial) return true;
+    auto credit = conn->send_credit;
+    /* a message larger than half of the window goes once that much credit
+     * is back (the remote holds back less than half of it, so waiting for
+     * the whole window could deadlock) */
+    if (credit >= (int64_t)std::min(seg.size(), conn->flow_window / 2))
+        return true;
+    if (!conn->credit_blocked)
+        nflow_blocked.fetch_add(1, std::memory_order_relaxed);
+    conn->rewind_send(std::move(seg));
+    Conn::mark_stalled(conn);
+    conn->credit_blocked = true;
+    conn->ready_send = false;
+    conn->ev_socket.del();
+    conn->ev_socket.add(conn->ready_recv ? 0 : FdEvent::READ);
+    return false;
+}
+
+void ConnPool::grant_credit(const conn_t &conn, size_t n) {
+    if (!conn->flow_window) conn->flow_window = n;
+    conn->send_credit += n;
+    if (!conn->credit_blocked) return;
+    conn->credit_blocked = false;
+    conn->ev_socket.del();
+    conn->ev_socket.add((conn->ready_recv ? 0 : FdEvent::READ) | FdEvent::WRITE);
+}
+
+void ConnPool::write_ctrl(const conn_t &conn, bytearray_t &&frame) {
+    worker_call(conn, [conn, frame=std::move(frame)](ThreadCall::Handle &) {
+        if (conn->is_terminated()) return;
+        if (!conn->ctrl_out) conn->ctrl_out = new bytearray_t();
+        conn->ctrl_out->insert(conn->ctrl_out->end(), frame.begin(), frame.end());
+        /* otherwise it goes with the next write callback */
+        if (conn->ready_send || conn->credit_blocked)
+        {
+            conn->ev_socket.del();
+            conn->ev_socket.add((conn->ready_recv ? 0 : FdEvent::READ) |
+                                FdEvent::WRITE);
+            conn->send_data_func(conn, conn->fd, FdEvent::WRITE);
+        }
+    });
+}
+
+void ConnPool::drop_expired(const conn_t &conn, MPSCWriteBuffer::buffer_entry_t &seg) {
+    nsend_expired.fetch_add(1, std::memory_order_relaxed);
+    send_expired_bytes.fetch_add(seg.size(), std::memory_order_relaxed);
+    conn->release_send(seg.buffered_size());
+    /* what has been paid for it (if it was charged while waiting for
+     * credit or the shared budget) goes to the next segments */
+    conn->send_head_time = 0;
+}
+
 void ConnPool::Conn::_send_data(const conn_t &conn, int fd, int events) {
     if (events & FdEvent::ERROR)
     {
@@ -67,35 +199,90 @@ void ConnPool::Conn::_send_data(const conn_t &conn, int fd, int events) {
         return;
     }
     ssize_t ret = conn->recv_chunk_size;
+    auto cpool = conn->cpool;
+    bool shaped = cpool->is_shaped(conn);
+    size_t sent = 0;
     for (;;)
     {
-        bytearray_t buff_seg = conn->send_buffer.move_pop();
-        ssize_t size = buff_seg.size();
-        if (!size) break;
-        ret = send(fd, buff_seg.data(), size, 0);
+        auto seg = conn->next_send();
+        if (seg.empty()) break;
+        mark_active(conn);
+        if (seg.deadline > 0 && !seg.partial && TokenBucket::now() > seg.deadline)
+        {
+            /* stale, do not waste the bandwidth on it */
+            cpool->drop_expired(conn, seg);
+            continue;
+        }
+        if (shaped)
+        {
+            if (sent >= send_quantum && cpool->shaper)
+            {
+                /* let other connections draw from the shared buckets */
+                conn->rewind_send(std::move(seg));
+                Conn::mark_stalled(conn);
+                conn->ready_send = false;
+                return;
+            }
+            if (!cpool->admit_send(conn, seg)) return;
+        }
+        size_t seg_size = seg.size();
+        if (conn->flow_window && !cpool->admit_credit(conn, seg))
+        {
+            /* the buckets have been charged already */
+            if (shaped) conn->send_paid += seg_size;
+            return;
+        }
+        size_t size;
+        const uint8_t *buff_seg = seg.chunk(size);
+        if (buff_seg)
+            ret = send(fd, buff_seg, size, 0);
+        else
+        {
+            /* the file range goes from the page cache to the socket */
+            off_t off = seg.file->offset + seg.offset;
+#ifdef __linux__
+            ret = sendfile(fd, seg.file->fd, &off, size);
+#else
+            bytearray_t tmp(std::min(size, (size_t)65536));
+            ret = pread(seg.file->fd, tmp.data(), tmp.size(), off);
+            if (ret > 0) ret = send(fd, tmp.data(), ret, 0);
+#endif
+            if (ret == 0)
+            {
+                /* the stream cannot be completed */
+                SALTICIDAE_LOG_WARN("file(%d) is shorter than expected",
+                                    seg.file->fd);
+                conn->cpool->worker_terminate(conn);
+                return;
+            }
+        }
+        if (ret > 0)
+        {
+            sent += ret;
+            if (!seg.ctrl) conn->send_credit -= ret;
+            seg.consume(ret);
+            if (buff_seg && !seg.ctrl) conn->release_send(ret);
+        }
         SALTICIDAE_LOG_DEBUG("socket(%d) sent %zd bytes", fd, ret);
-        size -= ret;
-        if (size > 0)
+        if (!seg.empty())
         {
-            if (ret < 1) /* nothing is sent */
+            /* rewind the leftover, which has been charged already */
+            if (shaped) conn->send_paid += seg.size();
+            conn->rewind_send(std::move(seg));
+            /* the owned part is sent, go on with the shared part */
+            if (ret == (ssize_t)size) continue;
+            if (ret < 0 && errno != EWOULDBLOCK)
             {
-                /* rewind the whole buff_seg */
-                conn->send_buffer.rewind(std::move(buff_seg));
-                if (ret < 0 && errno != EWOULDBLOCK)
-                {
-                    SALTICIDAE_LOG_INFO("send(%d) failure: %s", fd, strerror(errno));
-                    conn->cpool->worker_terminate(conn);
-                    return;
-                }
+                SALTICIDAE_LOG_INFO("send(%d) failure: %s", fd, strerror(errno));
+                conn->cpool->worker_terminate(conn);
+                return;
             }
-            else
-                /* rewind the leftover */
-                conn->send_buffer.rewind(
-                    bytearray_t(buff_seg.begin() + ret, buff_seg.end()));
             /* wait for the next write callback */
+            Conn::mark_stalled(conn);
             conn->ready_send = false;
             return;
         }
+        if (seg.file) seg.file->finish(true);
     }
     /* the send_buffer is empty though the kernel buffer is still available, so
      * temporarily mask the WRITE event and mark the `ready_send` flag */
@@ -104,6 +291,22 @@ void ConnPool::Conn::_send_data(const conn_t &conn, int fd, int events) {
     conn->ready_send = true;
 }
 
+bool ConnPool::Conn::_recv_over_budget(const conn_t &conn, size_t &want) {
+    /* the buffered data may complete the message (the socket is being
+     * read, so on_read() must not resume reading) */
+    conn->ready_recv = false;
+    conn->cpool->on_read(conn);
+    size_t buffered = conn->recv_buffer.size();
+    if (buffered < conn->recv_reserve)
+    {
+        want = std::min(want, conn->recv_reserve - buffered);
+        return true;
+    }
+    /* wait until the budget drains */
+    conn->worker.load(std::memory_order_relaxed)->pause_recv(conn);
+    return false;
+}
+
 void ConnPool::Conn::_recv_data(const conn_t &conn, int fd, int events) {
     if (events & FdEvent::ERROR)
     {
@@ -111,20 +314,30 @@ void ConnPool::Conn::_recv_data(const conn_t &conn, int fd, int events) {
         return;
     }
     const size_t recv_chunk_size = conn->recv_chunk_size;
-    ssize_t ret = recv_chunk_size;
-    while (ret == (ssize_t)recv_chunk_size)
+    size_t want = recv_chunk_size;
+    ssize_t ret = want;
+    while (ret == (ssize_t)want)
     {
-        if (conn->recv_buffer.len() >= conn->max_recv_buff_size)
+        want = recv_chunk_size;
+        if (conn->mem && !conn->mem->admit(conn->get_mem_held(), recv_chunk_size))
+        {
+            /* over the memory budget: only finish the message being
+             * received, as what it holds is never released otherwise */
+            if (!_recv_over_budget(conn, want)) return;
+        }
+        if (conn->recv_buffer.size() >= conn->max_recv_buff_size)
         {
             /* recv_buffer is full, temporarily mask the READ event */
             conn->ev_socket.del();
             conn->ev_socket.add(conn->ready_send ? 0 : FdEvent::WRITE);
             conn->ready_recv = true;
+            /* let the buffered data be consumed */
+            conn->cpool->on_read(conn);
             return;
         }
         bytearray_t buff_seg;
-        buff_seg.resize(recv_chunk_size);
-        ret = recv(fd, buff_seg.data(), recv_chunk_size, 0);
+        buff_seg.resize(want);
+        ret = recv(fd, buff_seg.data(), want, 0);
         SALTICIDAE_LOG_DEBUG("socket(%d) read %zd bytes", fd, ret);
         if (ret < 0)
         {
@@ -142,6 +355,9 @@ void ConnPool::Conn::_recv_data(const conn_t &conn, int fd, int events) {
         }
         buff_seg.resize(ret);
         conn->recv_buffer.push(std::move(buff_seg));
+        conn->acquire_recv(ret);
+        conn->last_recv.store(conn->worker.load(std::memory_order_relaxed)->get_ec().now(), std::memory_order_relaxed);
+        mark_active(conn);
     }
     /* wait for the next read callback */
     conn->ready_recv = false;
@@ -157,35 +373,69 @@ void ConnPool::Conn::_send_data_tls(const conn_t &conn, int fd, int events) {
     }
     ssize_t ret = conn->recv_chunk_size;
     auto &tls = conn->tls;
+    auto cpool = conn->cpool;
+    bool shaped = cpool->is_shaped(conn);
+    size_t sent = 0;
     for (;;)
     {
-        bytearray_t buff_seg = conn->send_buffer.move_pop();
-        ssize_t size = buff_seg.size();
-        if (!size) break;
-        ret = tls->send(buff_seg.data(), size);
+        auto seg = conn->next_send();
+        if (seg.empty()) break;
+        mark_active(conn);
+        if (seg.deadline > 0 && !seg.partial && TokenBucket::now() > seg.deadline)
+        {
+            /* stale, do not waste the bandwidth on it */
+            cpool->drop_expired(conn, seg);
+            continue;
+        }
+        if (shaped)
+        {
+            if (sent >= send_quantum && cpool->shaper)
+            {
+                /* let other connections draw from the shared buckets */
+                conn->rewind_send(std::move(seg));
+                Conn::mark_stalled(conn);
+                conn->ready_send = false;
+                return;
+            }
+            if (!cpool->admit_send(conn, seg)) return;
+        }
+        size_t seg_size = seg.size();
+        if (conn->flow_window && !cpool->admit_credit(conn, seg))
+        {
+            /* the buckets have been charged already */
+            if (shaped) conn->send_paid += seg_size;
+            return;
+        }
+        size_t size;
+        const uint8_t *buff_seg = seg.chunk(size);
+        ret = tls->send(buff_seg, size);
+        if (ret > 0)
+        {
+            sent += ret;
+            if (!seg.ctrl) conn->send_credit -= ret;
+            seg.consume(ret);
+            if (!seg.ctrl) conn->release_send(ret);
+        }
         SALTICIDAE_LOG_DEBUG("ssl(%d) sent %zd bytes", fd, ret);
-        size -= ret;
-        if (size > 0)
+        if (!seg.empty())
         {
-            if (ret < 1) /* nothing is sent */
+            /* rewind the leftover, which has been charged already */
+            if (shaped) conn->send_paid += seg.size();
+            conn->rewind_send(std::move(seg));
+            /* the owned part is sent, go on with the shared part */
+            if (ret == (ssize_t)size) continue;
+            if (ret < 0 && tls->get_error(ret) != SSL_ERROR_WANT_WRITE)
             {
-                /* rewind the whole buff_seg */
-                conn->send_buffer.rewind(std::move(buff_seg));
-                if (ret < 0 && tls->get_error(ret) != SSL_ERROR_WANT_WRITE)
-                {
-                    SALTICIDAE_LOG_INFO("send(%d) failure: %s", fd, strerror(errno));
-                    conn->cpool->worker_terminate(conn);
-                    return;
-                }
+                SALTICIDAE_LOG_INFO("send(%d) failure: %s", fd, strerror(errno));
+                conn->cpool->worker_terminate(conn);
+                return;
             }
-            else
-                /* rewind the leftover */
-                conn->send_buffer.rewind(
-                    bytearray_t(buff_seg.begin() + ret, buff_seg.end()));
             /* wait for the next write callback */
+            Conn::mark_stalled(conn);
             conn->ready_send = false;
             return;
         }
+        if (seg.file) seg.file->finish(true);
     }
     conn->ev_socket.del();
     conn->ev_socket.add(conn->ready_recv ? 0 : FdEvent::READ);
@@ -199,20 +449,28 @@ void ConnPool::Conn::_recv_data_tls(const conn_t &conn, int fd, int events) {
         return;
     }
     const size_t recv_chunk_size = conn->recv_chunk_size;
-    ssize_t ret = recv_chunk_size;
+    size_t want = recv_chunk_size;
+    ssize_t ret = want;
     auto &tls = conn->tls;
-    while (ret == (ssize_t)recv_chunk_size)
+    while (ret == (ssize_t)want)
     {
-        if (conn->recv_buffer.len() >= conn->max_recv_buff_size)
+        want = recv_chunk_size;
+        if (conn->mem && !conn->mem->admit(conn->get_mem_held(), recv_chunk_size))
+        {
+            if (!_recv_over_budget(conn, want)) return;
+        }
+        if (conn->recv_buffer.size() >= conn->max_recv_buff_size)
         {
             conn->ev_socket.del();
             conn->ev_socket.add(conn->ready_send ? 0 : FdEvent::WRITE);
             conn->ready_recv = true;
+            /* let the buffered data be consumed */
+            conn->cpool->on_read(conn);
             return;
         }
         bytearray_t buff_seg;
-        buff_seg.resize(recv_chunk_size);
-        ret = tls->recv(buff_seg.data(), recv_chunk_size);
+        buff_seg.resize(want);
+        ret = tls->recv(buff_seg.data(), want);
         SALTICIDAE_LOG_DEBUG("ssl(%d) read %zd bytes", fd, ret);
         if (ret < 0)
         {
@@ -228,6 +486,9 @@ void ConnPool::Conn::_recv_data_tls(const conn_t &conn, int fd, int events) {
         }
         buff_seg.resize(ret);
         conn->recv_buffer.push(std::move(buff_seg));
+        conn->acquire_recv(ret);
+        conn->last_recv.store(conn->worker.load(std::memory_order_relaxed)->get_ec().now(), std::memory_order_relaxed);
+        mark_active(conn);
     }
     conn->ready_recv = false;
     conn->cpool->on_read(conn);
@@ -249,10 +510,10 @@ void ConnPool::Conn::_recv_data_tls_handshake(const conn_t &conn, int, int) {
         conn->ev_socket.del();
         //conn->ev_socket.add(FdEvent::WRITE);
         conn->peer_cert = new X509(conn->tls->get_peer_cert());
-        conn->worker->enable_send_buffer(conn, conn->fd);
+        conn->worker.load(std::memory_order_relaxed)->enable_send_buffer(conn, conn->fd);
         auto cpool = conn->cpool;
         cpool->on_worker_setup(conn);
-        cpool->disp_tcall->async_call([cpool, conn](ThreadCall::Handle &) {
+        cpool->disp_call(conn, [cpool, conn](ThreadCall::Handle &) {
             try {
                 cpool->on_dispatcher_setup(conn);
                 cpool->update_conn(conn, true);
@@ -273,24 +534,151 @@ void ConnPool::Conn::_recv_data_tls_handshake(const conn_t &conn, int, int) {
 void ConnPool::Conn::_recv_data_dummy(const conn_t &, int, int) {}
 
 void ConnPool::worker_terminate(const conn_t &conn) {
-    conn->worker->get_tcall()->async_call([this, conn](ThreadCall::Handle &) {
+    worker_call(conn, [this, conn](ThreadCall::Handle &) {
         if (!conn->set_terminated()) return;
         on_worker_teardown(conn);
         //conn->stop();
-        disp_tcall->async_call([this, conn](ThreadCall::Handle &) {
+        disp_call(conn, [this, conn](ThreadCall::Handle &) {
             del_conn(conn);
         });
     });
 }
 
+void ConnPool::worker_terminate(std::vector<conn_t> &&conns) {
+    std::vector<conn_t> dead;
+    for (auto &conn: conns)
+    {
+        if (!conn->set_terminated()) continue;
+        on_worker_teardown(conn);
+        dead.push_back(std::move(conn));
+    }
+    if (dead.empty()) return;
+    if (ndisp > 1)
+    {
+        for (auto &conn: dead)
+            disp_call(conn, [this, conn](ThreadCall::Handle &) {
+                del_conn(conn);
+            });
+        return;
+    }
+    disp_tcall->async_call([this, dead=std::move(dead)](ThreadCall::Handle &) {
+        for (auto &conn: dead) del_conn(conn);
+    });
+}
+
+void ConnPool::check_slow(std::vector<conn_t> &stalled) {
+    double now = TokenBucket::now();
+    std::vector<conn_t> dead;
+    for (size_t i = 0; i < stalled.size();)
+    {
+        auto &conn = stalled[i];
+        size_t backlog = conn->get_send_backlog();
+        if (conn->is_terminated() || !backlog)
+        {
+            /* drained (or gone) */
+            conn->send_stalled = false;
+            conn->slow = false;
+            std::swap(conn, stalled.back());
+            stalled.pop_back();
+            continue;
+        }
+        i++;
+        double age = conn->send_head_time > 0 ? now - conn->send_head_time : 0;
+        if (!((slow_max_age > 0 && age > slow_max_age) ||
+            (slow_max_backlog && backlog > slow_max_backlog)))
+        {
+            conn->slow = false;
+            continue;
+        }
+        if (!conn->slow)
+        {
+            conn->slow = true;
+            nslow.fetch_add(1, std::memory_order_relaxed);
+            SALTICIDAE_LOG_INFO("slow consumer %s: age=%.3f backlog=%zu",
+                                std::string(*conn).c_str(), age, backlog);
+            user_tcall->async_call([this, conn, age, backlog](ThreadCall::Handle &) {
+                if (slow_consumer_cb) slow_consumer_cb(conn, age, backlog);
+            });
+        }
+        switch (slow_policy)
+        {
+            case SLOW_NOTIFY: break;
+            case SLOW_CONFLATE: drop_queued(conn, true); break;
+            case SLOW_DROP_OLDEST: drop_queued(conn, false); break;
+            case SLOW_DISCONNECT:
+                nslow_disconnected.fetch_add(1, std::memory_order_relaxed);
+                dead.push_back(conn);
+                break;
+        }
+    }
+    if (!dead.empty()) worker_terminate(std::move(dead));
+}
+
+void ConnPool::drop_queued(const conn_t &conn, bool all) {
+    using entry_t = MPSCWriteBuffer::buffer_entry_t;
+    auto &buff = conn->send_buffer;
+    double now = TokenBucket::now();
+    size_t backlog = conn->get_send_backlog();
+    size_t ndropped = 0, nbytes = 0;
+    /* the partially sent head is kept, otherwise the stream is corrupted */
+    entry_t head;
+    auto seg = conn->pop_send();
+    if (seg.partial)
+    {
+        head = std::move(seg);
+        seg = conn->pop_send();
+    }
+    auto drop = [&](entry_t &victim) {
+        ndropped++;
+        nbytes += victim.buffered_size();
+        conn->release_send(victim.buffered_size());
+        victim = entry_t();
+    };
+    if (all)
+    {
+        /* only the latest message survives */
+        for (auto next = conn->pop_send(); !next.empty();
+            next = conn->pop_send())
+        {
+            drop(seg);
+            seg = std::move(next);
+        }
+    }
+    else
+    {
+        while (!seg.empty())
+        {
+            bool too_big = slow_max_backlog && backlog - nbytes > slow_max_backlog;
+            bool too_old = slow_max_age > 0 && seg.enq_time > 0 &&
+                            now - seg.enq_time > slow_max_age;
+            if (!too_big && !too_old) break;
+            drop(seg);
+            seg = conn->pop_send();
+        }
+    }
+    /* put back the survivors in order */
+    if (!seg.empty()) buff.rewind(std::move(seg));
+    if (!head.empty())
+    {
+        conn->send_head_time = head.enq_time;
+        buff.rewind(std::move(head));
+    }
+    else
+    {
+        /* what has been paid for the dropped head goes to the new one */
+        conn->send_head_time = seg.enq_time;
+    }
+    nslow_dropped.fetch_add(ndropped, std::memory_order_relaxed);
+    nslow_dropped_bytes.fetch_add(nbytes, std::memory_order_relaxed);
+}
+
 /****/
 
 void ConnPool::disp_terminate(const conn_t &conn) {
-    auto worker = conn->worker;
-    if (worker)
+    if (conn->worker.load(std::memory_order_relaxed))
         worker_terminate(conn);
     else
-        disp_tcall->async_call([this, conn](ThreadCall::Handle &) {
+        disp_call(conn, [this, conn](ThreadCall::Handle &) {
             if (!conn->set_terminated()) return;
             on_worker_teardown(conn);
             //conn->stop();
@@ -298,36 +686,83 @@ void ConnPool::disp_terminate(const conn_t &conn) {
         });
 }
 
+bool ConnPool::set_keepalive(int fd) const {
+    if (!tcp_keepalive_idle) return true;
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char *)&one, sizeof(one)) < 0)
+        return false;
+#ifdef TCP_KEEPIDLE
+    if (setsockopt(fd, SOL_TCP, TCP_KEEPIDLE, (const char *)&tcp_keepalive_idle, sizeof(int)) < 0)
+        return false;
+#endif
+#ifdef TCP_KEEPINTVL
+    if (tcp_keepalive_interval &&
+        setsockopt(fd, SOL_TCP, TCP_KEEPINTVL, (const char *)&tcp_keepalive_interval, sizeof(int)) < 0)
+        return false;
+#endif
+#ifdef TCP_KEEPCNT
+    if (tcp_keepalive_count &&
+        setsockopt(fd, SOL_TCP, TCP_KEEPCNT, (const char *)&tcp_keepalive_count, sizeof(int)) < 0)
+        return false;
+#endif
+    return true;
+}
+
 void ConnPool::accept_client(int fd, int) {
     int client_fd;
     struct sockaddr client_addr;
+    NetAddr addr;
     try {
         socklen_t addr_size = sizeof(struct sockaddr_in);
-        if ((client_fd = accept(fd, &client_addr, &addr_size)) < 0)
+        if ((client_fd = transport ?
+                transport->accept(fd, addr) :
+                accept(fd, &client_addr, &addr_size)) < 0)
         {
+            if (transport && errno == EAGAIN) return;
             ev_listen.del();
             throw ConnPoolError(SALTI_ERROR_ACCEPT, errno);
         }
         else
         {
             int one = 1;
-            if (setsockopt(client_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one)) < 0 ||
-                //setsockopt(client_fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&one, sizeof(one)) < 0 ||
-                setsockopt(client_fd, SOL_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)) < 0)
-                throw ConnPoolError(SALTI_ERROR_ACCEPT, errno);
-            if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1)
-                throw ConnPoolError(SALTI_ERROR_ACCEPT, errno);
-
-            NetAddr addr((struct sockaddr_in *)&client_addr);
+            if (!transport)
+            {
+                if (setsockopt(client_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one)) < 0 ||
+                    //setsockopt(client_fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&one, sizeof(one)) < 0 ||
+                    setsockopt(client_fd, SOL_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)) < 0 ||
+                    !set_keepalive(client_fd))
+                    throw ConnPoolError(SALTI_ERROR_ACCEPT, errno);
+                if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1)
+                    throw ConnPoolError(SALTI_ERROR_ACCEPT, errno);
+                addr = NetAddr((struct sockaddr_in *)&client_addr);
+            }
+
             conn_t conn = create_conn();
+            conn->serial = conn_serial.fetch_add(1, std::memory_order_relaxed);
             conn->send_buffer.set_capacity(max_send_buff_size);
+            if (hibernate_after > 0)
+                conn->send_buffer.get_queue().enable_hibernation();
+            if (mem)
+            {
+                conn->mem = mem;
+                mem->nconn.fetch_add(1, std::memory_order_relaxed);
+            }
             conn->recv_chunk_size = recv_chunk_size;
             conn->max_recv_buff_size = max_recv_buff_size;
             conn->fd = client_fd;
             conn->cpool = this;
             conn->mode = Conn::PASSIVE;
             conn->addr = addr;
-            add_conn(conn);
+            conn->send_bucket = TokenBucket(conn_send_rate, conn_send_burst);
+            auto &disp = get_fd_disp(client_fd);
+            conn->disp = &disp;
+            if (&disp == &workers[0])
+                add_conn(conn);
+            else
+                /* the calls from the worker below land after this one */
+                disp.get_tcall()->async_call([this, conn](ThreadCall::Handle &) {
+                    add_conn(conn);
+                });
             SALTICIDAE_LOG_INFO("accepted %s", std::string(*conn).c_str());
             auto &worker = select_worker();
             conn->worker = &worker;
@@ -363,52 +798,80 @@ void ConnPool::_listen(NetAddr listen_addr) {
     if (listen_fd != -1)
     { /* reset the previous listen() */
         ev_listen.clear();
-        close(listen_fd);
+        if (transport) transport->close(listen_fd);
+        else close(listen_fd);
     }
-    if ((listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-        throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one)) < 0 ||
-        //setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&one, sizeof(one)) < 0 ||
-        setsockopt(listen_fd, SOL_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)) < 0)
-        throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
-    if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1)
+    if (transport)
+    {
+        if ((listen_fd = transport->listen(listen_addr)) < 0)
+            throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
+    }
+    else if ((listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
         throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
+    else
+    {
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one)) < 0 ||
+            //setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&one, sizeof(one)) < 0 ||
+            setsockopt(listen_fd, SOL_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)) < 0)
+            throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
+        if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1)
+            throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
 
-    struct sockaddr_in sockin;
-    memset(&sockin, 0, sizeof(struct sockaddr_in));
-    sockin.sin_family = AF_INET;
-    sockin.sin_addr.s_addr = INADDR_ANY;
-    sockin.sin_port = listen_addr.port;
+        struct sockaddr_in sockin;
+        memset(&sockin, 0, sizeof(struct sockaddr_in));
+        sockin.sin_family = AF_INET;
+        sockin.sin_addr.s_addr = INADDR_ANY;
+        sockin.sin_port = listen_addr.port;
 
-    if (bind(listen_fd, (struct sockaddr *)&sockin, sizeof(sockin)) < 0)
-        throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
-    if (::listen(listen_fd, max_listen_backlog) < 0)
-        throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
+        if (bind(listen_fd, (struct sockaddr *)&sockin, sizeof(sockin)) < 0)
+            throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
+        if (::listen(listen_fd, max_listen_backlog) < 0)
+            throw ConnPoolError(SALTI_ERROR_LISTEN, errno);
+    }
     ev_listen = FdEvent(disp_ec, listen_fd,
                 std::bind(&ConnPool::accept_client, this, _1, _2));
     ev_listen.add(FdEvent::READ);
     SALTICIDAE_LOG_INFO("listening to %u", ntohs(listen_addr.port));
 }
 
-ConnPool::conn_t ConnPool::_connect(const NetAddr &addr) {
+ConnPool::conn_t ConnPool::_connect(const NetAddr &addr, Worker &disp) {
     int fd;
     int one = 1;
-    if ((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-        throw ConnPoolError(SALTI_ERROR_CONNECT, errno);
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one)) < 0 ||
-        //setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&one, sizeof(one)) < 0 ||
-        setsockopt(fd, SOL_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)) < 0)
-        throw ConnPoolError(SALTI_ERROR_CONNECT, errno);
-    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
-        throw ConnPoolError(SALTI_ERROR_CONNECT, errno);
+    if (transport)
+    {
+        if ((fd = transport->connect(addr)) < 0)
+            throw ConnPoolError(SALTI_ERROR_CONNECT, errno);
+    }
+    else
+    {
+        if ((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+            throw ConnPoolError(SALTI_ERROR_CONNECT, errno);
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one)) < 0 ||
+            //setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&one, sizeof(one)) < 0 ||
+            setsockopt(fd, SOL_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)) < 0 ||
+            !set_keepalive(fd))
+            throw ConnPoolError(SALTI_ERROR_CONNECT, errno);
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+            throw ConnPoolError(SALTI_ERROR_CONNECT, errno);
+    }
     conn_t conn = create_conn();
+    conn->serial = conn_serial.fetch_add(1, std::memory_order_relaxed);
     conn->send_buffer.set_capacity(max_send_buff_size);
+    if (hibernate_after > 0)
+        conn->send_buffer.get_queue().enable_hibernation();
+    if (mem)
+    {
+        conn->mem = mem;
+        mem->nconn.fetch_add(1, std::memory_order_relaxed);
+    }
     conn->recv_chunk_size = recv_chunk_size;
     conn->max_recv_buff_size = max_recv_buff_size;
     conn->fd = fd;
     conn->cpool = this;
     conn->mode = Conn::ACTIVE;
     conn->addr = addr;
+    conn->send_bucket = TokenBucket(conn_send_rate, conn_send_burst);
+    conn->disp = &disp;
     add_conn(conn);
 
     struct sockaddr_in sockin;
@@ -417,7 +880,7 @@ ConnPool::conn_t ConnPool::_connect(const NetAddr &addr) {
     sockin.sin_addr.s_addr = addr.ip;
     sockin.sin_port = addr.port;
 
-    if (::connect(fd, (struct sockaddr *)&sockin,
+    if (!transport && ::connect(fd, (struct sockaddr *)&sockin,
                 sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS)
     {
         SALTICIDAE_LOG_INFO("cannot connect to %s", std::string(addr).c_str());
@@ -425,7 +888,7 @@ ConnPool::conn_t ConnPool::_connect(const NetAddr &addr) {
     }
     else
     {
-        conn->ev_connect = TimedFdEvent(disp_ec, conn->fd, [this, conn](int fd, int events) {
+        conn->ev_connect = TimedFdEvent(disp.get_ec(), conn->fd, [this, conn](int fd, int events) {
             conn_server(conn, fd, events);
         });
         conn->ev_connect.add(FdEvent::WRITE, conn_server_timeout);
@@ -435,6 +898,7 @@ ConnPool::conn_t ConnPool::_connect(const NetAddr &addr) {
 }
 
 void ConnPool::del_conn(const conn_t &conn) {
+    auto &pool = conn->disp.load(std::memory_order_relaxed)->pool;
     auto it = pool.find(conn->fd);
     assert(it != pool.end());
     pool.erase(it);
@@ -447,10 +911,209 @@ void ConnPool::release_conn(const conn_t &conn) {
     conn->ev_connect.clear();
     conn->ev_socket.clear();
     on_dispatcher_teardown(conn);
-    ::close(conn->fd);
+    if (transport) transport->close(conn->fd);
+    else ::close(conn->fd);
+}
+
+void ConnPool::stop_group_workers() {
+    /* the loops of the group keep running for the other pools, so
+     * everything of this pool is torn down on them instead: first stop
+     * taking calls and accepting connections */
+    for (size_t i = 0; i < nworker; i++)
+        group->call(i, [this, i]() {
+            workers[i].stop_tcall();
+            if (i == 0) ev_listen.clear();
+        });
+    /* then tear down the connections fed to each worker */
+    for (size_t i = 0; i < nworker; i++)
+        group->call(i, [this, i]() {
+            std::vector<conn_t> fed;
+            for (auto &it: workers[i].fed)
+                fed.push_back(it.second);
+            for (auto &conn: fed)
+                if (conn->set_terminated()) on_worker_teardown(conn);
+        });
+    /* and release all connections of each shard, then what is bound to the
+     * loop, on the same call so that no timer fires in between */
+    for (size_t i = 0; i < nworker; i++)
+        group->call(i, [this, i]() {
+            auto &worker = workers[i];
+            /* releasing a connection may start a new one (of PeerNetwork) */
+            while (!worker.pool.empty())
+            {
+                auto pool = std::move(worker.pool);
+                worker.pool.clear();
+                for (auto &it: pool)
+                {
+                    auto &conn = it.second;
+                    if (conn->set_terminated())
+                        on_worker_teardown(conn);
+                    release_conn(conn);
+                }
+            }
+            worker.release_conns();
+            on_worker_stop(worker);
+        });
+}
+
+bool ConnPool::migrate_conn(const conn_t &conn, Worker &to) {
+    auto from = conn->worker.load(std::memory_order_relaxed);
+    /* not set up yet (e.g. during the TLS handshake) */
+    if (conn->is_terminated() || from == &to ||
+        !conn->send_buffer.get_queue().is_registered() ||
+        !can_migrate(conn))
+        return false;
+    on_worker_detach(conn);
+    auto events = from->disown(conn);
+    nmigrating.fetch_add(1, std::memory_order_relaxed);
+    /* the calls made to the connection from now on land after this one */
+    to.get_tcall()->async_call([this, conn, &to, events](ThreadCall::Handle &) {
+        /* may run before the store below */
+        conn->worker.store(&to, std::memory_order_relaxed);
+        if (!conn->is_terminated())
+        {
+            try {
+                to.adopt(conn, events);
+                on_worker_attach(conn);
+            } catch (...) {
+                recoverable_error(std::current_exception(), -1);
+                worker_terminate(conn);
+            }
+        }
+        nmigrating.fetch_sub(1, std::memory_order_relaxed);
+    });
+    /* the calls posted to the old worker from now on are forwarded, and
+     * land after the adoption above (unless it has already happened) */
+    conn->worker.compare_exchange_strong(from, &to, std::memory_order_release);
+    nmigrated.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void ConnPool::shed_conns(Worker &worker, size_t n, Worker *to) {
+    worker.get_tcall()->async_call([this, &worker, n, to](ThreadCall::Handle &) {
+        std::vector<conn_t> conns;
+        for (auto &it: worker.fed)
+        {
+            if (conns.size() == n) break;
+            conns.push_back(it.second);
+        }
+        /* otherwise spread them over the active workers */
+        std::vector<size_t> loads;
+        if (!to)
+            for (size_t i = 0; i < nactive.load(std::memory_order_relaxed); i++)
+                loads.push_back(workers[i].get_load());
+        for (auto &conn: conns)
+        {
+            size_t idx = 0;
+            if (!to)
+            {
+                if (loads.empty()) break;
+                for (size_t i = 1; i < loads.size(); i++)
+                    if (loads[i] < loads[idx]) idx = i;
+            }
+            if (migrate_conn(conn, to ? *to : workers[idx]) && !to)
+                loads[idx]++;
+        }
+    });
+}
+
+void ConnPool::grow_workers() {
+    size_t n = nactive.load(std::memory_order_relaxed);
+    if (retiring)
+    {
+        /* take back the worker being retired */
+        auto idx = retiring - 1;
+        retiring = 0;
+        idle_since[idx] = workers[idx].get_ec().get_idle_time();
+        nactive.store(idx + 1, std::memory_order_relaxed);
+        SALTICIDAE_LOG_INFO("worker %zu is kept", idx);
+        return;
+    }
+    if (n >= max_worker) return;
+    auto &worker = workers[n];
+    idle_since[n] = worker.get_ec().get_idle_time();
+    worker.start();
+    nactive.store(n + 1, std::memory_order_relaxed);
+    SALTICIDAE_LOG_INFO("added worker %zu", n);
+    /* move the excess of the others onto the new worker */
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += workers[i].get_nconn();
+    size_t fair = total / (n + 1);
+    for (size_t i = 0; i < n; i++)
+    {
+        auto nconn = workers[i].get_nconn();
+        if (nconn > fair) shed_conns(workers[i], nconn - fair, &worker);
+    }
+}
+
+void ConnPool::retire_worker(size_t idx) {
+    /* no longer takes new connections */
+    nactive.store(idx, std::memory_order_relaxed);
+    retiring = idx + 1;
+    retire_nquiet = 0;
+    retire_nticks = 0;
+    SALTICIDAE_LOG_INFO("retiring worker %zu", idx);
+    shed_conns(workers[idx], workers[idx].get_nconn(), nullptr);
+}
+
+void ConnPool::elastic_tick() {
+    auto now = uv_hrtime();
+    double wall = now - util_since;
+    util_since = now;
+    size_t n = nactive.load(std::memory_order_relaxed);
+    double util = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        auto idle = workers[i].get_ec().get_idle_time();
+        double busy = 1 - (idle - idle_since[i]) / wall;
+        idle_since[i] = idle;
+        util += std::min(std::max(busy, 0.0), 1.0);
+    }
+    util /= n;
+    worker_util.store(util, std::memory_order_relaxed);
+    if (retiring)
+    {
+        auto &worker = workers[retiring - 1];
+        if (++retire_nticks > retire_max_ticks)
+            /* the rest cannot be moved (e.g. subscribed clients) */
+            grow_workers();
+        else if (worker.get_nconn() ||
+                nmigrating.load(std::memory_order_relaxed))
+        {
+            /* some are left (or have just been fed) */
+            retire_nquiet = 0;
+            shed_conns(worker, worker.get_nconn(), nullptr);
+        }
+        else if (++retire_nquiet >= 2)
+        {
+            /* a call that still reaches it (e.g. through worker_call()
+             * with the connection it had) is passed on to this shard */
+            worker.park(disp_tcall);
+            SALTICIDAE_LOG_INFO("retired worker %zu", retiring - 1);
+            retiring = 0;
+        }
+    }
+    if (util > grow_util)
+    {
+        nshrink_vote = 0;
+        if (++ngrow_vote < elastic_patience) return;
+        ngrow_vote = 0;
+        grow_workers();
+    }
+    /* the load of one less worker spread over the others */
+    else if (n > min_worker && !retiring && util * n / (n - 1) < shrink_util)
+    {
+        ngrow_vote = 0;
+        if (++nshrink_vote < elastic_patience) return;
+        nshrink_vote = 0;
+        retire_worker(n - 1);
+    }
+    else ngrow_vote = nshrink_vote = 0;
 }
 
 ConnPool::conn_t ConnPool::add_conn(const conn_t &conn) {
+    auto &pool = conn->disp.load(std::memory_order_relaxed)->pool;
     assert(pool.find(conn->fd) == pool.end());
     return pool.insert(std::make_pair(conn->fd, conn)).first->second;
 }
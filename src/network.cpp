@@ -312,6 +312,23 @@ int32_t peernetwork_multicast_msg_by_move(peernetwork_t *self,
     return self->_multicast_msg(std::move(*_moved_msg), *peers);
 }
 
+int32_t peernetwork_multicast_msg_nearest_by_move(peernetwork_t *self,
+                                    msg_t *_moved_msg, const peerid_array_t *peers, size_t k) {
+    return self->_multicast_msg_nearest(std::move(*_moved_msg), *peers, k);
+}
+
+double peernetwork_get_peer_rtt(const peernetwork_t *self,
+                                const peerid_t *peer,
+                                double *rttvar,
+                                SalticidaeCError *cerror) {
+    SALTICIDAE_CERROR_TRY(cerror)
+    auto rtt = self->get_peer_rtt(*peer);
+    if (rttvar) *rttvar = rtt.rttvar;
+    return rtt.srtt;
+    SALTICIDAE_CERROR_CATCH(cerror)
+    return -1;
+}
+
 void peernetwork_listen(peernetwork_t *self, const netaddr_t *listen_addr, SalticidaeCError *cerror) {
     SALTICIDAE_CERROR_TRY(cerror)
     self->listen(*listen_addr);
@@ -66,6 +66,13 @@ const char *SALTICIDAE_ERROR_STRINGS[] = {
     "operation not available",
     "unknown error",
     "oversized message",
+    "unable to access the capture file",
+    "invalid capture file",
+    "rpc timeout",
+    "rpc cancelled",
+    "malformed rpc response",
+    "rpc connection lost",
+    "fewer peers connected than requested",
 };
 
 const char *TTY_COLOR_RED = "\x1b[31m";
@@ -106,10 +113,54 @@ void sec2tv(double t, struct timeval &tv) {
     tv.tv_usec = trunc((t - tv.tv_sec) * 1e6);
 }
 
+const VirtualClock *TokenBucket::vclock = nullptr;
+
 double gen_rand_timeout(double base_timeout, double alpha) {
     return base_timeout + rand() / (double)RAND_MAX * alpha * base_timeout;
 }
 
+static inline uint64_t load_le64(const uint8_t *p) {
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; i--) x = (x << 8) | p[i];
+    return x;
+}
+
+static inline uint64_t rotl64(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+uint64_t siphash24(const uint8_t key[16], const uint8_t *data, size_t len) {
+    uint64_t k0 = load_le64(key), k1 = load_le64(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    auto round = [&]() {
+        v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+        v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+    };
+    const uint8_t *end = data + (len & ~(size_t)7);
+    for (; data != end; data += 8)
+    {
+        uint64_t m = load_le64(data);
+        v3 ^= m;
+        round(); round();
+        v0 ^= m;
+    }
+    /* the last block carries the remaining bytes and the length */
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < (len & 7); i++)
+        b |= (uint64_t)data[i] << (8 * i);
+    v3 ^= b;
+    round(); round();
+    v0 ^= b;
+    v2 ^= 0xff;
+    round(); round(); round(); round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 std::string vstringprintf(const char *fmt, va_list _ap) {
     int guessed_size = 1024;
     std::string buff;
@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdio>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/util.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::ClientNetwork;
+using salticidae::TimerEvent;
+using salticidae::Config;
+using salticidae::htole;
+using salticidae::letoh;
+using opcode_t = uint8_t;
+
+struct MsgEcho {
+    static const opcode_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t x;
+    MsgEcho(uint32_t x): x(x) { serialized << htole(x); }
+    MsgEcho(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+const opcode_t MsgEcho::opcode;
+
+using Net = ClientNetwork<opcode_t>;
+
+size_t get_rss() {
+    size_t size, resident;
+#ifdef __GLIBC__
+    /* hand the freed pages back to the OS so that they are not counted */
+    malloc_trim(0);
+#endif
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f || fscanf(f, "%zu %zu", &size, &resident) != 2)
+        resident = 0;
+    if (f) fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* open a plain (non-salticidae) client socket */
+int connect_raw(const NetAddr &addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = addr.ip;
+    sin.sin_port = addr.port;
+    if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    Config config;
+    auto opt_nconn = Config::OptValInt::create(2000);
+    auto opt_nworker = Config::OptValInt::create(1);
+    auto opt_hibernate = Config::OptValDouble::create(1);
+    auto opt_help = Config::OptValFlag::create(false);
+    config.add_opt("nconn", opt_nconn, Config::SET_VAL, 'n', "number of idle clients");
+    config.add_opt("nworker", opt_nworker, Config::SET_VAL, 'w', "number of worker threads");
+    config.add_opt("hibernate", opt_hibernate, Config::SET_VAL, 'i', "idle time before a connection hibernates (0 to disable)");
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
+    config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        return 0;
+    }
+    size_t nconn = opt_nconn->get();
+    NetAddr server_addr("127.0.0.1:12360");
+
+    salticidae::EventContext ec;
+    Net::Config netconfig;
+    netconfig.hibernate_after(opt_hibernate->get());
+    netconfig.nworker(opt_nworker->get());
+    netconfig.max_listen_backlog(nconn);
+    Net server(ec, netconfig);
+    size_t nready = 0, necho = 0;
+    server.reg_conn_handler([&](const salticidae::ConnPool::conn_t &, bool connected) {
+        if (connected && ++nready == nconn) ec.stop();
+        return true;
+    });
+    server.reg_handler([&](MsgEcho &&msg, const Net::conn_t &conn) {
+        server.send_msg(MsgEcho(msg.x), conn);
+    });
+    server.start();
+    server.listen(server_addr);
+    /* let the threads and the allocator settle */
+    TimerEvent ev_wait(ec, [&](TimerEvent &) { ec.stop(); });
+    ev_wait.add(0.5);
+    ec.dispatch();
+
+    size_t rss0 = get_rss();
+    std::vector<int> fds;
+    for (size_t i = 0; i < nconn; i++)
+    {
+        int fd = connect_raw(server_addr);
+        if (fd < 0)
+        {
+            fprintf(stderr, "cannot connect: %s\n", strerror(errno));
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+    ec.dispatch();
+    size_t rss1 = get_rss();
+    printf("connected: %.0f bytes per connection\n", (rss1 - rss0) / (double)nconn);
+
+    /* each client talks once and then stays idle */
+    bytearray_t req = salticidae::MsgBase<opcode_t>(MsgEcho(42), 0x0).serialize();
+    for (auto fd: fds)
+        if (write(fd, req.data(), req.size()) != (ssize_t)req.size())
+            fprintf(stderr, "short write\n");
+    TimerEvent ev_idle(ec, [&](TimerEvent &) { ec.stop(); });
+    ev_idle.add(std::max(opt_hibernate->get(), 0.5) + 1);
+    ec.dispatch();
+    std::vector<uint8_t> buff(4096);
+    for (auto fd: fds)
+        if (read(fd, buff.data(), buff.size()) > 0) necho++;
+    size_t rss2 = get_rss();
+    printf("idle (%zu echoed): %.0f bytes per connection\n", necho,
+            (rss2 - rss0) / (double)nconn);
+
+    for (auto fd: fds) close(fd);
+    server.stop();
+    return 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/util.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::MsgNetwork;
+using salticidae::Config;
+using salticidae::bytearray_t;
+using opcode_t = uint8_t;
+
+struct MsgPing {
+    static const opcode_t opcode = 0x0;
+    DataStream serialized;
+    bytearray_t data;
+    MsgPing(bytearray_t &&data) { serialized.put_data(data); }
+    MsgPing(DataStream &&s): data(std::move(s)) {}
+};
+
+struct MsgPong {
+    static const opcode_t opcode = 0x1;
+    DataStream serialized;
+    bytearray_t data;
+    MsgPong(bytearray_t &&data) { serialized.put_data(data); }
+    MsgPong(DataStream &&s): data(std::move(s)) {}
+};
+
+const opcode_t MsgPing::opcode;
+const opcode_t MsgPong::opcode;
+
+using Net = MsgNetwork<opcode_t>;
+using steady_clock = std::chrono::steady_clock;
+
+int main(int argc, char **argv) {
+    Config config;
+    auto opt_nround = Config::OptValInt::create(100000);
+    auto opt_nwarmup = Config::OptValInt::create(1000);
+    auto opt_size = Config::OptValInt::create(64);
+    auto opt_single = Config::OptValFlag::create(false);
+    auto opt_help = Config::OptValFlag::create(false);
+    config.add_opt("nround", opt_nround, Config::SET_VAL, 'n', "number of measured round trips");
+    config.add_opt("nwarmup", opt_nwarmup, Config::SET_VAL, 'w', "number of round trips before measuring");
+    config.add_opt("size", opt_size, Config::SET_VAL, 's', "payload size of a message");
+    config.add_opt("single", opt_single, Config::SWITCH_ON, '1', "run both ends in the single-threaded mode");
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
+    config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        return 0;
+    }
+    size_t nround = opt_nround->get();
+    size_t nwarmup = opt_nwarmup->get();
+    size_t size = opt_size->get();
+    bool single = opt_single->get();
+    NetAddr server_addr("127.0.0.1:12361");
+    Net::Config netconfig;
+    netconfig.single_thread(single);
+    netconfig.max_msg_size(std::max(size, (size_t)1024));
+
+    /* the server echoes on its own loop (and thread) */
+    std::mutex ready_lock;
+    std::condition_variable ready_cv;
+    bool ready = false;
+    std::thread server_thread([&]() {
+        salticidae::EventContext ec;
+        Net server(ec, netconfig);
+        server.reg_handler([&server](MsgPing &&msg, const Net::conn_t &conn) {
+            server.send_msg(MsgPong(std::move(msg.data)), conn);
+        });
+        server.reg_conn_handler([&ec](const salticidae::ConnPool::conn_t &, bool connected) {
+            if (!connected) ec.stop();
+            return true;
+        });
+        server.start();
+        server.listen(server_addr);
+        {
+            std::lock_guard<std::mutex> _(ready_lock);
+            ready = true;
+        }
+        ready_cv.notify_all();
+        ec.dispatch();
+    });
+    {
+        std::unique_lock<std::mutex> lk(ready_lock);
+        ready_cv.wait(lk, [&]() { return ready; });
+    }
+
+    salticidae::EventContext ec;
+    Net client(ec, netconfig);
+    std::vector<double> rtts;
+    rtts.reserve(nround);
+    size_t nsent = 0;
+    steady_clock::time_point t0;
+    auto ping = [&](const Net::conn_t &conn) {
+        t0 = steady_clock::now();
+        nsent++;
+        client.send_msg(MsgPing(bytearray_t(size, 0x42)), conn);
+    };
+    client.reg_handler([&](MsgPong &&msg, const Net::conn_t &conn) {
+        auto rtt = std::chrono::duration<double, std::micro>(steady_clock::now() - t0);
+        if (msg.data.size() != size)
+            throw std::runtime_error("corrupted echo");
+        if (nsent > nwarmup) rtts.push_back(rtt.count());
+        if (nsent < nwarmup + nround) ping(conn);
+        else ec.stop();
+    });
+    client.reg_conn_handler([&](const salticidae::ConnPool::conn_t &conn, bool connected) {
+        if (connected)
+            ping(salticidae::static_pointer_cast<Net::Conn>(conn));
+        return true;
+    });
+    client.start();
+    client.connect(server_addr);
+    ec.dispatch();
+    client.stop();
+    server_thread.join();
+
+    std::sort(rtts.begin(), rtts.end());
+    double sum = 0;
+    for (auto t: rtts) sum += t;
+    auto pct = [&](double p) { return rtts[std::min(rtts.size() - 1, (size_t)(p * rtts.size()))]; };
+    printf("%s mode, %zu round trips of %zu bytes: avg %.2f us, p50 %.2f us, p99 %.2f us\n",
+            single ? "single-threaded" : "threaded", rtts.size(), size,
+            sum / rtts.size(), pct(0.5), pct(0.99));
+    return 0;
+}
@@ -0,0 +1,296 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+
+#include "salticidae/msg.h"
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/capture.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::MsgNetwork;
+using salticidae::ConnPool;
+using salticidae::WireCapture;
+using salticidae::WireCaptureReader;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+using salticidae::Config;
+using opcode_t = uint8_t;
+using Net = MsgNetwork<opcode_t>;
+using Msg = Net::Msg;
+using steady_clock = std::chrono::steady_clock;
+
+struct Frame {
+    uint64_t ts;
+    /* the replayed connection that sends it */
+    size_t conn;
+    Msg msg;
+};
+
+/* each captured connection is replayed on a connection of its own */
+struct Replay {
+    Net::conn_t conn;
+    /* frames arrive in order on a connection, so the latency is matched
+     * against the oldest outstanding send time */
+    std::deque<steady_clock::time_point> inflight;
+};
+
+/* generate a capture file by sending `n` messages of `size` bytes over
+ * each of `nconn` local connections with the capture enabled */
+void gen_capture(const std::string &fname, int n, int size, int nconn) {
+    EventContext ec;
+    NetAddr addr("127.0.0.1:12344");
+    Net sink(ec, Net::Config().max_msg_size(size));
+    Net src(ec, Net::Config()
+        .max_msg_size(size)
+        .capture_file(fname)
+        .capture_payload(true));
+    int nrecv = 0;
+    sink.set_handler(0x1, [&](const Msg &, const Net::conn_t &) {
+        if (++nrecv == n * nconn) ec.stop();
+    });
+    src.reg_conn_handler([&](const ConnPool::conn_t &_conn, bool connected) {
+        if (!connected) return true;
+        auto conn = salticidae::static_pointer_cast<Net::Conn>(_conn);
+        for (int i = 0; i < n; i++)
+        {
+            DataStream s;
+            s << salticidae::htole((uint32_t)i);
+            bytearray_t payload(std::move(s));
+            payload.resize(size);
+            Msg msg(0x0);
+            msg.set_opcode(0x1);
+            msg.set_payload(std::move(payload));
+            msg.set_checksum();
+            src._send_msg(msg, conn);
+        }
+        return true;
+    });
+    sink.start();
+    sink.listen(addr);
+    src.start();
+    for (int i = 0; i < nconn; i++)
+        src.connect(addr);
+    ec.dispatch();
+}
+
+int main(int argc, char **argv) {
+    Config config;
+    auto opt_file = Config::OptValStr::create("salticidae.cap");
+    auto opt_dir = Config::OptValStr::create("send");
+    auto opt_speed = Config::OptValDouble::create(1);
+    auto opt_target = Config::OptValStr::create("");
+    auto opt_gen = Config::OptValInt::create(0);
+    auto opt_gen_size = Config::OptValInt::create(256);
+    auto opt_gen_conns = Config::OptValInt::create(2);
+    auto opt_help = Config::OptValFlag::create(false);
+    config.add_opt("file", opt_file, Config::SET_VAL, 'f', "capture file to replay");
+    config.add_opt("dir", opt_dir, Config::SET_VAL, 'd', "replay send, recv or all records");
+    config.add_opt("speed", opt_speed, Config::SET_VAL, 's', "time scale (0 for as fast as possible)");
+    config.add_opt("target", opt_target, Config::SET_VAL, 't', "replay to a remote endpoint instead of a local sink");
+    config.add_opt("gen", opt_gen, Config::SET_VAL, 'g', "generate a capture with n messages first");
+    config.add_opt("gen-size", opt_gen_size, Config::SET_VAL);
+    config.add_opt("gen-conns", opt_gen_conns, Config::SET_VAL);
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
+    config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        exit(0);
+    }
+    auto &fname = opt_file->get();
+    if (opt_gen->get() > 0)
+        gen_capture(fname, opt_gen->get(), opt_gen_size->get(),
+                    std::max(opt_gen_conns->get(), 1));
+
+    /* load the records */
+    auto &dir = opt_dir->get();
+    std::vector<Frame> frames;
+    std::unordered_map<uint32_t, size_t> conn_idx;
+    size_t max_len = 0, total_bytes = 0;
+    try {
+        WireCaptureReader reader(fname);
+        if (reader.get_header_size() != Msg::header_size)
+        {
+            fprintf(stderr, "header size mismatch (%zu in file, %zu expected)\n",
+                    reader.get_header_size(), Msg::header_size);
+            return 1;
+        }
+        for (WireCaptureReader::Record rec; reader.next(rec);)
+        {
+            if ((dir == "send" && rec.dir != WireCapture::SEND) ||
+                (dir == "recv" && rec.dir != WireCapture::RECV))
+                continue;
+            Msg msg(DataStream(std::move(rec.header)));
+            auto len = msg.get_length();
+            /* zero-fill the payloads that were not captured */
+            if (rec.payload.size() != len) rec.payload = bytearray_t(len);
+            msg.set_payload(std::move(rec.payload));
+            msg.set_checksum();
+            max_len = std::max(max_len, len);
+            total_bytes += len + Msg::header_size;
+            auto it = conn_idx.insert(std::make_pair(rec.conn_id, conn_idx.size())).first;
+            frames.push_back(Frame{rec.ts, it->second, std::move(msg)});
+        }
+    } catch (std::exception &err) {
+        fprintf(stderr, "cannot load %s: %s\n", fname.c_str(), err.what());
+        return 1;
+    }
+    if (frames.empty())
+    {
+        fprintf(stderr, "no records to replay\n");
+        return 1;
+    }
+    printf("loaded %zu records (%zu bytes) of %zu connections\n",
+            frames.size(), total_bytes, conn_idx.size());
+
+    EventContext ec;
+    bool local = opt_target->get().empty();
+    NetAddr target(local ? "127.0.0.1:12345" : opt_target->get());
+    auto net_config = Net::Config().max_msg_size(std::max(max_len, (size_t)1024));
+    Net sink(ec, net_config);
+    Net driver(ec, net_config);
+
+    std::vector<Replay> replays(conn_idx.size());
+    /* the connections of the sink, in the order they were accepted */
+    std::unordered_map<const ConnPool::Conn *, size_t> sink_idx;
+    size_t nconnected = 0;
+    std::vector<double> lat;
+    steady_clock::time_point t_start, t_end;
+    size_t idx = 0;
+    const double speed = opt_speed->get();
+    auto finish = [&]() {
+        t_end = steady_clock::now();
+        ec.stop();
+    };
+    for (int op = 0; op < 256; op++)
+        sink.set_handler((opcode_t)op, [&](const Msg &, const Net::conn_t &conn) {
+            auto &inflight = replays[sink_idx[conn.get()]].inflight;
+            lat.push_back(std::chrono::duration<double, std::micro>(
+                steady_clock::now() - inflight.front()).count());
+            inflight.pop_front();
+            if (lat.size() == frames.size()) finish();
+        });
+
+    TimerEvent ev_pace(ec, [&](TimerEvent &ev) {
+        auto elapsed = std::chrono::duration<double>(steady_clock::now() - t_start).count();
+        size_t burst = 0;
+        while (idx < frames.size())
+        {
+            /* older captures may hold records slightly out of order */
+            double due = std::max((int64_t)(frames[idx].ts - frames[0].ts),
+                                    (int64_t)0) / 1e9;
+            if (speed > 0)
+            {
+                due /= speed;
+                if (due > elapsed)
+                {
+                    ev.add(due - elapsed);
+                    return;
+                }
+            }
+            else if (++burst > 1000)
+            {
+                ev.add(0);
+                return;
+            }
+            auto &r = replays[frames[idx].conn];
+            r.inflight.push_back(steady_clock::now());
+            driver._send_msg(frames[idx++].msg, r.conn);
+        }
+        if (!local) finish();
+    });
+    /* the connections are opened one at a time, so that the i-th one
+     * accepted by the sink is the i-th one of the driver */
+    size_t nrequested = 1;
+    auto next_conn = [&]() {
+        if (nconnected < nrequested ||
+            (local && sink_idx.size() < nrequested))
+            return;
+        if (nrequested < replays.size())
+        {
+            nrequested++;
+            driver.connect(target);
+            return;
+        }
+        t_start = steady_clock::now();
+        ev_pace.add(0);
+    };
+    sink.reg_conn_handler([&](const ConnPool::conn_t &conn, bool connected) {
+        if (connected)
+        {
+            sink_idx.insert(std::make_pair(conn.get(), sink_idx.size()));
+            next_conn();
+        }
+        return true;
+    });
+    driver.reg_conn_handler([&](const ConnPool::conn_t &_conn, bool connected) {
+        if (connected && _conn->get_mode() == ConnPool::Conn::ACTIVE)
+        {
+            replays[nconnected++].conn = salticidae::static_pointer_cast<Net::Conn>(_conn);
+            next_conn();
+        }
+        else if (!connected && idx < frames.size())
+        {
+            fprintf(stderr, "connection lost\n");
+            finish();
+        }
+        return true;
+    });
+    if (local)
+    {
+        sink.start();
+        sink.listen(target);
+    }
+    driver.start();
+    driver.connect(target);
+    ec.dispatch();
+    driver.stop();
+    sink.stop();
+
+    double duration = std::chrono::duration<double>(t_end - t_start).count();
+    printf("replayed %zu records in %.3f sec (%.2f mps, %.2f MB/s)\n",
+            idx, duration, idx / duration, total_bytes / duration / 1e6);
+    if (!lat.empty())
+    {
+        double sum = 0;
+        for (auto &l: lat) sum += l;
+        std::sort(lat.begin(), lat.end());
+        printf("latency (us): avg %.2f p50 %.2f p99 %.2f max %.2f\n",
+                sum / lat.size(),
+                lat[lat.size() / 2],
+                lat[std::min(lat.size() - 1, lat.size() * 99 / 100)],
+                lat.back());
+    }
+    return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <signal.h>
+
+/* disable SHA256 checksum */
+#define SALTICIDAE_NOCHECKSUM
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/rpc.h"
+#include "salticidae/util.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::MsgNetwork;
+using salticidae::RPCEndpoint;
+using salticidae::TimerEvent;
+using salticidae::ThreadCall;
+using salticidae::Config;
+using salticidae::htole;
+using salticidae::letoh;
+using opcode_t = uint8_t;
+
+struct MsgReq {
+    static const opcode_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t x;
+    MsgReq(uint32_t x): x(x) { serialized << htole(x); }
+    MsgReq(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+struct MsgResp {
+    static const opcode_t opcode = 0x2;
+    DataStream serialized;
+    uint32_t x;
+    MsgResp(uint32_t x): x(x) { serialized << htole(x); }
+    MsgResp(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+const opcode_t MsgReq::opcode;
+const opcode_t MsgResp::opcode;
+
+using Net = MsgNetwork<opcode_t>;
+using RPC = RPCEndpoint<Net>;
+
+void masksigs() {
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+/* keep `depth` requests in flight for `duration` seconds */
+double run(Net &client, RPC &rpc, const salticidae::EventContext &ec,
+            const Net::conn_t &conn, size_t depth, double duration) {
+    size_t ncompleted = 0;
+    size_t nfailed = 0;
+    bool running = true;
+    std::function<void()> issue = [&]() {
+        rpc.call<MsgResp>(MsgReq(ncompleted), conn,
+            [&](RPC::Status status, MsgResp *resp) {
+                if (resp) ncompleted++;
+                else nfailed++;
+                if (running) issue();
+                else if (!rpc.get_npending()) ec.stop();
+            });
+    };
+    salticidae::ElapsedTime et;
+    et.start();
+    for (size_t i = 0; i < depth; i++) issue();
+    TimerEvent ev_stop(ec, [&](TimerEvent &) { running = false; });
+    ev_stop.add(duration);
+    ec.dispatch();
+    et.stop();
+    if (nfailed) fprintf(stderr, "%zu requests failed\n", nfailed);
+    return ncompleted / et.elapsed_sec;
+}
+
+int main(int argc, char **argv) {
+    Config config;
+    auto opt_time = Config::OptValDouble::create(5);
+    auto opt_depth = Config::OptValInt::create(0);
+    auto opt_help = Config::OptValFlag::create(false);
+    config.add_opt("time", opt_time, Config::SET_VAL, 't', "duration of each run (in seconds)");
+    config.add_opt("depth", opt_depth, Config::SET_VAL, 'd', "number of requests in flight (default: 1 and 64)");
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
+    config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        return 0;
+    }
+    NetAddr server_addr("127.0.0.1:12350");
+
+    /* the server runs in its own thread */
+    salticidae::EventContext sec;
+    Net server(sec, Net::Config());
+    RPC server_rpc(server, sec);
+    server_rpc.reg_method<MsgReq, MsgResp>(
+        [](MsgReq &&req, const Net::conn_t &, RPC::Reply<MsgResp> &&reply) {
+            reply(MsgResp(req.x));
+        });
+    ThreadCall server_tcall(sec);
+    server.start();
+    server.listen(server_addr);
+    std::thread server_thread([&]() {
+        masksigs();
+        sec.dispatch();
+    });
+
+    salticidae::EventContext ec;
+    Net client(ec, Net::Config());
+    RPC rpc(client, ec);
+    client.start();
+    auto conn = client.connect_sync(server_addr);
+
+    std::vector<size_t> depths;
+    if (opt_depth->get() > 0)
+        depths.push_back(opt_depth->get());
+    else
+        depths = {1, 64};
+    for (auto depth: depths)
+        printf("depth %zu: %.2f requests/sec\n", depth,
+                run(client, rpc, ec, conn, depth, opt_time->get()));
+
+    client.stop();
+    server_tcall.async_call([&](ThreadCall::Handle &) { sec.stop(); });
+    server_thread.join();
+    return 0;
+}
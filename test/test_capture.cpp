@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* The capture file hits the file size limit, as if the disk were full: the
+ * capture must give up and count the records it loses, while the traffic
+ * goes on. */
+
+#include <csignal>
+#include <cstdio>
+#include <sys/resource.h>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+
+struct MsgBlob {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    MsgBlob(size_t size) { serialized << bytearray_t(size, 0x5a); }
+    MsgBlob(DataStream &&) {}
+};
+
+const uint8_t MsgBlob::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const size_t nmsg = 1000;
+const size_t msg_size = 1024;
+const rlim_t file_limit = 100000;
+
+int main() {
+    const std::string fname = "test_capture.cap";
+    /* writes past the limit fail with EFBIG instead of killing the process */
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = file_limit;
+    setrlimit(RLIMIT_FSIZE, &rl);
+
+    NetAddr addr("127.0.0.1:12810");
+    EventContext ec;
+    Net receiver(ec, Net::Config());
+    Net::Config config;
+    config.capture_file(fname).capture_payload(true);
+    Net sender(ec, config);
+    size_t nrecv = 0;
+    receiver.reg_handler([&](MsgBlob &&, const Net::conn_t &) {
+        if (++nrecv == nmsg) ec.stop();
+    });
+    receiver.start();
+    receiver.listen(addr);
+    sender.start();
+    auto conn = sender.connect_sync(addr);
+    for (size_t i = 0; i < nmsg; i++)
+        sender.send_msg(MsgBlob(msg_size), conn);
+
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) { ec.stop(); });
+    ev_timeout.add(10);
+    ec.dispatch();
+    sender.stop();
+    receiver.stop();
+    size_t nlost = sender.get_capture_nlost();
+    printf("received %zu/%zu, %zu records lost\n", nrecv, nmsg, nlost);
+    remove(fname.c_str());
+    bool ok = nrecv == nmsg && nlost > 0 && nlost < nmsg;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Several updates per key are queued to a throttled connection with
+ * send_msg_conflated(): only the latest one of each key is sent, in the
+ * position of the first one, and get_nconflated() counts the superseded
+ * ones. */
+
+#include <cstdio>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgKV {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t key, ver;
+    MsgKV(uint32_t key, uint32_t ver, size_t size = 1024): key(key), ver(ver) {
+        serialized << htole(key) << htole(ver) << bytearray_t(size);
+    }
+    MsgKV(DataStream &&s) {
+        s >> key >> ver;
+        key = letoh(key);
+        ver = letoh(ver);
+    }
+};
+
+const uint8_t MsgKV::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const uint32_t nkey = 4;
+const uint32_t nver = 10;
+/* sent without a key */
+const uint32_t plug_key = 100;
+const uint32_t marker_key = 101;
+
+int main() {
+    EventContext ec;
+    NetAddr addr("127.0.0.1:12730");
+    Net::Config config;
+    config.max_msg_size(1 << 20);
+    Net receiver(ec, config);
+    /* the plug at the head of the queue holds back the rest for a while */
+    config.conn_send_rate(65536).conn_send_burst(4096);
+    Net sender(ec, config);
+    std::vector<std::pair<uint32_t, uint32_t>> recv;
+    bool ok = false;
+
+    receiver.reg_handler([&](MsgKV &&msg, const Net::conn_t &) {
+        recv.push_back(std::make_pair(msg.key, msg.ver));
+    });
+    receiver.start();
+    sender.start();
+    receiver.listen(addr);
+    auto conn = sender.connect_sync(addr);
+
+    bool queued = sender.send_msg(MsgKV(plug_key, 0, 65536), conn);
+    for (uint32_t v = 0; v < nver; v++)
+    {
+        for (uint32_t k = 0; k < nkey; k++)
+            queued &= sender.send_msg_conflated(MsgKV(k, v), conn, k);
+        /* queued after the first update of each key */
+        if (v == 0) queued &= sender.send_msg(MsgKV(marker_key, 0), conn);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> expected;
+    expected.push_back(std::make_pair(plug_key, 0));
+    for (uint32_t k = 0; k < nkey; k++)
+        expected.push_back(std::make_pair(k, nver - 1));
+    expected.push_back(std::make_pair(marker_key, 0));
+
+    TimerEvent ev_check(ec, [&](TimerEvent &ev) {
+        if (recv.size() < expected.size())
+        {
+            ev.add(0.1);
+            return;
+        }
+        ec.stop();
+    });
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) { ec.stop(); });
+    ev_check.add(0.1);
+    ev_timeout.add(10);
+    ec.dispatch();
+    /* anything sent beyond the expected messages would be there by now */
+    ev_timeout.add(0.5);
+    ec.dispatch();
+    size_t nconflated = sender.get_nconflated();
+    sender.stop();
+    receiver.stop();
+
+    printf("received:");
+    for (auto &r: recv) printf(" %u:%u", r.first, r.second);
+    printf("\nsuperseded: %zu\n", nconflated);
+    if (!queued)
+        printf("FAIL: the messages were not queued\n");
+    else if (recv != expected)
+        printf("FAIL: expected only the latest update of each key, in order\n");
+    else if (nconflated != nkey * (nver - 1))
+        printf("FAIL: expected %u superseded updates\n", nkey * (nver - 1));
+    else ok = true;
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Check SipHash-2-4 against the reference vectors, then send copies of
+ * messages through two connections to a server with two workers that
+ * deduplicates them: by a digest of the payload, and by an ID with a
+ * filter so small that the old IDs are forgotten early. */
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgData {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t data;
+    MsgData(uint32_t data): data(data) { serialized << htole(data); }
+    MsgData(DataStream &&s) { s >> data; data = letoh(data); }
+};
+
+struct MsgId {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint64_t id;
+    MsgId(uint64_t id): id(id) { serialized << htole(id); }
+    MsgId(DataStream &&s) { s >> id; id = letoh(id); }
+};
+
+const uint8_t MsgData::opcode;
+const uint8_t MsgId::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+/* the 64-bit outputs for the key 00..0f and the message 00..(len - 1) */
+const std::vector<std::pair<size_t, uint64_t>> sip_vectors = {
+    {0, 0x726fdb47dd0e0e31ULL},
+    {1, 0x74f839c593dc67fdULL},
+    {2, 0x0d6c8009d9a94f5aULL},
+    {3, 0x85676696d7fb7e2dULL},
+    {7, 0xab0200f58b01d137ULL},
+    {8, 0x93f5f5799a932462ULL},
+    {15, 0xa129ca6149be45e5ULL},
+    {63, 0x958a324ceb064572ULL},
+};
+
+const uint64_t nid = 256;
+
+int main() {
+    uint8_t key[16], data[64];
+    for (size_t i = 0; i < sizeof(key); i++) key[i] = i;
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = i;
+    for (auto &v: sip_vectors)
+        if (salticidae::siphash24(key, data, v.first) != v.second)
+        {
+            printf("FAIL: siphash24 of %zu bytes\n", v.first);
+            return 1;
+        }
+
+    EventContext ec;
+    NetAddr server_addr("127.0.0.1:12850");
+    Net::Config sconfig;
+    sconfig.dedup(MsgData::opcode, 60)
+        .dedup(MsgId::opcode, 60, [](const salticidae::bytearray_t &payload) {
+            uint64_t id;
+            memmove(&id, payload.data(), sizeof(id));
+            return letoh(id);
+        }, 64);
+    sconfig.nworker(2);
+    Net server(ec, sconfig);
+    Net client(ec, Net::Config());
+    std::vector<uint32_t> datas;
+    std::vector<uint64_t> ids;
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    bool ok = false;
+
+    server.reg_handler([&](MsgData &&msg, const Net::conn_t &) {
+        datas.push_back(msg.data);
+    });
+    server.reg_handler([&](MsgId &&msg, const Net::conn_t &) {
+        ids.push_back(msg.id);
+    });
+    server.start();
+    client.start();
+    server.listen(server_addr);
+    Net::conn_t conns[2] = {
+        client.connect_sync(server_addr),
+        client.connect_sync(server_addr)};
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    auto fail = [&](const char *err) {
+        printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        /* the same payload through both connections, then another one */
+        {[&]() {
+            client.send_msg(MsgData(1), conns[0]);
+            client.send_msg(MsgData(1), conns[1]);
+            client.send_msg(MsgData(2), conns[1]);
+        }, [&]() { return server.get_ndup() == 1 && datas.size() == 2; }},
+        /* fill the small filter many times over, the last ID is still
+         * there while the first one is long gone */
+        {[&]() {
+            if (datas[0] != 1 && datas[1] != 1)
+                return fail("the duplicated payload is lost");
+            for (uint64_t i = 0; i < nid; i++)
+                client.send_msg(MsgId(i), conns[0]);
+            client.send_msg(MsgId(nid - 1), conns[1]);
+        }, [&]() { return ids.size() == nid && server.get_ndup() == 2; }},
+        {[&]() { client.send_msg(MsgId(0), conns[1]); },
+            [&]() { return ids.size() == nid + 1; }},
+        /* give the stray copies time to show up */
+        {[&]() { after(0.3, [&]() {
+            if (ids.size() != nid + 1 || datas.size() != 2 || server.get_ndup() != 2)
+                return fail("a copy got through");
+            ok = true;
+            ec.stop();
+        }); }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    steps[0].first();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.02, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.02, *poll);
+    };
+    after(0.02, *poll);
+    after(10, [&]() {
+        printf("FAIL: timed out at step %zu (%zu IDs, %zu dup)\n",
+                idx, ids.size(), server.get_ndup());
+        ec.stop();
+    });
+    ec.dispatch();
+    timers.clear();
+    client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Node A runs four dispatcher shards and is connected to B, C and D. The
+ * calls that do not name a single connection (has_peer(), multicasts and
+ * deferred sends) are handled by the shards owning the peers: a peer is
+ * known as soon as add_peer() has been called, and each multicast is
+ * delivered once per chosen peer, with one error for the peers that are
+ * missing. Sending to the nearest peers counts a duplicate once, and tells
+ * a partial send (fewer peers connected than asked for) apart. */
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::PeerId;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+using Net = salticidae::PeerNetwork<uint8_t>;
+
+struct MsgTag {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t seq;
+    MsgTag(uint32_t seq): seq(seq) { serialized << htole(seq); }
+    MsgTag(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+const uint8_t MsgTag::opcode;
+
+const size_t nnode = 4;
+const size_t nshard = 4;
+const size_t nunknown = 64;
+
+NetAddr node_addr(size_t i) {
+    return NetAddr("127.0.0.1:" + std::to_string(12830 + i));
+}
+
+int main() {
+    EventContext ec;
+    std::vector<salticidae::BoxObj<Net>> nets;
+    /* the tags received by each node */
+    std::vector<std::vector<size_t>> ntag(nnode, std::vector<size_t>(5));
+    std::vector<int32_t> err_ids;
+    std::vector<int> err_codes;
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    std::vector<PeerId> peers;
+    PeerId a(node_addr(0));
+    PeerId missing(NetAddr("127.0.0.1:12839"));
+    /* known but never connected */
+    PeerId idle(NetAddr("10.0.0.1:1"));
+    int32_t mc_id = -1;
+    bool ok = false;
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    auto fail = [&](const char *err) {
+        printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+
+    for (size_t i = 0; i < nnode; i++)
+    {
+        Net::Config config;
+        config.ping_period(0.2).conn_timeout(10);
+        if (i == 0) config.nworker(nshard).ndispatcher(nshard);
+        nets.emplace_back(new Net(ec, config));
+        auto &net = nets.back();
+        net->reg_handler([&ntag, i](MsgTag &&msg, const Net::conn_t &) {
+            if (msg.seq < ntag[i].size()) ntag[i][msg.seq]++;
+        });
+        net->start();
+        net->listen(node_addr(i));
+    }
+    nets[0]->reg_error_handler([&](const std::exception_ptr err, bool, int32_t id) {
+        err_ids.push_back(id);
+        try {
+            std::rethrow_exception(err);
+        } catch (salticidae::SalticidaeError &e) {
+            err_codes.push_back(e.get_code());
+        } catch (...) {
+            err_codes.push_back(-1);
+        }
+    });
+
+    /* the peers land on all shards, and each is known right away */
+    for (size_t i = 0; i < nunknown; i++)
+    {
+        PeerId pid(NetAddr("10.0.0." + std::to_string(i + 1) + ":1"));
+        nets[0]->add_peer(pid);
+        if (!nets[0]->has_peer(pid))
+        {
+            printf("FAIL: a peer just added is unknown\n");
+            return 1;
+        }
+    }
+    for (size_t i = 1; i < nnode; i++)
+    {
+        PeerId pid(node_addr(i));
+        peers.push_back(pid);
+        nets[0]->add_peer(pid);
+        nets[0]->set_peer_addr(pid, node_addr(i));
+        nets[0]->conn_peer(pid, -1, 1);
+        nets[i]->add_peer(a);
+        nets[i]->set_peer_addr(a, node_addr(0));
+    }
+
+    auto count = [&](uint32_t seq) {
+        size_t cnt = 0;
+        for (size_t i = 1; i < nnode; i++) cnt += ntag[i][seq];
+        return cnt;
+    };
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        /* all links are up and have been sampled */
+        {[]() {}, [&]() {
+            for (auto &pid: peers)
+                if (nets[0]->get_peer_rtt(pid).srtt < 0) return false;
+            return true;
+        }},
+        /* to everyone, and to a peer that does not exist */
+        {[&]() {
+            auto to = peers;
+            to.push_back(missing);
+            mc_id = nets[0]->multicast_msg(MsgTag(1), to);
+        }, [&]() { return count(1) == nnode - 1 && err_ids.size() == 1; }},
+        {[&]() {
+            if (err_ids[0] != mc_id) return fail("the error is not for the multicast");
+            nets[0]->multicast_msg_nearest(MsgTag(2), peers, 2);
+        }, [&]() { return count(2) == 2; }},
+        {[&]() {
+            auto conn = nets[0]->get_peer_conn(peers[2]);
+            static_cast<Net::MsgNet &>(*nets[0]).send_msg_deferred(MsgTag(3), conn);
+        }, [&]() { return ntag[3][3] == 1; }},
+        /* two of the three peers are distinct, and only one is connected */
+        {[&]() {
+            mc_id = nets[0]->multicast_msg_nearest(MsgTag(4), {peers[0], idle, peers[0]}, 3);
+        }, [&]() { return ntag[1][4] == 1 && err_ids.size() == 2; }},
+        /* give the duplicates and stray errors time to show up */
+        {[&]() { after(0.5, [&]() {
+            for (size_t i = 1; i < nnode; i++)
+                if (ntag[i][1] != 1 || ntag[i][2] > 1 || ntag[i][3] > (i == 3) ||
+                    ntag[i][4] > (i == 1))
+                    return fail("a message is duplicated");
+            if (err_ids.size() != 2)
+                return fail("an unexpected error is reported");
+            if (err_ids[1] != mc_id ||
+                err_codes[1] != salticidae::SALTI_ERROR_MULTICAST_PARTIAL)
+                return fail("the partial send is not reported as such");
+            if (nets[0]->get_npending() != 0)
+                return fail("a connection is left pending");
+            ok = true;
+            ec.stop();
+        }); }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.05, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.05, *poll);
+    };
+    after(0.05, *poll);
+    after(15, [&]() {
+        printf("FAIL: timed out at step %zu\n", idx);
+        ec.stop();
+    });
+    ec.dispatch();
+    for (auto &net: nets) net->stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A pool in the elastic mode adds a worker under load and retires it once
+ * the load is gone; the connections moved either way keep delivering, in
+ * order, in both directions. The calls that reach a retired worker run on
+ * the dispatcher instead. */
+
+#include <cstdio>
+#include <functional>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::ThreadCall;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgLoad {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t id;
+    uint32_t seq;
+    size_t size;
+    MsgLoad(uint32_t id, uint32_t seq, size_t size):
+            id(id), seq(seq), size(size) {
+        serialized << htole(id) << htole(seq);
+        serialized.put_data(salticidae::bytearray_t(size, seq & 0xff));
+    }
+    MsgLoad(DataStream &&s) {
+        s >> id >> seq;
+        id = letoh(id);
+        seq = letoh(seq);
+        size = s.size();
+    }
+};
+
+struct MsgAck {
+    static const uint8_t opcode = 0x2;
+    DataStream serialized;
+    uint32_t seq;
+    MsgAck(uint32_t seq): seq(seq) { serialized << htole(seq); }
+    MsgAck(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+const uint8_t MsgLoad::opcode;
+const uint8_t MsgAck::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const size_t nclient = 4;
+const size_t load_size = 64 << 10;
+const size_t nfinal = 20;
+
+/* the calls queued on a parked loop, or posted after it stopped, run on the
+ * loop it forwards to */
+bool check_parked_forward() {
+    EventContext ec, ec_parked;
+    ThreadCall tcall(ec), parked(ec_parked);
+    size_t nrun = 0;
+    auto count = [&](ThreadCall::Handle &) {
+        if (++nrun == 2) ec.stop();
+    };
+    parked.async_call([&](ThreadCall::Handle &) {
+        parked.forward_to(&tcall);
+        ec_parked.stop();
+    });
+    parked.async_call(count);
+    ec_parked.dispatch();
+    parked.async_call(count);
+    TimerEvent timeout(ec, [&](TimerEvent &) { ec.stop(); });
+    timeout.add(5);
+    ec.dispatch();
+    return nrun == 2;
+}
+
+int main() {
+    if (!check_parked_forward())
+    {
+        printf("FAIL: a call to a parked worker is lost\n");
+        return 1;
+    }
+    EventContext ec;
+    NetAddr server_addr("127.0.0.1:12770");
+    Net::Config sconfig;
+    sconfig.max_msg_size(load_size + 1024);
+    sconfig.nworker(1)
+        .elastic_workers(1, 2, 0.2, 0.1)
+        .elastic_period(0.1);
+    Net server(ec, sconfig);
+    Net::Config cconfig;
+    cconfig.max_msg_size(load_size + 1024);
+    Net client(ec, cconfig);
+
+    std::vector<Net::conn_t> conns;
+    std::vector<uint32_t> sent(nclient), delivered(nclient);
+    std::vector<uint32_t> at_grow(nclient), acked(nclient);
+    bool loading = true;
+    size_t nmoved = 0;
+    bool ok = false;
+    enum { GROW, SPREAD, RETIRE, SETTLE, FINAL } phase = GROW;
+
+    auto finish = [&](const char *err) {
+        if (err) printf("FAIL: %s\n", err);
+        else ok = true;
+        ec.stop();
+    };
+    server.reg_handler([&](MsgLoad &&msg, const Net::conn_t &conn) {
+        if (msg.id >= nclient || msg.seq != delivered[msg.id])
+            return finish("a message is lost or out of order");
+        delivered[msg.id]++;
+        /* the final round is acked through the same connection */
+        if (!msg.size)
+            server.send_msg(MsgAck(msg.seq), conn);
+    });
+    client.reg_handler([&](MsgAck &&msg, const Net::conn_t &conn) {
+        for (size_t i = 0; i < nclient; i++)
+            if (conns[i] == conn)
+            {
+                if (msg.seq != sent[i] - nfinal + acked[i])
+                    return finish("an ack is lost or out of order");
+                acked[i]++;
+            }
+    });
+
+    server.start();
+    client.start();
+    server.listen(server_addr);
+    for (size_t i = 0; i < nclient; i++)
+        conns.push_back(client.connect_sync(server_addr));
+
+    TimerEvent pump(ec, [&](TimerEvent &ev) {
+        if (loading)
+            for (size_t i = 0; i < nclient; i++)
+                while (conns[i]->get_send_backlog() < 4 * load_size)
+                    client.send_msg(MsgLoad(i, sent[i]++, load_size), conns[i]);
+        ev.add(0.005);
+    });
+    pump.add(0);
+
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    TimerEvent check(ec, [&](TimerEvent &ev) {
+        switch (phase)
+        {
+        case GROW:
+            if (server.get_nactive_worker() == 2 && server.get_nmigrated() > 0)
+            {
+                printf("grown at utilization %.2f, %zu moved\n",
+                        server.get_worker_util(), server.get_nmigrated());
+                at_grow = delivered;
+                phase = SPREAD;
+                /* keep the load on the moved connections for a while */
+                after(1, [&]() {
+                    for (size_t i = 0; i < nclient; i++)
+                        if (delivered[i] <= at_grow[i])
+                            return finish("a connection stalled after the move");
+                    loading = false;
+                    nmoved = server.get_nmigrated();
+                    phase = RETIRE;
+                });
+            }
+            break;
+        case RETIRE:
+            if (server.get_nactive_worker() == 1)
+            {
+                printf("retiring at utilization %.2f\n", server.get_worker_util());
+                phase = SETTLE;
+                /* long enough for the worker to be stopped */
+                after(1, [&]() {
+                    if (server.get_nactive_worker() != 1)
+                        return finish("the retired worker came back");
+                    if (server.get_nmigrated() <= nmoved)
+                        return finish("no connection was moved back");
+                    for (size_t i = 0; i < nclient; i++)
+                        for (size_t j = 0; j < nfinal; j++)
+                            client.send_msg(MsgLoad(i, sent[i]++, 0), conns[i]);
+                    phase = FINAL;
+                });
+            }
+            break;
+        case FINAL:
+            {
+                bool done = true;
+                for (size_t i = 0; i < nclient; i++)
+                    done &= delivered[i] == sent[i] && acked[i] == nfinal;
+                if (done) return finish(nullptr);
+            }
+            break;
+        default:;
+        }
+        ev.add(0.05);
+    });
+    check.add(0);
+    after(30, [&]() { finish("timed out"); });
+
+    ec.dispatch();
+    pump.clear();
+    check.clear();
+    timers.clear();
+    conns.clear();
+    client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
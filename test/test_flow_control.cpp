@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "salticidae/msg.h"
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/stream.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::MsgNetwork;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+using salticidae::htole;
+using salticidae::letoh;
+
+const size_t window = 64 << 10;
+const uint32_t nmsgs = 64;
+
+/* every fourth message is larger than the window */
+size_t msg_size(uint32_t id) { return id % 4 ? 8 << 10 : 3 * window + 17; }
+
+struct MsgBytes {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t id;
+    bytearray_t bytes;
+    MsgBytes(uint32_t id): id(id) {
+        serialized << htole(id) << bytearray_t(msg_size(id), (uint8_t)id);
+    }
+    MsgBytes(DataStream &&s) {
+        s >> id;
+        id = letoh(id);
+        auto len = s.size();
+        auto base = s.get_data_inplace(len);
+        bytes = bytearray_t(base, base + len);
+    }
+};
+
+const uint8_t MsgBytes::opcode;
+
+using MsgNetworkByteOp = MsgNetwork<uint8_t>;
+
+struct MyNet: public MsgNetworkByteOp {
+    const std::string name;
+    uint32_t nrecv;
+    bool failed;
+
+    MyNet(const salticidae::EventContext &ec, const std::string name,
+            size_t window):
+            MsgNetworkByteOp(ec, MsgNetworkByteOp::Config()
+                .max_msg_size(1 << 20)
+                .flow_control(window)),
+            name(name), nrecv(0), failed(false) {
+        reg_handler([this](MsgBytes &&msg, const conn_t &) {
+            bool ok = msg.id == nrecv && msg.bytes.size() == msg_size(msg.id);
+            for (auto b: msg.bytes)
+                if (b != (uint8_t)msg.id) ok = false;
+            if (!ok)
+            {
+                fprintf(stderr, "[%s] unexpected message %u\n",
+                        this->name.c_str(), msg.id);
+                failed = true;
+            }
+            nrecv++;
+        });
+        reg_conn_handler([this](const ConnPool::conn_t &conn, bool connected) {
+            if (!connected) return true;
+            /* both ends flood each other at the same time */
+            auto c = salticidae::static_pointer_cast<Conn>(conn);
+            for (uint32_t i = 0; i < nmsgs; i++)
+                send_msg(MsgBytes(i), c);
+            return true;
+        });
+    }
+
+    bool done() const { return nrecv == nmsgs; }
+};
+
+int main() {
+    salticidae::EventContext ec;
+    NetAddr alice_addr("127.0.0.1:12400");
+    NetAddr carol_addr("127.0.0.1:12401");
+    MyNet alice(ec, "alice", window), bob(ec, "bob", window);
+    /* only one end of the second pair uses flow control */
+    MyNet carol(ec, "carol", window), dave(ec, "dave", 0);
+    for (auto net: {&alice, &bob, &carol, &dave}) net->start();
+    alice.listen(alice_addr);
+    carol.listen(carol_addr);
+    bob.connect(alice_addr);
+    dave.connect(carol_addr);
+
+    int ret = 1;
+    TimerEvent ev_check(ec, [&](TimerEvent &ev) {
+        if (alice.failed || bob.failed || carol.failed || dave.failed)
+        {
+            ec.stop();
+            return;
+        }
+        if (alice.done() && bob.done() && carol.done() && dave.done())
+        {
+            ret = 0;
+            ec.stop();
+            return;
+        }
+        ev.add(0.01);
+    });
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) {
+        fprintf(stderr, "timed out: alice got %u, bob got %u, carol got %u, "
+                "dave got %u of %u messages\n",
+                alice.nrecv, bob.nrecv, carol.nrecv, dave.nrecv, nmsgs);
+        ec.stop();
+    });
+    ev_check.add(0.01);
+    ev_timeout.add(10);
+    ec.dispatch();
+    size_t nblocked = alice.get_nflow_blocked() + bob.get_nflow_blocked();
+    if (!ret && !nblocked)
+    {
+        fprintf(stderr, "the senders never waited for credit\n");
+        ret = 1;
+    }
+    printf("%s (waited for credit %zu times)\n", ret ? "FAIL" : "PASS", nblocked);
+    return ret;
+}
@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A message received by the relay is framed once and forwarded to several
+ * plain sockets: each of them reads exactly the bytes of the frame, and
+ * the frame is no longer held by the connections once it is sent. */
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgData {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    MsgData(size_t size) {
+        bytearray_t data(size);
+        for (size_t i = 0; i < size; i++) data[i] = i * 7;
+        serialized << data;
+    }
+    MsgData(DataStream &&) {}
+};
+
+const uint8_t MsgData::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const size_t nsink = 3;
+/* large enough to be sent in several chunks */
+const size_t payload_size = 1 << 20;
+
+int main() {
+    EventContext ec;
+    NetAddr relay_addr("127.0.0.1:12900");
+    Net::Config config;
+    config.max_msg_size(payload_size + 64);
+    Net relay(ec, config);
+    Net source(ec, config);
+    std::vector<Net::conn_t> sink_conns;
+    Net::frame_t frame;
+    std::vector<int> fds;
+    std::vector<bytearray_t> recvd(nsink);
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    bool ok = false;
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    auto fail = [&](const char *err) {
+        printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+
+    relay.reg_conn_handler([&](const salticidae::ConnPool::conn_t &conn, bool connected) {
+        /* the sinks connect first */
+        if (connected && sink_conns.size() < nsink)
+            sink_conns.push_back(salticidae::static_pointer_cast<Net::Conn>(conn));
+        return true;
+    });
+    relay.set_handler(MsgData::opcode, [&](const Net::Msg &msg, const Net::conn_t &) {
+        frame = Net::make_frame(msg);
+        for (auto &conn: sink_conns)
+            if (!relay.forward_msg(frame, conn))
+                return fail("the frame is not accepted");
+    });
+    relay.start();
+    source.start();
+    relay.listen(relay_addr);
+
+    for (size_t i = 0; i < nsink; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = relay_addr.ip;
+        sin.sin_port = relay_addr.port;
+        if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        {
+            printf("FAIL: cannot connect a sink\n");
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+
+    auto all_read = [&]() {
+        uint8_t buff[65536];
+        bool done = true;
+        for (size_t i = 0; i < nsink; i++)
+        {
+            ssize_t ret;
+            while ((ret = recv(fds[i], buff, sizeof(buff), MSG_DONTWAIT)) > 0)
+                recvd[i].insert(recvd[i].end(), buff, buff + ret);
+            done &= frame && recvd[i].size() >= frame->size();
+        }
+        return done;
+    };
+
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        {[]() {}, [&]() { return sink_conns.size() == nsink; }},
+        {[&]() {
+            source.send_msg(MsgData(payload_size), source.connect_sync(relay_addr));
+        }, all_read},
+        /* the buffers go as soon as the last bytes are written */
+        {[]() {}, [&]() { return frame.get_cnt() == 1; }},
+        {[&]() {
+            for (auto &r: recvd)
+                if (r != *frame) return fail("a sink got different bytes");
+            ok = true;
+            ec.stop();
+        }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.01, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.01, *poll);
+    };
+    after(0.01, *poll);
+    after(10, [&]() {
+        printf("FAIL: timed out at step %zu (the frame has %zu references)\n",
+                idx, frame.get_cnt());
+        ec.stop();
+    });
+    ec.dispatch();
+    for (auto fd: fds) close(fd);
+    timers.clear();
+    sink_conns.clear();
+    source.stop();
+    relay.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
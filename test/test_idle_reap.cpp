@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ClientNetwork closes a client that has been quiet for idle_timeout, keeps
+ * the one that talks, and lets go of a client that left by itself without
+ * waiting for the idle check. */
+
+#include <cstdio>
+#include <functional>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgEcho {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t x;
+    MsgEcho(uint32_t x): x(x) { serialized << htole(x); }
+    MsgEcho(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+const uint8_t MsgEcho::opcode;
+
+using Net = salticidae::ClientNetwork<uint8_t>;
+using Client = salticidae::MsgNetwork<uint8_t>;
+
+int main() {
+    EventContext ec;
+    NetAddr server_addr("127.0.0.1:12710");
+    Net::Config config;
+    config.idle_timeout(1);
+    config.nworker(2);
+    Net server(ec, config);
+    Client client(ec, Client::Config());
+    std::vector<Net::conn_t> accepted;
+    size_t nclosed = 0;
+    Client::conn_t leaver, quiet, chatty;
+    bool ok = false;
+
+    server.reg_conn_handler([&](const salticidae::ConnPool::conn_t &conn, bool connected) {
+        if (connected)
+            accepted.push_back(salticidae::static_pointer_cast<Net::Conn>(conn));
+        else
+            nclosed++;
+        return true;
+    });
+    server.reg_handler([](MsgEcho &&, const Net::conn_t &) {});
+
+    auto finish = [&](const char *err) {
+        if (err) printf("FAIL: %s\n", err);
+        else ok = true;
+        ec.stop();
+    };
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    auto talk = std::make_shared<std::function<void()>>();
+    *talk = [&, talk]() {
+        if (chatty->is_terminated()) return;
+        client.send_msg(MsgEcho(0), chatty);
+        after(0.1, *talk);
+    };
+
+    server.start();
+    client.start();
+    server.listen(server_addr);
+
+    /* a client that leaves by itself */
+    leaver = client.connect_sync(server_addr);
+    after(0.2, [&]() { client.terminate(leaver); });
+    after(0.6, [&]() {
+        if (accepted.size() != 1 || nclosed != 1)
+            return finish("the first client did not come and go");
+        /* only held by the test */
+        if (accepted[0].get_cnt() != 1)
+            return finish("the closed connection is still referenced");
+        accepted.clear();
+        /* two more clients, one of which keeps talking */
+        quiet = client.connect_sync(server_addr);
+        chatty = client.connect_sync(server_addr);
+        (*talk)();
+        after(2.5, [&]() {
+            if (server.get_nidle_reaped() != 1 || nclosed != 2)
+                return finish("the quiet client was not reaped");
+            if (chatty->is_terminated())
+                return finish("the talking client was reaped");
+            if (!quiet->is_terminated())
+                return finish("the quiet client is still connected");
+            finish(nullptr);
+        });
+    });
+    after(10, [&]() { finish("timed out"); });
+    ec.dispatch();
+    accepted.clear();
+    client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
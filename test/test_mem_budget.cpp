@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Several senders stream messages larger than the fair share of the memory
+ * budget of the receiver, and one sends a message larger than the whole
+ * budget. Reading pauses as the budget runs out, but each connection must
+ * still finish the message it has started, so everything arrives. */
+
+#include <cstdio>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+
+struct MsgBlob {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    MsgBlob(size_t size) { serialized << bytearray_t(size, 0x5a); }
+    MsgBlob(DataStream &&) {}
+};
+
+const uint8_t MsgBlob::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const size_t budget = 65536;
+const size_t nsender = 4;
+const size_t nmsg = 16;
+const size_t msg_size = 40000;
+const size_t large_size = 200000;
+
+int main() {
+    NetAddr addr("127.0.0.1:12800");
+    EventContext ec;
+    Net::Config config;
+    config.mem_budget(budget);
+    config.max_msg_size(1 << 20);
+    Net receiver(ec, config);
+    std::vector<salticidae::BoxObj<Net>> senders;
+    size_t nrecv = 0;
+    receiver.reg_handler([&](MsgBlob &&, const Net::conn_t &) { nrecv++; });
+    receiver.start();
+    receiver.listen(addr);
+    for (size_t i = 0; i < nsender; i++)
+    {
+        Net::Config sconfig;
+        sconfig.max_msg_size(1 << 20);
+        senders.emplace_back(new Net(ec, sconfig));
+        auto &sender = senders.back();
+        sender->start();
+        auto conn = sender->connect_sync(addr);
+        for (size_t j = 0; j < nmsg; j++)
+            sender->send_msg(MsgBlob(msg_size), conn);
+        if (i == 0) sender->send_msg(MsgBlob(large_size), conn);
+    }
+
+    const size_t total = nsender * nmsg + 1;
+    TimerEvent ev_poll(ec, [&](TimerEvent &ev) {
+        if (nrecv == total) ec.stop();
+        else ev.add(0.05);
+    });
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) { ec.stop(); });
+    ev_poll.add(0.05);
+    ev_timeout.add(20);
+    ec.dispatch();
+
+    auto stats = receiver.get_mem_stats();
+    printf("received %zu/%zu, paused %zu times, %zu bytes held\n",
+        nrecv, total, stats.npaused, stats.used);
+    for (auto &sender: senders) sender->stop();
+    receiver.stop();
+    bool ok = nrecv == total && stats.npaused > 0;
+    if (!stats.npaused) printf("FAIL: the budget was never exhausted\n");
+    else if (!ok) printf("FAIL: the receiver stalled\n");
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -203,6 +203,9 @@ int main(int argc, char **argv) {
     auto opt_npeers = Config::OptValInt::create(5);
     auto opt_recv_chunk_size = Config::OptValInt::create(4096);
     auto opt_nworker = Config::OptValInt::create(2);
+    auto opt_ndispatcher = Config::OptValInt::create(1);
+    auto opt_worker_group = Config::OptValInt::create(0);
+    auto opt_max_worker = Config::OptValInt::create(0);
     auto opt_conn_timeout = Config::OptValDouble::create(5);
     auto opt_ping_peroid = Config::OptValDouble::create(2);
     auto opt_tls = Config::OptValFlag::create(false);
@@ -211,6 +214,9 @@ int main(int argc, char **argv) {
     config.add_opt("npeers", opt_npeers, Config::SET_VAL);
     config.add_opt("seg-buff-size", opt_recv_chunk_size, Config::SET_VAL);
     config.add_opt("nworker", opt_nworker, Config::SET_VAL);
+    config.add_opt("ndispatcher", opt_ndispatcher, Config::SET_VAL);
+    config.add_opt("worker-group", opt_worker_group, Config::SET_VAL);
+    config.add_opt("max-worker", opt_max_worker, Config::SET_VAL);
     config.add_opt("conn-timeout", opt_conn_timeout, Config::SET_VAL);
     config.add_opt("ping-period", opt_ping_peroid, Config::SET_VAL);
     config.add_opt("tls", opt_tls, Config::SWITCH_ON, 't');
@@ -227,6 +233,9 @@ int main(int argc, char **argv) {
     std::vector<AppContext> apps;
     std::vector<std::thread> threads;
     use_tls = opt_tls->get();
+    salticidae::ArcObj<salticidae::WorkerGroup> group(
+        opt_worker_group->get() > 0 ?
+            new salticidae::WorkerGroup(opt_worker_group->get()) : nullptr);
     apps.resize(addrs.size());
     for (size_t i = 0; i < apps.size(); i++)
     {
@@ -243,8 +252,12 @@ int main(int argc, char **argv) {
             valid_certs.insert(salticidae::get_hash(tls_cert->get_der()));
         }
         else cfg.enable_tls(false);
+        if (opt_max_worker->get() > 0)
+            cfg.elastic_workers(opt_nworker->get(), opt_max_worker->get());
         a.net = new MyNet(a.ec, MyNet::Config(cfg
                     .nworker(opt_nworker->get())
+                    .ndispatcher(opt_ndispatcher->get())
+                    .worker_group(group)
                     .recv_chunk_size(recv_chunk_size))
                         .conn_timeout(opt_conn_timeout->get())
                         .ping_period(opt_ping_peroid->get())
@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Node A is connected to B and C. C keeps A's link busy with a rate-limited
+ * stream, so its heartbeat pongs queue behind the data. A must still notice
+ * that C has become far away and prefer B when sending to the nearest peer. */
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::PeerId;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+using Net = salticidae::PeerNetwork<uint8_t>;
+
+struct MsgTag {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t seq;
+    MsgTag(uint32_t seq): seq(seq) { serialized << htole(seq); }
+    MsgTag(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+struct MsgBulk {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    MsgBulk(size_t size) { serialized << salticidae::bytearray_t(size, 0x5a); }
+    MsgBulk(DataStream &&) {}
+};
+
+const uint8_t MsgTag::opcode;
+const uint8_t MsgBulk::opcode;
+
+const size_t nnode = 3;
+/* C streams a little faster than it is allowed to send */
+const double send_rate = 100000;
+const size_t bulk_size = 2200;
+const double bulk_period = 0.02;
+
+NetAddr node_addr(size_t i) {
+    return NetAddr("127.0.0.1:" + std::to_string(12600 + i));
+}
+
+int main() {
+    EventContext ec;
+    std::vector<salticidae::BoxObj<Net>> nets;
+    std::vector<size_t> ntag(nnode), nbulk(nnode);
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    PeerId a(node_addr(0)), b(node_addr(1)), c(node_addr(2));
+    bool ok = false;
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+
+    for (size_t i = 0; i < nnode; i++)
+    {
+        Net::Config config;
+        config.ping_period(0.2)
+            .conn_timeout(10)
+            .rtt_probe_period(0.5);
+        config.max_msg_size(65536);
+        nets.emplace_back(new Net(ec, config));
+        auto &net = nets.back();
+        net->reg_handler([&ntag, i](MsgTag &&, const Net::conn_t &) { ntag[i]++; });
+        net->reg_handler([&nbulk, i](MsgBulk &&, const Net::conn_t &) { nbulk[i]++; });
+        net->start();
+        net->listen(node_addr(i));
+    }
+    /* A connects to B and C */
+    for (size_t i = 1; i < nnode; i++)
+    {
+        PeerId pid(node_addr(i));
+        nets[0]->add_peer(pid);
+        nets[0]->set_peer_addr(pid, node_addr(i));
+        nets[0]->conn_peer(pid, -1, 1);
+        nets[i]->add_peer(a);
+        nets[i]->set_peer_addr(a, node_addr(0));
+    }
+
+    auto stream = std::make_shared<std::function<void()>>();
+    *stream = [&, stream]() {
+        nets[2]->send_msg(MsgBulk(bulk_size), a);
+        after(bulk_period, *stream);
+    };
+
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        /* both links are up and have been sampled */
+        {[]() {}, [&]() {
+            return nets[0]->get_peer_rtt(b).srtt >= 0 &&
+                nets[0]->get_peer_rtt(c).srtt >= 0;
+        }},
+        /* C starts streaming to A with a backlog of about 0.3s */
+        {[&]() {
+            printf("initial srtt: B %.6f, C %.6f\n",
+                nets[0]->get_peer_rtt(b).srtt, nets[0]->get_peer_rtt(c).srtt);
+            nets[2]->set_peer_send_rate(a, send_rate, 8192);
+            for (size_t i = 0; i < 14; i++)
+                nets[2]->send_msg(MsgBulk(bulk_size), a);
+            (*stream)();
+        }, [&]() { return nets[0]->get_peer_rtt(c).srtt > 0.1; }},
+        {[&]() {
+            auto rtt_b = nets[0]->get_peer_rtt(b);
+            auto rtt_c = nets[0]->get_peer_rtt(c);
+            printf("busy srtt: B %.6f (var %.6f), C %.6f (var %.6f), %zu bulk received\n",
+                rtt_b.srtt, rtt_b.rttvar, rtt_c.srtt, rtt_c.rttvar, nbulk[0]);
+            if (!(rtt_b.srtt < 0.05) || !(rtt_c.rttvar >= 0))
+            {
+                printf("FAIL: unexpected RTT estimates\n");
+                ec.stop();
+                return;
+            }
+            nets[0]->multicast_msg_nearest(MsgTag(0), {c, b}, 1);
+        }, [&]() { return ntag[1] == 1; }},
+        /* give a misrouted copy time to show up */
+        {[&]() { after(0.5, [&]() {
+            ok = ntag[2] == 0;
+            if (!ok) printf("FAIL: the far peer was chosen\n");
+            ec.stop();
+        }); }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.05, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.05, *poll);
+    };
+    after(0.05, *poll);
+    after(15, [&]() {
+        printf("FAIL: timed out at step %zu (RTT of the busy link is stale)\n", idx);
+        ec.stop();
+    });
+    ec.dispatch();
+    for (auto &net: nets) net->stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Three clients of a ClientNetwork with two workers subscribe to topics
+ * through messages to the server. The published messages reach the
+ * subscribers of their topic only, and stop reaching a client once it
+ * unsubscribes or disconnects. */
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+/* subscribe (or unsubscribe) to topic "a" or "b" */
+struct MsgSub {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint8_t topic;
+    bool sub;
+    MsgSub(uint8_t topic, bool sub): topic(topic), sub(sub) {
+        serialized << topic << (uint8_t)sub;
+    }
+    MsgSub(DataStream &&s) {
+        uint8_t flag;
+        s >> topic >> flag;
+        sub = flag;
+    }
+};
+
+struct MsgPub {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t seq;
+    MsgPub(uint32_t seq): seq(seq) { serialized << htole(seq); }
+    MsgPub(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+const uint8_t MsgSub::opcode;
+const uint8_t MsgPub::opcode;
+
+using Server = salticidae::ClientNetwork<uint8_t>;
+using Client = salticidae::MsgNetwork<uint8_t>;
+
+const size_t nclient = 3;
+
+int main() {
+    EventContext ec;
+    NetAddr server_addr("127.0.0.1:12890");
+    Server::Config sconfig;
+    sconfig.nworker(2);
+    Server server(ec, sconfig);
+    Client client(ec, Client::Config());
+    std::vector<Client::conn_t> conns;
+    std::vector<std::vector<uint32_t>> recvd(nclient);
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    size_t nsub = 0, ndown = 0;
+    bool ok = false;
+
+    server.reg_handler([&](MsgSub &&msg, const Server::conn_t &conn) {
+        std::string topic(1, (char)msg.topic);
+        if (msg.sub) server.subscribe(conn, topic);
+        else server.unsubscribe(conn, topic);
+        nsub++;
+    });
+    server.reg_conn_handler([&](const salticidae::ConnPool::conn_t &, bool connected) {
+        if (!connected) ndown++;
+        return true;
+    });
+    client.reg_handler([&](MsgPub &&msg, const Client::conn_t &conn) {
+        for (size_t i = 0; i < nclient; i++)
+            if (conns[i] == conn) recvd[i].push_back(msg.seq);
+    });
+    server.start();
+    client.start();
+    server.listen(server_addr);
+    for (size_t i = 0; i < nclient; i++)
+        conns.push_back(client.connect_sync(server_addr));
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    auto fail = [&](const char *err) {
+        printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+    auto expect = [&](std::vector<std::vector<uint32_t>> exp) {
+        return recvd == exp;
+    };
+
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        /* everyone on "a", the first client also on "b" */
+        {[&]() {
+            for (size_t i = 0; i < nclient; i++)
+                client.send_msg(MsgSub('a', true), conns[i]);
+            client.send_msg(MsgSub('b', true), conns[0]);
+        }, [&]() { return nsub == nclient + 1; }},
+        {[&]() {
+            server.publish(MsgPub(1), "a");
+            server.publish(MsgPub(2), "b");
+            server.publish(MsgPub(3), "c");
+        }, [&]() { return expect({{1, 2}, {1}, {1}}); }},
+        /* the second client leaves "a", the third one goes away */
+        {[&]() {
+            client.send_msg(MsgSub('a', false), conns[1]);
+            client.terminate(conns[2]);
+        }, [&]() { return nsub == nclient + 2 && ndown == 1; }},
+        {[&]() {
+            server.publish(MsgPub(4), "a");
+            server.publish(MsgPub(5), "b");
+        }, [&]() { return expect({{1, 2, 4, 5}, {1}, {1}}); }},
+        /* give the stray copies time to show up */
+        {[&]() { after(0.3, [&]() {
+            if (!expect({{1, 2, 4, 5}, {1}, {1}}))
+                return fail("a message reached a client that is not subscribed");
+            ok = true;
+            ec.stop();
+        }); }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.02, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.02, *poll);
+    };
+    steps[0].first();
+    after(0.02, *poll);
+    after(10, [&]() {
+        printf("FAIL: timed out at step %zu\n", idx);
+        ec.stop();
+    });
+    ec.dispatch();
+    timers.clear();
+    conns.clear();
+    client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
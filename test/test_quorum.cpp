@@ -0,0 +1,203 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Node A makes quorum calls to B, C and D, where D never responds: a
+ * quorum of two is reached, a quorum of three times out with the two
+ * responses, and without a timeout it fails with RPC_UNREACHABLE as soon as
+ * D drops its connection, without any help from the application. */
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/rpc.h"
+
+using salticidae::NetAddr;
+using salticidae::PeerId;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgReq {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t x;
+    MsgReq(uint32_t x): x(x) { serialized << htole(x); }
+    MsgReq(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+struct MsgResp {
+    static const uint8_t opcode = 0x2;
+    DataStream serialized;
+    uint32_t x;
+    MsgResp(uint32_t x): x(x) { serialized << htole(x); }
+    MsgResp(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+const uint8_t MsgReq::opcode;
+const uint8_t MsgResp::opcode;
+
+using Net = salticidae::PeerNetwork<uint8_t>;
+using RPC = salticidae::RPCEndpoint<Net>;
+
+const size_t nnode = 4;
+
+NetAddr node_addr(size_t i) {
+    return NetAddr("127.0.0.1:" + std::to_string(12870 + i));
+}
+
+int main() {
+    EventContext ec;
+    std::vector<salticidae::BoxObj<Net>> nets;
+    std::vector<salticidae::BoxObj<RPC>> rpcs;
+    std::vector<RPC::Reply<MsgResp>> held;
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    std::vector<PeerId> peers;
+    PeerId a(node_addr(0));
+    /* the outcome of the last quorum call */
+    bool done = false;
+    RPC::Status status;
+    std::vector<uint32_t> resps;
+    std::vector<size_t> from;
+    bool ok = false;
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    auto fail = [&](const char *err) {
+        printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+
+    for (size_t i = 0; i < nnode; i++)
+    {
+        Net::Config config;
+        config.ping_period(0.2).conn_timeout(10);
+        nets.emplace_back(new Net(ec, config));
+        rpcs.emplace_back(new RPC(*nets.back(), ec));
+        rpcs.back()->reg_method<MsgReq, MsgResp>(
+            [&, i](MsgReq &&req, const Net::conn_t &conn, RPC::Reply<MsgResp> &&reply) {
+                if (i != 3)
+                {
+                    reply(MsgResp(req.x * 10 + i));
+                    return;
+                }
+                /* D sits on the requests and drops the connection with the
+                 * third one */
+                held.push_back(std::move(reply));
+                if (held.size() == 3) nets[3]->terminate(conn);
+            });
+        nets.back()->start();
+        nets.back()->listen(node_addr(i));
+    }
+    for (size_t i = 1; i < nnode; i++)
+    {
+        PeerId pid(node_addr(i));
+        peers.push_back(pid);
+        nets[0]->add_peer(pid);
+        nets[0]->set_peer_addr(pid, node_addr(i));
+        nets[0]->conn_peer(pid, 1);
+        nets[i]->add_peer(a);
+        nets[i]->set_peer_addr(a, node_addr(0));
+    }
+
+    auto quorum = [&](uint32_t x, size_t k, double timeout) {
+        done = false;
+        rpcs[0]->quorum_call<MsgResp>(MsgReq(x), peers, k,
+            [&](RPC::Status s, std::vector<MsgResp> &rs, std::vector<size_t> &f) {
+                if (done) return fail("a quorum call completed twice");
+                done = true;
+                status = s;
+                resps.clear();
+                for (auto &r: rs) resps.push_back(r.x);
+                from = f;
+            }, timeout);
+    };
+    /* the responses of B and C to the request x */
+    auto from_bc = [&](uint32_t x) {
+        if (resps.size() != 2 || from.size() != 2) return false;
+        for (size_t i = 0; i < 2; i++)
+            if (from[i] > 1 || resps[i] != x * 10 + from[i] + 1) return false;
+        return from[0] != from[1];
+    };
+
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        {[]() {}, [&]() {
+            for (auto &pid: peers)
+                if (nets[0]->get_peer_rtt(pid).srtt < 0) return false;
+            return true;
+        }},
+        {[&]() { quorum(1, 2, 5); }, [&]() { return done; }},
+        {[&]() {
+            if (status != RPC::RPC_OK || !from_bc(1))
+                return fail("the quorum of two was not reached");
+            quorum(2, 3, 0.5);
+        }, [&]() { return done; }},
+        {[&]() {
+            if (status != RPC::RPC_TIMEOUT || !from_bc(2))
+                return fail("the quorum of three did not time out");
+            quorum(3, 3, 0);
+        }, [&]() { return done; }},
+        /* give a stray completion time to show up */
+        {[&]() {
+            if (status != RPC::RPC_UNREACHABLE || !from_bc(3))
+                return fail("the lost peer did not fail the quorum");
+            after(0.3, [&]() {
+                if (rpcs[0]->get_npending())
+                    return fail("a quorum call is still pending");
+                ok = true;
+                ec.stop();
+            });
+        }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.02, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.02, *poll);
+    };
+    after(0.02, *poll);
+    after(15, [&]() {
+        printf("FAIL: timed out at step %zu\n", idx);
+        ec.stop();
+    });
+    ec.dispatch();
+    rpcs.clear();
+    for (auto &net: nets) net->stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Payloads much larger than a receive chunk are sunk into a file and into
+ * memory as they arrive: check the bytes that land there, that a payload
+ * with a wrong checksum is reported with ok == false, and that the messages
+ * after the sunk ones are received as usual. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const uint8_t blob_opcode = 0x7;
+
+struct MsgDone {
+    static const uint8_t opcode = 0x8;
+    DataStream serialized;
+    MsgDone() {}
+    MsgDone(DataStream &&) {}
+};
+
+const uint8_t MsgDone::opcode;
+
+/* the payload of the i-th blob */
+bytearray_t make_blob(uint32_t i) {
+    bytearray_t blob((1 << 20) + 13 * i);
+    uint32_t x = i + 1;
+    for (auto &b: blob)
+    {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+    return blob;
+}
+
+int main() {
+    EventContext ec;
+    NetAddr addr("127.0.0.1:12760");
+    Net sender(ec, Net::Config());
+    Net receiver(ec, Net::Config());
+    const size_t nblob = 3;
+    /* blob 0 goes to a file, the others to memory; blob 2 is corrupted */
+    char fname[] = "/tmp/salticidae_recv_sink_XXXXXX";
+    int fd = mkstemp(fname);
+    if (fd < 0)
+    {
+        printf("FAIL: cannot create the file\n");
+        return 1;
+    }
+    unlink(fname);
+    std::vector<bytearray_t> mem(nblob);
+    std::vector<Net::SinkedPayload> done;
+    size_t nopened = 0;
+    bool finished = false;
+
+    receiver.reg_recv_sink(blob_opcode,
+        [&](const Net::conn_t &, size_t len, Net::RecvSink &dest) {
+            /* called by a worker, before the payload arrives */
+            size_t i = nopened++;
+            if (i == 0)
+            {
+                dest.fd = fd;
+                dest.offset = 100;
+            }
+            else
+            {
+                mem[i].resize(len);
+                dest.addr = mem[i].data();
+            }
+            return true;
+        },
+        [&](const Net::SinkedPayload &p, const Net::conn_t &) {
+            done.push_back(p);
+        });
+    receiver.reg_handler([&](MsgDone &&, const Net::conn_t &) {
+        finished = true;
+        ec.stop();
+    });
+    receiver.start();
+    sender.start();
+    receiver.listen(addr);
+    auto conn = sender.connect_sync(addr);
+    for (uint32_t i = 0; i < nblob; i++)
+    {
+        Net::Msg msg(sender.get_msg_magic());
+        msg.set_opcode(blob_opcode);
+        msg.set_payload(make_blob(i));
+        msg.set_checksum();
+        if (i == 2) msg.set_checksum(msg.peek_checksum() ^ 1);
+        sender._send_msg(msg, conn);
+    }
+    sender.send_msg(MsgDone(), conn);
+
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) { ec.stop(); });
+    ev_timeout.add(10);
+    ec.dispatch();
+    sender.stop();
+    receiver.stop();
+
+    bool ok = finished && done.size() == nblob;
+    if (!ok) printf("FAIL: got %zu of the %zu payloads\n", done.size(), nblob);
+    for (size_t i = 0; ok && i < nblob; i++)
+    {
+        auto blob = make_blob(i);
+        auto &p = done[i];
+        bytearray_t got;
+        if (i == 0)
+        {
+            got.resize(p.len);
+            if (p.sink.fd != fd || p.sink.offset != 100 ||
+                pread(fd, got.data(), got.size(), 100) != (ssize_t)got.size())
+                got.clear();
+        }
+        else if (p.sink.addr == mem[i].data())
+            got = mem[i];
+        printf("payload %zu: len %zu, ok %d, %s\n", i, p.len, p.ok,
+                got == blob ? "intact" : "mismatch");
+        /* the corrupted one arrives in full, but is not ok */
+        if (p.len != blob.size() || got != blob || p.ok != (i != 2)) ok = false;
+    }
+    close(fd);
+    if (ok) printf("PASS\n");
+    else printf("FAIL\n");
+    return ok ? 0 : 1;
+}
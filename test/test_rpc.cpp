@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A malformed rpc response fails the call with RPC_MALFORMED and terminates
+ * the connection, instead of crashing the client. */
+
+#include <cstdio>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/rpc.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgReq {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t x;
+    MsgReq(uint32_t x): x(x) { serialized << htole(x); }
+    MsgReq(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+struct MsgResp {
+    static const uint8_t opcode = 0x2;
+    DataStream serialized;
+    uint32_t x;
+    /* a truncated response only carries half of x */
+    MsgResp(uint32_t x, bool truncated = false): x(x) {
+        if (truncated)
+            serialized << htole((uint16_t)x);
+        else
+            serialized << htole(x);
+    }
+    MsgResp(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+const uint8_t MsgReq::opcode;
+const uint8_t MsgResp::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+using RPC = salticidae::RPCEndpoint<Net>;
+
+int main() {
+    EventContext ec;
+    NetAddr server_addr("127.0.0.1:12700");
+    Net server(ec, Net::Config());
+    Net client(ec, Net::Config());
+    RPC server_rpc(server, ec);
+    RPC client_rpc(client, ec);
+    bool ok = false;
+    int nresp = 0, ndisconnected = 0;
+
+    /* odd requests get a truncated response */
+    server_rpc.reg_method<MsgReq, MsgResp>(
+        [](MsgReq &&req, const Net::conn_t &, RPC::Reply<MsgResp> &&reply) {
+            reply(MsgResp(req.x + 1, req.x & 1));
+        });
+    client.reg_conn_handler([&](const salticidae::ConnPool::conn_t &, bool connected) {
+        if (!connected) ndisconnected++;
+        return true;
+    });
+
+    auto finish = [&](const char *err) {
+        if (err) printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) { finish("timed out"); });
+    TimerEvent ev_check(ec, [&](TimerEvent &) {
+        if (nresp != 2) return finish("the malformed response was not reported");
+        if (ndisconnected != 1) return finish("the connection was not terminated");
+        if (client_rpc.get_npending()) return finish("the call is still pending");
+        ok = true;
+        finish(nullptr);
+    });
+
+    server.start();
+    client.start();
+    server.listen(server_addr);
+    auto conn = client.connect_sync(server_addr);
+    client_rpc.call<MsgResp>(MsgReq(2), conn, [&](RPC::Status status, MsgResp *resp) {
+        if (status != RPC::RPC_OK || !resp || resp->x != 3)
+            return finish("the well-formed response was not delivered");
+        nresp++;
+        client_rpc.call<MsgResp>(MsgReq(5), conn, [&](RPC::Status status, MsgResp *resp) {
+            if (status != RPC::RPC_MALFORMED || resp)
+                return finish("expected RPC_MALFORMED");
+            nresp++;
+            ev_check.add(0.5);
+        });
+    });
+    ev_timeout.add(10);
+    ec.dispatch();
+    client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
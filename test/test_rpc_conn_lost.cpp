@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* The requests pending on a connection fail with RPC_DISCONNECTED as soon
+ * as it is gone, with or without a timeout, and the timeouts cancelled on
+ * the way do not fire. */
+
+#include <cstdio>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/rpc.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::TimerWheel;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgReq {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t x;
+    MsgReq(uint32_t x): x(x) { serialized << htole(x); }
+    MsgReq(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+struct MsgResp {
+    static const uint8_t opcode = 0x2;
+    DataStream serialized;
+    uint32_t x;
+    MsgResp(uint32_t x): x(x) { serialized << htole(x); }
+    MsgResp(DataStream &&s) { s >> x; x = letoh(x); }
+};
+
+const uint8_t MsgReq::opcode;
+const uint8_t MsgResp::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+using RPC = salticidae::RPCEndpoint<Net>;
+
+const size_t nreq = 3;
+
+/* a cancelled entry is gone, an expired one can no longer be cancelled */
+bool check_wheel_cancel() {
+    EventContext ec;
+    std::vector<int> fired;
+    TimerWheel<int> wheel(ec, [&](int &x) {
+        fired.push_back(x);
+        if (x == 3) ec.stop();
+    }, 0.01);
+    wheel.add(0.05, 1);
+    auto h = wheel.add(0.05, 2);
+    auto h3 = wheel.add(0.1, 3);
+    if (!wheel.cancel(h) || wheel.cancel(h) || wheel.size() != 2)
+        return false;
+    TimerEvent timeout(ec, [&](TimerEvent &) { ec.stop(); });
+    timeout.add(5);
+    ec.dispatch();
+    return fired == std::vector<int>{1, 3} && !wheel.cancel(h3);
+}
+
+int main() {
+    if (!check_wheel_cancel())
+    {
+        printf("FAIL: a cancelled timeout fired\n");
+        return 1;
+    }
+    EventContext ec;
+    NetAddr server_addr("127.0.0.1:12860");
+    Net server(ec, Net::Config());
+    Net client(ec, Net::Config());
+    RPC server_rpc(server, ec);
+    RPC client_rpc(client, ec);
+    std::vector<RPC::Reply<MsgResp>> held;
+    size_t nfailed = 0;
+    bool ok = false;
+
+    auto finish = [&](const char *err) {
+        if (err) printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+    /* never reply, and drop the connection once all requests are in */
+    server_rpc.reg_method<MsgReq, MsgResp>(
+        [&](MsgReq &&, const Net::conn_t &conn, RPC::Reply<MsgResp> &&reply) {
+            held.push_back(std::move(reply));
+            if (held.size() == nreq) server.terminate(conn);
+        });
+    TimerEvent ev_check(ec, [&](TimerEvent &) {
+        if (client_rpc.get_npending()) return finish("a request is still pending");
+        ok = true;
+        finish(nullptr);
+    });
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) {
+        finish("the requests did not fail with the connection");
+    });
+
+    server.start();
+    client.start();
+    server.listen(server_addr);
+    auto conn = client.connect_sync(server_addr);
+    for (size_t i = 0; i < nreq; i++)
+    {
+        /* no timeout for the first ones, a long one for the last */
+        auto id = client_rpc.call<MsgResp>(MsgReq(i), conn,
+            [&](RPC::Status status, MsgResp *resp) {
+                if (status != RPC::RPC_DISCONNECTED || resp)
+                    return finish("expected RPC_DISCONNECTED");
+                if (++nfailed == nreq) ev_check.add(0.2);
+            }, i + 1 < nreq ? 0 : 30);
+        if (!id)
+        {
+            printf("FAIL: the request cannot be sent\n");
+            return 1;
+        }
+    }
+    ev_timeout.add(10);
+    ec.dispatch();
+    client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
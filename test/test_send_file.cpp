@@ -0,0 +1,185 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* send_file() streams a file range with sendfile(2) over plain TCP and
+ * reads it into memory with TLS. Check the payload that arrives and the
+ * result passed to the callback, also when the file turns out to be
+ * shorter than announced and when the queued range is dropped. A range
+ * that cannot be read for the checksum is refused with MsgNetworkError. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+using salticidae::PKey;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const uint8_t file_opcode = 0x5;
+
+/* holds back what is queued after it on a rate-limited connection */
+struct MsgPlug {
+    static const uint8_t opcode = 0x6;
+    DataStream serialized;
+    MsgPlug(size_t size) { serialized << bytearray_t(size); }
+    MsgPlug(DataStream &&) {}
+};
+
+const uint8_t MsgPlug::opcode;
+
+enum Case {
+    FULL, /**< the whole range arrives */
+    SHORT, /**< the file is truncated before the range is sent */
+    DROPPED /**< the connection is closed before the range is sent */
+};
+
+bool run(bool tls, Case c, const char *name, uint16_t port) {
+    /* the file, with a range in the middle */
+    size_t file_size = c == FULL ? (3 << 20) + 77 : 1 << 16;
+    off_t offset = 4099;
+    size_t len = file_size - offset - 1000;
+    bytearray_t content(file_size);
+    uint32_t x = port;
+    for (auto &b: content)
+    {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+    char fname[] = "/tmp/salticidae_send_file_XXXXXX";
+    int fd = mkstemp(fname);
+    if (fd < 0 || write(fd, content.data(), file_size) != (ssize_t)file_size)
+    {
+        printf("%s: FAIL: cannot create the file\n", name);
+        return false;
+    }
+    unlink(fname);
+
+    EventContext ec;
+    NetAddr addr("127.0.0.1:" + std::to_string(port));
+    Net::Config config;
+    config.max_msg_size(std::max(file_size, (size_t)1 << 17) + 1024);
+    if (tls)
+    {
+        auto key = new PKey(PKey::create_privkey_rsa(2048));
+        config.enable_tls(true)
+            .tls_key(key)
+            .tls_cert(new salticidae::X509(
+                salticidae::X509::create_self_signed_from_pubkey(*key)));
+    }
+    Net receiver(ec, config);
+    if (c != FULL) config.conn_send_rate(1 << 18).conn_send_burst(1 << 14);
+    Net sender(ec, config);
+
+    int result = -1;
+    bool received = false, intact = false, plugged = false, closed = false;
+    receiver.set_handler(file_opcode, [&](const Net::Msg &msg, const Net::conn_t &) {
+        received = true;
+        auto &payload = msg.peek_payload();
+        intact = payload.size() == len &&
+            std::equal(payload.begin(), payload.end(), content.begin() + offset);
+    });
+    receiver.reg_handler([&](MsgPlug &&, const Net::conn_t &) { plugged = true; });
+    sender.reg_conn_handler([&](const salticidae::ConnPool::conn_t &, bool connected) {
+        if (!connected) closed = true;
+        return true;
+    });
+    receiver.start();
+    sender.start();
+    receiver.listen(addr);
+    auto conn = sender.connect_sync(addr);
+    if (c != FULL) sender.send_msg(MsgPlug(1 << 17), conn);
+    bool queued = sender.send_file(conn, fd, offset, len, file_opcode,
+                                    [&](bool ok) { result = ok; });
+    if (c == SHORT) queued &= ftruncate(fd, offset + len / 2) == 0;
+    if (c == DROPPED) sender.terminate(conn);
+
+    TimerEvent ev_poll(ec, [&](TimerEvent &ev) {
+        if (result != -1 && (c != FULL || received)) ec.stop();
+        else ev.add(0.05);
+    });
+    TimerEvent ev_timeout(ec, [&](TimerEvent &) { ec.stop(); });
+    ev_poll.add(0.05);
+    ev_timeout.add(20);
+    ec.dispatch();
+    /* whatever else arrives */
+    ev_timeout.add(0.3);
+    ec.dispatch();
+    sender.stop();
+    receiver.stop();
+    close(fd);
+
+    printf("%s: callback %d, received %d (intact %d), plug %d, closed %d\n",
+            name, result, received, intact, plugged, closed);
+    bool ok;
+    switch (c)
+    {
+        case FULL: ok = result == 1 && received && intact && !closed; break;
+        /* the message cannot be completed, the stream is cut after the plug */
+        case SHORT: ok = result == 0 && !received && plugged && closed; break;
+        case DROPPED: ok = result == 0 && !received; break;
+    }
+    ok &= queued;
+    if (!ok) printf("%s: FAIL\n", name);
+    return ok;
+}
+
+bool check_unreadable() {
+#ifndef SALTICIDAE_NOCHECKSUM
+    char fname[] = "/tmp/salticidae_send_file_XXXXXX";
+    int fd = mkstemp(fname);
+    if (fd < 0) return false;
+    unlink(fname);
+    bool ok = false;
+    try {
+        Net::Msg::get_checksum(fd, 0, 4096);
+    } catch (salticidae::MsgNetworkError &) {
+        ok = true;
+    } catch (...) {}
+    close(fd);
+    if (!ok) printf("unreadable: FAIL\n");
+    return ok;
+#else
+    return true;
+#endif
+}
+
+int main() {
+    bool ok = check_unreadable();
+    ok &= run(false, FULL, "tcp", 12750);
+    ok &= run(false, SHORT, "tcp-short", 12751);
+    ok &= run(false, DROPPED, "tcp-dropped", 12752);
+    ok &= run(true, FULL, "tls", 12753);
+    ok &= run(true, DROPPED, "tls-dropped", 12754);
+    printf(ok ? "PASS\n" : "FAIL\n");
+    return ok ? 0 : 1;
+}
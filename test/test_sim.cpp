@@ -0,0 +1,212 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdio>
+#include <chrono>
+#include <set>
+#include <vector>
+#include <unordered_set>
+#include <sys/resource.h>
+
+#include "salticidae/network.h"
+#include "salticidae/sim.h"
+
+using salticidae::NetAddr;
+using salticidae::PeerId;
+using salticidae::DataStream;
+using salticidae::SimContext;
+using salticidae::htole;
+using salticidae::letoh;
+using salticidae::Config;
+
+using Net = salticidae::PeerNetwork<uint8_t>;
+
+struct MsgGossip {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t id;
+    MsgGossip(uint32_t id, size_t size): id(id) {
+        serialized << htole(id) << salticidae::bytearray_t(size);
+    }
+    MsgGossip(DataStream &&s) {
+        s >> id;
+        id = letoh(id);
+    }
+};
+
+const uint8_t MsgGossip::opcode;
+
+struct Node {
+    salticidae::BoxObj<Net> net;
+    std::vector<PeerId> peers;
+    std::unordered_set<uint32_t> seen;
+    /* the connections reported up (the failed attempts are only reported
+     * down) */
+    std::unordered_set<const void *> up;
+};
+
+int main(int argc, char **argv) {
+    Config config;
+    auto opt_nodes = Config::OptValInt::create(500);
+    auto opt_degree = Config::OptValInt::create(8);
+    auto opt_duration = Config::OptValDouble::create(3600);
+    auto opt_loss = Config::OptValDouble::create(0.01);
+    auto opt_gossip = Config::OptValDouble::create(30);
+    auto opt_seed = Config::OptValInt::create(0);
+    auto opt_help = Config::OptValFlag::create(false);
+    config.add_opt("nodes", opt_nodes, Config::SET_VAL);
+    config.add_opt("degree", opt_degree, Config::SET_VAL);
+    config.add_opt("duration", opt_duration, Config::SET_VAL, 'd', "simulated time (sec)");
+    config.add_opt("loss", opt_loss, Config::SET_VAL);
+    config.add_opt("gossip-interval", opt_gossip, Config::SET_VAL);
+    config.add_opt("seed", opt_seed, Config::SET_VAL);
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
+    config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        exit(0);
+    }
+
+    /* each simulated connection takes four fds */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    SimContext sim(opt_seed->get());
+    size_t n = opt_nodes->get();
+    std::vector<NetAddr> addrs;
+    std::vector<Node> nodes(n);
+    for (size_t i = 0; i < n; i++)
+        addrs.push_back(NetAddr((uint32_t)htonl(0x0a000000 + i), htons(10000)));
+
+    /* links with 10-100ms latency and 10Mbps bandwidth */
+    sim.set_default_link_model(
+        SimContext::LinkModel(0.01, 0.09, 1.25e6, opt_loss->get()));
+
+    std::set<std::pair<size_t, size_t>> edges;
+    for (size_t i = 0; i < n; i++)
+        while (edges.size() < (i + 1) * opt_degree->get() / 2)
+        {
+            size_t j = sim.rand_u32() % n;
+            if (j == i) continue;
+            edges.insert(std::make_pair(std::min(i, j), std::max(i, j)));
+        }
+
+    uint32_t ngossip = 0;
+    std::vector<size_t> coverage;
+    for (size_t i = 0; i < n; i++)
+    {
+        auto &node = nodes[i];
+        Net::Config net_config;
+        net_config.ping_period(30).conn_timeout(90);
+        net_config.max_msg_size(4096);
+        sim.add_node(net_config, addrs[i]);
+        node.net = new Net(sim.get_ec(), net_config);
+        node.net->reg_handler([&, i](MsgGossip &&msg, const Net::conn_t &conn) {
+            auto &node = nodes[i];
+            if (!node.seen.insert(msg.id).second) return;
+            coverage[msg.id]++;
+            auto from = conn->get_peer_id();
+            std::vector<PeerId> fwd;
+            for (auto &pid: node.peers)
+                if (pid != from) fwd.push_back(pid);
+            node.net->multicast_msg(MsgGossip(msg.id, 256), fwd);
+        });
+        node.net->reg_peer_handler([&, i](const Net::conn_t &conn, bool connected) {
+            if (connected) nodes[i].up.insert(conn.get());
+            else nodes[i].up.erase(conn.get());
+        });
+        node.net->start();
+        node.net->listen(addrs[i]);
+    }
+    for (auto &e: edges)
+        for (auto k: {e.first, e.second})
+        {
+            auto other = addrs[k == e.first ? e.second : e.first];
+            auto &node = nodes[k];
+            node.peers.push_back(PeerId(other));
+            node.net->add_peer(PeerId(other));
+            node.net->set_peer_addr(PeerId(other), other);
+            /* one side connects, which saves the fds of the races */
+            if (k == e.first) node.net->conn_peer(PeerId(other));
+        }
+
+    /* periodically originate a gossip from a random node */
+    std::function<void()> gossip = [&]() {
+        auto &node = nodes[sim.rand_u32() % n];
+        auto id = ngossip++;
+        coverage.push_back(1);
+        node.seen.insert(id);
+        node.net->multicast_msg(MsgGossip(id, 256), node.peers);
+        sim.add_timer(opt_gossip->get(), gossip);
+    };
+    sim.add_timer(60, gossip);
+
+    /* partition a few nodes for five minutes in the middle */
+    double duration = opt_duration->get();
+    sim.add_timer(duration / 3, [&]() {
+        for (size_t i = 0; i < std::min(n, (size_t)10); i++)
+            for (size_t j = 0; j < n; j++)
+                if (i != j) sim.set_link_down(addrs[i], addrs[j], true);
+    });
+    sim.add_timer(duration / 3 + 300, [&]() {
+        for (size_t i = 0; i < std::min(n, (size_t)10); i++)
+            for (size_t j = 0; j < n; j++)
+                if (i != j) sim.set_link_down(addrs[i], addrs[j], false);
+    });
+
+    auto t0 = std::chrono::steady_clock::now();
+    try {
+        sim.run_until(duration);
+    } catch (const salticidae::SalticidaeError &e) {
+        /* each simulated connection takes four fds */
+        fprintf(stderr, "simulation aborted: %s\n", std::string(e).c_str());
+        nodes.clear();
+        return 1;
+    }
+    double wall = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+
+    size_t nconnected = 0, npeers = 0;
+    for (auto &node: nodes)
+    {
+        nconnected += node.up.size();
+        npeers += node.peers.size();
+    }
+    /* gossips originated shortly before the end may not have finished */
+    size_t ncomplete = 0, nchecked = 0;
+    for (uint32_t id = 0; id + 2 < ngossip; id++, nchecked++)
+        if (coverage[id] == n) ncomplete++;
+    printf("simulated %.0f sec in %.2f sec: %zu events, %zu chunks, %zu bytes\n",
+            duration, wall, sim.get_nevents(), sim.get_nframes(), sim.get_nbytes());
+    printf("connected peers: %zu/%zu\n", nconnected, npeers);
+    printf("fully delivered gossips: %zu/%zu\n", ncomplete, nchecked);
+    /* the networks go before the simulator */
+    nodes.clear();
+    return nconnected == npeers ? 0 : 1;
+}
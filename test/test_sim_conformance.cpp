@@ -0,0 +1,344 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Run the same scenario on PeerNetwork over loopback, in real time, and on
+ * a SimContext, and check that both reach the same outcome. */
+
+#include <cstdio>
+#include <functional>
+#include <set>
+#include <vector>
+#include <unordered_map>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+#include "salticidae/sim.h"
+
+using salticidae::NetAddr;
+using salticidae::PeerId;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::SimContext;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgTag {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t src, seq;
+    MsgTag(uint32_t src, uint32_t seq): src(src), seq(seq) {
+        serialized << htole(src) << htole(seq);
+    }
+    MsgTag(DataStream &&s) {
+        s >> src >> seq;
+        src = letoh(src);
+        seq = letoh(seq);
+    }
+};
+
+const uint8_t MsgTag::opcode;
+
+const size_t nnode = 4;
+
+NetAddr node_addr(size_t i) {
+    return NetAddr("127.0.0.1:" + std::to_string(12500 + i));
+}
+
+size_t node_idx(const PeerId &pid) {
+    size_t j = 0;
+    while (j < nnode && pid != PeerId(node_addr(j))) j++;
+    return j;
+}
+
+/* what the user loop of each node observed */
+struct Trace {
+    /* the number of peer up and down events, by node and peer */
+    std::vector<std::vector<int>> nup, ndown;
+    /* peer down events for connections never reported up (lost handshake
+     * races and failed retries, their number depends on the timing) */
+    std::vector<int> nstray;
+    std::vector<std::set<std::pair<uint32_t, uint32_t>>> recv;
+
+    Trace(): nup(nnode, std::vector<int>(nnode)),
+            ndown(nnode, std::vector<int>(nnode)),
+            nstray(nnode), recv(nnode) {}
+
+    bool is_up(size_t i, size_t j) const { return nup[i][j] > ndown[i][j]; }
+    size_t nconnected(size_t i) const {
+        size_t cnt = 0;
+        for (size_t j = 0; j < nnode; j++) cnt += is_up(i, j);
+        return cnt;
+    }
+
+    /* how often a link went down and up again depends on the timing of the
+     * handshake races, so only the final state and the deliveries have to
+     * match */
+    bool operator==(const Trace &other) const {
+        for (size_t i = 0; i < nnode; i++)
+            for (size_t j = 0; j < nnode; j++)
+                if (is_up(i, j) != other.is_up(i, j)) return false;
+        return recv == other.recv;
+    }
+
+    /* the retries to the node that went away fail */
+    bool retried() const {
+        for (size_t i = 0; i < 3; i++)
+            if (!nstray[i]) return false;
+        return true;
+    }
+
+    void print(const char *name) const {
+        printf("%s:\n", name);
+        for (size_t i = 0; i < nnode; i++)
+        {
+            printf("  node %zu: up/down", i);
+            for (size_t j = 0; j < nnode; j++)
+                if (j != i) printf(" %zu:%d/%d", j, nup[i][j], ndown[i][j]);
+            printf(", stray %d, received %zu\n", nstray[i], recv[i].size());
+        }
+    }
+};
+
+/* The scenario, as a sequence of steps that each wait for a condition on
+ * the trace. Net provides the operations on the nodes and after(). */
+template<typename Net>
+void run_scenario(Net &net, Trace &trace) {
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    auto all_connected = [&trace](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            if (trace.nconnected(i) != n - 1) return false;
+        return true;
+    };
+    auto steps = std::make_shared<std::vector<step_t>>(std::vector<step_t>{
+        /* everyone connects to everyone at once, so both ends of each pair
+         * race to establish the connection */
+        {[&]() {
+            for (size_t i = 0; i < nnode; i++) net.add_peers(i);
+        }, [=]() { return all_connected(nnode); }},
+        {[&]() {
+            for (size_t i = 0; i < nnode; i++) net.multicast(i, MsgTag(i, 0));
+        }, [&]() {
+            for (size_t i = 0; i < nnode; i++)
+                if (trace.recv[i].size() != nnode - 1) return false;
+            return true;
+        }},
+        /* node 0 restarts its connection to node 1 */
+        {[&]() { net.reset(0, 1); }, [&]() {
+            return trace.ndown[0][1] && trace.ndown[1][0] &&
+                trace.is_up(0, 1) && trace.is_up(1, 0);
+        }},
+        {[&]() { net.send(0, 1, MsgTag(0, 1)); }, [&]() {
+            return trace.recv[1].count(std::make_pair(0, 1));
+        }},
+        /* node 3 goes away, the others keep trying to reach it */
+        {[&]() { net.shutdown(3); }, [&]() {
+            for (size_t i = 0; i < 3; i++)
+                if (trace.is_up(i, 3)) return false;
+            return true;
+        }},
+    });
+    auto idx = std::make_shared<size_t>(0);
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [=, &net]() {
+        if (*idx == steps->size()) return;
+        if (!(*steps)[*idx].second())
+        {
+            net.after(0.05, *poll);
+            return;
+        }
+        if (++*idx == steps->size())
+        {
+            /* let a few failed retries happen before comparing */
+            net.after(3, [&net]() { net.finish(); });
+            return;
+        }
+        (*steps)[*idx].first();
+        net.after(0.05, *poll);
+    };
+    (*steps)[0].first();
+    net.after(0.05, *poll);
+}
+
+struct PeerTracker {
+    Trace &trace;
+    std::unordered_map<const void *, size_t> up_conns;
+
+    PeerTracker(Trace &trace): trace(trace) {}
+
+    void on_peer(size_t i, const void *conn, size_t j, bool connected) {
+        if (connected)
+        {
+            up_conns[conn] = j;
+            trace.nup[i][j]++;
+            return;
+        }
+        auto it = up_conns.find(conn);
+        if (it == up_conns.end())
+        {
+            trace.nstray[i]++;
+            return;
+        }
+        trace.ndown[i][it->second]++;
+        up_conns.erase(it);
+    }
+};
+
+/* the nodes of the scenario, on the context given to init() */
+struct Nodes {
+    using Net = salticidae::PeerNetwork<uint8_t>;
+    std::vector<salticidae::BoxObj<Net>> nets;
+    std::vector<PeerTracker> trackers;
+    bool finished;
+
+    Nodes(): finished(false) {}
+
+    template<typename Setup>
+    void init(Trace &trace, const EventContext &ec, Setup setup) {
+        for (size_t i = 0; i < nnode; i++)
+        {
+            trackers.emplace_back(trace);
+            Net::Config config;
+            config.ping_period(2).conn_timeout(5);
+            setup(config, i);
+            nets.emplace_back(new Net(ec, config));
+            auto &net = nets.back();
+            net->reg_peer_handler([this, i](const Net::conn_t &conn, bool connected) {
+                trackers[i].on_peer(i, conn.get(),
+                    connected ? node_idx(conn->get_peer_id()) : nnode, connected);
+            });
+            net->reg_handler([&trace, i](MsgTag &&msg, const Net::conn_t &) {
+                trace.recv[i].insert(std::make_pair(msg.src, msg.seq));
+            });
+            net->start();
+            net->listen(node_addr(i));
+        }
+    }
+
+    void add_peers(size_t i) {
+        for (size_t j = 0; j < nnode; j++)
+        {
+            if (j == i) continue;
+            PeerId pid(node_addr(j));
+            nets[i]->add_peer(pid);
+            nets[i]->set_peer_addr(pid, node_addr(j));
+            nets[i]->conn_peer(pid, -1, 1);
+        }
+    }
+    void multicast(size_t i, MsgTag &&msg) {
+        std::vector<PeerId> peers;
+        for (size_t j = 0; j < nnode; j++)
+            if (j != i) peers.push_back(PeerId(node_addr(j)));
+        nets[i]->multicast_msg(std::move(msg), peers);
+    }
+    void send(size_t i, size_t j, MsgTag &&msg) {
+        nets[i]->send_msg(msg, PeerId(node_addr(j)));
+    }
+    void reset(size_t i, size_t j) { nets[i]->conn_peer(PeerId(node_addr(j)), -1, 1); }
+    void shutdown(size_t i) { nets[i] = nullptr; }
+};
+
+/* over loopback, in real time */
+struct RealNet: Nodes {
+    EventContext ec;
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+
+    RealNet(Trace &trace) { init(trace, ec, [](Net::Config &, size_t) {}); }
+
+    void after(double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    }
+    void finish() {
+        finished = true;
+        ec.stop();
+    }
+
+    bool run() {
+        after(60, [this]() { ec.stop(); });
+        ec.dispatch();
+        return finished;
+    }
+};
+
+/* on a simulator, with loopback-like links */
+struct SimNet: Nodes {
+    SimContext sim;
+
+    SimNet(Trace &trace): sim(1) {
+        sim.set_default_link_model(SimContext::LinkModel(0.0001));
+        init(trace, sim.get_ec(), [this](Net::Config &config, size_t i) {
+            sim.add_node(config, node_addr(i));
+        });
+    }
+    /* the networks go before the simulator */
+    ~SimNet() { nets.clear(); }
+
+    void after(double t, std::function<void()> cb) { sim.add_timer(t, std::move(cb)); }
+    void finish() { finished = true; }
+
+    bool run() {
+        while (!finished && sim.now() < 60)
+            sim.run_until(sim.now() + 1);
+        return finished;
+    }
+};
+
+int main() {
+    Trace real_trace, sim_trace;
+    bool ok = true;
+    {
+        RealNet net(real_trace);
+        run_scenario(net, real_trace);
+        if (!net.run())
+        {
+            printf("the PeerNetwork over loopback did not finish the scenario\n");
+            ok = false;
+        }
+    }
+    {
+        SimNet net(sim_trace);
+        run_scenario(net, sim_trace);
+        if (!net.run())
+        {
+            printf("the simulated PeerNetwork did not finish the scenario\n");
+            ok = false;
+        }
+    }
+    real_trace.print("loopback");
+    sim_trace.print("simulated");
+    if (!(real_trace == sim_trace))
+    {
+        printf("the outcomes differ\n");
+        ok = false;
+    }
+    if (!real_trace.retried() || !sim_trace.retried())
+    {
+        printf("the failed retries were not reported\n");
+        ok = false;
+    }
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
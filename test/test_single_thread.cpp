@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Two networks run in the single-threaded mode on one loop, so each reply
+ * is written to the socket from within the handler of the request. Every
+ * request is answered with a large message (that cannot go out at once)
+ * followed by small ones, and the client asks for more from its own
+ * handler: the messages must still arrive complete and in order. */
+
+#include <cstdio>
+#include <functional>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::bytearray_t;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgReq {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t seq;
+    MsgReq(uint32_t seq): seq(seq) { serialized << htole(seq); }
+    MsgReq(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+struct MsgData {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t seq;
+    bytearray_t data;
+    MsgData(uint32_t seq, size_t size): seq(seq) {
+        serialized << htole(seq);
+        serialized.put_data(bytearray_t(size, (uint8_t)seq));
+    }
+    MsgData(DataStream &&s) {
+        s >> seq;
+        seq = letoh(seq);
+        auto len = s.size();
+        auto base = s.get_data_inplace(len);
+        data = bytearray_t(base, base + len);
+    }
+};
+
+const uint8_t MsgReq::opcode;
+const uint8_t MsgData::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const uint32_t nreq = 64;
+/* requests in flight */
+const uint32_t npipe = 4;
+const size_t nreply = 3;
+const size_t large_size = 4 << 20;
+
+size_t reply_size(uint32_t seq) { return seq % nreply ? 16 : large_size; }
+
+int main() {
+    EventContext ec;
+    NetAddr server_addr("127.0.0.1:12910");
+    Net::Config config;
+    config.max_msg_size(large_size + 1024);
+    config.single_thread(true);
+    Net server(ec, config), client(ec, config);
+    uint32_t nreq_recv = 0, nsent = 0, nrecv = 0;
+    bool ok = false, done = false;
+
+    /* the rest of a batch may still be handled after the loop is stopped */
+    auto finish = [&](const char *err) {
+        if (done) return;
+        done = true;
+        if (err) printf("FAIL: %s\n", err);
+        else ok = true;
+        ec.stop();
+    };
+    server.reg_handler([&](MsgReq &&msg, const Net::conn_t &conn) {
+        if (msg.seq != nreq_recv++)
+            return finish("a request is out of order");
+        for (size_t i = 0; i < nreply; i++)
+        {
+            uint32_t seq = msg.seq * nreply + i;
+            server.send_msg(MsgData(seq, reply_size(seq)), conn);
+        }
+    });
+    client.reg_handler([&](MsgData &&msg, const Net::conn_t &conn) {
+        if (msg.seq != nrecv)
+            return finish("a reply is out of order");
+        if (msg.data.size() != reply_size(msg.seq))
+            return finish("a reply is truncated");
+        for (auto b: msg.data)
+            if (b != (uint8_t)msg.seq)
+                return finish("a reply is corrupted");
+        /* the last reply to a request asks for the next one */
+        if (++nrecv % nreply) return;
+        if (nsent < nreq)
+            client.send_msg(MsgReq(nsent++), conn);
+        else if (nrecv == nreq * nreply)
+            finish(nullptr);
+    });
+    client.reg_conn_handler([&](const salticidae::ConnPool::conn_t &conn, bool connected) {
+        if (!connected) return true;
+        auto c = salticidae::static_pointer_cast<Net::Conn>(conn);
+        while (nsent < npipe)
+            client.send_msg(MsgReq(nsent++), c);
+        return true;
+    });
+
+    server.start();
+    client.start();
+    server.listen(server_addr);
+    client.connect(server_addr);
+    TimerEvent timeout(ec, [&](TimerEvent &) {
+        printf("got %u of %u replies\n", nrecv, nreq * (uint32_t)nreply);
+        finish("timed out");
+    });
+    timeout.add(20);
+    ec.dispatch();
+    client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
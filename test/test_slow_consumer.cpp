@@ -0,0 +1,249 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A receiver that stops reading for a while makes the sender a slow
+ * consumer. Check each policy against the bytes that eventually reach the
+ * receiver: the frames that arrive are intact (in particular the one that was
+ * partially sent when the policy kicked in), and the stats and the handler
+ * agree with what was dropped. */
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::ConnPool;
+using salticidae::bytearray_t;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgSeq {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    uint32_t seq;
+    /* the filler is derived from seq, so a frame can be checked alone */
+    MsgSeq(uint32_t seq, size_t size): seq(seq) {
+        serialized << htole(seq) << bytearray_t(size, (uint8_t)seq);
+    }
+    MsgSeq(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+const uint8_t MsgSeq::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const size_t nmsg = 512;
+const size_t msg_size = 8192;
+const size_t max_backlog = 65536;
+
+/* do not read for `pause` seconds, then read until the peer is quiet for a
+ * second or closes the connection */
+bytearray_t run_receiver(int fd, double pause, bool &closed) {
+    bytearray_t data;
+    closed = false;
+    usleep(pause * 1e6);
+    uint8_t buff[65536];
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (poll(&pfd, 1, 1000) > 0)
+    {
+        ssize_t ret = read(fd, buff, sizeof(buff));
+        if (ret <= 0)
+        {
+            closed = true;
+            break;
+        }
+        data.insert(data.end(), buff, buff + ret);
+    }
+    return data;
+}
+
+/* split the stream into frames, return false at the first corrupted one
+ * (a trailing incomplete frame is left in `rest`) */
+bool parse_frames(const bytearray_t &data, std::vector<uint32_t> &seqs, size_t &rest) {
+    const size_t header_size = Net::Msg::header_size;
+    size_t pos = 0;
+    while (data.size() - pos >= header_size)
+    {
+        DataStream hdr(bytearray_t(data.begin() + pos, data.begin() + pos + header_size));
+        Net::Msg msg(std::move(hdr));
+        if (msg.get_magic() != 0 || msg.get_opcode() != MsgSeq::opcode ||
+            msg.get_length() != sizeof(uint32_t) + msg_size)
+            return false;
+        if (data.size() - pos - header_size < msg.get_length()) break;
+        auto begin = data.begin() + pos + header_size;
+        msg.set_payload(bytearray_t(begin, begin + msg.get_length()));
+        if (!msg.verify_checksum()) return false;
+        MsgSeq m(msg.get_payload());
+        for (size_t i = 0; i < msg_size; i++)
+            if (begin[sizeof(uint32_t) + i] != (uint8_t)m.seq) return false;
+        seqs.push_back(m.seq);
+        pos += header_size + msg.get_length();
+    }
+    rest = data.size() - pos;
+    return true;
+}
+
+bool run(ConnPool::SlowConsumerPolicy policy, const char *name, uint16_t port) {
+    NetAddr addr("127.0.0.1:" + std::to_string(port));
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1, rcvbuf = 4096;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    /* a small window, so the data piles up at the sender */
+    setsockopt(lfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = addr.ip;
+    sin.sin_port = addr.port;
+    if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(lfd, 1) < 0)
+    {
+        printf("%s: FAIL: cannot listen\n", name);
+        close(lfd);
+        return false;
+    }
+
+    EventContext ec;
+    Net::Config config;
+    config.slow_consumer(0, max_backlog, policy);
+    config.max_msg_size(msg_size + 1024);
+    Net sender(ec, config);
+    size_t nslow_cb = 0, ndisconnected = 0;
+    sender.reg_slow_consumer_handler([&](const ConnPool::conn_t &, double, size_t backlog) {
+        if (backlog > max_backlog) nslow_cb++;
+    });
+    sender.reg_conn_handler([&](const ConnPool::conn_t &, bool connected) {
+        if (!connected) ndisconnected++;
+        return true;
+    });
+    sender.start();
+
+    auto conn = sender.connect_sync(addr);
+    int fd = accept(lfd, nullptr, nullptr);
+    bytearray_t data;
+    bool closed;
+    std::atomic<bool> done(false);
+    std::thread receiver([&]() {
+        data = run_receiver(fd, 1, closed);
+        done = true;
+    });
+    bool ok = true;
+    for (uint32_t i = 0; i < nmsg; i++)
+        ok &= sender.send_msg(MsgSeq(i, msg_size), conn);
+    /* let the receiver pause, catch up and go quiet */
+    TimerEvent ev_poll(ec, [&](TimerEvent &ev) {
+        if (done) ec.stop();
+        else ev.add(0.1);
+    });
+    ev_poll.add(0.1);
+    ec.dispatch();
+    receiver.join();
+    auto stats = sender.get_slow_consumer_stats();
+    sender.stop();
+    close(fd);
+    close(lfd);
+
+    std::vector<uint32_t> seqs;
+    size_t rest = 0;
+    if (!ok)
+        printf("%s: FAIL: the messages were not queued\n", name);
+    else if (!parse_frames(data, seqs, rest))
+    {
+        printf("%s: FAIL: corrupted stream after %zu frames\n", name, seqs.size());
+        ok = false;
+    }
+    for (size_t i = 1; ok && i < seqs.size(); i++)
+        if (seqs[i] <= seqs[i - 1])
+        {
+            printf("%s: FAIL: out of order\n", name);
+            ok = false;
+        }
+    printf("%s: received %zu/%zu (%zu trailing bytes), slow %zu (handler %zu), "
+            "dropped %zu (%zu bytes), disconnected %zu\n",
+            name, seqs.size(), nmsg, rest, stats.nslow, nslow_cb,
+            stats.ndropped, stats.ndropped_bytes, stats.ndisconnected);
+    if (!ok) return false;
+    if (!stats.nslow || !nslow_cb)
+    {
+        printf("%s: FAIL: not reported as a slow consumer\n", name);
+        return false;
+    }
+    if (policy == ConnPool::SLOW_DISCONNECT)
+    {
+        /* what arrived is a prefix of the stream */
+        for (size_t i = 0; i < seqs.size(); i++)
+            if (seqs[i] != i) ok = false;
+        if (!ok || stats.ndisconnected != 1 || ndisconnected != 1 ||
+            !closed || seqs.size() == nmsg || stats.ndropped)
+        {
+            printf("%s: FAIL: the connection was not dropped\n", name);
+            return false;
+        }
+        return true;
+    }
+    if (rest || closed || ndisconnected)
+    {
+        printf("%s: FAIL: the stream did not end on a frame boundary\n", name);
+        return false;
+    }
+    if (policy == ConnPool::SLOW_NOTIFY)
+    {
+        if (seqs.size() != nmsg || stats.ndropped)
+        {
+            printf("%s: FAIL: messages were dropped\n", name);
+            return false;
+        }
+        return true;
+    }
+    /* SLOW_CONFLATE and SLOW_DROP_OLDEST keep the latest message */
+    if (seqs.empty() || seqs.back() != nmsg - 1 ||
+        stats.ndropped != nmsg - seqs.size() ||
+        stats.ndropped_bytes < stats.ndropped * msg_size)
+    {
+        printf("%s: FAIL: the drops do not add up\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool ok = true;
+    ok &= run(ConnPool::SLOW_NOTIFY, "notify", 12720);
+    ok &= run(ConnPool::SLOW_CONFLATE, "conflate", 12721);
+    ok &= run(ConnPool::SLOW_DROP_OLDEST, "drop-oldest", 12722);
+    ok &= run(ConnPool::SLOW_DISCONNECT, "disconnect", 12723);
+    printf(ok ? "PASS\n" : "FAIL\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A opens a bundle of stripes to B. Unkeyed messages must arrive in order
+ * while keyed ones spread over the stripes. The bundle must come back when
+ * a stripe breaks, and when the chosen connection breaks, with the stripes
+ * torn down along with it; removing the peer must tear down everything. */
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::PeerId;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::htole;
+using salticidae::letoh;
+
+using Net = salticidae::PeerNetwork<uint8_t>;
+
+struct MsgSeq {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t seq;
+    MsgSeq(uint32_t seq): seq(seq) {
+        serialized << htole(seq) << salticidae::bytearray_t(512, 0x5a);
+    }
+    MsgSeq(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+struct MsgKeyed {
+    static const uint8_t opcode = 0x1;
+    DataStream serialized;
+    MsgKeyed() { serialized << salticidae::bytearray_t(512, 0xa5); }
+    MsgKeyed(DataStream &&) {}
+};
+
+const uint8_t MsgSeq::opcode;
+const uint8_t MsgKeyed::opcode;
+
+const size_t nstripe = 4;
+const uint32_t batch = 2000;
+
+NetAddr node_addr(size_t i) {
+    return NetAddr("127.0.0.1:" + std::to_string(12700 + i));
+}
+
+int main() {
+    EventContext ec;
+    std::vector<salticidae::BoxObj<Net>> nets;
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    PeerId a(node_addr(0)), b(node_addr(1));
+    /* the connections of B, and the chosen one to A */
+    std::unordered_map<const void *, salticidae::ConnPool::conn_t> conns;
+    const void *chosen = nullptr;
+    size_t nup = 0;
+    uint32_t next_seq = 0, nseq = 0, nkeyed = 0, nreordered = 0;
+    int64_t last_seq = -1;
+    bool ok = false;
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        Net::Config config;
+        config.nstripe(nstripe).nworker(2);
+        config.ping_period(0.5).conn_timeout(5);
+        nets.emplace_back(new Net(ec, config));
+        nets.back()->start();
+        nets.back()->listen(node_addr(i));
+    }
+    nets[1]->reg_conn_handler([&](const salticidae::ConnPool::conn_t &conn, bool connected) {
+        if (connected) conns[conn.get()] = conn;
+        else conns.erase(conn.get());
+        return true;
+    });
+    nets[1]->reg_peer_handler([&](const Net::conn_t &conn, bool connected) {
+        if (connected)
+        {
+            chosen = conn.get();
+            nup++;
+        }
+        else if (conn.get() == chosen)
+            chosen = nullptr;
+    });
+    nets[1]->reg_handler([&](MsgSeq &&msg, const Net::conn_t &) {
+        if ((int64_t)msg.seq <= last_seq) nreordered++;
+        last_seq = msg.seq;
+        nseq++;
+    });
+    nets[1]->reg_handler([&](MsgKeyed &&, const Net::conn_t &) { nkeyed++; });
+    nets[0]->add_peer(b);
+    nets[0]->set_peer_addr(b, node_addr(1));
+    nets[0]->conn_peer(b, -1, 1);
+    nets[1]->add_peer(a);
+    nets[1]->set_peer_addr(a, node_addr(0));
+
+    auto send_batch = [&]() {
+        nseq = nkeyed = 0;
+        for (uint32_t i = 0; i < batch; i++)
+        {
+            nets[0]->send_msg(MsgSeq(next_seq++), b);
+            nets[0]->send_msg(MsgKeyed(), b, Net::any_stripe);
+        }
+    };
+    auto delivered = [&]() { return nseq == batch && nkeyed == batch; };
+    auto bundled = [&]() { return chosen && conns.size() == nstripe; };
+    /* break a stripe, or the chosen connection */
+    auto terminate = [&](bool stripe) {
+        for (auto &c: conns)
+            if ((c.first == chosen) != stripe)
+            {
+                nets[1]->terminate(c.second);
+                return;
+            }
+    };
+    std::vector<const void *> before;
+    auto snapshot = [&]() {
+        before.clear();
+        for (auto &c: conns) before.push_back(c.first);
+    };
+    /* the bundle is back up, through at least one new connection */
+    auto rebundled = [&]() {
+        if (!bundled()) return false;
+        for (auto &c: conns)
+            if (std::find(before.begin(), before.end(), c.first) == before.end())
+                return true;
+        return false;
+    };
+
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        {[]() {}, bundled},
+        {send_batch, delivered},
+        /* a broken stripe is opened again, while the traffic goes on */
+        {[&]() {
+            snapshot();
+            terminate(true);
+            send_batch();
+        }, [&]() { return delivered() && rebundled(); }},
+        {send_batch, delivered},
+        /* the stripes go down with the chosen connection and the peer
+         * reconnects with a new bundle */
+        {[&]() {
+            snapshot();
+            terminate(false);
+        }, [&]() { return nup == 2 && rebundled(); }},
+        {send_batch, delivered},
+        /* removing the peer drops the whole bundle */
+        {[&]() { nets[0]->del_peer(b); }, [&]() { return conns.empty(); }},
+        {[&]() {
+            printf("%u reordered, %zu bytes lost with the stripes\n",
+                nreordered, nets[0]->get_stripe_lost_bytes());
+            ok = nreordered == 0;
+            if (!ok) printf("FAIL: unkeyed messages were reordered\n");
+            ec.stop();
+        }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.05, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.05, *poll);
+    };
+    after(0.05, *poll);
+    after(30, [&]() {
+        printf("FAIL: timed out at step %zu (%zu connections, %u/%u delivered)\n",
+            idx, conns.size(), nseq, nkeyed);
+        ec.stop();
+    });
+    ec.dispatch();
+    conns.clear();
+    for (auto &net: nets) net->stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}
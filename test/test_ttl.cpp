@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2018 Cornell University.
+ *
+ * Author: Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Messages sent with send_msg_ttl() expire on both sides: in the send
+ * queue of a connection held back by the egress budget, where the tokens
+ * paid for a dropped message go to the next one instead of being charged
+ * again, and in the receive queue of a remote whose user loop is busy,
+ * which learns the deadlines from the tags sent along. */
+
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "salticidae/event.h"
+#include "salticidae/network.h"
+
+using salticidae::NetAddr;
+using salticidae::DataStream;
+using salticidae::EventContext;
+using salticidae::TimerEvent;
+using salticidae::TokenBucket;
+using salticidae::htole;
+using salticidae::letoh;
+
+struct MsgData {
+    static const uint8_t opcode = 0x0;
+    DataStream serialized;
+    uint32_t seq;
+    MsgData(uint32_t seq, size_t size = 0): seq(seq) {
+        serialized << htole(seq) << salticidae::bytearray_t(size);
+    }
+    MsgData(DataStream &&s) { s >> seq; seq = letoh(seq); }
+};
+
+const uint8_t MsgData::opcode;
+
+using Net = salticidae::MsgNetwork<uint8_t>;
+
+const size_t msg_size = 16 << 10;
+const double send_rate = 50 << 10;
+const uint32_t nstale = 10;
+
+int main() {
+    EventContext ec;
+    NetAddr addr0("127.0.0.1:12880");
+    Net::Config rconfig;
+    rconfig.deadline_tags();
+    rconfig.max_msg_size(msg_size + 64);
+    Net server(ec, rconfig);
+    /* the shaped sender only gets two messages out at once */
+    Net::Config sconfig;
+    sconfig.deadline_tags();
+    sconfig.max_msg_size(msg_size + 64);
+    sconfig.send_rate(send_rate).send_burst(msg_size);
+    Net client(ec, sconfig);
+    Net::Config bconfig;
+    bconfig.deadline_tags();
+    Net busy_client(ec, bconfig);
+    std::vector<uint32_t> recvd;
+    std::vector<salticidae::BoxObj<TimerEvent>> timers;
+    double t_last = 0, t_sent = 0;
+    bool ok = false;
+
+    server.reg_handler([&](MsgData &&msg, const Net::conn_t &) {
+        recvd.push_back(msg.seq);
+        if (msg.seq == nstale) t_last = TokenBucket::now();
+        /* the user loop is busy for a while */
+        if (msg.seq == 100)
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    });
+    server.start();
+    client.start();
+    busy_client.start();
+    server.listen(addr0);
+    auto conn = client.connect_sync(addr0);
+    auto bconn = busy_client.connect_sync(addr0);
+
+    auto after = [&](double t, std::function<void()> cb) {
+        auto ev = new TimerEvent(ec, [cb=std::move(cb)](TimerEvent &) { cb(); });
+        timers.emplace_back(ev);
+        ev->add(t);
+    };
+    auto fail = [&](const char *err) {
+        printf("FAIL: %s\n", err);
+        ec.stop();
+    };
+
+    using step_t = std::pair<std::function<void()>, std::function<bool()>>;
+    std::vector<step_t> steps{
+        {[]() {}, []() { return true; }},
+        /* the third message is paid for but expires while waiting for
+         * the budget, the rest expire behind it, and the last one (without
+         * a deadline) goes with the tokens of the third */
+        {[&]() {
+            t_sent = TokenBucket::now();
+            for (uint32_t i = 0; i < nstale; i++)
+                client.send_msg_ttl(MsgData(i, msg_size), conn, 0.1);
+            client.send_msg(MsgData(nstale, msg_size), conn);
+        }, [&]() { return t_last > 0; }},
+        {[&]() {
+            auto stats = client.get_expiry_stats();
+            printf("the last message took %.3f sec, %zu expired\n",
+                    t_last - t_sent, stats.nsend_expired);
+            if (recvd != std::vector<uint32_t>{0, 1, nstale})
+                return fail("an expired message was sent");
+            if (stats.nsend_expired != nstale - 2 ||
+                stats.send_expired_bytes < (nstale - 2) * msg_size)
+                return fail("the expired messages are not counted");
+            /* one wait for the budget of the expired message, not two */
+            if (t_last - t_sent > 1.5 * msg_size / send_rate)
+                return fail("the tokens of the expired message were lost");
+            recvd.clear();
+            /* held up by the busy user loop of the remote */
+            busy_client.send_msg(MsgData(100), bconn);
+            for (uint32_t i = 101; i < 105; i++)
+                busy_client.send_msg_ttl(MsgData(i), bconn, 0.1);
+            busy_client.send_msg_ttl(MsgData(105), bconn, 5);
+        }, [&]() { return recvd.size() == 2; }},
+        {[&]() { after(0.2, [&]() {
+            if (recvd != std::vector<uint32_t>{100, 105})
+                return fail("an expired message was handled");
+            if (server.get_expiry_stats().nrecv_expired != 4)
+                return fail("the expired messages are not counted by the remote");
+            if (busy_client.get_expiry_stats().nsend_expired)
+                return fail("the sender dropped a message");
+            ok = true;
+            ec.stop();
+        }); }, []() { return false; }},
+    };
+
+    size_t idx = 0;
+    auto poll = std::make_shared<std::function<void()>>();
+    *poll = [&, poll]() {
+        if (!steps[idx].second())
+        {
+            after(0.01, *poll);
+            return;
+        }
+        steps[++idx].first();
+        after(0.01, *poll);
+    };
+    after(0.01, *poll);
+    after(10, [&]() {
+        printf("FAIL: timed out at step %zu\n", idx);
+        ec.stop();
+    });
+    ec.dispatch();
+    timers.clear();
+    client.stop();
+    busy_client.stop();
+    server.stop();
+    if (ok) printf("PASS\n");
+    return ok ? 0 : 1;
+}